@@ -0,0 +1,184 @@
+// Copyright: 2022, Diez B. Roggisch, Berlin, all rights reserved
+#include "record_codec.hpp"
+#include "lora_codec.hpp"
+
+#include <algorithm>
+#include <array>
+
+using namespace beehive::records;
+
+extern "C" {
+
+size_t beehive_codec_max_frame_size()
+{
+  return codec::MAX_FRAME_SIZE;
+}
+
+// Encodes count records into out, starting with a key frame.
+// Returns the number of bytes written, or 0 if out is too small.
+size_t beehive_codec_encode(const compact_record_t* records, size_t count, uint8_t* out, size_t capacity)
+{
+  codec::Encoder encoder;
+  size_t written = 0;
+  for(size_t i = 0; i < count; ++i)
+  {
+    if(capacity - written < codec::MAX_FRAME_SIZE)
+    {
+      return 0;
+    }
+    written += encoder.encode(records[i], out + written);
+  }
+  return written;
+}
+
+// Decodes up to max_records records. Returns their number,
+// or -1 if the data is corrupt.
+int beehive_codec_decode(const uint8_t* data, size_t len, compact_record_t* records, size_t max_records)
+{
+  codec::Decoder decoder;
+  const auto end = data + len;
+  size_t count = 0;
+  while(data < end && count < max_records)
+  {
+    data = decoder.decode(data, end, records[count]);
+    if(!data)
+    {
+      return -1;
+    }
+    ++count;
+  }
+  return int(count);
+}
+
+// Decodes a batch payload into up to max_records records
+// and their sequence numbers. Returns their number, or -1
+// if the payload is corrupt or doesn't fit.
+int beehive_codec_decode_batch(const uint8_t* data, size_t len, uint32_t* sequences, compact_record_t* records, size_t max_records)
+{
+  size_t count = 0;
+  const auto ok = codec::decode_batch(
+    data, len,
+    [&](uint32_t sequence, const compact_record_t& record) {
+      if(count < max_records)
+      {
+        sequences[count] = sequence;
+        records[count] = record;
+      }
+      ++count;
+    });
+  return ok && count <= max_records ? int(count) : -1;
+}
+
+// Encodes count records with their sequence numbers as
+// a batch payload. Returns the number of bytes written,
+// or 0 if out is too small or there are too many records.
+size_t beehive_codec_encode_batch(const uint32_t* sequences, const compact_record_t* records, size_t count, uint8_t* out, size_t capacity)
+{
+  if(count > codec::MAX_BATCH_RECORDS || capacity < codec::max_batch_size(count))
+  {
+    return 0;
+  }
+  codec::BatchEncoder encoder(out);
+  for(size_t i = 0; i < count; ++i)
+  {
+    encoder.add(sequences[i], records[i]);
+  }
+  return encoder.size();
+}
+
+// Encodes a READINGS LoRa packet. Returns its size, or 0
+// if it doesn't fit or there are too many readings.
+size_t beehive_lora_encode_readings(uint32_t device_id, uint32_t sequence, const compact_reading_t* readings, size_t count, uint8_t* out, size_t capacity)
+{
+  namespace lora = beehive::lora::codec;
+  lora::readings_t packet;
+  if(count > MAX_SENSORS)
+  {
+    return 0;
+  }
+  packet.count = uint8_t(count);
+  std::copy(readings, readings + count, packet.readings);
+  return lora::encode_readings({ lora::READINGS, device_id, sequence }, packet, out, capacity);
+}
+
+// Decodes a READINGS LoRa packet into up to MAX_SENSORS
+// readings. Returns their number, or the negated
+// lora::codec::status_t if the packet is invalid.
+int beehive_lora_decode_readings(const uint8_t* data, size_t len, uint32_t* device_id, uint32_t* sequence, compact_reading_t* readings)
+{
+  namespace lora = beehive::lora::codec;
+  lora::header_t header;
+  lora::readings_t packet;
+  const uint8_t* body;
+  size_t body_len;
+  auto status = lora::open(data, len, header, body, body_len);
+  if(status == lora::OK)
+  {
+    status = header.type == lora::READINGS ? lora::decode_readings(body, body_len, packet) : lora::BAD_TYPE;
+  }
+  if(status != lora::OK)
+  {
+    return -int(status);
+  }
+  *device_id = header.device_id;
+  *sequence = header.sequence;
+  std::copy(packet.readings, packet.readings + packet.count, readings);
+  return packet.count;
+}
+
+// Decodes a CYCLES LoRa packet into up to max_cycles
+// records and their sequence numbers. The timestamp of
+// the records is the age of the cycle in seconds. Returns
+// their number, or the negated lora::codec::status_t if
+// the packet is invalid.
+int beehive_lora_decode_cycles(const uint8_t* data, size_t len, uint32_t* device_id, uint32_t* sequences, compact_record_t* records, size_t max_cycles)
+{
+  namespace lora = beehive::lora::codec;
+  lora::header_t header;
+  const uint8_t* body;
+  size_t body_len;
+  size_t count = 0;
+  lora::sender_t sender;
+  auto status = lora::open(data, len, header, body, body_len);
+  if(status == lora::OK)
+  {
+    status = header.type != lora::CYCLES ? lora::BAD_TYPE : lora::decode_cycles(
+      header.sequence, body, body_len, sender,
+      [&](uint32_t sequence, uint32_t age, const lora::readings_t& readings) {
+        if(count < max_cycles)
+        {
+          sequences[count] = sequence;
+          records[count].timestamp = age;
+          records[count].count = readings.count;
+          std::copy(readings.readings, readings.readings + readings.count, records[count].readings);
+        }
+        ++count;
+      });
+  }
+  if(status != lora::OK)
+  {
+    return -int(status);
+  }
+  *device_id = header.device_id;
+  return int(std::min(count, max_cycles));
+}
+
+// Encodes an ACK for the given ranges of sequence numbers,
+// reporting the RSSI in dBm and SNR in quarter dB of the
+// packet. Returns its size, or 0 if it doesn't fit.
+size_t beehive_lora_encode_ack(uint32_t device_id, int16_t rssi, int8_t snr, const uint32_t* firsts, const uint8_t* counts, size_t ranges, uint8_t* out, size_t capacity)
+{
+  namespace lora = beehive::lora::codec;
+  std::array<lora::ack_range_t, lora::MAX_ACK_RANGES> acked;
+  if(ranges > acked.size())
+  {
+    return 0;
+  }
+  for(size_t i = 0; i < ranges; ++i)
+  {
+    acked[i] = { firsts[i], counts[i] };
+  }
+  return lora::encode_ack(device_id, { rssi, snr }, acked.data(), ranges, out, capacity);
+}
+
+} // extern "C"
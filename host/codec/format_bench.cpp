@@ -0,0 +1,200 @@
+// Copyright: 2022, Diez B. Roggisch, Berlin, all rights reserved
+//
+// Formats the native MQTT payload and the SD card line of
+// a sensor cycle, as mqtt.cpp and sdcard.cpp do, with the
+// Formatter and with the stringstreams it replaced. Fails
+// if the Formatter allocates.
+//
+//   format_bench [cycles]
+#include "format.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iomanip>
+#include <new>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace {
+
+size_t s_allocations = 0;
+
+struct reading_t
+{
+  uint8_t busno;
+  uint8_t address;
+  uint16_t raw_humidity;
+  uint16_t raw_temperature;
+};
+
+using clock_type = std::chrono::steady_clock;
+
+const char* SEPARATOR = ";";
+const char* FILE_FORMAT_VERSION = "V2,";
+
+void native_payload(beehive::util::Formatter& payload, size_t counter, std::time_t timestamp, const std::vector<reading_t>& readings)
+{
+  size_t readings_count = 0;
+  payload.clear();
+  payload.decimal(counter).append(',').isoformat(timestamp).append(SEPARATOR);
+  for(const auto& entry : readings)
+  {
+    payload.hex(entry.busno, 2).hex(entry.address, 2).append(',');
+    payload.append('T').hex(entry.raw_temperature, 4).append(',');
+    payload.append('H').hex(entry.raw_humidity, 4);
+    if(++readings_count < readings.size())
+    {
+      payload.append(SEPARATOR);
+    }
+  }
+}
+
+// Without the CRC sdcard.cpp appends, that's
+// the same for both.
+void sdcard_line(beehive::util::Formatter& line, size_t sequence, std::time_t timestamp, const std::vector<reading_t>& readings)
+{
+  line.clear();
+  line.append('#').append(FILE_FORMAT_VERSION).hex(uint32_t(sequence), 8).append(',').isoformat(timestamp).append(',');
+  for(const auto& reading : readings)
+  {
+    line.hex(reading.busno, 2).append(',').hex(reading.address, 2).append(',');
+    line.append('H').hex(reading.raw_humidity, 4).append(",T").hex(reading.raw_temperature, 4).append(',');
+  }
+}
+
+std::string isoformat(std::time_t timestamp)
+{
+  std::tm tm;
+  localtime_r(&timestamp, &tm);
+  std::stringstream ss;
+  ss << std::put_time(&tm, "%FT%T%z");
+  return ss.str();
+}
+
+std::string native_payload_stream(size_t counter, std::time_t timestamp, const std::vector<reading_t>& readings)
+{
+  size_t readings_count = 0;
+  std::stringstream ss;
+  ss << counter << "," << isoformat(timestamp) << SEPARATOR;
+  for(const auto& entry : readings)
+  {
+    ss << std::hex << std::setw(2) << std::setfill('0') << int(entry.busno);
+    ss << std::hex << std::setw(2) << std::setfill('0') << int(entry.address) << ",";
+    ss << "T" << std::hex << std::setw(4) << std::setfill('0') << entry.raw_temperature << ",";
+    ss << "H" << std::hex << std::setw(4) << std::setfill('0') << entry.raw_humidity;
+    if(++readings_count < readings.size())
+    {
+      ss << SEPARATOR;
+    }
+  }
+  return ss.str();
+}
+
+std::string sdcard_line_stream(size_t sequence, std::time_t timestamp, const std::vector<reading_t>& readings)
+{
+  std::stringstream ss;
+  ss << "#" << FILE_FORMAT_VERSION << std::hex << std::setw(8) << std::setfill('0') << sequence << "," << isoformat(timestamp) << ",";
+  for(const auto& reading : readings)
+  {
+    ss << std::hex << std::setw(2) << std::setfill('0') << int(reading.busno) << ",";
+    ss << std::hex << std::setw(2) << std::setfill('0') << int(reading.address) << ",";
+    ss << "H" << std::hex << std::setw(4) << std::setfill('0') << reading.raw_humidity << ",";
+    ss << "T" << std::hex << std::setw(4) << std::setfill('0') << reading.raw_temperature << ",";
+  }
+  return ss.str();
+}
+
+struct result_t
+{
+  double ns_per_cycle;
+  double allocations_per_cycle;
+};
+
+template<typename Cycle>
+result_t measure(size_t cycles, Cycle cycle)
+{
+  const auto allocations = s_allocations;
+  const auto start = clock_type::now();
+  for(size_t i = 0; i < cycles; ++i)
+  {
+    cycle(i);
+  }
+  const auto seconds = std::chrono::duration<double>(clock_type::now() - start).count();
+  return { seconds * 1e9 / cycles, double(s_allocations - allocations) / cycles };
+}
+
+} // namespace
+
+void* operator new(size_t size)
+{
+  ++s_allocations;
+  if(auto p = std::malloc(size ? size : 1))
+  {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept
+{
+  std::free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+  std::free(p);
+}
+
+int main(int argc, char** argv)
+{
+  const auto cycles = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 200000ul;
+  // So localtime_r doesn't go looking for zone files
+  // while we count.
+  setenv("TZ", "UTC", 1);
+  tzset();
+
+  std::vector<reading_t> readings;
+  for(uint8_t i = 0; i < 8; ++i)
+  {
+    readings.push_back({ uint8_t(i / 4), uint8_t(0x44 + i % 2), uint16_t(0x6000 + i * 37), uint16_t(0x6800 + i * 91) });
+  }
+  const std::time_t timestamp = 1643630400;
+
+  // As the MQTT client and the card writer keep them
+  beehive::util::FormatBuffer<512> payload;
+  beehive::util::FormatBuffer<256> line;
+
+  // Both produce the same, before we count anything
+  native_payload(payload, 4711, timestamp, readings);
+  sdcard_line(line, 4711, timestamp, readings);
+  if(native_payload_stream(4711, timestamp, readings) != payload.c_str()
+     || sdcard_line_stream(4711, timestamp, readings) != line.c_str())
+  {
+    std::fprintf(stderr, "formatter and stream output differ:\n%s\n%s\n", payload.c_str(), line.c_str());
+    return 1;
+  }
+
+  size_t checksum = 0;
+  const auto formatter = measure(cycles, [&](size_t i) {
+    native_payload(payload, i, timestamp + std::time_t(i), readings);
+    sdcard_line(line, i, timestamp + std::time_t(i), readings);
+    checksum += payload.size() + line.size();
+  });
+  const auto stream = measure(cycles, [&](size_t i) {
+    checksum += native_payload_stream(i, timestamp + std::time_t(i), readings).size();
+    checksum += sdcard_line_stream(i, timestamp + std::time_t(i), readings).size();
+  });
+
+  std::printf("payload and line for %zu readings, %lu cycles\n", readings.size(), cycles);
+  std::printf("  formatter    %8.1f ns/cycle %6.2f allocations/cycle\n", formatter.ns_per_cycle, formatter.allocations_per_cycle);
+  std::printf("  stringstream %8.1f ns/cycle %6.2f allocations/cycle\n", stream.ns_per_cycle, stream.allocations_per_cycle);
+  std::printf("  checksum     %zu\n", checksum);
+  if(formatter.allocations_per_cycle != 0)
+  {
+    std::fprintf(stderr, "the formatter allocated\n");
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,118 @@
+// Copyright: 2022, Diez B. Roggisch, Berlin, all rights reserved
+//
+// Throughput of the LoRa packet codec, for full CYCLES
+// packets as the field devices send them and the ACKs
+// to them. The numbers are for comparing changes on one
+// machine; the ESP32 is a lot slower.
+//
+//   lora_codec_bench [packets]
+#include "lora_codec.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+using namespace beehive::lora::codec;
+
+namespace {
+
+using clock_type = std::chrono::steady_clock;
+
+double seconds_since(clock_type::time_point start)
+{
+  return std::chrono::duration<double>(clock_type::now() - start).count();
+}
+
+void report(const char* what, size_t packets, size_t bytes, double seconds)
+{
+  std::printf(
+    "%-16s %10.0f packets/s %8.1f MB/s %8.1f ns/packet\n",
+    what, packets / seconds, bytes / seconds / 1e6, seconds * 1e9 / packets);
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+  const auto packets = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 1000000ul;
+
+  // Four sensors, as on our hives
+  readings_t readings = {};
+  readings.count = 4;
+  for(uint8_t i = 0; i < readings.count; ++i)
+  {
+    readings.readings[i] = { uint8_t(i / 2), uint8_t(0x44 + i % 2), uint16_t(0x6000 + i), uint16_t(0x6800 + i) };
+  }
+
+  std::vector<uint8_t> packet(MAX_PACKET_SIZE);
+  size_t len = 0, bytes = 0, cycles = 0;
+  auto start = clock_type::now();
+  for(size_t i = 0; i < packets; ++i)
+  {
+    CyclesEncoder encoder(0x12345678, { 14, 0xbeef }, packet.data(), packet.size());
+    auto sequence = uint32_t(i * 8);
+    while(encoder.add(sequence, 300, readings))
+    {
+      sequence += 1 + sequence % 3;
+    }
+    len = encoder.finish();
+    bytes += len;
+    cycles += encoder.count();
+  }
+  report("encode cycles", packets, bytes, seconds_since(start));
+  std::printf("%-16s %10zu bytes, %zu cycles per packet\n", "", len, cycles / packets);
+
+  bytes = 0;
+  uint32_t checksum = 0;
+  start = clock_type::now();
+  for(size_t i = 0; i < packets; ++i)
+  {
+    header_t header;
+    const uint8_t* body;
+    size_t body_len;
+    sender_t sender;
+    if(open(packet.data(), len, header, body, body_len) != OK
+       || decode_cycles(
+            header.sequence, body, body_len, sender,
+            [&](uint32_t sequence, uint32_t age, const readings_t& r) { checksum += sequence + age + r.readings[0].raw_humidity; }) != OK)
+    {
+      std::fprintf(stderr, "decoding failed\n");
+      return 1;
+    }
+    bytes += len;
+  }
+  report("decode cycles", packets, bytes, seconds_since(start));
+
+  ack_range_t ranges[4] = { { 100, 10 }, { 112, 3 }, { 120, 20 }, { 150, 1 } };
+  bytes = 0;
+  start = clock_type::now();
+  for(size_t i = 0; i < packets; ++i)
+  {
+    ranges[0].first = uint32_t(i);
+    len = encode_ack(0x12345678, { -110, -20 }, ranges, 4, packet.data(), packet.size());
+    bytes += len;
+  }
+  report("encode ack", packets, bytes, seconds_since(start));
+
+  bytes = 0;
+  start = clock_type::now();
+  for(size_t i = 0; i < packets; ++i)
+  {
+    header_t header;
+    const uint8_t* body;
+    size_t body_len;
+    link_t link;
+    if(open(packet.data(), len, header, body, body_len) != OK
+       || decode_ack(body, body_len, link, [&](uint32_t first, uint8_t count) { checksum += first + count; }) != OK)
+    {
+      std::fprintf(stderr, "decoding failed\n");
+      return 1;
+    }
+    bytes += len;
+  }
+  report("decode ack", packets, bytes, seconds_since(start));
+  // Keeps the decoding from being optimised away
+  std::printf("%-16s %10u\n", "checksum", unsigned(checksum));
+  return 0;
+}
@@ -0,0 +1,200 @@
+// Copyright: 2022, Diez B. Roggisch, Berlin, all rights reserved
+//
+// Feeds randomly mutated packets to open() and the
+// decoders. Half of them get their CRC fixed up, so the
+// body parsers see the damage too. Built with the address
+// and undefined behaviour sanitizers where available.
+//
+//   lora_codec_fuzz [iterations] [seed]
+#include "lora_codec.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <random>
+#include <vector>
+
+using namespace beehive::lora::codec;
+
+#define CHECK(condition) \
+  do { \
+    if(!(condition)) \
+    { \
+      std::fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #condition); \
+      std::abort(); \
+    } \
+  } while(false)
+
+namespace {
+
+using packet_t = std::vector<uint8_t>;
+
+readings_t random_readings(std::mt19937& random)
+{
+  readings_t readings = {};
+  readings.count = uint8_t(random() % (beehive::records::MAX_SENSORS + 1));
+  for(size_t i = 0; i < readings.count; ++i)
+  {
+    readings.readings[i] = { uint8_t(random()), uint8_t(random()), uint16_t(random()), uint16_t(random()) };
+  }
+  return readings;
+}
+
+packet_t seed_packet(std::mt19937& random)
+{
+  packet_t packet(MAX_PACKET_SIZE);
+  size_t len = 0;
+  switch(random() % 3)
+  {
+  case 0:
+    len = encode_readings({ READINGS, uint32_t(random()), uint32_t(random()) }, random_readings(random), packet.data(), packet.size());
+    break;
+  case 1:
+  {
+    CyclesEncoder encoder(uint32_t(random()), { uint8_t(random()), uint16_t(random()) }, packet.data(), packet.size());
+    auto sequence = uint32_t(random());
+    while(encoder.add(sequence, uint32_t(random() >> (random() % 32)), random_readings(random)) && random() % 8)
+    {
+      sequence += uint32_t(random() % 300);
+    }
+    len = encoder.finish();
+    break;
+  }
+  case 2:
+  {
+    ack_range_t ranges[MAX_ACK_RANGES];
+    const auto count = random() % (MAX_ACK_RANGES + 1);
+    for(size_t i = 0; i < count; ++i)
+    {
+      ranges[i] = { uint32_t(random()), uint8_t(random()) };
+    }
+    len = encode_ack(uint32_t(random()), { int16_t(-int(random() % 200)), int8_t(random()) }, ranges, count, packet.data(), packet.size());
+    break;
+  }
+  }
+  CHECK(len > 0);
+  packet.resize(len);
+  return packet;
+}
+
+void mutate(packet_t& packet, std::mt19937& random)
+{
+  const auto mutations = 1 + random() % 4;
+  for(size_t i = 0; i < mutations; ++i)
+  {
+    const auto at = packet.empty() ? 0 : random() % packet.size();
+    switch(random() % 5)
+    {
+    case 0:
+      if(!packet.empty())
+      {
+        packet[at] ^= uint8_t(1 << (random() % 8));
+      }
+      break;
+    case 1:
+      if(!packet.empty())
+      {
+        packet[at] = uint8_t(random());
+      }
+      break;
+    case 2:
+      packet.resize(at);
+      break;
+    case 3:
+      packet.insert(packet.begin() + long(at), uint8_t(random()));
+      break;
+    case 4:
+      if(!packet.empty())
+      {
+        packet.erase(packet.begin() + long(at));
+      }
+      break;
+    }
+  }
+  if(random() % 2 && packet.size() >= HEADER_SIZE + CRC_SIZE)
+  {
+    const auto crc = crc16(packet.data(), packet.size() - CRC_SIZE);
+    packet[packet.size() - 2] = uint8_t(crc);
+    packet[packet.size() - 1] = uint8_t(crc >> 8);
+  }
+}
+
+// Returns the status of decoding the packet. The decoders
+// deliver all or nothing, and only within the body.
+status_t decode(const packet_t& packet)
+{
+  // A copy of exactly the packet's size, so the sanitizer
+  // catches reads past its end.
+  std::unique_ptr<uint8_t[]> data(new uint8_t[packet.size()]);
+  std::copy(packet.begin(), packet.end(), data.get());
+
+  header_t header;
+  const uint8_t* body;
+  size_t body_len;
+  auto status = open(data.get(), packet.size(), header, body, body_len);
+  if(status != OK)
+  {
+    return status;
+  }
+  CHECK(body == data.get() + HEADER_SIZE);
+  CHECK(body_len + HEADER_SIZE + CRC_SIZE == packet.size());
+  switch(header.type)
+  {
+  case READINGS:
+  {
+    readings_t readings;
+    status = decode_readings(body, body_len, readings);
+    CHECK(status != OK || readings.count <= beehive::records::MAX_SENSORS);
+    break;
+  }
+  case CYCLES:
+  {
+    sender_t sender;
+    size_t delivered = 0;
+    status = decode_cycles(
+      header.sequence, body, body_len, sender,
+      [&](uint32_t, uint32_t, const readings_t& readings) {
+        CHECK(readings.count <= beehive::records::MAX_SENSORS);
+        ++delivered;
+      });
+    CHECK(status == OK ? delivered == body[CYCLES_PREFIX_SIZE - 1] : delivered == 0);
+    break;
+  }
+  case ACK:
+  {
+    link_t link;
+    size_t delivered = 0;
+    status = decode_ack(body, body_len, link, [&](uint32_t, uint8_t) { ++delivered; });
+    CHECK(status == OK ? delivered == body[2] : delivered == 0);
+    break;
+  }
+  default:
+    status = BAD_TYPE;
+    break;
+  }
+  return status;
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+  const auto iterations = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 200000ul;
+  const auto seed = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 1ul;
+  std::mt19937 random(static_cast<uint32_t>(seed));
+  size_t statuses[TRAILING_DATA + 1] = {};
+  for(size_t i = 0; i < iterations; ++i)
+  {
+    auto packet = seed_packet(random);
+    CHECK(decode(packet) == OK);
+    mutate(packet, random);
+    ++statuses[decode(packet)];
+  }
+  std::printf("lora codec fuzz, %lu iterations, seed %lu\n", iterations, seed);
+  for(int status = OK; status <= TRAILING_DATA; ++status)
+  {
+    std::printf("  %-18s %zu\n", describe(status_t(status)), statuses[status]);
+  }
+  return 0;
+}
@@ -0,0 +1,302 @@
+// Copyright: 2022, Diez B. Roggisch, Berlin, all rights reserved
+//
+// Round trips and rejections of the LoRa packet codec.
+// Exits non-zero on the first failed check.
+#include "lora_codec.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+using namespace beehive::lora::codec;
+
+#define CHECK(condition) \
+  do { \
+    if(!(condition)) \
+    { \
+      std::fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #condition); \
+      std::exit(1); \
+    } \
+  } while(false)
+
+namespace {
+
+readings_t make_readings(uint8_t count, uint8_t seed)
+{
+  readings_t readings = {};
+  readings.count = count;
+  for(uint8_t i = 0; i < count; ++i)
+  {
+    readings.readings[i] = { uint8_t(i % 2), uint8_t(0x44 + i), uint16_t(seed * 1000 + i), uint16_t(0xffff - seed - i) };
+  }
+  return readings;
+}
+
+bool same(const readings_t& a, const readings_t& b)
+{
+  if(a.count != b.count)
+  {
+    return false;
+  }
+  for(size_t i = 0; i < a.count; ++i)
+  {
+    const auto& x = a.readings[i];
+    const auto& y = b.readings[i];
+    if(x.busno != y.busno || x.address != y.address
+       || x.raw_humidity != y.raw_humidity || x.raw_temperature != y.raw_temperature)
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+status_t open_as(const uint8_t* data, size_t len, packet_type_t type, header_t& header, const uint8_t*& body, size_t& body_len)
+{
+  const auto status = open(data, len, header, body, body_len);
+  if(status != OK)
+  {
+    return status;
+  }
+  return header.type == type ? OK : BAD_TYPE;
+}
+
+void readings_round_trip()
+{
+  for(uint8_t count = 0; count <= beehive::records::MAX_SENSORS; ++count)
+  {
+    const auto sent = make_readings(count, 3);
+    uint8_t packet[MAX_PACKET_SIZE];
+    const auto len = encode_readings({ READINGS, 0xdeadbeef, 4711 }, sent, packet, sizeof(packet));
+    CHECK(len == HEADER_SIZE + 1 + READING_SIZE * count + CRC_SIZE);
+
+    header_t header;
+    const uint8_t* body;
+    size_t body_len;
+    readings_t received;
+    CHECK(open_as(packet, len, READINGS, header, body, body_len) == OK);
+    CHECK(header.device_id == 0xdeadbeef);
+    CHECK(header.sequence == 4711);
+    CHECK(decode_readings(body, body_len, received) == OK);
+    CHECK(same(sent, received));
+  }
+  auto too_many = make_readings(beehive::records::MAX_SENSORS, 0);
+  too_many.count = beehive::records::MAX_SENSORS + 1;
+  uint8_t packet[MAX_PACKET_SIZE];
+  CHECK(encode_readings({ READINGS, 1, 1 }, too_many, packet, sizeof(packet)) == 0);
+  CHECK(encode_readings({ READINGS, 1, 1 }, make_readings(4, 0), packet, HEADER_SIZE + 4) == 0);
+}
+
+void cycles_round_trip()
+{
+  // Gaps of all varint sizes, as retransmissions leave them
+  const std::vector<uint32_t> sequences = { 100, 101, 103, 230, 20000, 3000000, 0x80000000u };
+  const sender_t sent_by = { 17, 0xbeef };
+  uint8_t packet[MAX_PACKET_SIZE];
+  CyclesEncoder encoder(42, sent_by, packet, sizeof(packet));
+  for(size_t i = 0; i < sequences.size(); ++i)
+  {
+    CHECK(encoder.add(sequences[i], uint32_t(i * 300), make_readings(uint8_t(i % 3), uint8_t(i))));
+  }
+  const auto len = encoder.finish();
+  CHECK(len > 0 && len <= MAX_PACKET_SIZE);
+
+  header_t header;
+  const uint8_t* body;
+  size_t body_len;
+  sender_t sender;
+  size_t count = 0;
+  CHECK(open_as(packet, len, CYCLES, header, body, body_len) == OK);
+  CHECK(header.device_id == 42);
+  CHECK(header.sequence == sequences.front());
+  CHECK(decode_cycles(
+          header.sequence, body, body_len, sender,
+          [&](uint32_t sequence, uint32_t age, const readings_t& readings) {
+            CHECK(count < sequences.size());
+            CHECK(sequence == sequences[count]);
+            CHECK(age == count * 300);
+            CHECK(same(readings, make_readings(uint8_t(count % 3), uint8_t(count))));
+            ++count;
+          }) == OK);
+  CHECK(count == sequences.size());
+  CHECK(sender.tx_power == sent_by.tx_power);
+  CHECK(sender.epoch == sent_by.epoch);
+}
+
+void cycles_fill_packet()
+{
+  // Full cycles are split at the packet size
+  uint8_t packet[MAX_PACKET_SIZE];
+  CyclesEncoder encoder(1, { 20, 1 }, packet, sizeof(packet));
+  const auto readings = make_readings(beehive::records::MAX_SENSORS, 1);
+  uint32_t sequence = 1;
+  while(encoder.add(sequence, 0, readings))
+  {
+    ++sequence;
+  }
+  CHECK(encoder.count() == 2);
+  const auto len = encoder.finish();
+  CHECK(len > 0 && len <= MAX_PACKET_SIZE);
+  CHECK(len + max_cycle_size(readings) > MAX_PACKET_SIZE);
+}
+
+void cycles_limit()
+{
+  // Empty cycles are the smallest, MAX_CYCLES of them
+  // need more than a packet.
+  std::vector<uint8_t> packet(4096);
+  CyclesEncoder encoder(1, { 20, 1 }, packet.data(), packet.size());
+  const auto empty = make_readings(0, 0);
+  for(uint32_t sequence = 1; sequence <= MAX_CYCLES; ++sequence)
+  {
+    CHECK(encoder.add(sequence, 0, empty));
+  }
+  CHECK(!encoder.add(MAX_CYCLES + 1, 0, empty));
+  const auto len = encoder.finish();
+  CHECK(len > 0);
+
+  header_t header;
+  const uint8_t* body;
+  size_t body_len;
+  sender_t sender;
+  size_t count = 0;
+  CHECK(open_as(packet.data(), len, CYCLES, header, body, body_len) == OK);
+  CHECK(decode_cycles(header.sequence, body, body_len, sender, [&](uint32_t, uint32_t, const readings_t&) { ++count; }) == OK);
+  CHECK(count == MAX_CYCLES);
+}
+
+void ack_round_trip()
+{
+  ack_range_t ranges[MAX_ACK_RANGES + 1];
+  for(size_t i = 0; i < MAX_ACK_RANGES + 1; ++i)
+  {
+    ranges[i] = { uint32_t(1000 * i + 7), uint8_t(i + 1) };
+  }
+  uint8_t packet[MAX_PACKET_SIZE];
+  for(size_t count = 0; count <= MAX_ACK_RANGES; ++count)
+  {
+    const auto len = encode_ack(99, { -117, -38 }, ranges, count, packet, sizeof(packet));
+    CHECK(len > 0);
+
+    header_t header;
+    const uint8_t* body;
+    size_t body_len;
+    link_t link;
+    size_t received = 0;
+    CHECK(open_as(packet, len, ACK, header, body, body_len) == OK);
+    CHECK(header.device_id == 99);
+    CHECK(decode_ack(
+            body, body_len, link,
+            [&](uint32_t first, uint8_t n) {
+              CHECK(received < count);
+              CHECK(first == ranges[received].first);
+              CHECK(n == ranges[received].count);
+              ++received;
+            }) == OK);
+    CHECK(received == count);
+    CHECK(link.rssi == -117);
+    CHECK(link.snr == -38);
+  }
+  CHECK(encode_ack(99, { -117, -38 }, ranges, MAX_ACK_RANGES + 1, packet, sizeof(packet)) == 0);
+
+  // The RSSI is clamped to what the byte holds
+  header_t header;
+  const uint8_t* body;
+  size_t body_len;
+  link_t link;
+  auto len = encode_ack(1, { -300, 0 }, ranges, 0, packet, sizeof(packet));
+  CHECK(open_as(packet, len, ACK, header, body, body_len) == OK);
+  CHECK(decode_ack(body, body_len, link, [](uint32_t, uint8_t) {}) == OK);
+  CHECK(link.rssi == -255);
+  len = encode_ack(1, { 5, 0 }, ranges, 0, packet, sizeof(packet));
+  CHECK(open_as(packet, len, ACK, header, body, body_len) == OK);
+  CHECK(decode_ack(body, body_len, link, [](uint32_t, uint8_t) {}) == OK);
+  CHECK(link.rssi == 0);
+}
+
+// Recomputes the CRC after tampering with the packet
+void reseal(uint8_t* packet, size_t len)
+{
+  const auto crc = crc16(packet, len - CRC_SIZE);
+  packet[len - 2] = uint8_t(crc);
+  packet[len - 1] = uint8_t(crc >> 8);
+}
+
+void rejections()
+{
+  uint8_t packet[MAX_PACKET_SIZE];
+  CyclesEncoder encoder(5, { 14, 2 }, packet, sizeof(packet));
+  CHECK(encoder.add(10, 1, make_readings(3, 1)));
+  CHECK(encoder.add(12, 0, make_readings(2, 2)));
+  const auto len = encoder.finish();
+
+  header_t header;
+  const uint8_t* body;
+  size_t body_len;
+  sender_t sender;
+  const auto nothing = [](uint32_t, uint32_t, const readings_t&) { CHECK(false); };
+
+  // Shorter than header and CRC
+  for(size_t cut = 0; cut < HEADER_SIZE + CRC_SIZE; ++cut)
+  {
+    CHECK(open(packet, cut, header, body, body_len) == TRUNCATED);
+  }
+  // Cut anywhere, the CRC doesn't match anymore
+  for(size_t cut = HEADER_SIZE + CRC_SIZE; cut < len; ++cut)
+  {
+    CHECK(open(packet, cut, header, body, body_len) == BAD_CRC);
+  }
+  // Every single bit flip is caught by the CRC
+  for(size_t bit = 0; bit < len * 8; ++bit)
+  {
+    packet[bit / 8] ^= uint8_t(1 << (bit % 8));
+    CHECK(open(packet, len, header, body, body_len) == BAD_CRC);
+    packet[bit / 8] ^= uint8_t(1 << (bit % 8));
+  }
+  CHECK(open(packet, len, header, body, body_len) == OK);
+
+  // A body cut short with a valid CRC delivers nothing
+  for(size_t cut = 0; cut < body_len; ++cut)
+  {
+    CHECK(decode_cycles(header.sequence, body, cut, sender, nothing) == TRUNCATED);
+  }
+
+  std::vector<uint8_t> copy(packet, packet + len);
+  copy[0] = VERSION + 1;
+  reseal(copy.data(), copy.size());
+  CHECK(open(copy.data(), copy.size(), header, body, body_len) == BAD_VERSION);
+
+  copy.assign(packet, packet + len);
+  copy.insert(copy.end() - CRC_SIZE, 0);
+  reseal(copy.data(), copy.size());
+  CHECK(open(copy.data(), copy.size(), header, body, body_len) == OK);
+  CHECK(decode_cycles(header.sequence, body, body_len, sender, nothing) == TRAILING_DATA);
+
+  // The count of the first cycle's readings
+  copy.assign(packet, packet + len);
+  copy[HEADER_SIZE + CYCLES_PREFIX_SIZE + 2] = beehive::records::MAX_SENSORS + 1;
+  reseal(copy.data(), copy.size());
+  CHECK(open(copy.data(), copy.size(), header, body, body_len) == OK);
+  CHECK(decode_cycles(header.sequence, body, body_len, sender, nothing) == TOO_MANY_READINGS);
+
+  // A varint running past 32 bits
+  copy.assign(packet, packet + HEADER_SIZE + CYCLES_PREFIX_SIZE);
+  copy.insert(copy.end(), { 0xff, 0xff, 0xff, 0xff, 0xff, 0x01, 0, 0, 0, 0 });
+  reseal(copy.data(), copy.size());
+  CHECK(open(copy.data(), copy.size(), header, body, body_len) == OK);
+  CHECK(decode_cycles(header.sequence, body, body_len, sender, nothing) == TRUNCATED);
+}
+
+} // namespace
+
+int main()
+{
+  readings_round_trip();
+  cycles_round_trip();
+  cycles_fill_packet();
+  cycles_limit();
+  ack_round_trip();
+  rejections();
+  std::printf("lora codec: ok\n");
+  return 0;
+}
@@ -0,0 +1,57 @@
+// Copyright: 2022, Diez B. Roggisch, Berlin, all rights reserved
+//
+// FatFs configuration of the harness. Mirrors the sdkconfig
+// of the firmware where it matters for the sector IO: SD
+// card sectors, code page 437 without long file names, a
+// sector cache per file. On top the harness enables mkfs
+// and fast seek, which it uses to format the image and to
+// count the fragments of files.
+//
+// Copied next to ff.c by CMakeLists.txt, so it takes the
+// place of the ffconf.h that comes with the sources.
+
+// Whatever revision ff.h is, this file fits it
+#define FFCONF_DEF FF_DEFINED
+
+#define FF_FS_READONLY 0
+#define FF_FS_MINIMIZE 0
+#define FF_USE_FIND 0
+#define FF_USE_MKFS 1
+#define FF_USE_FASTSEEK 1
+#define FF_USE_EXPAND 0
+#define FF_USE_CHMOD 0
+#define FF_USE_LABEL 0
+#define FF_USE_FORWARD 0
+#define FF_USE_STRFUNC 0
+#define FF_PRINT_LLI 0
+#define FF_PRINT_FLOAT 0
+#define FF_STRF_ENCODE 3
+
+#define FF_CODE_PAGE 437
+#define FF_USE_LFN 0
+#define FF_MAX_LFN 255
+#define FF_LFN_UNICODE 0
+#define FF_LFN_BUF 255
+#define FF_SFN_BUF 12
+#define FF_FS_RPATH 0
+
+#define FF_VOLUMES 2
+#define FF_STR_VOLUME_ID 0
+#define FF_VOLUME_STRS "RAM","NAND","CF","SD","SD2","USB","USB2","USB3"
+#define FF_MULTI_PARTITION 0
+#define FF_MIN_SS 512
+#define FF_MAX_SS 512
+#define FF_LBA64 0
+#define FF_MIN_GPT 0x10000000
+#define FF_USE_TRIM 0
+
+#define FF_FS_TINY 0
+#define FF_FS_EXFAT 0
+#define FF_FS_NORTC 1
+#define FF_NORTC_MON 1
+#define FF_NORTC_MDAY 1
+#define FF_NORTC_YEAR 2022
+#define FF_FS_NOFSINFO 0
+#define FF_FS_LOCK 0
+#define FF_FS_REENTRANT 0
+#define FF_FS_TIMEOUT 1000
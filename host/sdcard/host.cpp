@@ -0,0 +1,890 @@
+// Copyright: 2022, Diez B. Roggisch, Berlin, all rights reserved
+//
+// The host side of the ESP-IDF parts the SD card writer
+// uses: tasks as threads, a synchronous event loop, the
+// VFS on top of FatFs, and the SD card as a disk image.
+
+// FatFs and POSIX both have a DIR
+#define DIR FF_DIR
+#include "ff.h"
+#undef DIR
+
+#include "host.hpp"
+
+#include "beehive_events.hpp"
+#include "diskio_sdmmc.h"
+#include "esp_log.h"
+#include "esp_rom_crc.h"
+#include "esp_timer.h"
+#include "esp_vfs_fat.h"
+#include "freertos/task.h"
+#include "vfs.h"
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+
+esp_log_level_t g_esp_log_level = ESP_LOG_WARN;
+
+extern "C" {
+
+ESP_EVENT_DEFINE_BASE(SENSOR_EVENTS);
+ESP_EVENT_DEFINE_BASE(SDCARD_EVENTS);
+
+// Bounds of RTC_DATA_ATTR, provided by the linker
+extern char __start_beehive_rtc[];
+extern char __stop_beehive_rtc[];
+
+}
+
+namespace {
+
+const char* TAG = "host";
+
+using clock_type = std::chrono::steady_clock;
+
+const auto s_start = clock_type::now();
+
+void busy_wait(uint64_t us)
+{
+  if(!us)
+  {
+    return;
+  }
+  // sleep_for is far too coarse for single sectors
+  const auto until = clock_type::now() + std::chrono::microseconds(us);
+  while(clock_type::now() < until)
+  {
+  }
+}
+
+// -- disk image
+
+struct image_t
+{
+  uint8_t* data = nullptr;
+  uint64_t size = 0;
+  int fd = -1;
+  uint32_t read_latency = 0;
+  uint32_t write_latency = 0;
+  std::atomic<uint64_t> sectors_read{0};
+  std::atomic<uint64_t> sectors_written{0};
+  std::atomic<uint64_t> read_commands{0};
+  std::atomic<uint64_t> write_commands{0};
+};
+
+image_t s_image;
+sdmmc_card_t s_card;
+
+// -- ESP-IDF disk IO dispatch
+
+const ff_diskio_impl_t* s_diskio[FF_VOLUMES] = {};
+const sdmmc_card_t* s_diskio_cards[FF_VOLUMES] = {};
+
+DSTATUS sdmmc_init(unsigned char)
+{
+  return 0;
+}
+
+DSTATUS sdmmc_status(unsigned char)
+{
+  return 0;
+}
+
+DRESULT sdmmc_read(unsigned char pdrv, unsigned char* buff, uint32_t sector, unsigned count)
+{
+  return sdmmc_read_sectors(const_cast<sdmmc_card_t*>(s_diskio_cards[pdrv]), buff, sector, count) == ESP_OK ? RES_OK : RES_ERROR;
+}
+
+DRESULT sdmmc_write(unsigned char pdrv, const unsigned char* buff, uint32_t sector, unsigned count)
+{
+  return sdmmc_write_sectors(const_cast<sdmmc_card_t*>(s_diskio_cards[pdrv]), buff, sector, count) == ESP_OK ? RES_OK : RES_ERROR;
+}
+
+DRESULT sdmmc_ioctl(unsigned char pdrv, unsigned char cmd, void* buff)
+{
+  switch(cmd)
+  {
+  case CTRL_SYNC:
+    return RES_OK;
+  case GET_SECTOR_COUNT:
+    *static_cast<LBA_t*>(buff) = LBA_t(s_diskio_cards[pdrv]->csd.capacity);
+    return RES_OK;
+  case GET_SECTOR_SIZE:
+    *static_cast<WORD*>(buff) = WORD(s_diskio_cards[pdrv]->csd.sector_size);
+    return RES_OK;
+  case GET_BLOCK_SIZE:
+    *static_cast<DWORD*>(buff) = 1;
+    return RES_OK;
+  default:
+    return RES_ERROR;
+  }
+}
+
+const ff_diskio_impl_t s_sdmmc_impl = {
+  sdmmc_init,
+  sdmmc_status,
+  sdmmc_read,
+  sdmmc_write,
+  sdmmc_ioctl
+};
+
+// -- VFS
+
+// What esp_vfs_fat_sdspi_mount mounted
+std::string s_base_path;
+FATFS s_fs;
+
+struct vfs_dir_t
+{
+  FF_DIR dir;
+  struct dirent entry;
+};
+
+// The FatFs path of a path under the mount point
+std::optional<std::string> fat_path(const char* path)
+{
+  const auto len = s_base_path.size();
+  if(len == 0 || strncmp(path, s_base_path.c_str(), len) != 0 || (path[len] != '/' && path[len] != 0))
+  {
+    errno = ENOENT;
+    return std::nullopt;
+  }
+  return std::string("0:") + (path[len] ? path + len : "/");
+}
+
+// Like the ESP-IDF VFS does it
+int set_errno(FRESULT result)
+{
+  switch(result)
+  {
+  case FR_OK:
+    return 0;
+  case FR_NO_FILE:
+  case FR_NO_PATH:
+    errno = ENOENT;
+    break;
+  case FR_EXIST:
+    errno = EEXIST;
+    break;
+  case FR_DENIED:
+    errno = ENOSPC;
+    break;
+  case FR_TOO_MANY_OPEN_FILES:
+    errno = ENFILE;
+    break;
+  case FR_INVALID_NAME:
+    errno = EINVAL;
+    break;
+  default:
+    errno = EIO;
+    break;
+  }
+  return -1;
+}
+
+BYTE fat_mode(const char* mode)
+{
+  const auto plus = strchr(mode, '+') != nullptr;
+  switch(mode[0])
+  {
+  case 'r':
+    return plus ? FA_READ | FA_WRITE : FA_READ;
+  case 'w':
+    return (plus ? FA_READ | FA_WRITE : FA_WRITE) | FA_CREATE_ALWAYS;
+  case 'a':
+    return (plus ? FA_READ | FA_WRITE : FA_WRITE) | FA_OPEN_APPEND;
+  default:
+    return 0;
+  }
+}
+
+// -- tasks and events
+
+struct task_deleted_t
+{
+};
+
+struct handler_t
+{
+  esp_event_base_t base;
+  int32_t id;
+  esp_event_handler_t handler;
+  void* arg;
+};
+
+std::mutex s_handlers_mutex;
+std::vector<handler_t> s_handlers;
+
+} // namespace
+
+// -- tasks
+
+struct host_task_t
+{
+  std::thread thread;
+  std::mutex mutex;
+  std::condition_variable cv;
+  uint32_t notifications = 0;
+  bool deleted = false;
+};
+
+namespace {
+
+thread_local host_task_t* s_current_task = nullptr;
+
+} // namespace
+
+BaseType_t xTaskCreate(TaskFunction_t code, const char*, uint32_t, void* parameters, UBaseType_t, TaskHandle_t* created_task)
+{
+  auto task = new host_task_t;
+  task->thread = std::thread([task, code, parameters]() {
+    s_current_task = task;
+    try
+    {
+      code(parameters);
+    }
+    catch(const task_deleted_t&)
+    {
+    }
+  });
+  if(created_task)
+  {
+    *created_task = task;
+  }
+  return pdPASS;
+}
+
+// The task finishes what it is doing first, unlike on the
+// device, so the harness never unmounts under a write.
+void vTaskDelete(TaskHandle_t task)
+{
+  {
+    std::lock_guard<std::mutex> lock(task->mutex);
+    task->deleted = true;
+  }
+  task->cv.notify_one();
+  task->thread.join();
+  delete task;
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task)
+{
+  {
+    std::lock_guard<std::mutex> lock(task->mutex);
+    ++task->notifications;
+  }
+  task->cv.notify_one();
+  return pdPASS;
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear_count_on_exit, TickType_t)
+{
+  auto task = s_current_task;
+  std::unique_lock<std::mutex> lock(task->mutex);
+  task->cv.wait(lock, [task]() { return task->notifications || task->deleted; });
+  if(task->deleted)
+  {
+    throw task_deleted_t();
+  }
+  const auto notifications = task->notifications;
+  task->notifications = clear_count_on_exit ? 0 : notifications - 1;
+  return notifications;
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+  std::this_thread::sleep_for(std::chrono::milliseconds(ticks));
+}
+
+// -- events
+
+esp_err_t esp_event_post(esp_event_base_t event_base, int32_t event_id, const void* event_data, size_t, uint32_t)
+{
+  std::vector<handler_t> handlers;
+  {
+    std::lock_guard<std::mutex> lock(s_handlers_mutex);
+    handlers = s_handlers;
+  }
+  for(const auto& h : handlers)
+  {
+    if(strcmp(h.base, event_base) == 0 && (h.id == ESP_EVENT_ANY_ID || h.id == event_id))
+    {
+      h.handler(h.arg, event_base, event_id, const_cast<void*>(event_data));
+    }
+  }
+  return ESP_OK;
+}
+
+esp_err_t esp_event_handler_instance_register(esp_event_base_t event_base, int32_t event_id, esp_event_handler_t event_handler, void* event_handler_arg, esp_event_handler_instance_t*)
+{
+  std::lock_guard<std::mutex> lock(s_handlers_mutex);
+  s_handlers.push_back({ event_base, event_id, event_handler, event_handler_arg });
+  return ESP_OK;
+}
+
+// The parts of beehive_events.cpp the writer uses. The
+// batch payload is laid out the same, the floating point
+// values are left out as the writer only stores raw ones.
+namespace beehive::events {
+
+namespace sensors {
+
+namespace {
+
+struct batch_event_t
+{
+  size_t count;
+  beehive::records::compact_record_t records[1];
+};
+
+} // namespace
+
+void send_batch(const std::vector<beehive::records::compact_record_t>& records)
+{
+  const auto payload_size = records.size() * sizeof(beehive::records::compact_record_t);
+  std::vector<uint8_t> block(sizeof(size_t) + payload_size);
+  auto p = reinterpret_cast<batch_event_t*>(block.data());
+  p->count = records.size();
+  std::memcpy(&p->records[0], records.data(), payload_size);
+  esp_event_post(SENSOR_EVENTS, SHT3XDIS_BATCH, block.data(), block.size(), 0);
+}
+
+sht3xdis_record_t expand(const beehive::records::compact_record_t& record)
+{
+  sht3xdis_record_t result;
+  result.timestamp = record.timestamp;
+  for(size_t j = 0; j < record.count; ++j)
+  {
+    const auto& reading = record.readings[j];
+    result.readings.push_back({ reading.busno, reading.address, 0, 0, reading.raw_humidity, reading.raw_temperature });
+  }
+  return result;
+}
+
+std::optional<std::vector<sht3xdis_record_t>> receive_records(sensor_events_t kind, void* event_data)
+{
+  if(kind != SHT3XDIS_BATCH)
+  {
+    return std::nullopt;
+  }
+  const auto p = static_cast<batch_event_t*>(event_data);
+  std::vector<sht3xdis_record_t> result(p->count);
+  for(size_t i = 0; i < p->count; ++i)
+  {
+    result[i] = expand(p->records[i]);
+  }
+  return result;
+}
+
+} // namespace sensors
+
+namespace sdcard {
+
+void recovered(const recovery_report_t& report)
+{
+  esp_event_post(SDCARD_EVENTS, RECOVERED, &report, sizeof(report), 0);
+}
+
+std::optional<recovery_report_t> receive_recovery_report(sdcard_events_t id, void* event_data)
+{
+  if(id != RECOVERED)
+  {
+    return std::nullopt;
+  }
+  return *static_cast<recovery_report_t*>(event_data);
+}
+
+} // namespace sdcard
+
+} // namespace beehive::events
+
+// -- small things
+
+const char* esp_err_to_name(esp_err_t err)
+{
+  switch(err)
+  {
+  case ESP_OK: return "ESP_OK";
+  case ESP_FAIL: return "ESP_FAIL";
+  case ESP_ERR_NO_MEM: return "ESP_ERR_NO_MEM";
+  case ESP_ERR_INVALID_STATE: return "ESP_ERR_INVALID_STATE";
+  default: return "ESP_ERR";
+  }
+}
+
+uint32_t esp_rom_crc32_le(uint32_t crc, const uint8_t* buf, uint32_t len)
+{
+  crc = ~crc;
+  for(uint32_t i = 0; i < len; ++i)
+  {
+    crc ^= buf[i];
+    for(int bit = 0; bit < 8; ++bit)
+    {
+      crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+    }
+  }
+  return ~crc;
+}
+
+int64_t esp_timer_get_time()
+{
+  return std::chrono::duration_cast<std::chrono::microseconds>(clock_type::now() - s_start).count();
+}
+
+esp_err_t spi_bus_initialize(spi_host_device_t, const spi_bus_config_t*, int)
+{
+  return ESP_OK;
+}
+
+esp_err_t spi_bus_free(spi_host_device_t)
+{
+  return ESP_OK;
+}
+
+// -- the card
+
+void sdmmc_card_print_info(FILE* stream, const sdmmc_card_t* card)
+{
+  if(g_esp_log_level >= ESP_LOG_INFO)
+  {
+    std::fprintf(stream, "Image: %lluMB\n", (unsigned long long)(uint64_t(card->csd.capacity) * card->csd.sector_size >> 20));
+  }
+}
+
+esp_err_t sdmmc_read_sectors(sdmmc_card_t*, void* dst, size_t start_sector, size_t sector_count)
+{
+  if((start_sector + sector_count) * beehive::host::SECTOR_SIZE > s_image.size)
+  {
+    return ESP_FAIL;
+  }
+  busy_wait(uint64_t(s_image.read_latency) * sector_count);
+  std::memcpy(dst, s_image.data + start_sector * beehive::host::SECTOR_SIZE, sector_count * beehive::host::SECTOR_SIZE);
+  s_image.sectors_read += sector_count;
+  ++s_image.read_commands;
+  return ESP_OK;
+}
+
+esp_err_t sdmmc_write_sectors(sdmmc_card_t*, const void* src, size_t start_sector, size_t sector_count)
+{
+  if((start_sector + sector_count) * beehive::host::SECTOR_SIZE > s_image.size)
+  {
+    return ESP_FAIL;
+  }
+  busy_wait(uint64_t(s_image.write_latency) * sector_count);
+  std::memcpy(s_image.data + start_sector * beehive::host::SECTOR_SIZE, src, sector_count * beehive::host::SECTOR_SIZE);
+  s_image.sectors_written += sector_count;
+  ++s_image.write_commands;
+  return ESP_OK;
+}
+
+void ff_diskio_register(BYTE pdrv, const ff_diskio_impl_t* discio_impl)
+{
+  s_diskio[pdrv] = discio_impl;
+}
+
+void ff_diskio_register_sdmmc(BYTE pdrv, sdmmc_card_t* card)
+{
+  s_diskio_cards[pdrv] = card;
+  ff_diskio_register(pdrv, card ? &s_sdmmc_impl : nullptr);
+}
+
+BYTE ff_diskio_get_pdrv_card(const sdmmc_card_t* card)
+{
+  for(BYTE pdrv = 0; pdrv < FF_VOLUMES; ++pdrv)
+  {
+    if(s_diskio_cards[pdrv] == card)
+    {
+      return pdrv;
+    }
+  }
+  return 0xff;
+}
+
+// What FatFs calls, dispatched like ESP-IDF's diskio.c
+extern "C" {
+
+DSTATUS disk_initialize(BYTE pdrv)
+{
+  return s_diskio[pdrv] ? s_diskio[pdrv]->init(pdrv) : STA_NOINIT;
+}
+
+DSTATUS disk_status(BYTE pdrv)
+{
+  return s_diskio[pdrv] ? s_diskio[pdrv]->status(pdrv) : STA_NOINIT;
+}
+
+DRESULT disk_read(BYTE pdrv, BYTE* buff, LBA_t sector, UINT count)
+{
+  return s_diskio[pdrv] ? s_diskio[pdrv]->read(pdrv, buff, uint32_t(sector), count) : RES_NOTRDY;
+}
+
+DRESULT disk_write(BYTE pdrv, const BYTE* buff, LBA_t sector, UINT count)
+{
+  return s_diskio[pdrv] ? s_diskio[pdrv]->write(pdrv, buff, uint32_t(sector), count) : RES_NOTRDY;
+}
+
+DRESULT disk_ioctl(BYTE pdrv, BYTE cmd, void* buff)
+{
+  return s_diskio[pdrv] ? s_diskio[pdrv]->ioctl(pdrv, cmd, buff) : RES_NOTRDY;
+}
+
+} // extern "C"
+
+esp_err_t esp_vfs_fat_sdspi_mount(const char* base_path, const sdmmc_host_t*, const sdspi_device_config_t*, const esp_vfs_fat_sdmmc_mount_config_t* mount_config, sdmmc_card_t** out_card)
+{
+  if(!s_image.data)
+  {
+    return ESP_ERR_INVALID_STATE;
+  }
+  s_card.csd.capacity = int(s_image.size / beehive::host::SECTOR_SIZE);
+  s_card.csd.sector_size = int(beehive::host::SECTOR_SIZE);
+  ff_diskio_register_sdmmc(0, &s_card);
+  auto result = f_mount(&s_fs, "0:", 1);
+  if(result == FR_NO_FILESYSTEM && mount_config->format_if_mount_failed)
+  {
+    ESP_LOGW(TAG, "Formatting the image");
+    std::vector<BYTE> work(FF_MAX_SS * 8);
+    const MKFS_PARM parameters = { FM_ANY, 0, 0, 0, DWORD(mount_config->allocation_unit_size) };
+    result = f_mkfs("0:", &parameters, work.data(), UINT(work.size()));
+    if(result == FR_OK)
+    {
+      result = f_mount(&s_fs, "0:", 1);
+    }
+  }
+  if(result != FR_OK)
+  {
+    ESP_LOGE(TAG, "Mounting failed (%d)", int(result));
+    ff_diskio_register_sdmmc(0, nullptr);
+    return ESP_FAIL;
+  }
+  s_base_path = base_path;
+  *out_card = &s_card;
+  return ESP_OK;
+}
+
+esp_err_t esp_vfs_fat_sdcard_unmount(const char*, sdmmc_card_t*)
+{
+  f_mount(nullptr, "0:", 0);
+  ff_diskio_register_sdmmc(0, nullptr);
+  s_base_path.clear();
+  return ESP_OK;
+}
+
+// -- VFS
+
+FILE* beehive_vfs_fopen(const char* path, const char* mode)
+{
+  const auto fat = fat_path(path);
+  if(!fat)
+  {
+    return nullptr;
+  }
+  auto file = new FIL;
+  const auto result = f_open(file, fat->c_str(), fat_mode(mode));
+  if(result != FR_OK)
+  {
+    delete file;
+    set_errno(result);
+    return nullptr;
+  }
+  return reinterpret_cast<FILE*>(file);
+}
+
+int beehive_vfs_fclose(FILE* f)
+{
+  auto file = reinterpret_cast<FIL*>(f);
+  const auto result = f_close(file);
+  delete file;
+  return result == FR_OK ? 0 : set_errno(result);
+}
+
+size_t beehive_vfs_fread(void* buffer, size_t size, size_t count, FILE* f)
+{
+  UINT read = 0;
+  if(size == 0 || set_errno(f_read(reinterpret_cast<FIL*>(f), buffer, UINT(size * count), &read)) != 0)
+  {
+    return 0;
+  }
+  return read / size;
+}
+
+size_t beehive_vfs_fwrite(const void* buffer, size_t size, size_t count, FILE* f)
+{
+  UINT written = 0;
+  if(size == 0 || set_errno(f_write(reinterpret_cast<FIL*>(f), buffer, UINT(size * count), &written)) != 0)
+  {
+    return 0;
+  }
+  if(written < size * count)
+  {
+    errno = ENOSPC;
+  }
+  return written / size;
+}
+
+int beehive_vfs_fseek(FILE* f, long offset, int whence)
+{
+  auto file = reinterpret_cast<FIL*>(f);
+  FSIZE_t position = 0;
+  switch(whence)
+  {
+  case SEEK_SET:
+    position = FSIZE_t(offset);
+    break;
+  case SEEK_CUR:
+    position = FSIZE_t(long(f_tell(file)) + offset);
+    break;
+  case SEEK_END:
+    position = FSIZE_t(long(f_size(file)) + offset);
+    break;
+  default:
+    errno = EINVAL;
+    return -1;
+  }
+  return set_errno(f_lseek(file, position));
+}
+
+long beehive_vfs_ftell(FILE* f)
+{
+  return long(f_tell(reinterpret_cast<FIL*>(f)));
+}
+
+int beehive_vfs_fflush(FILE* f)
+{
+  return set_errno(f_sync(reinterpret_cast<FIL*>(f)));
+}
+
+int beehive_vfs_truncate(const char* path, off_t length)
+{
+  const auto fat = fat_path(path);
+  if(!fat)
+  {
+    return -1;
+  }
+  FIL file;
+  auto result = f_open(&file, fat->c_str(), FA_WRITE);
+  if(result != FR_OK)
+  {
+    return set_errno(result);
+  }
+  if(FSIZE_t(length) > f_size(&file))
+  {
+    f_close(&file);
+    errno = EPERM;
+    return -1;
+  }
+  result = f_lseek(&file, FSIZE_t(length));
+  if(result == FR_OK)
+  {
+    result = f_truncate(&file);
+  }
+  const auto closed = f_close(&file);
+  return set_errno(result != FR_OK ? result : closed);
+}
+
+int beehive_vfs_stat(const char* path, struct beehive_vfs_stat* st)
+{
+  const auto fat = fat_path(path);
+  if(!fat)
+  {
+    return -1;
+  }
+  FILINFO info;
+  const auto result = f_stat(fat->c_str(), &info);
+  if(result != FR_OK)
+  {
+    return set_errno(result);
+  }
+  st->st_size = off_t(info.fsize);
+  st->st_mode = (info.fattrib & AM_DIR) ? S_IFDIR : S_IFREG;
+  return 0;
+}
+
+int beehive_vfs_unlink(const char* path)
+{
+  const auto fat = fat_path(path);
+  return fat ? set_errno(f_unlink(fat->c_str())) : -1;
+}
+
+DIR* beehive_vfs_opendir(const char* path)
+{
+  const auto fat = fat_path(path);
+  if(!fat)
+  {
+    return nullptr;
+  }
+  auto dir = new vfs_dir_t;
+  const auto result = f_opendir(&dir->dir, fat->c_str());
+  if(result != FR_OK)
+  {
+    delete dir;
+    set_errno(result);
+    return nullptr;
+  }
+  return reinterpret_cast<DIR*>(dir);
+}
+
+struct dirent* beehive_vfs_readdir(DIR* d)
+{
+  auto dir = reinterpret_cast<vfs_dir_t*>(d);
+  FILINFO info;
+  if(f_readdir(&dir->dir, &info) != FR_OK || info.fname[0] == 0)
+  {
+    return nullptr;
+  }
+  std::memset(&dir->entry, 0, sizeof(dir->entry));
+  std::strncpy(dir->entry.d_name, info.fname, sizeof(dir->entry.d_name) - 1);
+  dir->entry.d_type = (info.fattrib & AM_DIR) ? DT_DIR : DT_REG;
+  return &dir->entry;
+}
+
+int beehive_vfs_closedir(DIR* d)
+{
+  auto dir = reinterpret_cast<vfs_dir_t*>(d);
+  const auto result = f_closedir(&dir->dir);
+  delete dir;
+  return set_errno(result);
+}
+
+// -- the harness
+
+namespace beehive::host {
+
+bool open_image(const std::string& path, uint64_t size)
+{
+  close_image();
+  size -= size % SECTOR_SIZE;
+  void* data;
+  if(path.empty())
+  {
+    data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  }
+  else
+  {
+    s_image.fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if(s_image.fd < 0 || ftruncate(s_image.fd, off_t(size)) != 0)
+    {
+      ESP_LOGE(TAG, "Can't open %s: %s", path.c_str(), strerror(errno));
+      return false;
+    }
+    data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, s_image.fd, 0);
+  }
+  if(data == MAP_FAILED)
+  {
+    ESP_LOGE(TAG, "Can't map %llu bytes: %s", (unsigned long long)size, strerror(errno));
+    return false;
+  }
+  s_image.data = static_cast<uint8_t*>(data);
+  s_image.size = size;
+  return true;
+}
+
+void close_image()
+{
+  if(s_image.data)
+  {
+    munmap(s_image.data, s_image.size);
+    s_image.data = nullptr;
+  }
+  if(s_image.fd >= 0)
+  {
+    close(s_image.fd);
+    s_image.fd = -1;
+  }
+}
+
+uint64_t image_sectors()
+{
+  return s_image.size / SECTOR_SIZE;
+}
+
+void set_latency(uint32_t read_us_per_sector, uint32_t write_us_per_sector)
+{
+  s_image.read_latency = read_us_per_sector;
+  s_image.write_latency = write_us_per_sector;
+}
+
+image_counters_t image_counters()
+{
+  return {
+    s_image.sectors_read,
+    s_image.sectors_written,
+    s_image.read_commands,
+    s_image.write_commands
+  };
+}
+
+bool format_image(uint32_t cluster_size)
+{
+  s_card.csd.capacity = int(s_image.size / SECTOR_SIZE);
+  s_card.csd.sector_size = int(SECTOR_SIZE);
+  ff_diskio_register_sdmmc(0, &s_card);
+  std::vector<BYTE> work(FF_MAX_SS * 64);
+  const MKFS_PARM parameters = { FM_ANY, 2, 0, 0, DWORD(cluster_size) };
+  const auto result = f_mkfs("0:", &parameters, work.data(), UINT(work.size()));
+  ff_diskio_register_sdmmc(0, nullptr);
+  if(result != FR_OK)
+  {
+    ESP_LOGE(TAG, "Formatting failed (%d)", int(result));
+  }
+  return result == FR_OK;
+}
+
+bool remove_file(const char* name)
+{
+  ff_diskio_register_sdmmc(0, &s_card);
+  auto result = f_mount(&s_fs, "0:", 1);
+  if(result == FR_OK)
+  {
+    result = f_unlink((std::string("0:/") + name).c_str());
+    f_mount(nullptr, "0:", 0);
+  }
+  ff_diskio_register_sdmmc(0, nullptr);
+  return result == FR_OK;
+}
+
+std::optional<size_t> file_fragments(const std::string& name)
+{
+  std::optional<size_t> fragments;
+  ff_diskio_register_sdmmc(0, &s_card);
+  if(f_mount(&s_fs, "0:", 1) == FR_OK)
+  {
+    FIL file;
+    if(f_open(&file, ("0:/" + name).c_str(), FA_READ) == FR_OK)
+    {
+      // The map size comes first, then a length and start
+      // cluster per fragment and a terminating zero. Too
+      // small a map still reports the size it needs.
+      std::vector<DWORD> map(1025);
+      map[0] = DWORD(map.size());
+      file.cltbl = map.data();
+      const auto result = f_lseek(&file, CREATE_LINKMAP);
+      if(result == FR_OK || result == FR_NOT_ENOUGH_CORE)
+      {
+        fragments = (map[0] - 1) / 2;
+      }
+      f_close(&file);
+    }
+    f_mount(nullptr, "0:", 0);
+  }
+  ff_diskio_register_sdmmc(0, nullptr);
+  return fragments;
+}
+
+void clear_rtc_memory()
+{
+  std::memset(__start_beehive_rtc, 0, size_t(__stop_beehive_rtc - __start_beehive_rtc));
+}
+
+void reset_event_handlers()
+{
+  std::lock_guard<std::mutex> lock(s_handlers_mutex);
+  s_handlers.clear();
+}
+
+} // namespace beehive::host
@@ -0,0 +1,50 @@
+// Copyright: 2022, Diez B. Roggisch, Berlin, all rights reserved
+//
+// What the harness controls of the simulated device: the
+// disk image standing in for the SD card, and the memory
+// and event handlers a restart wipes.
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+
+namespace beehive::host {
+
+const size_t SECTOR_SIZE = 512;
+
+struct image_counters_t
+{
+  uint64_t sectors_read;
+  uint64_t sectors_written;
+  // separate reads and writes, as the card sees them
+  uint64_t read_commands;
+  uint64_t write_commands;
+};
+
+// A RAM image if path is empty, otherwise a file that is
+// created or extended to size bytes. Both are sparse, so
+// a large card costs only what gets written.
+bool open_image(const std::string& path, uint64_t size);
+void close_image();
+uint64_t image_sectors();
+// Simulated card latency, busy waited per sector
+void set_latency(uint32_t read_us_per_sector, uint32_t write_us_per_sector);
+image_counters_t image_counters();
+// FAT32 if the image is large enough, with two FATs like
+// the cards come formatted
+bool format_image(uint32_t cluster_size);
+// A file in the root directory of the image, while
+// nothing else has it mounted
+bool remove_file(const char* name);
+// The contiguous cluster runs of a file in the root
+// directory, from the FatFs link map
+std::optional<size_t> file_fragments(const std::string& name);
+
+// Deep sleep keeps RTC memory, a power cycle doesn't
+void clear_rtc_memory();
+// A restart drops all event handlers
+void reset_event_handlers();
+
+} // namespace beehive::host
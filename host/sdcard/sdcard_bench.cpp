@@ -0,0 +1,436 @@
+// Copyright: 2022, Diez B. Roggisch, Berlin, all rights reserved
+//
+// Runs the SDCardWriter of the firmware against FatFs on a
+// disk image, to see what a change to the write path costs
+// without a device. Every wake up of the device is one
+// boot of the writer: mount, recover, write the records of
+// the cycle, unmount. RTC memory survives that, unless we
+// simulate a power cycle.
+//
+// For cards with 1, 100 and 1000 data files it reports
+//
+// - the boot recovery time and sectors read, from the RTC
+//   cursor, from the cursor file and by scanning the card
+// - records/s, bytes per record and the sector writes per
+//   record, split into FAT, root directory and the rest, for
+//   wake ups with one record each
+//
+// and then for a year of data files, written one record per
+// wake up from an empty card, what creating a file costs the
+// wake up that does it, and the fragments of the files.
+//
+//   sdcard_bench [--image FILE] [--size-mb N] [--cluster-kb N]
+//                [--read-latency-us N] [--write-latency-us N]
+//                [--sensors N] [--cycles N] [--files N,N,...]
+//                [--rotation-files N] [--verbose]
+//
+// Without --image the card is a sparse RAM image. The
+// latencies are per sector, busy waited, and show up in the
+// times the writer measures.
+#include "host.hpp"
+
+#include "beehive_events.hpp"
+#include "diskstats.hpp"
+#include "esp_log.h"
+#include "sdcard.hpp"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace {
+
+using beehive::sdcard::SDCardWriter;
+using beehive::sdcard::diskstats::disk_counters_t;
+using clock_type = std::chrono::steady_clock;
+
+struct options_t
+{
+  std::string image;
+  uint64_t size_mb = 4096;
+  uint32_t cluster_kb = 32;
+  uint32_t read_latency = 0;
+  uint32_t write_latency = 0;
+  size_t sensors = 2;
+  size_t cycles = 200;
+  std::vector<size_t> files = { 1, 100, 1000 };
+  size_t rotation_files = 365;
+};
+
+// The records of a batch event the writer takes without
+// dropping: its four staging buffers hold 32 lines each.
+const size_t FILL_BATCH = 96;
+const std::time_t START = 1640995200; // 2022-01-01
+const std::time_t PERIOD = 300;
+
+// -- the simulated device
+
+std::mutex s_mutex;
+std::condition_variable s_cv;
+size_t s_total_written = 0;
+bool s_failed = false;
+
+void sdcard_event_handler(void*, esp_event_base_t, int32_t id, void* event_data)
+{
+  using namespace beehive::events::sdcard;
+  if(id == DATASET_WRITTEN || id == NO_FILE)
+  {
+    {
+      std::lock_guard<std::mutex> lock(s_mutex);
+      if(id == DATASET_WRITTEN)
+      {
+        s_total_written = *static_cast<const size_t*>(event_data);
+      }
+      s_failed = id == NO_FILE;
+    }
+    s_cv.notify_all();
+  }
+}
+
+class Device
+{
+public:
+  explicit Device(size_t sensors)
+    : _sensors(sensors)
+  {
+  }
+
+  // Returns false if the card didn't mount
+  bool wake()
+  {
+    beehive::host::reset_event_handlers();
+    esp_event_handler_instance_register(SDCARD_EVENTS, ESP_EVENT_ANY_ID, sdcard_event_handler, nullptr, nullptr);
+    _writer = std::make_unique<SDCardWriter>();
+    return _writer->available();
+  }
+
+  // Posts count records as one event and waits for the
+  // writer to put them on the card. A batch can take more
+  // than one drain, so we wait for its last sequence.
+  bool record(size_t count)
+  {
+    const auto dropped = _writer->stats().dropped;
+    const auto last_sequence = _writer->total_datasets_written() + count;
+    std::vector<beehive::records::compact_record_t> records(count);
+    for(auto& record : records)
+    {
+      record.timestamp = uint32_t(_time);
+      record.count = uint8_t(_sensors);
+      for(size_t i = 0; i < _sensors; ++i)
+      {
+        record.readings[i] = { uint8_t(i / 2), uint8_t(0x44 + i % 2), uint16_t(0x6000 + _time % 977), uint16_t(0x6800 + _time % 613) };
+      }
+      _time += PERIOD;
+    }
+    {
+      std::lock_guard<std::mutex> lock(s_mutex);
+      s_total_written = 0;
+      s_failed = false;
+    }
+    // The event loop is synchronous, so the writer has
+    // staged or dropped all of them when this returns.
+    beehive::events::sensors::send_batch(records);
+    if(_writer->stats().dropped != dropped)
+    {
+      std::fprintf(stderr, "The writer dropped records\n");
+      std::exit(1);
+    }
+    std::unique_lock<std::mutex> lock(s_mutex);
+    if(!s_cv.wait_for(lock, std::chrono::seconds(30), [last_sequence]() { return s_failed || s_total_written >= last_sequence; }))
+    {
+      std::fprintf(stderr, "The writer didn't finish\n");
+      std::exit(1);
+    }
+    return !s_failed;
+  }
+
+  void sleep()
+  {
+    _writer.reset();
+  }
+
+  SDCardWriter& writer() { return *_writer; }
+
+private:
+  size_t _sensors;
+  std::time_t _time = START;
+  std::unique_ptr<SDCardWriter> _writer;
+};
+
+disk_counters_t operator-(const disk_counters_t& a, const disk_counters_t& b)
+{
+  return {
+    a.sectors_read - b.sectors_read,
+    a.sectors_written - b.sectors_written,
+    a.fat_sectors_written - b.fat_sectors_written,
+    a.directory_sectors_written - b.directory_sectors_written,
+    a.write_time - b.write_time
+  };
+}
+
+// -- scenarios
+
+bool fill(Device& device, size_t files)
+{
+  if(!device.wake())
+  {
+    return false;
+  }
+  while(device.writer().file_count() < files)
+  {
+    if(!device.record(FILL_BATCH))
+    {
+      std::fprintf(stderr, "Filling the card failed\n");
+      return false;
+    }
+  }
+  device.sleep();
+  return true;
+}
+
+bool recovery(Device& device, const char* how)
+{
+  const auto before = beehive::sdcard::diskstats::counters();
+  const auto start = clock_type::now();
+  if(!device.wake())
+  {
+    return false;
+  }
+  const auto wall = std::chrono::duration<double, std::micro>(clock_type::now() - start).count();
+  const auto stats = device.writer().stats();
+  const auto disk = beehive::sdcard::diskstats::counters() - before;
+  device.sleep();
+  std::printf(
+    "  recovery %-12s %8u us %8u sectors read, boot %8.0f us\n",
+    how, unsigned(stats.boot_recovery_time), unsigned(disk.sectors_read), wall);
+  return true;
+}
+
+bool write_cycles(Device& device, size_t cycles, uint32_t cluster_size)
+{
+  uint64_t records = 0, bytes = 0, write_path_time = 0, boot_recovery_time = 0;
+  uint32_t max_write_path = 0;
+  const auto disk_before = beehive::sdcard::diskstats::counters();
+  const auto image_before = beehive::host::image_counters();
+  const auto start = clock_type::now();
+  for(size_t i = 0; i < cycles; ++i)
+  {
+    if(!device.wake() || !device.record(1))
+    {
+      std::fprintf(stderr, "Writing failed\n");
+      return false;
+    }
+    const auto stats = device.writer().stats();
+    device.sleep();
+    records += stats.records_written;
+    bytes += stats.bytes_written;
+    write_path_time += stats.write_path_time;
+    max_write_path = std::max(max_write_path, stats.write_path_time);
+    boot_recovery_time += stats.boot_recovery_time;
+  }
+  const auto seconds = std::chrono::duration<double>(clock_type::now() - start).count();
+  const auto disk = beehive::sdcard::diskstats::counters() - disk_before;
+  const auto image = beehive::host::image_counters();
+  const auto written = image.sectors_written - image_before.sectors_written;
+  const auto per_record = [records](double value) { return records ? value / records : 0; };
+
+  std::printf("  %zu wake ups with one record each, %zu KB clusters\n", cycles, size_t(cluster_size / 1024));
+  std::printf("    %10.0f records/s, %.0f us boot recovery and %.0f us write path per record, %u us max\n",
+              records / seconds, per_record(boot_recovery_time), per_record(write_path_time), unsigned(max_write_path));
+  std::printf("    %10.1f bytes per record in the file, %.1f written to the card\n",
+              per_record(bytes), per_record(written * beehive::host::SECTOR_SIZE));
+  std::printf("    %10.2f FAT, %.2f directory and %.2f other sector writes per record\n",
+              per_record(disk.fat_sectors_written), per_record(disk.directory_sectors_written),
+              per_record(disk.sectors_written - disk.fat_sectors_written - disk.directory_sectors_written));
+  std::printf("    %10.2f sector reads and %.2f write commands per record, %.0f us in sector writes\n",
+              per_record(image.sectors_read - image_before.sectors_read),
+              per_record(image.write_commands - image_before.write_commands),
+              per_record(disk.write_time));
+  return true;
+}
+
+struct wake_ups_t
+{
+  uint64_t count = 0;
+  uint64_t write_path_time = 0;
+  uint64_t preallocation_time = 0;
+  uint64_t sectors_written = 0;
+  uint32_t max_write_path = 0;
+
+  void add(const beehive::sdcard::writer_stats_t& stats, const disk_counters_t& disk)
+  {
+    ++count;
+    write_path_time += stats.write_path_time;
+    preallocation_time += stats.preallocation_time;
+    sectors_written += disk.sectors_written;
+    max_write_path = std::max(max_write_path, stats.write_path_time);
+  }
+
+  void print(const char* what) const
+  {
+    const auto per_wake_up = [this](double value) { return count ? value / count : 0; };
+    std::printf("    %8llu %-16s %6.0f us write path, %u us max, %.0f us preallocating, %.1f sectors written\n",
+                (unsigned long long)count, what, per_wake_up(write_path_time), unsigned(max_write_path),
+                per_wake_up(preallocation_time), per_wake_up(sectors_written));
+  }
+};
+
+bool rotations(const options_t& options)
+{
+  std::printf("%zu files, one record per wake up, %u KB clusters\n", options.rotation_files, unsigned(options.cluster_kb));
+  beehive::host::clear_rtc_memory();
+  if(!beehive::host::format_image(options.cluster_kb * 1024))
+  {
+    return false;
+  }
+  beehive::host::set_latency(options.read_latency, options.write_latency);
+  Device device(options.sensors);
+  wake_ups_t rotating, appending;
+  for(size_t files = 0; files < options.rotation_files;)
+  {
+    const auto before = beehive::sdcard::diskstats::counters();
+    if(!device.wake() || !device.record(1))
+    {
+      std::fprintf(stderr, "Writing failed\n");
+      return false;
+    }
+    const auto stats = device.writer().stats();
+    const auto disk = beehive::sdcard::diskstats::counters() - before;
+    const auto rotated = device.writer().file_count() != files;
+    files = device.writer().file_count();
+    device.sleep();
+    (rotated ? rotating : appending).add(stats, disk);
+  }
+  rotating.print("new files");
+  appending.print("appends");
+
+  if(!device.wake())
+  {
+    return false;
+  }
+  const auto data_files = device.writer().list_files();
+  device.sleep();
+  size_t fragments = 0, max_fragments = 0;
+  for(const auto& file : data_files)
+  {
+    const auto count = beehive::host::file_fragments(file.name);
+    if(!count)
+    {
+      std::fprintf(stderr, "No link map for %s\n", file.name.c_str());
+      return false;
+    }
+    fragments += *count;
+    max_fragments = std::max(max_fragments, *count);
+  }
+  const auto index_fragments = beehive::host::file_fragments("INDEX.BIN");
+  std::printf("    %8.2f fragments per data file, %zu max, %zu in INDEX.BIN\n",
+              data_files.empty() ? 0.0 : double(fragments) / data_files.size(), max_fragments,
+              index_fragments ? *index_fragments : 0);
+  return true;
+}
+
+bool run(const options_t& options, size_t files)
+{
+  std::printf("%zu files\n", files);
+  beehive::host::clear_rtc_memory();
+  if(!beehive::host::format_image(options.cluster_kb * 1024))
+  {
+    return false;
+  }
+  Device device(options.sensors);
+  // Filling is not what we measure
+  beehive::host::set_latency(0, 0);
+  if(!fill(device, files))
+  {
+    return false;
+  }
+  beehive::host::set_latency(options.read_latency, options.write_latency);
+  if(!recovery(device, "rtc cursor"))
+  {
+    return false;
+  }
+  beehive::host::clear_rtc_memory();
+  recovery(device, "cursor file");
+  beehive::host::clear_rtc_memory();
+  beehive::host::remove_file("CURSOR.BIN");
+  recovery(device, "scan");
+  return write_cycles(device, options.cycles, options.cluster_kb * 1024);
+}
+
+std::vector<size_t> parse_list(const char* list)
+{
+  std::vector<size_t> result;
+  std::stringstream ss(list);
+  std::string item;
+  while(std::getline(ss, item, ','))
+  {
+    result.push_back(std::stoul(item));
+  }
+  return result;
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+  options_t options;
+  for(int i = 1; i < argc; ++i)
+  {
+    const std::string arg = argv[i];
+    const auto value = [&]() {
+      if(i + 1 == argc)
+      {
+        std::fprintf(stderr, "%s needs a value\n", arg.c_str());
+        std::exit(2);
+      }
+      return argv[++i];
+    };
+    if(arg == "--image") options.image = value();
+    else if(arg == "--size-mb") options.size_mb = std::stoull(value());
+    else if(arg == "--cluster-kb") options.cluster_kb = uint32_t(std::stoul(value()));
+    else if(arg == "--read-latency-us") options.read_latency = uint32_t(std::stoul(value()));
+    else if(arg == "--write-latency-us") options.write_latency = uint32_t(std::stoul(value()));
+    else if(arg == "--sensors") options.sensors = std::stoul(value());
+    else if(arg == "--cycles") options.cycles = std::stoul(value());
+    else if(arg == "--files") options.files = parse_list(value());
+    else if(arg == "--rotation-files") options.rotation_files = std::stoul(value());
+    else if(arg == "--verbose") g_esp_log_level = ESP_LOG_INFO;
+    else
+    {
+      std::fprintf(stderr, "Unknown option %s\n", arg.c_str());
+      return 2;
+    }
+  }
+  if(options.sensors > beehive::records::MAX_SENSORS)
+  {
+    std::fprintf(stderr, "At most %zu sensors\n", beehive::records::MAX_SENSORS);
+    return 2;
+  }
+  if(!beehive::host::open_image(options.image, options.size_mb << 20))
+  {
+    return 1;
+  }
+  std::printf("%llu MB %s image, %u/%u us per sector read/written, %zu sensors\n",
+              (unsigned long long)options.size_mb, options.image.empty() ? "RAM" : options.image.c_str(),
+              unsigned(options.read_latency), unsigned(options.write_latency), options.sensors);
+  for(const auto files : options.files)
+  {
+    if(!run(options, files))
+    {
+      return 1;
+    }
+  }
+  if(options.rotation_files && !rotations(options))
+  {
+    return 1;
+  }
+  beehive::host::close_image();
+  return 0;
+}
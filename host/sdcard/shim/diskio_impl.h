@@ -0,0 +1,19 @@
+// Copyright: 2022, Diez B. Roggisch, Berlin, all rights reserved
+#pragma once
+
+// The disk IO dispatch ESP-IDF puts between FatFs and
+// the drivers.
+#include "ff.h"
+#include "diskio.h"
+
+#include <cstdint>
+
+typedef struct {
+  DSTATUS (*init)(unsigned char pdrv);
+  DSTATUS (*status)(unsigned char pdrv);
+  DRESULT (*read)(unsigned char pdrv, unsigned char* buff, uint32_t sector, unsigned count);
+  DRESULT (*write)(unsigned char pdrv, const unsigned char* buff, uint32_t sector, unsigned count);
+  DRESULT (*ioctl)(unsigned char pdrv, unsigned char cmd, void* buff);
+} ff_diskio_impl_t;
+
+void ff_diskio_register(BYTE pdrv, const ff_diskio_impl_t* discio_impl);
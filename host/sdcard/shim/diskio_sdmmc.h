@@ -0,0 +1,8 @@
+// Copyright: 2022, Diez B. Roggisch, Berlin, all rights reserved
+#pragma once
+
+#include "diskio_impl.h"
+#include "sdmmc_cmd.h"
+
+void ff_diskio_register_sdmmc(BYTE pdrv, sdmmc_card_t* card);
+BYTE ff_diskio_get_pdrv_card(const sdmmc_card_t* card);
@@ -0,0 +1,14 @@
+// Copyright: 2022, Diez B. Roggisch, Berlin, all rights reserved
+#pragma once
+
+#include "driver/spi_common.h"
+#include "hal/gpio_types.h"
+#include "sdmmc_cmd.h"
+
+typedef struct {
+  spi_host_device_t host_id;
+  gpio_num_t gpio_cs;
+} sdspi_device_config_t;
+
+#define SDSPI_HOST_DEFAULT() { SPI2_HOST }
+#define SDSPI_DEVICE_CONFIG_DEFAULT() { SPI2_HOST, GPIO_NUM_NC }
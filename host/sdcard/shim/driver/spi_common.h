@@ -0,0 +1,25 @@
+// Copyright: 2022, Diez B. Roggisch, Berlin, all rights reserved
+#pragma once
+
+#include "esp_err.h"
+#include "hal/spi_types.h"
+
+#include <cstdint>
+
+typedef struct {
+  int mosi_io_num;
+  int miso_io_num;
+  int sclk_io_num;
+  int quadwp_io_num;
+  int quadhd_io_num;
+  int data4_io_num;
+  int data5_io_num;
+  int data6_io_num;
+  int data7_io_num;
+  int max_transfer_sz;
+  uint32_t flags;
+  int intr_flags;
+} spi_bus_config_t;
+
+esp_err_t spi_bus_initialize(spi_host_device_t host, const spi_bus_config_t* bus_config, int dma_chan);
+esp_err_t spi_bus_free(spi_host_device_t host);
@@ -0,0 +1,7 @@
+// Copyright: 2022, Diez B. Roggisch, Berlin, all rights reserved
+#pragma once
+
+// RTC memory survives deep sleep but not a power cycle.
+// The harness clears this section to simulate the latter.
+#define RTC_DATA_ATTR __attribute__((section("beehive_rtc")))
+#define IRAM_ATTR
@@ -0,0 +1,28 @@
+// Copyright: 2022, Diez B. Roggisch, Berlin, all rights reserved
+//
+// The parts of ESP-IDF the SD card writer uses, on the
+// host. Just enough to compile sdcard.cpp and diskstats.cpp
+// unchanged, see host.cpp for the implementations.
+#pragma once
+
+#include <cstdio>
+#include <cstdlib>
+
+typedef int esp_err_t;
+
+#define ESP_OK 0
+#define ESP_FAIL -1
+#define ESP_ERR_NO_MEM 0x101
+#define ESP_ERR_INVALID_STATE 0x103
+
+const char* esp_err_to_name(esp_err_t);
+
+#define ESP_ERROR_CHECK(x) \
+  do { \
+    const esp_err_t err_rc_ = (x); \
+    if(err_rc_ != ESP_OK) \
+    { \
+      std::fprintf(stderr, "%s:%d: %s failed: %s\n", __FILE__, __LINE__, #x, esp_err_to_name(err_rc_)); \
+      std::abort(); \
+    } \
+  } while(false)
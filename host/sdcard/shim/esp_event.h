@@ -0,0 +1,13 @@
+// Copyright: 2022, Diez B. Roggisch, Berlin, all rights reserved
+#pragma once
+
+#include "esp_err.h"
+#include "esp_event_base.h"
+
+#include <cstddef>
+#include <cstdint>
+
+// Unlike on the device, the handlers run right away in
+// the posting task, with the posted data instead of a copy.
+esp_err_t esp_event_post(esp_event_base_t event_base, int32_t event_id, const void* event_data, size_t event_data_size, uint32_t ticks_to_wait);
+esp_err_t esp_event_handler_instance_register(esp_event_base_t event_base, int32_t event_id, esp_event_handler_t event_handler, void* event_handler_arg, esp_event_handler_instance_t* instance);
@@ -0,0 +1,8 @@
+// Copyright: 2022, Diez B. Roggisch, Berlin, all rights reserved
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// The CRC-32 of zlib, as the ROM function computes it
+uint32_t esp_rom_crc32_le(uint32_t crc, const uint8_t* buf, uint32_t len);
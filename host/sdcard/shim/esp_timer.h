@@ -0,0 +1,7 @@
+// Copyright: 2022, Diez B. Roggisch, Berlin, all rights reserved
+#pragma once
+
+#include <cstdint>
+
+// Microseconds of the host's monotonic clock
+int64_t esp_timer_get_time();
@@ -0,0 +1,6 @@
+// Copyright: 2022, Diez B. Roggisch, Berlin, all rights reserved
+#pragma once
+
+typedef enum {
+  GPIO_NUM_NC = -1,
+} gpio_num_t;
@@ -0,0 +1,8 @@
+// Copyright: 2022, Diez B. Roggisch, Berlin, all rights reserved
+#pragma once
+
+typedef enum {
+  SPI1_HOST,
+  SPI2_HOST,
+  SPI3_HOST,
+} spi_host_device_t;
@@ -0,0 +1,4 @@
+// Copyright: 2022, Diez B. Roggisch, Berlin, all rights reserved
+#pragma once
+
+// beehive_events.hpp includes it, the writer needs none of it.
@@ -0,0 +1,2 @@
+// Copyright: 2022, Diez B. Roggisch, Berlin, all rights reserved
+#pragma once
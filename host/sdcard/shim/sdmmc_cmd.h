@@ -0,0 +1,27 @@
+// Copyright: 2022, Diez B. Roggisch, Berlin, all rights reserved
+#pragma once
+
+#include "esp_err.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+
+typedef struct {
+  int slot;
+} sdmmc_host_t;
+
+typedef struct {
+  // in sectors
+  int capacity;
+  int sector_size;
+} sdmmc_csd_t;
+
+// The disk image stands in for the card
+typedef struct {
+  sdmmc_csd_t csd;
+} sdmmc_card_t;
+
+void sdmmc_card_print_info(FILE* stream, const sdmmc_card_t* card);
+esp_err_t sdmmc_read_sectors(sdmmc_card_t* card, void* dst, size_t start_sector, size_t sector_count);
+esp_err_t sdmmc_write_sectors(sdmmc_card_t* card, const void* src, size_t start_sector, size_t sector_count);
@@ -0,0 +1,70 @@
+// Copyright: 2022, Diez B. Roggisch, Berlin, all rights reserved
+//
+// Force included into sdcard.cpp: sends the stdio, dirent
+// and stat calls under the mount point to FatFs on the disk
+// image, as the ESP-IDF VFS does on the device. Newlib's
+// stdio buffer isn't modelled, every fwrite becomes one
+// f_write. The system headers come first, so the macros
+// below only apply to sdcard.cpp itself.
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <dirent.h>
+#include <fcntl.h>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <vector>
+
+struct beehive_vfs_stat
+{
+  off_t st_size;
+  mode_t st_mode;
+};
+
+FILE* beehive_vfs_fopen(const char* path, const char* mode);
+int beehive_vfs_fclose(FILE* f);
+size_t beehive_vfs_fread(void* buffer, size_t size, size_t count, FILE* f);
+size_t beehive_vfs_fwrite(const void* buffer, size_t size, size_t count, FILE* f);
+int beehive_vfs_fseek(FILE* f, long offset, int whence);
+long beehive_vfs_ftell(FILE* f);
+int beehive_vfs_fflush(FILE* f);
+int beehive_vfs_truncate(const char* path, off_t length);
+int beehive_vfs_stat(const char* path, struct beehive_vfs_stat* st);
+int beehive_vfs_unlink(const char* path);
+DIR* beehive_vfs_opendir(const char* path);
+struct dirent* beehive_vfs_readdir(DIR* dir);
+int beehive_vfs_closedir(DIR* dir);
+
+#define fopen beehive_vfs_fopen
+#define fclose beehive_vfs_fclose
+#define fread beehive_vfs_fread
+#define fwrite beehive_vfs_fwrite
+#define fseek beehive_vfs_fseek
+#define ftell beehive_vfs_ftell
+#define fflush beehive_vfs_fflush
+#define truncate beehive_vfs_truncate
+#define stat beehive_vfs_stat
+#define unlink beehive_vfs_unlink
+#define opendir beehive_vfs_opendir
+#define readdir beehive_vfs_readdir
+#define closedir beehive_vfs_closedir
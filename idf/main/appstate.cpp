@@ -2,6 +2,7 @@
 
 #include "appstate.hpp"
 #include "beehive_events.hpp"
+#include "batch.hpp"
 #include "esp_err.h"
 #include <esp_ota_ops.h>
 
@@ -9,6 +10,7 @@
 #define LOG_LOCAL_LEVEL ESP_LOG_DEBUG
 #include "esp_log.h"
 
+#include <mutex>
 #include <sstream>
 
 namespace beehive::appstate {
@@ -32,8 +34,28 @@ std::string s_system_name;
 #define SLEEPTIME_DEFAULT 300
 uint32_t s_sleeptime;
 
+#define BATCH_SIZE_DEFAULT 1
+uint32_t s_batch_size;
+
+#define DEADBAND_DEFAULT 0
+uint32_t s_deadband;
+
+#define HEARTBEAT_DEFAULT 3600
+uint32_t s_heartbeat;
+
+#define MQTT_QOS_DEFAULT 1
+uint32_t s_mqtt_qos;
+
 nvs_handle s_nvs_handle;
 
+// Nesting depth of open Updates, and the
+// settings changed within them. Updates come from
+// the MQTT and the HTTP task, an Update holds the
+// mutex for its whole scope.
+std::recursive_mutex s_update_mutex;
+int s_update_depth = 0;
+uint32_t s_updated = 0;
+
 std::string hash(const char* arg)
 {
   const auto h = std::hash<std::string>{}(arg);
@@ -92,8 +114,46 @@ struct NVSLoadStore<uint32_t>
 
 };
 
+// Commits a single change right away. Within an Update
+// it gets recorded instead, returns true if so.
+bool deferred(beehive::events::config::config_events_t setting)
+{
+  std::lock_guard<std::recursive_mutex> lock(s_update_mutex);
+  if(s_update_depth)
+  {
+    s_updated |= 1u << setting;
+    return true;
+  }
+  nvs_commit(s_nvs_handle);
+  return false;
+}
+
 } // namespace
 
+Update::Update()
+{
+  s_update_mutex.lock();
+  ++s_update_depth;
+}
+
+Update::~Update()
+{
+  // Releases the lock taken by the constructor
+  std::lock_guard<std::recursive_mutex> lock(s_update_mutex, std::adopt_lock);
+  if(--s_update_depth || !s_updated)
+  {
+    return;
+  }
+  const auto err = nvs_commit(s_nvs_handle);
+  if(err != ESP_OK)
+  {
+    ESP_LOGE(TAG, "Committing the configuration failed: %s", esp_err_to_name(err));
+  }
+  ESP_LOGD(TAG, "updated: 0x%x", s_updated);
+  beehive::events::config::updated(s_updated);
+  s_updated = 0;
+}
+
 void init()
 {
   //Initialize NVS
@@ -124,6 +184,22 @@ void init()
     {
       s_sleeptime = SLEEPTIME_DEFAULT;
     }
+    if(sr.restore(s_nvs_handle, hash("batch_size").c_str(), &s_batch_size) != ESP_OK)
+    {
+      s_batch_size = BATCH_SIZE_DEFAULT;
+    }
+    if(sr.restore(s_nvs_handle, hash("deadband").c_str(), &s_deadband) != ESP_OK)
+    {
+      s_deadband = DEADBAND_DEFAULT;
+    }
+    if(sr.restore(s_nvs_handle, hash("heartbeat").c_str(), &s_heartbeat) != ESP_OK)
+    {
+      s_heartbeat = HEARTBEAT_DEFAULT;
+    }
+    if(sr.restore(s_nvs_handle, hash("mqtt_qos").c_str(), &s_mqtt_qos) != ESP_OK)
+    {
+      s_mqtt_qos = MQTT_QOS_DEFAULT;
+    }
   }
   #ifdef USE_LORA
   {
@@ -141,6 +217,10 @@ void promote_configuration()
   beehive::events::config::mqtt::hostname(s_mqtt_host.c_str());
   beehive::events::config::system_name(s_system_name.c_str());
   beehive::events::config::sleeptime(s_sleeptime);
+  beehive::events::config::batch_size(s_batch_size);
+  beehive::events::config::deadband(s_deadband);
+  beehive::events::config::heartbeat(s_heartbeat);
+  beehive::events::config::mqtt_qos(s_mqtt_qos);
   #ifdef USE_LORA
   beehive::events::config::lora_dbm(s_lora_dbm);
   #endif
@@ -151,7 +231,10 @@ void set_mqtt_host(const std::string& host)
   s_mqtt_host = host;
   auto sr = NVSLoadStore<std::string>{};
   sr.store(s_nvs_handle, hash("mqtt_hostname").c_str(), s_mqtt_host);
-  beehive::events::config::mqtt::hostname(s_mqtt_host.c_str());
+  if(!deferred(beehive::events::config::MQTT_HOST))
+  {
+    beehive::events::config::mqtt::hostname(s_mqtt_host.c_str());
+  }
 }
 
 const std::string& mqtt_host() { return s_mqtt_host; }
@@ -160,7 +243,10 @@ void set_system_name(const std::string& system_name) {
   s_system_name = system_name;
   auto sr = NVSLoadStore<std::string>{};
   sr.store(s_nvs_handle, hash("system_name").c_str(), s_system_name);
-  beehive::events::config::system_name(s_system_name.c_str());
+  if(!deferred(beehive::events::config::SYSTEM_NAME))
+  {
+    beehive::events::config::system_name(s_system_name.c_str());
+  }
 }
 
 const std::string& system_name() { return s_system_name; }
@@ -170,11 +256,102 @@ void set_sleeptime(uint32_t sleeptime) {
   auto sr = NVSLoadStore<decltype(sleeptime)>{};
   sr.store(s_nvs_handle, hash("sleeptime").c_str(), s_sleeptime);
   ESP_LOGD(TAG, "sleeptime: %i", s_sleeptime);
-  beehive::events::config::sleeptime(s_sleeptime);
+  if(!deferred(beehive::events::config::SLEEPTIME))
+  {
+    beehive::events::config::sleeptime(s_sleeptime);
+  }
 }
 
 uint32_t sleeptime() { return s_sleeptime; }
 
+void set_batch_size(uint32_t batch_size) {
+  // One slot is kept free, see batch::flush_due
+  s_batch_size = std::min<uint32_t>(beehive::batch::CAPACITY - 1, std::max(batch_size, 1u));
+  auto sr = NVSLoadStore<decltype(batch_size)>{};
+  sr.store(s_nvs_handle, hash("batch_size").c_str(), s_batch_size);
+  ESP_LOGD(TAG, "batch_size: %i", s_batch_size);
+  if(!deferred(beehive::events::config::BATCH_SIZE))
+  {
+    beehive::events::config::batch_size(s_batch_size);
+  }
+}
+
+uint32_t batch_size() { return s_batch_size; }
+
+void set_deadband(uint32_t deadband) {
+  s_deadband = deadband;
+  auto sr = NVSLoadStore<decltype(deadband)>{};
+  sr.store(s_nvs_handle, hash("deadband").c_str(), s_deadband);
+  ESP_LOGD(TAG, "deadband: %i", s_deadband);
+  if(!deferred(beehive::events::config::DEADBAND))
+  {
+    beehive::events::config::deadband(s_deadband);
+  }
+}
+
+uint32_t deadband() { return s_deadband; }
+
+void set_heartbeat(uint32_t heartbeat) {
+  s_heartbeat = heartbeat;
+  auto sr = NVSLoadStore<decltype(heartbeat)>{};
+  sr.store(s_nvs_handle, hash("heartbeat").c_str(), s_heartbeat);
+  ESP_LOGD(TAG, "heartbeat: %i", s_heartbeat);
+  if(!deferred(beehive::events::config::HEARTBEAT))
+  {
+    beehive::events::config::heartbeat(s_heartbeat);
+  }
+}
+
+uint32_t heartbeat() { return s_heartbeat; }
+
+void set_mqtt_qos(uint32_t mqtt_qos) {
+  // We don't do QoS 2
+  s_mqtt_qos = std::min(mqtt_qos, 1u);
+  auto sr = NVSLoadStore<decltype(mqtt_qos)>{};
+  sr.store(s_nvs_handle, hash("mqtt_qos").c_str(), s_mqtt_qos);
+  ESP_LOGD(TAG, "mqtt_qos: %i", s_mqtt_qos);
+  if(!deferred(beehive::events::config::MQTT_QOS))
+  {
+    beehive::events::config::mqtt_qos(s_mqtt_qos);
+  }
+}
+
+uint32_t mqtt_qos() { return s_mqtt_qos; }
+
+void set_mqtt_acked_sequence(uint32_t sequence)
+{
+  auto sr = NVSLoadStore<decltype(sequence)>{};
+  sr.store(s_nvs_handle, hash("mqtt_acked").c_str(), sequence);
+}
+
+void set_config_version(uint32_t version)
+{
+  auto sr = NVSLoadStore<decltype(version)>{};
+  sr.store(s_nvs_handle, hash("config_version").c_str(), version);
+}
+
+std::optional<uint32_t> config_version()
+{
+  uint32_t version;
+  auto sr = NVSLoadStore<decltype(version)>{};
+  if(sr.restore(s_nvs_handle, hash("config_version").c_str(), &version) != ESP_OK)
+  {
+    return std::nullopt;
+  }
+  return version;
+}
+
+std::optional<uint32_t> mqtt_acked_sequence()
+{
+  uint32_t sequence;
+  auto sr = NVSLoadStore<decltype(sequence)>{};
+  if(sr.restore(s_nvs_handle, hash("mqtt_acked").c_str(), &sequence) != ESP_OK)
+  {
+    return std::nullopt;
+  }
+  return sequence;
+}
+
 const char *ntp_server() { return "pool.ntp.org"; }
 
 std::string version()
@@ -198,7 +375,10 @@ void set_lora_dbm(uint32_t lora_dbm)
   auto lora_dbm_store = NVSLoadStore<decltype(lora_dbm)>{};
   lora_dbm_store.store(s_nvs_handle, hash("lora_dbm").c_str(), s_lora_dbm);
   ESP_LOGD(TAG, "LoRa DBM: %i", s_lora_dbm);
-  beehive::events::config::lora_dbm(s_lora_dbm);
+  if(!deferred(beehive::events::config::LORA_DBM))
+  {
+    beehive::events::config::lora_dbm(s_lora_dbm);
+  }
 }
 #endif // USE_LORA
 
@@ -2,12 +2,27 @@
 
 #pragma once
 
+#include <optional>
 #include <string>
 
 namespace beehive::appstate {
 
 void init();
 void promote_configuration();
+
+// Batches the setters called during its lifetime: NVS
+// gets committed once at the end, and instead of one
+// CONFIG_EVENTS event per setting a single UPDATED event
+// carries the mask of what changed. Updates nest.
+class Update
+{
+public:
+  Update();
+  ~Update();
+  Update(const Update&) = delete;
+  Update& operator=(const Update&) = delete;
+};
+
 void set_mqtt_host(const std::string &);
 const std::string& mqtt_host();
 
@@ -17,6 +32,35 @@ const std::string& system_name();
 void set_sleeptime(uint32_t);
 uint32_t sleeptime();
 
+void set_batch_size(uint32_t);
+uint32_t batch_size();
+
+// Raw counts a reading has to move before it gets
+// reported again, 0 reports every reading.
+void set_deadband(uint32_t);
+uint32_t deadband();
+
+// Seconds after which a sensor is reported even
+// if it stayed within the deadband.
+void set_heartbeat(uint32_t);
+uint32_t heartbeat();
+
+// 1 waits for the broker to acknowledge every reading,
+// 0 goes to sleep as soon as they are sent.
+void set_mqtt_qos(uint32_t);
+uint32_t mqtt_qos();
+
+// The highest MQTT sequence number up to which the
+// broker acknowledged everything. Not configuration,
+// so it doesn't get promoted.
+void set_mqtt_acked_sequence(uint32_t);
+std::optional<uint32_t> mqtt_acked_sequence();
+
+// The version of the last configuration received over
+// MQTT, so a retained one is only applied once.
+void set_config_version(uint32_t);
+std::optional<uint32_t> config_version();
+
 const char* ntp_server();
 
 std::string version();
@@ -0,0 +1,153 @@
+// Copyright: 2022, Diez B. Roggisch, Berlin, all rights reserved
+
+#include "batch.hpp"
+#include "appstate.hpp"
+#include "records.hpp"
+
+#include <esp_attr.h>
+#include <esp_log.h>
+
+#include <algorithm>
+#include <mutex>
+
+#define TAG "batch"
+
+namespace beehive::batch {
+
+namespace {
+
+using namespace beehive::events::sensors;
+
+struct rtc_ring_t
+{
+  size_t head;
+  size_t count;
+  beehive::records::compact_record_t records[CAPACITY];
+};
+
+RTC_DATA_ATTR rtc_ring_t s_ring;
+
+// The records from head on that went out during this wake.
+// Posted by submit, and in flight once the event loop has
+// handed them to the SD card and MQTT. A wake that ends
+// before they are delivered sends them again.
+std::mutex s_mutex;
+size_t s_posted = 0;
+size_t s_in_flight = 0;
+
+void drop_oldest(size_t count)
+{
+  s_ring.head = (s_ring.head + count) % CAPACITY;
+  s_ring.count -= count;
+  s_posted -= std::min(s_posted, count);
+  s_in_flight -= std::min(s_in_flight, count);
+}
+
+void batch_event_handler(void*, esp_event_base_t, int32_t id, void* event_data)
+{
+  const auto records = receive_records(sensor_events_t(id), event_data);
+  if(records)
+  {
+    std::lock_guard<std::mutex> lock(s_mutex);
+    s_in_flight = std::min(s_posted, s_in_flight + records->size());
+  }
+}
+
+// The events come after the batch in the event loop, so they
+// cover it. On the card MQTT can replay the records from there,
+// without a card they have to be out.
+void delivered()
+{
+  std::lock_guard<std::mutex> lock(s_mutex);
+  if(s_in_flight)
+  {
+    ESP_LOGD(TAG, "%i records delivered", int(s_in_flight));
+    drop_oldest(s_in_flight);
+  }
+}
+
+void sdcard_event_handler(void*, esp_event_base_t, int32_t, void*)
+{
+  delivered();
+}
+
+void mqtt_event_handler(void*, esp_event_base_t, int32_t, void* event_data)
+{
+  if(*static_cast<size_t*>(event_data) == 0)
+  {
+    delivered();
+  }
+}
+
+void watch_delivery()
+{
+  static bool watching = false;
+  if(watching)
+  {
+    return;
+  }
+  watching = true;
+  ESP_ERROR_CHECK(esp_event_handler_instance_register(SENSOR_EVENTS, SHT3XDIS_BATCH, batch_event_handler, nullptr, nullptr));
+  ESP_ERROR_CHECK(esp_event_handler_instance_register(SDCARD_EVENTS, beehive::events::sdcard::DATASET_WRITTEN, sdcard_event_handler, nullptr, nullptr));
+  ESP_ERROR_CHECK(esp_event_handler_instance_register(BEEHIVE_MQTT_EVENTS, beehive::events::mqtt::PUBLISHED, mqtt_event_handler, nullptr, nullptr));
+}
+
+} // namespace
+
+bool enabled()
+{
+  return beehive::appstate::batch_size() > 1;
+}
+
+size_t size()
+{
+  return s_ring.count;
+}
+
+bool flush_due()
+{
+  // The reading of this wake makes count + 1. The batch size
+  // is capped at CAPACITY - 1, so after a failed flush the
+  // next one still fits before push overwrites the oldest.
+  return s_ring.count + 1 >= std::min<size_t>(beehive::appstate::batch_size(), CAPACITY - 1);
+}
+
+void push(std::time_t timestamp, const std::vector<sht3xdis_value_t>& readings)
+{
+  std::lock_guard<std::mutex> lock(s_mutex);
+  if(s_ring.count == CAPACITY)
+  {
+    // overwrite the oldest record
+    drop_oldest(1);
+  }
+  s_ring.records[(s_ring.head + s_ring.count) % CAPACITY] = compact(timestamp, readings);
+  ++s_ring.count;
+  ESP_LOGD(TAG, "Buffered record, %i in RTC memory", int(s_ring.count));
+}
+
+void submit(const std::vector<sht3xdis_value_t>& readings)
+{
+  if(!enabled() && s_ring.count == 0)
+  {
+    send_readings(readings);
+    return;
+  }
+  watch_delivery();
+  push(std::time(nullptr), readings);
+  std::vector<beehive::records::compact_record_t> records;
+  {
+    // Only what isn't out yet, the ring is cleared
+    // once the records are delivered.
+    std::lock_guard<std::mutex> lock(s_mutex);
+    records.reserve(s_ring.count - s_posted);
+    for(size_t i=s_posted; i < s_ring.count; ++i)
+    {
+      records.push_back(s_ring.records[(s_ring.head + i) % CAPACITY]);
+    }
+    s_posted = s_ring.count;
+  }
+  ESP_LOGI(TAG, "Submitting batch of %i records", int(records.size()));
+  send_batch(records);
+}
+
+} // namespace beehive::batch
@@ -0,0 +1,29 @@
+// Copyright: 2022, Diez B. Roggisch, Berlin, all rights reserved
+
+#pragma once
+
+#include "beehive_events.hpp"
+
+#include <ctime>
+#include <vector>
+
+// Readings buffered in RTC slow memory across deep sleep, so
+// we only need to bring up the radio every N wakes.
+namespace beehive::batch {
+
+// How many records fit into RTC memory
+const size_t CAPACITY = 24;
+
+bool enabled();
+size_t size();
+// True if the next reading should trigger the
+// transmission of the whole batch.
+bool flush_due();
+
+void push(std::time_t timestamp, const std::vector<events::sensors::sht3xdis_value_t>&);
+// Posts the readings, either directly or together with
+// the buffered records as one batch. Those stay in RTC
+// memory until the SD card or MQTT report them delivered.
+void submit(const std::vector<events::sensors::sht3xdis_value_t>&);
+
+} // namespace beehive::batch
@@ -2,7 +2,9 @@
 
 #include "beehive_events.hpp"
 #include <buttons.hpp>
+#include "deets/i2c/sht3xdis.hpp"
 
+#include <cstddef>
 #include <cstring>
 #include <optional>
 
@@ -30,6 +32,21 @@ struct sht3xdis_event_t
   beehive::events::sensors::sht3xdis_value_t values[1];
 };
 
+struct batch_event_t
+{
+  size_t count;
+  beehive::records::compact_record_t records[1];
+};
+
+// Starts with the count, like the batch
+struct relayed_event_t
+{
+  size_t count;
+  uint32_t device_id;
+  int64_t received_at;
+  beehive::events::lora::relayed_record_t records[1];
+};
+
 struct config_event_name_t
 {
   char name[200];
@@ -47,6 +64,11 @@ void published(size_t message_backlog_count)
     &message_backlog_count, sizeof(message_backlog_count), 0);
 }
 
+void connected()
+{
+  esp_event_post(BEEHIVE_MQTT_EVENTS, CONNECTED, nullptr, 0, 0);
+}
+
 } // namespace mqtt
 
 namespace ota {
@@ -61,6 +83,26 @@ void none() { esp_event_post(OTA_EVENTS, NONE, nullptr, 0, 0); }
 
 
 
+namespace sdcard {
+
+void recovered(const recovery_report_t& report)
+{
+  esp_event_post(SDCARD_EVENTS, RECOVERED, (void*)&report, sizeof(report), 0);
+}
+
+std::optional<recovery_report_t> receive_recovery_report(sdcard_events_t kind, void* event_data)
+{
+  switch(kind)
+  {
+  case RECOVERED:
+    return *static_cast<recovery_report_t*>(event_data);
+  default:
+    return std::nullopt;
+  }
+}
+
+} // namespace sdcard
+
 namespace buttons {
 
 void register_button_callback(button_events_t e,
@@ -115,6 +157,84 @@ std::optional<std::vector<sht3xdis_value_t>> receive_readings(sensor_events_t ki
 }
 
 
+beehive::records::compact_record_t compact(std::time_t timestamp, const std::vector<sht3xdis_value_t>& readings)
+{
+  beehive::records::compact_record_t record;
+  record.timestamp = uint32_t(timestamp);
+  record.count = uint8_t(std::min(readings.size(), beehive::records::MAX_SENSORS));
+  for(size_t i=0; i < record.count; ++i)
+  {
+    record.readings[i] = {
+      readings[i].busno,
+      readings[i].address,
+      readings[i].raw_humidity,
+      readings[i].raw_temperature
+    };
+  }
+  return record;
+}
+
+void send_batch(const std::vector<beehive::records::compact_record_t>& records)
+{
+  const auto payload_size = records.size() * sizeof(beehive::records::compact_record_t);
+  std::vector<uint8_t> block(
+    sizeof(size_t) +
+    payload_size);
+
+  auto p = (batch_event_t*)block.data();
+  p->count = records.size();
+  std::memcpy(&p->records[0], records.data(), payload_size);
+
+  esp_event_post(
+    SENSOR_EVENTS, SHT3XDIS_BATCH,
+    block.data(), block.size(),
+    0);
+}
+
+sht3xdis_record_t expand(const beehive::records::compact_record_t& record)
+{
+  using namespace deets::i2c::sht3xdis;
+
+  sht3xdis_record_t result;
+  result.timestamp = record.timestamp;
+  for(size_t j=0; j < record.count; ++j)
+  {
+    const auto& reading = record.readings[j];
+    result.readings.push_back(
+      {
+	reading.busno, reading.address,
+	SHT3XDIS::raw2humidity(reading.raw_humidity),
+	SHT3XDIS::raw2temperature(reading.raw_temperature),
+	reading.raw_humidity,
+	reading.raw_temperature
+      });
+  }
+  return result;
+}
+
+std::optional<std::vector<sht3xdis_record_t>> receive_records(sensor_events_t kind, void *event_data)
+{
+  switch(kind)
+  {
+  case SHT3XDIS_READINGS:
+    return std::vector<sht3xdis_record_t>{
+      { std::time(nullptr), *receive_readings(kind, event_data) }
+    };
+  case SHT3XDIS_BATCH:
+    {
+      const auto p = (batch_event_t*)event_data;
+      std::vector<sht3xdis_record_t> result(p->count);
+      for(size_t i=0; i < p->count; ++i)
+      {
+	result[i] = expand(p->records[i]);
+      }
+      return result;
+    }
+  default:
+    return std::nullopt;
+  }
+}
+
 } // namespace sensors
 
 namespace config {
@@ -131,11 +251,45 @@ void sleeptime(uint32_t sleeptime)
   esp_event_post(CONFIG_EVENTS, SLEEPTIME, (void*)&sleeptime, sizeof(sleeptime), 0);
 }
 
+void batch_size(uint32_t batch_size)
+{
+  esp_event_post(CONFIG_EVENTS, BATCH_SIZE, (void*)&batch_size, sizeof(batch_size), 0);
+}
+
+void deadband(uint32_t deadband)
+{
+  esp_event_post(CONFIG_EVENTS, DEADBAND, (void*)&deadband, sizeof(deadband), 0);
+}
+
+void heartbeat(uint32_t heartbeat)
+{
+  esp_event_post(CONFIG_EVENTS, HEARTBEAT, (void*)&heartbeat, sizeof(heartbeat), 0);
+}
+
+void mqtt_qos(uint32_t mqtt_qos)
+{
+  esp_event_post(CONFIG_EVENTS, MQTT_QOS, (void*)&mqtt_qos, sizeof(mqtt_qos), 0);
+}
+
 void lora_dbm(uint32_t lora_dbm)
 {
   esp_event_post(CONFIG_EVENTS, LORA_DBM, (void*)&lora_dbm, sizeof(lora_dbm), 0);
 }
 
+void updated(uint32_t settings)
+{
+  esp_event_post(CONFIG_EVENTS, UPDATED, (void*)&settings, sizeof(settings), 0);
+}
+
+uint32_t updated_settings(config_events_t kind, void* event_data)
+{
+  if(kind == UPDATED)
+  {
+    return *(uint32_t*)event_data;
+  }
+  return 1u << kind;
+}
+
 namespace mqtt {
 
 void hostname(const char *hostname)
@@ -181,11 +335,57 @@ std::optional<lora_stats_t> receive_stats(lora_events_t kind, void *event_data)
   }
 }
 
-void send_stats(size_t package_count, size_t malformed_package_count) {
-  lora_stats_t stats = { package_count, malformed_package_count };
+void send_stats(const lora_stats_t& stats) {
   esp_event_post(LORA_EVENTS, STATS, (void*)&stats, sizeof(stats), 0);
 }
 
+void send_relayed(const relayed_t& relayed)
+{
+  const auto payload_size = relayed.records.size() * sizeof(relayed_record_t);
+  std::vector<uint8_t> block(offsetof(relayed_event_t, records) + payload_size);
+
+  auto p = (relayed_event_t*)block.data();
+  p->count = relayed.records.size();
+  p->device_id = relayed.device_id;
+  p->received_at = relayed.received_at;
+  std::memcpy(&p->records[0], relayed.records.data(), payload_size);
+
+  esp_event_post(
+    LORA_EVENTS, RELAYED,
+    block.data(), block.size(),
+    0);
+}
+
+std::optional<relayed_t> receive_relayed(lora_events_t kind, void *event_data)
+{
+  switch(kind)
+  {
+  case RELAYED:
+    {
+      const auto p = (relayed_event_t*)event_data;
+      return relayed_t{ p->device_id, p->received_at, { p->records, p->records + p->count } };
+    }
+  default:
+    return std::nullopt;
+  }
+}
+
+void send_link(const device_link_t& link)
+{
+  esp_event_post(LORA_EVENTS, LINK, (void*)&link, sizeof(link), 0);
+}
+
+std::optional<device_link_t> receive_link(lora_events_t kind, void *event_data)
+{
+  switch(kind)
+  {
+  case LINK:
+    return *(device_link_t*)event_data;
+  default:
+    return std::nullopt;
+  }
+}
+
 } // namespace lora
 
 } // namespace beehive::events
@@ -2,10 +2,12 @@
 #pragma once
 #include "mqtt_client.h"
 #include "pins.hpp"
+#include "records.hpp"
 
 #include "esp_event.h"
 #include "esp_event_base.h"
 
+#include <ctime>
 #include <optional>
 #include <vector>
 #include <functional>
@@ -33,17 +35,87 @@ namespace lora {
 enum lora_events_t
 {
   STATS,
+  RELAYED,
+  LINK,
+};
+
+// A cycle a field device sent, with its sequence number
+struct relayed_record_t
+{
+  uint32_t sequence;
+  beehive::records::compact_record_t record;
+};
+
+struct relayed_t
+{
+  uint32_t device_id;
+  // esp_timer time the first packet of
+  // the records came out of the radio
+  int64_t received_at;
+  std::vector<relayed_record_t> records;
 };
 
 struct lora_stats_t
 {
   size_t package_count;
   size_t malformed_package_count;
+  // Time on air per reading sent or received, in us
+  uint32_t airtime_per_reading;
+  // Field device: cycles sent again, packets the base
+  // station acknowledged, and cycles still waiting
+  uint32_t retries;
+  uint32_t acked_packets;
+  size_t unacked;
+  // From taking the readings to their ack, in ms
+  uint32_t delivery_p50;
+  uint32_t delivery_p90;
+  uint32_t delivery_max;
+  // Base station: packets dropped because forwarding
+  // fell behind, and the time from receiving a packet
+  // to publishing its readings to MQTT, in us
+  uint32_t overruns;
+  uint32_t forward_p50;
+  uint32_t forward_p90;
+  uint32_t forward_max;
+  // Base station: the field devices we heard from, and
+  // the cycles they sent again because an ack got lost
+  size_t devices;
+  uint32_t duplicates;
+  // The transmit power in use, in dBm, and how the last
+  // packet got received: on the field device what the base
+  // station reported for ours, on the base station the last
+  // one from any device. RSSI in dBm, SNR in quarter dB.
+  uint32_t tx_power;
+  int32_t rssi;
+  int32_t snr;
 };
 
-void send_stats(size_t package_count, size_t malformed_package_count);
+void send_stats(const lora_stats_t&);
 std::optional<lora_stats_t> receive_stats(lora_events_t, void *event_data);
 
+// Base station: the new cycles of a field device, to
+// be published under its own topic.
+void send_relayed(const relayed_t&);
+std::optional<relayed_t> receive_relayed(lora_events_t, void *event_data);
+
+// Base station: how a field device reaches us
+struct device_link_t
+{
+  uint32_t device_id;
+  // dBm, as the device sent its last packet
+  uint32_t tx_power;
+  // dBm and quarter dB, as we received it
+  int32_t rssi;
+  int32_t snr;
+  uint32_t packets;
+  uint32_t cycles;
+  uint32_t duplicates;
+  uint32_t late;
+};
+
+void send_link(const device_link_t&);
+std::optional<device_link_t> receive_link(lora_events_t, void *event_data);
+
 } // namespace lora
 
 namespace buttons {
@@ -61,9 +133,10 @@ void register_button_callback(button_events_t,
 
 namespace mqtt {
 
-enum mqtt_events_t { PUBLISHED };
+enum mqtt_events_t { PUBLISHED, CONNECTED };
 
 void published(size_t);
+void connected();
 
 }
 
@@ -72,7 +145,8 @@ namespace sensors {
 enum sensor_events_t
 {
   SHT3XDIS_COUNT,
-  SHT3XDIS_READINGS
+  SHT3XDIS_READINGS,
+  SHT3XDIS_BATCH
 };
 
 struct sht3xdis_value_t
@@ -85,10 +159,25 @@ struct sht3xdis_value_t
   uint16_t raw_temperature;
 };
 
+struct sht3xdis_record_t
+{
+  std::time_t timestamp;
+  std::vector<sht3xdis_value_t> readings;
+};
+
 void send_readings(const std::vector<sht3xdis_value_t> &);
 std::optional<std::vector<sht3xdis_value_t>> receive_readings(sensor_events_t,
                                                               void *event_data);
 
+beehive::records::compact_record_t compact(std::time_t timestamp, const std::vector<sht3xdis_value_t>&);
+
+void send_batch(const std::vector<beehive::records::compact_record_t> &);
+sht3xdis_record_t expand(const beehive::records::compact_record_t&);
+// Works for both SHT3XDIS_READINGS and SHT3XDIS_BATCH, single
+// readings are timestamped on reception.
+std::optional<std::vector<sht3xdis_record_t>> receive_records(sensor_events_t,
+                                                              void *event_data);
+
 } // namespace sensors
 
 namespace ota {
@@ -114,9 +203,23 @@ enum sdcard_events_t
   MOUNTED,
   DATASET_WRITTEN,
   FILE_COUNT,
-  NO_FILE
+  NO_FILE,
+  RECOVERED
 };
 
+struct recovery_report_t
+{
+  size_t filename_index;
+  size_t bytes_discarded;
+  // complete records found behind the cursor
+  size_t records_recovered;
+  // false if we had to fall back to a scan
+  bool used_cursor;
+};
+
+void recovered(const recovery_report_t&);
+std::optional<recovery_report_t> receive_recovery_report(sdcard_events_t, void* event_data);
+
 }
 
 namespace config {
@@ -127,11 +230,27 @@ enum config_events_t
   SYSTEM_NAME,
   SLEEPTIME,
   LORA_DBM,
+  BATCH_SIZE,
+  DEADBAND,
+  HEARTBEAT,
+  MQTT_QOS,
+  // Several of the above at once, the event data is
+  // a mask of (1 << setting). Read the new values
+  // from appstate.
+  UPDATED,
 };
 
 void system_name(const char *system_name);
 void sleeptime(uint32_t sleeptime);
+void batch_size(uint32_t batch_size);
+void deadband(uint32_t deadband);
+void heartbeat(uint32_t heartbeat);
+void mqtt_qos(uint32_t mqtt_qos);
 void lora_dbm(uint32_t lora_dbm);
+void updated(uint32_t settings);
+// The changed settings of an UPDATED event, or
+// just the setting of a single one.
+uint32_t updated_settings(config_events_t, void* event_data);
 
 namespace mqtt {
 
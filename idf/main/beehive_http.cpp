@@ -3,17 +3,88 @@
 #include "beehive_http.hpp"
 #include "appstate.hpp"
 #include "beehive_events.hpp"
+#include "configuration.hpp"
+#include "flashlog.hpp"
+#include "mqtt.hpp"
+#include "sdcard.hpp"
+#include "format.hpp"
 
 #include "http.hpp"
 #include "nlohmann/json.hpp"
 
+#include <esp_log.h>
+
+#include <cstdio>
+#include <sys/stat.h>
+#include <cstdlib>
+#include <optional>
+#include <utility>
+
+#define TAG "http"
+
 namespace beehive::http {
 
 namespace {
 
+// The JSON server occupies the default ports
+const uint16_t DATA_SERVER_PORT = 8080;
+const uint16_t DATA_SERVER_CTRL_PORT = 32769;
+
+// Same layout as the lines in the SD card files
+int format_record(char* buffer, size_t size, uint32_t sequence, const beehive::records::compact_record_t& record)
+{
+  beehive::util::Formatter line(buffer, size);
+  line.append("#V2,").hex(sequence, 8).append(',').isoformat(record.timestamp).append(',');
+  for(size_t i=0; i < record.count; ++i)
+  {
+    const auto& reading = record.readings[i];
+    line.hex(reading.busno, 2).append(',').hex(reading.address, 2).append(',');
+    line.append('H').hex(reading.raw_humidity, 4).append(",T").hex(reading.raw_temperature, 4).append(',');
+  }
+  line.append("\r\n");
+  return int(line.size());
+}
+
 extern const uint8_t index_html_start[] asm("_binary_index_html_start");
 extern const uint8_t index_html_end[] asm("_binary_index_html_end");
 
+// Parses "bytes=<start>-<end>", "bytes=<start>-" and "bytes=-<suffix>"
+// into an inclusive range within size.
+std::optional<std::pair<size_t, size_t>> parse_range(const char* header, size_t size)
+{
+  if(strncmp(header, "bytes=", 6) != 0 || size == 0)
+  {
+    return std::nullopt;
+  }
+  const char* p = header + 6;
+  char* end;
+  if(*p == '-')
+  {
+    const auto suffix = strtoul(p + 1, &end, 10);
+    if(end == p + 1 || suffix == 0)
+    {
+      return std::nullopt;
+    }
+    return std::make_pair(size - std::min<size_t>(suffix, size), size - 1);
+  }
+  const auto start = strtoul(p, &end, 10);
+  if(end == p || *end != '-' || start >= size)
+  {
+    return std::nullopt;
+  }
+  p = end + 1;
+  auto last = size - 1;
+  if(*p)
+  {
+    last = std::min<size_t>(strtoul(p, &end, 10), size - 1);
+    if(end == p || last < start)
+    {
+      return std::nullopt;
+    }
+  }
+  return std::make_pair(size_t(start), last);
+}
+
 } // namespace
 
 
@@ -33,29 +104,7 @@ HTTPServer::HTTPServer(std::function<size_t()> file_count)
   _server.register_handler(
     "/configuration", HTTP_POST,
     [](const json& body) -> json {
-      if(body.contains("mqtt_hostname") && body["mqtt_hostname"].is_string())
-      {
-	const auto hostname = body["mqtt_hostname"].get<std::string>();
-	beehive::appstate::set_mqtt_host(hostname);
-      }
-      if(body.contains("system_name") && body["system_name"].is_string())
-      {
-	const auto system_name = body["system_name"].get<std::string>();
-	beehive::appstate::set_system_name(system_name);
-      }
-      if(body.contains("sleeptime") && body["sleeptime"].is_number())
-      {
-	const auto sleeptime = body["sleeptime"].get<uint32_t>();
-	beehive::appstate::set_sleeptime(sleeptime);
-      }
-#ifdef USE_LORA
-      if(body.contains("lora_dbm") && body["lora_dbm"].is_number())
-      {
-	const auto lora_dbm = body["lora_dbm"].get<uint32_t>();
-	beehive::appstate::set_lora_dbm(lora_dbm);
-      }
-#endif // USE_LORA
-
+      beehive::configuration::apply(body);
       json j2 = {
 	{"status", "ok"}
       };
@@ -65,16 +114,7 @@ HTTPServer::HTTPServer(std::function<size_t()> file_count)
   _server.register_handler(
     "/configuration", HTTP_GET,
     [](const json& body) -> json {
-      json j2 = {
-#ifdef USE_LORA
-	{"lora_dbm", beehive::appstate::lora_dbm()},
-#endif // USE_LORA
-	{"sleeptime", beehive::appstate::sleeptime()},
-	{"system_name", beehive::appstate::system_name()},
-	{"app_version", beehive::appstate::version()},
-	{"mqtt_hostname", beehive::appstate::mqtt_host()}
-      };
-      return j2;
+      return beehive::configuration::to_json();
     });
 
   _server.register_handler(
@@ -83,10 +123,312 @@ HTTPServer::HTTPServer(std::function<size_t()> file_count)
       json j2 = {
 	{"file-count", _file_count() }
       };
+      if(_sdcard)
+      {
+	const auto stats = _sdcard->stats();
+	j2["sdcard"] = {
+	  {"queue-depth", stats.queue_depth},
+	  {"max-queue-depth", stats.max_queue_depth},
+	  {"dropped", stats.dropped},
+	  {"writes", stats.writes},
+	  {"write-latency-us", {
+	      {"p50", stats.p50},
+	      {"p90", stats.p90},
+	      {"p99", stats.p99},
+	      {"max", stats.max}
+	    }},
+	  {"records-written", stats.records_written},
+	  {"bytes-written", stats.bytes_written},
+	  {"write-path-us", stats.write_path_time},
+	  {"preallocation-us", stats.preallocation_time},
+	  {"boot-recovery-us", stats.boot_recovery_time},
+	  {"sectors-read", stats.disk.sectors_read},
+	  {"sectors-written", stats.disk.sectors_written},
+	  {"fat-sectors-written", stats.disk.fat_sectors_written},
+	  {"directory-sectors-written", stats.disk.directory_sectors_written},
+	  {"sector-write-us", stats.disk.write_time}
+	};
+      }
+      if(_mqtt)
+      {
+	const auto stats = _mqtt->stats();
+	j2["mqtt"] = {
+	  {"in-flight", stats.in_flight},
+	  {"oldest-unacked-age-ms", stats.oldest_unacked_age},
+	  {"untracked", stats.untracked},
+	  {"acked", stats.acked},
+	  {"puback-latency-ms", {
+	      {"p50", stats.p50},
+	      {"p90", stats.p90},
+	      {"p99", stats.p99},
+	      {"max", stats.max}
+	    }},
+	  {"outbox-depth", stats.outbox_depth},
+	  {"replayed", stats.replayed},
+	  {"replay-rate", stats.replay_rate},
+	  {"tls", stats.tls},
+	  {"connect-ms", {
+	      {"last", stats.connect_time},
+	      {"count", stats.connects},
+	      {"p50", stats.connect_p50},
+	      {"p90", stats.connect_p90},
+	      {"max", stats.connect_max}
+	    }}
+	};
+      }
       return j2;
     });
 
   _server.start();
+  start_data_server();
+}
+
+HTTPServer::~HTTPServer()
+{
+  if(_data_server)
+  {
+    httpd_stop(_data_server);
+  }
+}
+
+void HTTPServer::start_data_server()
+{
+  httpd_config_t config = HTTPD_DEFAULT_CONFIG();
+  config.server_port = DATA_SERVER_PORT;
+  config.ctrl_port = DATA_SERVER_CTRL_PORT;
+  config.uri_match_fn = httpd_uri_match_wildcard;
+  if(httpd_start(&_data_server, &config) != ESP_OK)
+  {
+    ESP_LOGE(TAG, "Couldn't start data server on port %i", DATA_SERVER_PORT);
+    _data_server = nullptr;
+  }
+}
+
+void HTTPServer::register_data_handler(const char* uri, esp_err_t (*handler)(httpd_req_t*))
+{
+  if(!_data_server)
+  {
+    return;
+  }
+  httpd_uri_t uri_handler = {
+    .uri = uri,
+    .method = HTTP_GET,
+    .handler = handler,
+    .user_ctx = this
+  };
+  httpd_register_uri_handler(_data_server, &uri_handler);
+}
+
+esp_err_t HTTPServer::send_buffered(httpd_req_t* req, const char* data, size_t len)
+{
+  if(_chunk_fill + len > _chunk.size())
+  {
+    const auto res = httpd_resp_send_chunk(req, _chunk.data(), _chunk_fill);
+    _chunk_fill = 0;
+    if(res != ESP_OK)
+    {
+      return res;
+    }
+  }
+  std::copy(data, data + len, _chunk.data() + _chunk_fill);
+  _chunk_fill += len;
+  return ESP_OK;
+}
+
+esp_err_t HTTPServer::finish_chunks(httpd_req_t* req)
+{
+  if(_chunk_fill)
+  {
+    httpd_resp_send_chunk(req, _chunk.data(), _chunk_fill);
+    _chunk_fill = 0;
+  }
+  return httpd_resp_send_chunk(req, nullptr, 0);
+}
+
+void HTTPServer::serve_flashlog(beehive::flashlog::FlashLog& flashlog)
+{
+  _flashlog = &flashlog;
+  register_data_handler("/flashlog", HTTPServer::s_flashlog_handler);
+}
+
+esp_err_t HTTPServer::s_flashlog_handler(httpd_req_t* req)
+{
+  auto self = static_cast<HTTPServer*>(req->user_ctx);
+  httpd_resp_set_type(req, "text/plain");
+  auto res = ESP_OK;
+  self->_flashlog->for_each(
+    [self, req, &res](uint32_t sequence, const beehive::records::compact_record_t& record) {
+      if(res == ESP_OK)
+      {
+        std::array<char, 512> line;
+        const auto len = format_record(line.data(), line.size(), sequence, record);
+        res = self->send_buffered(req, line.data(), len);
+      }
+    });
+  if(res != ESP_OK)
+  {
+    // The client went away, nothing more to send
+    self->_chunk_fill = 0;
+    return res;
+  }
+  return self->finish_chunks(req);
+}
+
+void HTTPServer::report_mqtt(beehive::mqtt::MQTTClient& mqtt)
+{
+  _mqtt = &mqtt;
+}
+
+void HTTPServer::serve_sdcard(beehive::sdcard::SDCardWriter& sdcard)
+{
+  _sdcard = &sdcard;
+  _server.register_handler(
+    "/files", HTTP_GET,
+    [this](const json& body) -> json {
+      auto files = json::array();
+      for(const auto& file : _sdcard->list_files())
+      {
+	files.push_back({{"name", file.name}, {"size", file.size}});
+      }
+      return files;
+    });
+  register_data_handler("/files/*", HTTPServer::s_file_handler);
+  register_data_handler("/since", HTTPServer::s_since_handler);
+  register_data_handler("/range", HTTPServer::s_range_handler);
+}
+
+esp_err_t HTTPServer::s_file_handler(httpd_req_t* req)
+{
+  auto self = static_cast<HTTPServer*>(req->user_ctx);
+  const auto path = self->_sdcard->data_file_path(req->uri + strlen("/files/"));
+  const auto file_size = path ? self->_sdcard->data_file_size(*path) : std::nullopt;
+  if(!file_size)
+  {
+    return httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "No such file");
+  }
+  const auto size = *file_size;
+  size_t start = 0;
+  size_t last = size ? size - 1 : 0;
+
+  // Header values must stay alive until the response is sent
+  std::array<char, 64> range_header;
+  std::array<char, 64> content_range;
+  if(httpd_req_get_hdr_value_str(req, "Range", range_header.data(), range_header.size()) == ESP_OK)
+  {
+    const auto range = parse_range(range_header.data(), size);
+    if(!range)
+    {
+      snprintf(content_range.data(), content_range.size(), "bytes */%u", unsigned(size));
+      httpd_resp_set_status(req, HTTPD_416);
+      httpd_resp_set_hdr(req, "Content-Range", content_range.data());
+      return httpd_resp_send(req, nullptr, 0);
+    }
+    std::tie(start, last) = *range;
+    snprintf(content_range.data(), content_range.size(), "bytes %u-%u/%u", unsigned(start), unsigned(last), unsigned(size));
+    httpd_resp_set_status(req, HTTPD_206);
+    httpd_resp_set_hdr(req, "Content-Range", content_range.data());
+  }
+  httpd_resp_set_type(req, "text/plain");
+  httpd_resp_set_hdr(req, "Accept-Ranges", "bytes");
+
+  auto f = fopen(path->c_str(), "r");
+  if(!f || fseek(f, start, SEEK_SET) != 0)
+  {
+    if(f)
+    {
+      fclose(f);
+    }
+    return httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Can't read file");
+  }
+  auto remaining = size ? last - start + 1 : 0;
+  auto res = ESP_OK;
+  while(remaining && res == ESP_OK)
+  {
+    const auto read_bytes = fread(self->_chunk.data(), 1, std::min(remaining, self->_chunk.size()), f);
+    if(read_bytes == 0)
+    {
+      break;
+    }
+    res = httpd_resp_send_chunk(req, self->_chunk.data(), read_bytes);
+    remaining -= read_bytes;
+  }
+  fclose(f);
+  if(res != ESP_OK)
+  {
+    return res;
+  }
+  return httpd_resp_send_chunk(req, nullptr, 0);
+}
+
+esp_err_t HTTPServer::s_since_handler(httpd_req_t* req)
+{
+  auto self = static_cast<HTTPServer*>(req->user_ctx);
+  std::array<char, 64> query;
+  std::array<char, 16> value;
+  if(httpd_req_get_url_query_str(req, query.data(), query.size()) != ESP_OK
+     || httpd_query_key_value(query.data(), "seq", value.data(), value.size()) != ESP_OK)
+  {
+    return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "seq parameter missing");
+  }
+  const auto sequence = size_t(strtoul(value.data(), nullptr, 0));
+  return self->stream_lines(
+    req,
+    [self, sequence](auto callback) {
+      self->_sdcard->read_since(sequence, callback);
+    });
+}
+
+esp_err_t HTTPServer::s_range_handler(httpd_req_t* req)
+{
+  auto self = static_cast<HTTPServer*>(req->user_ctx);
+  std::array<char, 64> query;
+  std::array<char, 16> value;
+  if(httpd_req_get_url_query_str(req, query.data(), query.size()) != ESP_OK)
+  {
+    return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "from or last parameter missing");
+  }
+  const auto now = std::time(nullptr);
+  std::time_t from;
+  std::time_t to = now;
+  if(httpd_query_key_value(query.data(), "last", value.data(), value.size()) == ESP_OK)
+  {
+    from = now - std::time_t(strtoul(value.data(), nullptr, 0));
+  }
+  else if(httpd_query_key_value(query.data(), "from", value.data(), value.size()) == ESP_OK)
+  {
+    from = std::time_t(strtoul(value.data(), nullptr, 0));
+  }
+  else
+  {
+    return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "from or last parameter missing");
+  }
+  if(httpd_query_key_value(query.data(), "to", value.data(), value.size()) == ESP_OK)
+  {
+    to = std::time_t(strtoul(value.data(), nullptr, 0));
+  }
+  return self->stream_lines(
+    req,
+    [self, from, to](auto callback) {
+      self->_sdcard->read_time_range(from, to, callback);
+    });
+}
+
+esp_err_t HTTPServer::stream_lines(httpd_req_t* req, std::function<void(beehive::sdcard::SDCardWriter::line_callback_t)> reader)
+{
+  httpd_resp_set_type(req, "text/plain");
+  auto res = ESP_OK;
+  reader(
+    [this, req, &res](const char* line, size_t len) {
+      res = send_buffered(req, line, len);
+      return res == ESP_OK;
+    });
+  if(res != ESP_OK)
+  {
+    // The client went away, nothing more to send
+    _chunk_fill = 0;
+    return res;
+  }
+  return finish_chunks(req);
 }
 
 }
@@ -1,13 +1,60 @@
 #include <http.hpp>
+#include <esp_http_server.h>
+
+#include <array>
+
+namespace beehive::flashlog {
+
+class FlashLog;
+
+} // namespace beehive::flashlog
+
+namespace beehive::mqtt {
+
+class MQTTClient;
+
+} // namespace beehive::mqtt
+
+#include "sdcard.hpp"
 
 namespace beehive::http {
 
 class HTTPServer {
 public:
   HTTPServer(std::function<size_t()> file_count);
+  ~HTTPServer();
+
+  void serve_flashlog(beehive::flashlog::FlashLog&);
+  void serve_sdcard(beehive::sdcard::SDCardWriter&);
+  // Adds the publish statistics to /status
+  void report_mqtt(beehive::mqtt::MQTTClient&);
+
 private:
+  void start_data_server();
+  void register_data_handler(const char* uri, esp_err_t (*handler)(httpd_req_t*));
+
+  // Appends to the chunk buffer, sending it when full
+  esp_err_t send_buffered(httpd_req_t*, const char* data, size_t len);
+  esp_err_t finish_chunks(httpd_req_t*);
+
+  static esp_err_t s_flashlog_handler(httpd_req_t*);
+  static esp_err_t s_file_handler(httpd_req_t*);
+  static esp_err_t s_since_handler(httpd_req_t*);
+  static esp_err_t s_range_handler(httpd_req_t*);
+  esp_err_t stream_lines(httpd_req_t*, std::function<void(beehive::sdcard::SDCardWriter::line_callback_t)> reader);
+
   deets::http::HTTPServer _server;
   std::function<size_t()> _file_count;
+
+  // Data that is too big to go through JSON is streamed
+  // from a second server, in chunks from this buffer.
+  httpd_handle_t _data_server = nullptr;
+  std::array<char, 4096> _chunk;
+  size_t _chunk_fill = 0;
+
+  beehive::flashlog::FlashLog* _flashlog = nullptr;
+  beehive::sdcard::SDCardWriter* _sdcard = nullptr;
+  beehive::mqtt::MQTTClient* _mqtt = nullptr;
 };
 
 }
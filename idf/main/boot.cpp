@@ -0,0 +1,77 @@
+// Copyright: 2022, Diez B. Roggisch, Berlin, all rights reserved
+
+#include "boot.hpp"
+#include "format.hpp"
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/event_groups.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+
+#include <array>
+#include <atomic>
+
+#define TAG "boot"
+
+namespace beehive::boot {
+
+namespace {
+
+const char* STAGE_NAMES[STAGE_COUNT] = {
+  "wifi",
+  "time",
+  "connected",
+  "readings",
+  "first PUBACK",
+  "sleep",
+};
+
+EventGroupHandle_t s_stages;
+// Microseconds since wake, 0 if not reached yet
+std::array<std::atomic<int64_t>, STAGE_COUNT> s_reached_at;
+
+} // namespace
+
+void init()
+{
+  s_stages = xEventGroupCreate();
+}
+
+void mark(stage_t stage)
+{
+  int64_t expected = 0;
+  // The timer starts at the wake, so it can't be 0 here
+  if(s_reached_at[stage].compare_exchange_strong(expected, esp_timer_get_time()))
+  {
+    xEventGroupSetBits(s_stages, EventBits_t(1) << stage);
+  }
+}
+
+bool wait_for(stage_t stage, std::chrono::milliseconds timeout)
+{
+  const auto bit = EventBits_t(1) << stage;
+  const auto bits = xEventGroupWaitBits(s_stages, bit, pdFALSE, pdTRUE, timeout.count() / portTICK_PERIOD_MS);
+  return bits & bit;
+}
+
+void log_trace()
+{
+  beehive::util::FormatBuffer<160> trace;
+  trace.append("wake");
+  for(size_t stage = 0; stage < STAGE_COUNT; ++stage)
+  {
+    trace.append(" -> ").append(STAGE_NAMES[stage]).append(' ');
+    const auto reached_at = s_reached_at[stage].load();
+    if(reached_at)
+    {
+      trace.decimal(reached_at / 1000).append("ms");
+    }
+    else
+    {
+      trace.append('-');
+    }
+  }
+  ESP_LOGI(TAG, "%s", trace.c_str());
+}
+
+} // namespace beehive::boot
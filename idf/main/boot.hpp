@@ -0,0 +1,33 @@
+// Copyright: 2022, Diez B. Roggisch, Berlin, all rights reserved
+
+#pragma once
+
+#include <chrono>
+
+// The stages of a wake. Sensor acquisition, the WIFI and
+// MQTT connect and NTP run concurrently, and wait for each
+// other through these. Each stage is marked once with its
+// time since the wake, so the overlap can be checked in the
+// trace logged before going to sleep.
+namespace beehive::boot {
+
+enum stage_t
+{
+  WIFI_UP,
+  // Either still kept by the RTC, or from NTP
+  TIME_VALID,
+  MQTT_CONNECTED,
+  READINGS_TAKEN,
+  FIRST_PUBACK,
+  SLEEP,
+  STAGE_COUNT
+};
+
+// Must be called before any other function
+void init();
+void mark(stage_t);
+// Returns false if the stage wasn't reached in time
+bool wait_for(stage_t, std::chrono::milliseconds timeout);
+void log_trace();
+
+} // namespace beehive::boot
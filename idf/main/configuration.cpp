@@ -0,0 +1,80 @@
+// Copyright: 2022, Diez B. Roggisch, Berlin, all rights reserved
+
+#include "configuration.hpp"
+#include "appstate.hpp"
+
+namespace beehive::configuration {
+
+using json = nlohmann::json;
+
+json to_json()
+{
+  json j = {
+#ifdef USE_LORA
+    {"lora_dbm", beehive::appstate::lora_dbm()},
+#endif // USE_LORA
+    {"sleeptime", beehive::appstate::sleeptime()},
+    {"batch_size", beehive::appstate::batch_size()},
+    {"deadband", beehive::appstate::deadband()},
+    {"heartbeat", beehive::appstate::heartbeat()},
+    {"mqtt_qos", beehive::appstate::mqtt_qos()},
+    {"system_name", beehive::appstate::system_name()},
+    {"app_version", beehive::appstate::version()},
+    {"mqtt_hostname", beehive::appstate::mqtt_host()}
+  };
+  const auto config_version = beehive::appstate::config_version();
+  if(config_version)
+  {
+    j["config_version"] = *config_version;
+  }
+  return j;
+}
+
+void apply(const json& body)
+{
+  beehive::appstate::Update update;
+  if(body.contains("mqtt_hostname") && body["mqtt_hostname"].is_string())
+  {
+    const auto hostname = body["mqtt_hostname"].get<std::string>();
+    beehive::appstate::set_mqtt_host(hostname);
+  }
+  if(body.contains("system_name") && body["system_name"].is_string())
+  {
+    const auto system_name = body["system_name"].get<std::string>();
+    beehive::appstate::set_system_name(system_name);
+  }
+  if(body.contains("sleeptime") && body["sleeptime"].is_number())
+  {
+    const auto sleeptime = body["sleeptime"].get<uint32_t>();
+    beehive::appstate::set_sleeptime(sleeptime);
+  }
+  if(body.contains("batch_size") && body["batch_size"].is_number())
+  {
+    const auto batch_size = body["batch_size"].get<uint32_t>();
+    beehive::appstate::set_batch_size(batch_size);
+  }
+  if(body.contains("deadband") && body["deadband"].is_number())
+  {
+    const auto deadband = body["deadband"].get<uint32_t>();
+    beehive::appstate::set_deadband(deadband);
+  }
+  if(body.contains("heartbeat") && body["heartbeat"].is_number())
+  {
+    const auto heartbeat = body["heartbeat"].get<uint32_t>();
+    beehive::appstate::set_heartbeat(heartbeat);
+  }
+  if(body.contains("mqtt_qos") && body["mqtt_qos"].is_number())
+  {
+    const auto mqtt_qos = body["mqtt_qos"].get<uint32_t>();
+    beehive::appstate::set_mqtt_qos(mqtt_qos);
+  }
+#ifdef USE_LORA
+  if(body.contains("lora_dbm") && body["lora_dbm"].is_number())
+  {
+    const auto lora_dbm = body["lora_dbm"].get<uint32_t>();
+    beehive::appstate::set_lora_dbm(lora_dbm);
+  }
+#endif // USE_LORA
+}
+
+} // namespace beehive::configuration
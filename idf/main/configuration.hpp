@@ -0,0 +1,17 @@
+// Copyright: 2022, Diez B. Roggisch, Berlin, all rights reserved
+
+#pragma once
+
+#include "nlohmann/json.hpp"
+
+// The configuration as JSON, shared by the HTTP
+// server and the remote configuration over MQTT.
+namespace beehive::configuration {
+
+nlohmann::json to_json();
+
+// Applies the settings found in body as one
+// appstate::Update, unknown keys are ignored.
+void apply(const nlohmann::json& body);
+
+} // namespace beehive::configuration
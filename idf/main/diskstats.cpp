@@ -0,0 +1,156 @@
+// Copyright: 2022, Diez B. Roggisch, Berlin, all rights reserved
+#include "diskstats.hpp"
+
+#include "diskio_impl.h"
+#include "diskio_sdmmc.h"
+#include "esp_timer.h"
+#include "ff.h"
+
+#include <atomic>
+
+#include "esp_log.h"
+
+namespace beehive::sdcard::diskstats {
+
+namespace {
+
+static const char *TAG = "diskstats";
+
+sdmmc_card_t* s_card = nullptr;
+
+// The sector ranges we want to tell apart
+uint32_t s_data_start = 0;
+uint32_t s_root_dir_start = 0;
+uint32_t s_root_dir_end = 0;
+
+std::atomic<uint32_t> s_sectors_read;
+std::atomic<uint32_t> s_sectors_written;
+std::atomic<uint32_t> s_fat_sectors_written;
+std::atomic<uint32_t> s_directory_sectors_written;
+std::atomic<uint32_t> s_write_time;
+
+// Mirrors the IDF diskio_sdmmc implementation, the card
+// is already initialized when we take over.
+DSTATUS counting_init(unsigned char)
+{
+  return 0;
+}
+
+DSTATUS counting_status(unsigned char)
+{
+  return 0;
+}
+
+DRESULT counting_read(unsigned char, unsigned char* buff, uint32_t sector, unsigned count)
+{
+  s_sectors_read += count;
+  const auto err = sdmmc_read_sectors(s_card, buff, sector, count);
+  if(err != ESP_OK)
+  {
+    ESP_LOGE(TAG, "sdmmc_read_sectors failed (%d)", err);
+    return RES_ERROR;
+  }
+  return RES_OK;
+}
+
+DRESULT counting_write(unsigned char, const unsigned char* buff, uint32_t sector, unsigned count)
+{
+  s_sectors_written += count;
+  for(auto s = sector; s < sector + count; ++s)
+  {
+    if(s < s_data_start)
+    {
+      ++s_fat_sectors_written;
+    }
+    else if(s >= s_root_dir_start && s < s_root_dir_end)
+    {
+      ++s_directory_sectors_written;
+    }
+  }
+  const auto start = esp_timer_get_time();
+  const auto err = sdmmc_write_sectors(s_card, buff, sector, count);
+  s_write_time += uint32_t(esp_timer_get_time() - start);
+  if(err != ESP_OK)
+  {
+    ESP_LOGE(TAG, "sdmmc_write_sectors failed (%d)", err);
+    return RES_ERROR;
+  }
+  return RES_OK;
+}
+
+DRESULT counting_ioctl(unsigned char, unsigned char cmd, void* buff)
+{
+  switch(cmd)
+  {
+  case CTRL_SYNC:
+    return RES_OK;
+  case GET_SECTOR_COUNT:
+    *static_cast<DWORD*>(buff) = s_card->csd.capacity;
+    return RES_OK;
+  case GET_SECTOR_SIZE:
+    *static_cast<WORD*>(buff) = s_card->csd.sector_size;
+    return RES_OK;
+  default:
+    return RES_ERROR;
+  }
+}
+
+const ff_diskio_impl_t s_counting_impl = {
+  counting_init,
+  counting_status,
+  counting_read,
+  counting_write,
+  counting_ioctl
+};
+
+} // namespace
+
+bool install(sdmmc_card_t* card, const char* mount_point)
+{
+  const auto pdrv = ff_diskio_get_pdrv_card(card);
+  if(pdrv == 0xff)
+  {
+    ESP_LOGE(TAG, "No FatFs drive for the card at %s", mount_point);
+    return false;
+  }
+  s_card = card;
+  ff_diskio_register(pdrv, &s_counting_impl);
+
+  const char drive[] = { char('0' + pdrv), ':', 0 };
+  DWORD free_clusters;
+  FATFS* fs;
+  if(f_getfree(drive, &free_clusters, &fs) != FR_OK)
+  {
+    ESP_LOGE(TAG, "Can't get the FAT layout of %s", mount_point);
+    return true;
+  }
+  s_data_start = fs->database;
+  // FAT12/16 have a fixed root directory before the data
+  // area, FAT32 keeps it in a cluster chain of which we
+  // only count the first cluster.
+  if(fs->fs_type == FS_FAT32)
+  {
+    s_root_dir_start = fs->database + (fs->dirbase - 2) * fs->csize;
+    s_root_dir_end = s_root_dir_start + fs->csize;
+  }
+  else
+  {
+    s_data_start = fs->dirbase;
+    s_root_dir_start = fs->dirbase;
+    s_root_dir_end = fs->database;
+  }
+  return true;
+}
+
+disk_counters_t counters()
+{
+  return {
+    s_sectors_read,
+    s_sectors_written,
+    s_fat_sectors_written,
+    s_directory_sectors_written,
+    s_write_time
+  };
+}
+
+} // namespace beehive::sdcard::diskstats
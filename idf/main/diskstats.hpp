@@ -0,0 +1,31 @@
+// Copyright: 2022, Diez B. Roggisch, Berlin, all rights reserved
+
+#pragma once
+
+#include "sdmmc_cmd.h"
+
+#include <cstdint>
+
+// Counts the sector IO FatFs does on the SD card, so we
+// can see how much a change to the write path costs in
+// FAT and directory updates on a real card.
+namespace beehive::sdcard::diskstats {
+
+struct disk_counters_t
+{
+  uint32_t sectors_read;
+  uint32_t sectors_written;
+  // FAT and reserved sectors
+  uint32_t fat_sectors_written;
+  // root directory entries
+  uint32_t directory_sectors_written;
+  // time spent in sector writes, in us
+  uint32_t write_time;
+};
+
+// Replaces the FatFs disk IO for the card with a counting
+// one. Must be called after mounting.
+bool install(sdmmc_card_t* card, const char* mount_point);
+disk_counters_t counters();
+
+} // namespace beehive::sdcard::diskstats
@@ -1,6 +1,7 @@
 #include "display.hpp"
 #include "appstate.hpp"
 #include "beehive_events.hpp"
+#include "format.hpp"
 #include "util.hpp"
 #include "lora.hpp"
 
@@ -142,6 +143,11 @@ void Display::lora_info_t::event_handler(esp_event_base_t event_base,
   {
     package_count = stats->package_count;
     malformed_package_count = stats->malformed_package_count;
+    airtime_per_reading = stats->airtime_per_reading;
+    devices = stats->devices;
+    tx_power = stats->tx_power;
+    rssi = stats->rssi;
+    snr = stats->snr;
   }
 }
 
@@ -152,26 +158,51 @@ void Display::lora_info_t::show(Display& display)
   y += 4 + NORMAL.size;
   auto x = 4;
   x += display.font_render(NORMAL, "Role: ", x, y);
-  display.font_render(NORMAL, beehive::lora::is_field_device() ? "FIELD" : "BASE", x, y);
+  if(beehive::lora::is_field_device())
+  {
+    display.font_render(NORMAL, "FIELD", x, y);
+  }
+  else
+  {
+    x += display.font_render(NORMAL, "BASE, ", x, y);
+    x += display.font_render(NORMAL, devices, x, y);
+    display.font_render(NORMAL, " dev", x, y);
+  }
 
   y += 4 + NORMAL.size;
   x = 4;
-  x += display.font_render(NORMAL, "Packages: ", x, y);
-  display.font_render(NORMAL, package_count, x, y);
   if(beehive::lora::is_field_device())
   {
-    y += 4 + NORMAL.size;
-    x = 4;
-    x += display.font_render(NORMAL, "dbm: ", x, y);
-    display.font_render(NORMAL, beehive::appstate::lora_dbm(), x, y);
+    x += display.font_render(NORMAL, "Packages: ", x, y);
+    display.font_render(NORMAL, package_count, x, y);
   }
   else // BASE
   {
-    y += 4 + NORMAL.size;
-    x = 4;
-    x += display.font_render(NORMAL, "Malformed: ", x, y);
+    x += display.font_render(NORMAL, "Pkgs: ", x, y);
+    x += display.font_render(NORMAL, package_count, x, y);
+    x += display.font_render(NORMAL, " Bad: ", x, y);
     display.font_render(NORMAL, malformed_package_count, x, y);
   }
+
+  y += 4 + NORMAL.size;
+  x = 4;
+  x += display.font_render(NORMAL, "us/reading: ", x, y);
+  display.font_render(NORMAL, airtime_per_reading, x, y);
+
+  // The field device shows how the base station hears
+  // it, the base station its last packet.
+  beehive::util::FormatBuffer<32> link;
+  if(beehive::lora::is_field_device())
+  {
+    link.append("TX: ").decimal(tx_power).append("dBm SNR: ");
+  }
+  else
+  {
+    link.append("RX: ").decimal(rssi).append("dBm SNR: ");
+  }
+  link.fixed(snr / 4.0f);
+  y += 4 + NORMAL.size;
+  display.font_render(NORMAL, link.c_str(), 4, y);
 }
 #endif
 
@@ -198,6 +229,8 @@ void Display::sdcard_info_t::event_handler(esp_event_base_t event_base,
   case beehive::events::sdcard::NO_FILE:
     no_file = true;
     break;
+  case beehive::events::sdcard::RECOVERED:
+    break;
   }
 }
 
@@ -277,11 +310,20 @@ void Display::smartconfig_info_t::show(Display& display)
 }
 
 
-Display::sensor_info_t::sensor_info_t() : Display::event_listener_base_t{{SENSOR_EVENTS}} {}
+Display::sensor_info_t::sensor_info_t() : Display::event_listener_base_t{{SENSOR_EVENTS, LORA_EVENTS}} {}
 
 void Display::sensor_info_t::event_handler(esp_event_base_t event_base,
                          int32_t event_id, void* event_data)
 {
+  // The base station relays the readings of its field devices
+  if(event_base == LORA_EVENTS)
+  {
+    if(event_id == beehive::events::lora::RELAYED)
+    {
+      sensor_readings += *static_cast<size_t*>(event_data);
+    }
+    return;
+  }
   const auto sensor_event_id = beehive::events::sensors::sensor_events_t(event_id);
   switch(sensor_event_id)
   {
@@ -291,6 +333,9 @@ void Display::sensor_info_t::event_handler(esp_event_base_t event_base,
   case beehive::events::sensors::SHT3XDIS_READINGS:
     ++sensor_readings;
     break;
+  case beehive::events::sensors::SHT3XDIS_BATCH:
+    sensor_readings += *static_cast<size_t*>(event_data);
+    break;
   }
 }
 
@@ -325,6 +370,8 @@ void Display::mqtt_info_t::event_handler(esp_event_base_t event_base,
   case beehive::events::mqtt::PUBLISHED:
     message_backlog = *static_cast<size_t*>(event_data);
     break;
+  case beehive::events::mqtt::CONNECTED:
+    break;
   }
 }
 
@@ -67,6 +67,12 @@ class Display {
 
     size_t package_count = 0;
     size_t malformed_package_count = 0;
+    size_t airtime_per_reading = 0;
+    size_t devices = 0;
+    uint32_t tx_power = 0;
+    // dBm and quarter dB
+    int32_t rssi = 0;
+    int32_t snr = 0;
   };
 #endif
 
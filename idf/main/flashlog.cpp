@@ -0,0 +1,238 @@
+// Copyright: 2022, Diez B. Roggisch, Berlin, all rights reserved
+
+#include "flashlog.hpp"
+
+#include <esp_rom_crc.h>
+#include <esp_log.h>
+
+#include <cstddef>
+#include <cstring>
+
+#define TAG "flashlog"
+
+namespace beehive::flashlog {
+
+namespace {
+
+using namespace beehive::records;
+
+#define PARTITION_LABEL "beelog"
+#define PARTITION_SUBTYPE esp_partition_subtype_t(0x99)
+#define SECTOR_SIZE SPI_FLASH_SEC_SIZE
+#define SECTOR_MAGIC 0x474f4c42 // "BLOG"
+#define FRAME_MAGIC 0xbee5
+
+struct sector_header_t
+{
+  uint32_t magic;
+  uint32_t sector_sequence;
+  uint32_t first_record_sequence;
+  uint32_t crc;
+};
+
+// Each record is framed like this, followed by the used
+// part of the compact_record_t, padded to 4 bytes.
+// Erased flash reads as 0xff, so a magic of 0xffff
+// marks the end of the sector's data.
+struct frame_header_t
+{
+  uint16_t magic;
+  uint16_t length;
+  uint32_t sequence;
+  uint32_t crc;
+};
+
+size_t align4(size_t size)
+{
+  return (size + 3) & ~size_t(3);
+}
+
+uint32_t sector_crc(const sector_header_t& header)
+{
+  return esp_rom_crc32_le(0, reinterpret_cast<const uint8_t*>(&header), offsetof(sector_header_t, crc));
+}
+
+uint32_t frame_crc(const frame_header_t& header, const uint8_t* payload)
+{
+  const auto crc = esp_rom_crc32_le(0, reinterpret_cast<const uint8_t*>(&header.sequence), sizeof(header.sequence));
+  return esp_rom_crc32_le(crc, payload, header.length);
+}
+
+// True if there is an intact frame at offset, header
+// is filled in as far as it could be read.
+bool valid_frame(const uint8_t* sector, size_t offset, frame_header_t* header)
+{
+  if(offset + sizeof(frame_header_t) > SECTOR_SIZE)
+  {
+    return false;
+  }
+  std::memcpy(header, sector + offset, sizeof(frame_header_t));
+  return header->magic == FRAME_MAGIC
+    && header->length <= sizeof(compact_record_t)
+    && offset + sizeof(frame_header_t) + header->length <= SECTOR_SIZE
+    && header->crc == frame_crc(*header, sector + offset + sizeof(frame_header_t));
+}
+
+} // namespace
+
+FlashLog::FlashLog(std::function<bool()> primary_available)
+  : _partition(esp_partition_find_first(ESP_PARTITION_TYPE_DATA, PARTITION_SUBTYPE, PARTITION_LABEL))
+  , _primary_available(primary_available)
+{
+  if(!_partition)
+  {
+    ESP_LOGE(TAG, "No '%s' partition, flash log disabled", PARTITION_LABEL);
+    return;
+  }
+  _sector_count = _partition->size / SECTOR_SIZE;
+  _page.reserve(SECTOR_SIZE);
+  mount();
+  ESP_ERROR_CHECK(esp_event_handler_instance_register(SENSOR_EVENTS, beehive::events::sensors::SHT3XDIS_READINGS, FlashLog::s_sensor_event_handler, this, NULL));
+  ESP_ERROR_CHECK(esp_event_handler_instance_register(SENSOR_EVENTS, beehive::events::sensors::SHT3XDIS_BATCH, FlashLog::s_sensor_event_handler, this, NULL));
+}
+
+void FlashLog::mount()
+{
+  auto found = false;
+  for(size_t sector=0; sector < _sector_count; ++sector)
+  {
+    sector_header_t header;
+    esp_partition_read(_partition, sector * SECTOR_SIZE, &header, sizeof(header));
+    if(header.magic == SECTOR_MAGIC && header.crc == sector_crc(header)
+       && (!found || header.sector_sequence > _sector_sequence))
+    {
+      found = true;
+      _sector = sector;
+      _sector_sequence = header.sector_sequence;
+      _sequence = header.first_record_sequence;
+    }
+  }
+  if(!found)
+  {
+    ESP_LOGI(TAG, "Empty flash log, %i sectors", int(_sector_count));
+    // Makes the first append start a fresh sector 0
+    _sector = _sector_count - 1;
+    _offset = SECTOR_SIZE;
+    return;
+  }
+  // Only the newest sector needs to be walked to find
+  // the write position, so mounting is bounded.
+  std::vector<uint8_t> sector(SECTOR_SIZE);
+  esp_partition_read(_partition, _sector * SECTOR_SIZE, sector.data(), sector.size());
+  _offset = sizeof(sector_header_t);
+  frame_header_t header;
+  while(valid_frame(sector.data(), _offset, &header))
+  {
+    _sequence = header.sequence + 1;
+    _offset += align4(sizeof(frame_header_t) + header.length);
+  }
+  if(_offset + sizeof(frame_header_t) <= SECTOR_SIZE && header.magic != 0xffff)
+  {
+    ESP_LOGE(TAG, "Torn frame in sector %i at %i, sealing sector", int(_sector), int(_offset));
+    _offset = SECTOR_SIZE;
+  }
+  ESP_LOGI(TAG, "Mounted flash log, sector %i, offset %i, next sequence %i", int(_sector), int(_offset), int(_sequence));
+}
+
+void FlashLog::next_sector()
+{
+  _sector = (_sector + 1) % _sector_count;
+  esp_partition_erase_range(_partition, _sector * SECTOR_SIZE, SECTOR_SIZE);
+  sector_header_t header = { SECTOR_MAGIC, ++_sector_sequence, _sequence, 0 };
+  header.crc = sector_crc(header);
+  esp_partition_write(_partition, _sector * SECTOR_SIZE, &header, sizeof(header));
+  _offset = sizeof(header);
+}
+
+void FlashLog::flush_page()
+{
+  if(_page.empty())
+  {
+    return;
+  }
+  const auto res = esp_partition_write(_partition, _sector * SECTOR_SIZE + _offset, _page.data(), _page.size());
+  if(res != ESP_OK)
+  {
+    ESP_LOGE(TAG, "Writing flash log failed: %s", esp_err_to_name(res));
+  }
+  _offset += _page.size();
+  _page.clear();
+}
+
+void FlashLog::append(const std::vector<compact_record_t>& records)
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+  for(const auto& record : records)
+  {
+    frame_header_t header = { FRAME_MAGIC, uint16_t(used_size(record)), _sequence, 0 };
+    const auto frame_size = align4(sizeof(header) + header.length);
+    if(_offset + _page.size() + frame_size > SECTOR_SIZE)
+    {
+      flush_page();
+      next_sector();
+    }
+    header.crc = frame_crc(header, reinterpret_cast<const uint8_t*>(&record));
+    const auto start = _page.size();
+    _page.resize(start + frame_size, 0);
+    std::memcpy(_page.data() + start, &header, sizeof(header));
+    std::memcpy(_page.data() + start + sizeof(header), &record, header.length);
+    ++_sequence;
+  }
+  flush_page();
+  ESP_LOGD(TAG, "Appended %i records, next sequence %i", int(records.size()), int(_sequence));
+}
+
+void FlashLog::for_each(record_callback_t callback) const
+{
+  std::vector<uint8_t> sector(SECTOR_SIZE);
+  for(size_t i=1; i <= _sector_count; ++i)
+  {
+    {
+      // We only hold the lock while copying, the
+      // callback might be slow.
+      std::lock_guard<std::mutex> lock(_mutex);
+      esp_partition_read(_partition, ((_sector + i) % _sector_count) * SECTOR_SIZE, sector.data(), sector.size());
+    }
+    sector_header_t sector_header;
+    std::memcpy(&sector_header, sector.data(), sizeof(sector_header));
+    if(sector_header.magic != SECTOR_MAGIC || sector_header.crc != sector_crc(sector_header))
+    {
+      continue;
+    }
+    auto offset = sizeof(sector_header_t);
+    frame_header_t header;
+    while(valid_frame(sector.data(), offset, &header))
+    {
+      compact_record_t record;
+      std::memcpy(&record, sector.data() + offset + sizeof(header), header.length);
+      callback(header.sequence, record);
+      offset += align4(sizeof(header) + header.length);
+    }
+  }
+}
+
+void FlashLog::s_sensor_event_handler(void *handler_args,
+                                        esp_event_base_t base, int32_t id,
+                                        void *event_data) {
+  static_cast<FlashLog*>(handler_args)->sensor_event_handler(base, beehive::events::sensors::sensor_events_t(id), event_data);
+}
+
+void FlashLog::sensor_event_handler(esp_event_base_t base, beehive::events::sensors::sensor_events_t id, void* event_data)
+{
+  if(_primary_available())
+  {
+    return;
+  }
+  const auto records = beehive::events::sensors::receive_records(id, event_data);
+  if(records)
+  {
+    std::vector<compact_record_t> compact_records;
+    for(const auto& record : *records)
+    {
+      compact_records.push_back(beehive::events::sensors::compact(record.timestamp, record.readings));
+    }
+    append(compact_records);
+  }
+}
+
+} // namespace beehive::flashlog
@@ -0,0 +1,55 @@
+// Copyright: 2022, Diez B. Roggisch, Berlin, all rights reserved
+
+#pragma once
+
+#include "beehive_events.hpp"
+#include "records.hpp"
+
+#include <esp_partition.h>
+
+#include <functional>
+#include <mutex>
+#include <vector>
+
+// An append-only ring log in a dedicated flash partition. It
+// takes over when there is no usable SD card, so readings
+// don't depend on the MQTT broker being reachable.
+namespace beehive::flashlog {
+
+class FlashLog
+{
+public:
+  using record_callback_t = std::function<void(uint32_t sequence, const beehive::records::compact_record_t&)>;
+
+  // primary_available tells us if there is another sink
+  // taking care of the readings.
+  FlashLog(std::function<bool()> primary_available);
+
+  bool available() const { return _partition != nullptr; }
+  void append(const std::vector<beehive::records::compact_record_t>&);
+  // Iterates all records from oldest to newest.
+  void for_each(record_callback_t) const;
+
+private:
+  static void s_sensor_event_handler(void *handler_args, esp_event_base_t base, int32_t id, void *event_data);
+  void sensor_event_handler(esp_event_base_t base, beehive::events::sensors::sensor_events_t id, void* event_data);
+
+  void mount();
+  void next_sector();
+  void flush_page();
+
+  const esp_partition_t* _partition;
+  std::function<bool()> _primary_available;
+  mutable std::mutex _mutex;
+
+  size_t _sector_count = 0;
+  size_t _sector = 0;
+  // write offset inside the current sector
+  size_t _offset = 0;
+  uint32_t _sector_sequence = 0;
+  uint32_t _sequence = 0;
+  // frames are staged here so each batch is one flash write
+  std::vector<uint8_t> _page;
+};
+
+} // namespace beehive::flashlog
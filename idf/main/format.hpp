@@ -0,0 +1,184 @@
+// Copyright: 2022, Diez B. Roggisch, Berlin, all rights reserved
+
+#pragma once
+
+#include <array>
+#include <charconv>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <string_view>
+
+// Formatting of payloads and lines without streams or heap
+// allocations. A Formatter appends into a caller provided
+// buffer and keeps it NUL terminated. Output that doesn't
+// fit is dropped and marks the formatter as overflowed, so
+// callers check once at the end instead of after every
+// field.
+namespace beehive::util {
+
+class Formatter
+{
+public:
+  Formatter(char* buffer, size_t capacity)
+    : _begin(buffer)
+    , _end(buffer + capacity - 1)
+    , _p(buffer)
+  {
+    *_p = 0;
+  }
+
+  Formatter(const Formatter&) = delete;
+  Formatter& operator=(const Formatter&) = delete;
+
+  Formatter& append(char c)
+  {
+    if(reserve(1))
+    {
+      *_p++ = c;
+      *_p = 0;
+    }
+    return *this;
+  }
+
+  Formatter& append(std::string_view s)
+  {
+    if(reserve(s.size()))
+    {
+      std::memcpy(_p, s.data(), s.size());
+      _p += s.size();
+      *_p = 0;
+    }
+    return *this;
+  }
+
+  template<typename T>
+  Formatter& decimal(T value)
+  {
+    return convert(value, 10, 0);
+  }
+
+  // Lowercase hex, zero padded to width digits
+  template<typename T>
+  Formatter& hex(T value, int width=0)
+  {
+    return convert(value, 16, width);
+  }
+
+  // Fixed point with the given number of decimals. to_chars
+  // for floating point isn't available in our toolchain, and
+  // we only need a few digits anyway.
+  Formatter& fixed(float value, int decimals=2)
+  {
+    if(!std::isfinite(value))
+    {
+      return append("nan");
+    }
+    uint32_t scale = 1;
+    for(int i = 0; i < decimals; ++i)
+    {
+      scale *= 10;
+    }
+    const auto scaled = int64_t(std::lround(double(value) * scale));
+    const auto magnitude = uint64_t(scaled < 0 ? -scaled : scaled);
+    if(scaled < 0)
+    {
+      append('-');
+    }
+    decimal(magnitude / scale);
+    if(decimals)
+    {
+      append('.');
+      convert(magnitude % scale, 10, decimals);
+    }
+    return *this;
+  }
+
+  // Local time as 2022-01-31T12:00:00+0000
+  Formatter& isoformat(std::time_t t)
+  {
+    std::tm tm;
+    localtime_r(&t, &tm);
+    // strftime needs room for the terminator
+    const auto written = std::strftime(_p, size_t(_end - _p) + 1, "%FT%T%z", &tm);
+    if(written)
+    {
+      _p += written;
+    }
+    else
+    {
+      _overflowed = true;
+    }
+    *_p = 0;
+    return *this;
+  }
+
+  const char* c_str() const { return _begin; }
+  size_t size() const { return size_t(_p - _begin); }
+  bool overflowed() const { return _overflowed; }
+
+  void clear()
+  {
+    _p = _begin;
+    *_p = 0;
+    _overflowed = false;
+  }
+
+private:
+  bool reserve(size_t len)
+  {
+    if(size_t(_end - _p) < len)
+    {
+      _overflowed = true;
+      return false;
+    }
+    return true;
+  }
+
+  template<typename T>
+  Formatter& convert(T value, int base, int width)
+  {
+    // Enough for 64 bit values in base 10 and 16
+    std::array<char, 20> digits;
+    const auto result = std::to_chars(digits.begin(), digits.end(), value, base);
+    const auto len = int(result.ptr - digits.begin());
+    for(int i = len; i < width; ++i)
+    {
+      append('0');
+    }
+    return append(std::string_view(digits.data(), size_t(len)));
+  }
+
+  char* _begin;
+  char* _end;
+  char* _p;
+  bool _overflowed = false;
+};
+
+namespace detail {
+
+// A base class, so the storage exists before
+// the Formatter gets constructed on top of it.
+template<size_t N>
+struct format_storage_t
+{
+  std::array<char, N> storage;
+};
+
+} // namespace detail
+
+// A Formatter with its own storage, meant to live on the
+// stack or as a member that is cleared for every payload.
+template<size_t N>
+class FormatBuffer : private detail::format_storage_t<N>, public Formatter
+{
+public:
+  FormatBuffer()
+    : Formatter(this->storage.data(), N)
+  {
+  }
+};
+
+} // namespace beehive::util
@@ -0,0 +1,66 @@
+// Copyright: 2022, Diez B. Roggisch, Berlin, all rights reserved
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+namespace beehive::util {
+
+// Counts durations in power-of-two buckets, which is precise
+// enough to tell a 1ms write from a 100ms FAT hiccup. Written
+// from one task, readers only ever get approximate values.
+class LatencyHistogram
+{
+public:
+  static const size_t BUCKETS = 32;
+
+  void record(uint32_t us)
+  {
+    size_t bucket = 0;
+    while(bucket + 1 < BUCKETS && (uint32_t(1) << bucket) < us)
+    {
+      ++bucket;
+    }
+    _buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+    _count.fetch_add(1, std::memory_order_relaxed);
+    if(us > _max.load(std::memory_order_relaxed))
+    {
+      _max.store(us, std::memory_order_relaxed);
+    }
+  }
+
+  // The upper bound of the bucket the given
+  // percentile (0-100) falls into.
+  uint32_t percentile(uint32_t p) const
+  {
+    const auto count = _count.load(std::memory_order_relaxed);
+    if(count == 0)
+    {
+      return 0;
+    }
+    const auto rank = (uint64_t(count) * p + 99) / 100;
+    uint64_t seen = 0;
+    for(size_t bucket = 0; bucket < BUCKETS; ++bucket)
+    {
+      seen += _buckets[bucket].load(std::memory_order_relaxed);
+      if(seen >= rank && seen > 0)
+      {
+        return std::min(uint32_t(1) << bucket, max());
+      }
+    }
+    return max();
+  }
+
+  uint32_t count() const { return _count.load(std::memory_order_relaxed); }
+  uint32_t max() const { return _max.load(std::memory_order_relaxed); }
+
+private:
+  std::array<std::atomic<uint32_t>, BUCKETS> _buckets = {};
+  std::atomic<uint32_t> _count = 0;
+  std::atomic<uint32_t> _max = 0;
+};
+
+} // namespace beehive::util
@@ -0,0 +1,149 @@
+// Copyright: 2022, Diez B. Roggisch, Berlin, all rights reserved
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <optional>
+
+namespace beehive::mqtt {
+
+// The messages published but not yet acknowledged, keyed
+// by their MQTT message id. An open-addressed table with
+// linear probing, so tracking a publish never allocates.
+template<size_t N>
+class InFlightTable
+{
+  static_assert(N && (N & (N - 1)) == 0, "N must be a power of two");
+public:
+  struct entry_t
+  {
+    int64_t sent_at;
+    // sequence number of the record in the message,
+    // 0 for messages we don't need to replay
+    size_t sequence;
+  };
+
+  // Returns false if the table is full or the id is
+  // already tracked.
+  bool insert(int msg_id, int64_t sent_at, size_t sequence=0)
+  {
+    if(_size == N || find(msg_id))
+    {
+      return false;
+    }
+    for(size_t probe = 0; probe < N; ++probe)
+    {
+      auto& slot = _slots[(hash(msg_id) + probe) % N];
+      if(slot.state != USED)
+      {
+        slot = { msg_id, { sent_at, sequence }, USED };
+        ++_size;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Returns the entry of the message, if we tracked it.
+  std::optional<entry_t> erase(int msg_id)
+  {
+    auto slot = find(msg_id);
+    if(!slot)
+    {
+      return std::nullopt;
+    }
+    // Tombstone, so the probe chains of other
+    // ids stay intact.
+    slot->state = DELETED;
+    --_size;
+    if(_size == 0)
+    {
+      clear();
+    }
+    return slot->entry;
+  }
+
+  // When the oldest unacknowledged message was sent
+  std::optional<int64_t> oldest() const
+  {
+    std::optional<int64_t> result;
+    for(const auto& slot : _slots)
+    {
+      if(slot.state == USED && (!result || slot.entry.sent_at < *result))
+      {
+        result = slot.entry.sent_at;
+      }
+    }
+    return result;
+  }
+
+  // The lowest sequence number still waiting for its ack
+  std::optional<size_t> lowest_sequence() const
+  {
+    std::optional<size_t> result;
+    for(const auto& slot : _slots)
+    {
+      if(slot.state == USED && slot.entry.sequence && (!result || slot.entry.sequence < *result))
+      {
+        result = slot.entry.sequence;
+      }
+    }
+    return result;
+  }
+
+  size_t size() const { return _size; }
+
+  void clear()
+  {
+    for(auto& slot : _slots)
+    {
+      slot.state = FREE;
+    }
+    _size = 0;
+  }
+
+private:
+  enum state_t : uint8_t
+  {
+    FREE,
+    USED,
+    DELETED
+  };
+
+  struct slot_t
+  {
+    int msg_id;
+    entry_t entry;
+    state_t state;
+  };
+
+  static size_t hash(int msg_id)
+  {
+    // msg ids are handed out sequentially, so they
+    // already spread over the table.
+    return size_t(uint32_t(msg_id));
+  }
+
+  slot_t* find(int msg_id)
+  {
+    for(size_t probe = 0; probe < N; ++probe)
+    {
+      auto& slot = _slots[(hash(msg_id) + probe) % N];
+      if(slot.state == FREE)
+      {
+        return nullptr;
+      }
+      if(slot.state == USED && slot.msg_id == msg_id)
+      {
+        return &slot;
+      }
+    }
+    return nullptr;
+  }
+
+  std::array<slot_t, N> _slots = {};
+  size_t _size = 0;
+};
+
+} // namespace beehive::mqtt
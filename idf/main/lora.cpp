@@ -1,13 +1,23 @@
 // Copyright: 2022, Diez B. Roggisch, Berlin, all rights reserved
 #ifdef USE_LORA
 #include "lora.hpp"
+#include "lora_codec.hpp"
 #include "pins.hpp"
 #include "beehive_events.hpp"
 #include "deets/i2c/sht3xdis.hpp"
 #include "mqtt.hpp"
 #include "appstate.hpp"
+#include "reporting.hpp"
+#include "sdcard.hpp"
 
 #include "esp_mac.h"
+#include "esp_random.h"
+#include "sdkconfig.h"
+#include <esp_timer.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
 
 #define LOG_LOCAL_LEVEL ESP_LOG_DEBUG
 #include "esp_log.h"
@@ -23,15 +33,89 @@ std::array<std::array<uint8_t, 6>, 2> LORA_SENDER_MACS = {
   }
 };
 
+// The base station from the configuration, with
+// it set every other device is in the field.
+std::optional<std::array<uint8_t, 6>> base_station_mac()
+{
+  std::array<unsigned, 6> bytes;
+  if(std::sscanf(CONFIG_BEEHIVE_LORA_BASE_MAC, "%x:%x:%x:%x:%x:%x",
+                 &bytes[0], &bytes[1], &bytes[2], &bytes[3], &bytes[4], &bytes[5]) != 6)
+  {
+    return std::nullopt;
+  }
+  std::array<uint8_t, 6> mac;
+  std::copy(bytes.begin(), bytes.end(), mac.begin());
+  return mac;
+}
+
+// The lower four bytes of the MAC, the
+// vendor prefix is the same for all of ours.
+uint32_t device_id()
+{
+  std::array<uint8_t, 6> mac;
+  esp_read_mac(mac.data(), ESP_MAC_WIFI_STA);
+  return uint32_t(mac[2]) << 24 | uint32_t(mac[3]) << 16 | uint32_t(mac[4]) << 8 | mac[5];
+}
+
+// The sender counts the age, we know the time.
+beehive::records::compact_record_t to_record(std::time_t now, uint32_t age, const beehive::lora::codec::readings_t& readings)
+{
+  beehive::records::compact_record_t record;
+  record.timestamp = uint32_t(now - age);
+  record.count = readings.count;
+  std::copy(readings.readings, readings.readings + readings.count, record.readings);
+  return record;
+}
+
+// Time on air in us, for the modem settings SX1276 uses:
+// SF7, 125kHz bandwidth, 4/5 coding rate, 8 symbols
+// preamble, explicit header and payload CRC. See the
+// SX1276 datasheet, 4.1.1.7.
+uint32_t airtime(size_t packet_size)
+{
+  const int sf = 7;
+  const int coding_rate = 1;
+  const double symbol_time = double(1 << sf) / 125000 * 1e6;
+  const auto payload_symbols = 8 + std::max(
+    int(std::ceil((8.0 * packet_size - 4 * sf + 28 + 16) / (4 * sf))) * (coding_rate + 4),
+    0);
+  return uint32_t((8 + 4.25 + payload_symbols) * symbol_time);
+}
 
 }
 
 namespace beehive::lora {
 
+namespace {
+
+// Cycles kept for retransmission, older ones are
+// read back from the card once the link is back.
+const size_t MAX_UNACKED = 64;
+const size_t BACKFILL_CYCLES = 8;
+// Packets per window, so an outage doesn't
+// turn into a burst of airtime.
+const size_t WINDOW_PACKETS = 4;
+// The base station acks right after decoding
+const int64_t ACK_TIMEOUT_MS = 500;
+const auto FORWARD_TASK_STACK = 8192;
+// Backfilling reads the card from this task
+const auto ARQ_TASK_STACK = 8192;
+// Beyond that, the closest ranges get merged, and
+// we might send a few suppressed cycles.
+const size_t MAX_EVICTED_RANGES = 128;
+
+} // namespace
+
 bool is_field_device()
 {
   std::array<uint8_t, 6> mac;
   esp_read_mac(mac.data(), ESP_MAC_WIFI_STA);
+  // Listing every hive of an apiary doesn't scale
+  static const auto base_mac = base_station_mac();
+  if(base_mac)
+  {
+    return mac != *base_mac;
+  }
   for(const auto& field_mac : LORA_SENDER_MACS)
   {
     if(field_mac == mac)
@@ -44,7 +128,8 @@ bool is_field_device()
 
 
 LoRaLink::LoRaLink()
-  : _lora(VSPI_HOST, LORA_CS, LORA_SCLK, LORA_MOSI, LORA_MISO, LORA_SPI_SPEED, LORA_DI0, beehive::appstate::lora_dbm())
+  : _lora(VSPI_HOST, LORA_CS, LORA_SCLK, LORA_MOSI, LORA_MISO, LORA_SPI_SPEED, LORA_DI0, LORA_RST, beehive::appstate::lora_dbm())
+  , _power(int(beehive::appstate::lora_dbm()))
 {
   // Set our own custom syncword (BEeehive)
   _lora.sync_word(0xBE);
@@ -57,9 +142,16 @@ LoRaLink::~LoRaLink()
 }
 
 
-void LoRaLink::setup_field_work(size_t sequence_num)
+void LoRaLink::setup_field_work(beehive::sdcard::SDCardWriter& sdcard)
 {
-  _sequence_num = sequence_num;
+  // Our sequence numbers are the ones on the card,
+  // so we can backfill from it.
+  _sdcard = &sdcard;
+  _sequence_num = sdcard.total_datasets_written();
+  _device_id = device_id();
+  _epoch = uint16_t(esp_random());
+  _cycles = std::make_unique<cycle_ring_t>();
+  xTaskCreate(LoRaLink::s_arq_task, "lora-arq", ARQ_TASK_STACK, this, uxTaskPriorityGet(NULL), &_arq_task);
   ESP_ERROR_CHECK(esp_event_handler_instance_register(
                     SENSOR_EVENTS,
                     beehive::events::sensors::SHT3XDIS_READINGS,
@@ -81,42 +173,404 @@ void LoRaLink::sensor_event_handler(
     esp_event_base_t base, beehive::events::sensors::sensor_events_t id,
     void *event_data)
 {
-  const auto readings = beehive::events::sensors::receive_readings(id, event_data);
-  if (readings) {
-    ESP_LOGD(TAG, "Received sensor message, creating LoRa Message");
-    ++_sequence_num;
-    size_t offset = 0;
-    // We have a current maximum of 8 sensors with 6 bytes of information
-    // in total. So we should be safe to carry these + some protocol overhead.
-    std::array<uint8_t, 128> data; // Currently a hard limit instead of FIFO size
-    std::copy(&_sequence_num, &_sequence_num + sizeof(_sequence_num), data.data() + offset);
-    offset += sizeof(_sequence_num);
-    data[offset++] = 1; // Running number
-    data[offset++] = readings->size();
-    for(const auto& reading : *readings)
-    {
-      data[offset++] = reading.busno;
-      data[offset++] = reading.address;
-      data[offset++] = reading.raw_humidity & 0xff;
-      data[offset++] = reading.raw_humidity >> 8;
-      data[offset++] = reading.raw_temperature & 0xff;
-      data[offset++] = reading.raw_temperature >> 8;
-    }
-    _lora.send(data.data(), offset, 10000);
+  auto readings = beehive::events::sensors::receive_readings(id, event_data);
+  if(!readings)
+  {
+    return;
+  }
+  // The card counts every reading, suppressed or not
+  const auto sequence = uint32_t(++_sequence_num);
+  // Airtime is what we are short of, so stable
+  // sensors are only sent with their heartbeat.
+  beehive::reporting::filter(beehive::reporting::LORA, std::time(nullptr), *readings);
+  if(readings->empty())
+  {
+    ESP_LOGD(TAG, "No reading moved beyond the deadband, not sending");
+    return;
+  }
+  auto cycle = _cycles->producer_slot();
+  if(!cycle)
+  {
+    ++_overruns;
+    ESP_LOGE(TAG, "Sending can't keep up, cycle %u stays on the card, %i overruns", unsigned(sequence), int(_overruns));
+    return;
+  }
+  cycle->sequence = sequence;
+  cycle->taken_at = esp_timer_get_time();
+  cycle->sends = 0;
+  cycle->readings.count = uint8_t(std::min(readings->size(), beehive::records::MAX_SENSORS));
+  for(size_t i = 0; i < cycle->readings.count; ++i)
+  {
+    const auto& reading = (*readings)[i];
+    cycle->readings.readings[i] = {
+      reading.busno, reading.address,
+      reading.raw_humidity, reading.raw_temperature
+    };
+  }
+  _cycles->publish();
+  xTaskNotifyGive(_arq_task);
+}
+
+void LoRaLink::s_arq_task(void* user_data)
+{
+  static_cast<LoRaLink*>(user_data)->arq_task();
+}
+
+void LoRaLink::arq_task()
+{
+  while(true)
+  {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    if(_reconfigure.exchange(false))
+    {
+      // The policy stays below it
+      _power.set_ceiling(int(beehive::appstate::lora_dbm()));
+      apply_power();
+    }
+    for(auto cycle = _cycles->consumer_slot(); cycle; cycle = _cycles->consumer_slot())
+    {
+      const auto taken = *cycle;
+      _cycles->release();
+      add_cycle(taken);
+    }
+  }
+}
+
+void LoRaLink::add_cycle(const cycle_t& cycle)
+{
+  ESP_LOGD(TAG, "Collecting cycle %i", int(_fresh + 1));
+  if(_unacked.size() == MAX_UNACKED)
+  {
+    evict();
+  }
+  // Every packet pays for preamble and header, so we
+  // fill it up to the FIFO before we send. The age is
+  // estimated, the encoder knows the exact size.
+  const auto size = codec::cycle_size(1, beehive::appstate::sleeptime() * beehive::appstate::batch_size(), cycle.readings);
+  if(codec::HEADER_SIZE + codec::CYCLES_PREFIX_SIZE + _fresh_size + size + codec::CRC_SIZE > codec::MAX_PACKET_SIZE)
+  {
+    send_window();
+  }
+  _unacked.push_back(cycle);
+  ++_fresh;
+  _fresh_size += size;
+  if(_fresh >= beehive::appstate::batch_size())
+  {
+    send_window();
+  }
+}
+
+void LoRaLink::evict()
+{
+  const auto sequence = _unacked.front().sequence;
+  _unacked.pop_front();
+  if(!_sdcard || !_sdcard->available())
+  {
+    ESP_LOGE(TAG, "No card to backfill from, cycle %u is lost", unsigned(sequence));
+    beehive::reporting::forget(beehive::reporting::LORA);
+    return;
+  }
+  // Mostly the newest, but backfilled cycles
+  // can get evicted again.
+  auto range = std::lower_bound(
+    _evicted.begin(), _evicted.end(), sequence,
+    [](const std::pair<uint32_t, uint32_t>& r, uint32_t sequence) { return r.second < sequence; });
+  if(range != _evicted.end() && range->first <= sequence)
+  {
+    return;
+  }
+  if(range != _evicted.begin() && std::prev(range)->second + 1 == sequence)
+  {
+    std::prev(range)->second = sequence;
+    if(range != _evicted.end() && range->first == sequence + 1)
+    {
+      std::prev(range)->second = range->second;
+      _evicted.erase(range);
+    }
+  }
+  else if(range != _evicted.end() && range->first == sequence + 1)
+  {
+    range->first = sequence;
+  }
+  else
+  {
+    _evicted.insert(range, { sequence, sequence });
+  }
+  if(_evicted.size() > MAX_EVICTED_RANGES)
+  {
+    size_t closest = 0;
+    for(size_t i = 1; i + 1 < _evicted.size(); ++i)
+    {
+      if(_evicted[i + 1].first - _evicted[i].second < _evicted[closest + 1].first - _evicted[closest].second)
+      {
+        closest = i;
+      }
+    }
+    _evicted[closest].second = _evicted[closest + 1].second;
+    _evicted.erase(_evicted.begin() + closest + 1);
+  }
+}
+
+void LoRaLink::trim_evicted(uint32_t sequence)
+{
+  auto range = _evicted.begin();
+  while(range != _evicted.end() && range->second <= sequence)
+  {
+    ++range;
+  }
+  _evicted.erase(_evicted.begin(), range);
+  if(!_evicted.empty() && _evicted.front().first <= sequence)
+  {
+    _evicted.front().first = sequence + 1;
+  }
+}
+
+void LoRaLink::backfill()
+{
+  if(_evicted.empty() || !_link_up || _unacked.size() + BACKFILL_CYCLES > MAX_UNACKED)
+  {
+    return;
+  }
+  const auto now = esp_timer_get_time();
+  const auto time = std::time(nullptr);
+  const auto last = _evicted.back().second;
+  auto range = _evicted.cbegin();
+  // The card is read up to here
+  auto scanned = _evicted.front().first - 1;
+  auto stopped = false;
+  std::vector<cycle_t> cycles;
+  _sdcard->read_since(
+    scanned,
+    [&](const char* line, size_t len) {
+      const auto stored = beehive::sdcard::SDCardWriter::parse_record(line, len);
+      if(!stored)
+      {
+        return true;
+      }
+      const auto sequence = uint32_t(stored->sequence);
+      if(sequence > last)
+      {
+        return false;
+      }
+      scanned = sequence;
+      while(range->second < sequence)
+      {
+        ++range;
+      }
+      // Acked, or suppressed by the deadband
+      if(sequence < range->first)
+      {
+        return true;
+      }
+      cycle_t cycle;
+      cycle.sequence = sequence;
+      cycle.taken_at = now - int64_t(time - stored->record.timestamp) * 1000000;
+      cycle.sends = 0;
+      cycle.readings.count = stored->record.count;
+      std::copy(stored->record.readings, stored->record.readings + stored->record.count, cycle.readings.readings);
+      cycles.push_back(cycle);
+      stopped = cycles.size() == BACKFILL_CYCLES;
+      return !stopped;
+    });
+  // What isn't on the card can't be sent
+  trim_evicted(stopped ? scanned : last);
+  // They are older than what we hold, mostly
+  for(const auto& cycle : cycles)
+  {
+    const auto pos = std::lower_bound(
+      _unacked.begin(), _unacked.end(), cycle.sequence,
+      [](const cycle_t& c, uint32_t sequence) { return c.sequence < sequence; });
+    if(pos == _unacked.end() || pos->sequence != cycle.sequence)
+    {
+      _unacked.insert(pos, cycle);
+    }
+  }
+  ESP_LOGI(TAG, "Backfilled %i cycles from the card, %i ranges to go", int(cycles.size()), int(_evicted.size()));
+}
+
+void LoRaLink::send_window()
+{
+  backfill();
+  // Oldest first. Acks remove cycles while we go,
+  // so we keep our place by sequence number.
+  uint32_t next = 0;
+  size_t packets = 0;
+  while(packets < WINDOW_PACKETS)
+  {
+    auto cycle = std::lower_bound(
+      _unacked.begin(), _unacked.end(), next,
+      [](const cycle_t& c, uint32_t sequence) { return c.sequence < sequence; });
+    if(cycle == _unacked.end())
+    {
+      break;
+    }
+    const auto now = esp_timer_get_time();
+    std::array<uint8_t, codec::MAX_PACKET_SIZE> data;
+    codec::CyclesEncoder encoder(_device_id, { uint8_t(_power.dbm()), _epoch }, data.data(), data.size());
+    size_t readings = 0;
+    for(; cycle != _unacked.end(); ++cycle)
+    {
+      const auto age = uint32_t((now - cycle->taken_at) / 1000000);
+      if(!encoder.add(cycle->sequence, age, cycle->readings))
+      {
+        break;
+      }
+      if(cycle->sends++)
+      {
+        ++_retries;
+      }
+      readings += cycle->readings.count;
+      next = cycle->sequence + 1;
+    }
+    if(!encoder.count())
+    {
+      // Can't happen with MAX_SENSORS readings per cycle
+      ESP_LOGE(TAG, "Dropping cycle that doesn't fit into a packet");
+      next = cycle->sequence + 1;
+      _unacked.erase(cycle);
+      continue;
+    }
+    const auto size = encoder.finish();
+    _lora.send(data.data(), size, 10000);
     ++_package_count;
-    beehive::events::lora::send_stats(_package_count, _malformed_package_count);
+    ++packets;
+    count_airtime(size, readings);
+    ESP_LOGI(TAG, "Sent %i cycles, %i readings in %i bytes", int(encoder.count()), int(readings), int(size));
+    _link_up = await_ack();
+    if(!_link_up)
+    {
+      if(_power.missed())
+      {
+        apply_power();
+      }
+      // The rest waits for the next window
+      break;
+    }
   }
+  _fresh = 0;
+  _fresh_size = 0;
+  ESP_LOGI(TAG, "Window done, %i unacked, %i retries, loss %i%%",
+           int(_unacked.size()), int(_retries),
+           int(100 * (_package_count - _acked_packets) / std::max<size_t>(_package_count, 1)));
+  send_stats();
 }
 
-void LoRaLink::run_base_work()
+bool LoRaLink::await_ack()
 {
-  using namespace beehive::events::sensors;
-  using namespace deets::i2c::sht3xdis;
+  const auto deadline = esp_timer_get_time() + ACK_TIMEOUT_MS * 1000;
+  while(true)
+  {
+    const auto remaining = int((deadline - esp_timer_get_time()) / 1000);
+    if(remaining <= 0)
+    {
+      return false;
+    }
+    SX1276::buffer_t data;
+    const auto received = _lora.recv(data, remaining);
+    // Corrupt, the deadline decides
+    if(received == 0)
+    {
+      continue;
+    }
+    codec::header_t header;
+    const uint8_t* body;
+    size_t body_len;
+    // Other field devices are on the same channel
+    if(codec::open(data.data(), received, header, body, body_len) != codec::OK
+       || header.type != codec::ACK
+       || header.device_id != _device_id)
+    {
+      continue;
+    }
+    const auto now = esp_timer_get_time();
+    codec::link_t link;
+    const auto status = codec::decode_ack(
+      body, body_len, link,
+      [&](uint32_t first, uint8_t count) {
+        acknowledged(first, count, now);
+      });
+    if(status == codec::OK)
+    {
+      ++_acked_packets;
+      _link = link;
+      if(_power.acknowledged(link.snr))
+      {
+        apply_power();
+      }
+      return true;
+    }
+  }
+}
+
+void LoRaLink::acknowledged(uint32_t first, uint8_t count, int64_t now)
+{
+  auto cycle = std::lower_bound(
+    _unacked.begin(), _unacked.end(), first,
+    [](const cycle_t& c, uint32_t sequence) { return c.sequence < sequence; });
+  while(cycle != _unacked.end() && cycle->sequence - first < count)
+  {
+    _delivery_latency.record(uint32_t((now - cycle->taken_at) / 1000));
+    cycle = _unacked.erase(cycle);
+  }
+}
+
+void LoRaLink::apply_power()
+{
+  _lora.tx_power(_power.dbm());
+  ESP_LOGI(TAG, "Transmitting with %idBm, the base station got %idBm at %.2fdB SNR",
+           _power.dbm(), int(_link.rssi), _link.snr / 4.0);
+}
+
+void LoRaLink::count_airtime(size_t packet_size, size_t readings)
+{
+  _airtime += airtime(packet_size);
+  _airtime_readings += readings;
+}
 
+void LoRaLink::send_stats()
+{
+  beehive::events::lora::lora_stats_t stats = {
+    _package_count,
+    _malformed_package_count,
+    _airtime_readings ? uint32_t(_airtime / _airtime_readings) : 0,
+    _retries,
+    _acked_packets,
+    _unacked.size(),
+    _delivery_latency.percentile(50),
+    _delivery_latency.percentile(90),
+    _delivery_latency.max(),
+    _overruns,
+    _mqtt ? _mqtt->relay_latency().percentile(50) : 0,
+    _mqtt ? _mqtt->relay_latency().percentile(90) : 0,
+    _mqtt ? _mqtt->relay_latency().max() : 0,
+    _devices ? _devices->size() : 0,
+    _duplicates,
+    uint32_t(_power.dbm()),
+    _link.rssi,
+    _link.snr
+  };
+  beehive::events::lora::send_stats(stats);
+}
+
+void LoRaLink::run_base_work()
+{
+  _frames = std::make_unique<frame_ring_t>();
+  _devices = std::make_unique<DeviceTable<64>>();
+  xTaskCreate(LoRaLink::s_forward_task, "lora-forward", FORWARD_TASK_STACK, this, uxTaskPriorityGet(NULL), &_forward_task);
+  // The DIO0 interrupt wakes us from recv. Reading
+  // the FIFO must not wait for MQTT, the card or the display, so
+  // this loop only timestamps, acks and queues the packets.
+  vTaskPrioritySet(NULL, uxTaskPriorityGet(NULL) + 1);
   while(true)
   {
-    std::array<uint8_t, RF95::FIFO_SIZE> data;
+    SX1276::buffer_t data;
     const auto bytes_received = _lora.recv(data);
+    const auto received_at = esp_timer_get_time();
+    // The radio keeps them until the next packet
+    const codec::link_t link = {
+      int16_t(_lora.packet_rssi()),
+      int8_t(std::lround(_lora.packet_snr() * 4))
+    };
 
     // No bytes means stray package or something similar
     if(bytes_received == 0)
@@ -124,58 +578,216 @@ void LoRaLink::run_base_work()
       continue;
     }
     ++_package_count;
-    // Sanity check our packet
-    auto valid = false;
-    if(bytes_received >= 6)
+    auto frame = _frames->producer_slot();
+    if(!frame)
     {
-      const auto readings_count = data[5];
-      // 6 bytes preamble with seq_no, running no and then
-      // 6 bytes per reading
-      valid = bytes_received == 6 + 6 * readings_count;
+      // Without an ack the field device sends it again
+      ++_overruns;
+      ESP_LOGW(TAG, "Forwarding can't keep up, dropped package, %i overruns", int(_overruns));
+      continue;
     }
+    frame->received_at = received_at;
+    frame->link = link;
+    frame->length = bytes_received;
+    std::copy(data.begin(), data.begin() + bytes_received, frame->data.begin());
+    acknowledge_frame(*frame);
+    _frames->publish();
+    xTaskNotifyGive(_forward_task);
+  }
+}
+
+void LoRaLink::acknowledge_frame(const received_frame_t& frame)
+{
+  codec::header_t header;
+  const uint8_t* body;
+  size_t body_len;
+  if(codec::open(frame.data.data(), frame.length, header, body, body_len) != codec::OK
+     || header.type != codec::CYCLES)
+  {
+    return;
+  }
+  std::array<uint32_t, codec::MAX_CYCLES> sequences;
+  size_t count = 0;
+  codec::sender_t sender;
+  const auto status = codec::decode_cycles(
+    header.sequence, body, body_len, sender,
+    [&](uint32_t sequence, uint32_t, const codec::readings_t&) {
+      sequences[count++] = sequence;
+    });
+  if(status == codec::OK)
+  {
+    send_ack(header.device_id, frame.link, sequences.data(), count);
+  }
+}
 
-    if(valid)
+void LoRaLink::s_forward_task(void* user_data)
+{
+  static_cast<LoRaLink*>(user_data)->forward_task();
+}
+
+void LoRaLink::forward_task()
+{
+  std::vector<beehive::events::lora::relayed_t> relayed;
+  while(true)
+  {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    // Whatever piled up goes out as one batch per device
+    relayed.clear();
+    auto decoded = false;
+    for(auto frame = _frames->consumer_slot(); frame; frame = _frames->consumer_slot())
+    {
+      decoded |= decode_frame(*frame, relayed);
+      _frames->release();
+    }
+    if(decoded)
     {
-      // I can't use the following, but have to do this using the
-      // awkward for loop. If not the CPU pukes with some memory
-      // alignment issue.
-      //std::copy(data.data(), data.data() + sizeof(_sequence_num), &_sequence_num);
-      size_t sno = 0;
-      for(size_t i=0; i < 4; ++i)
-      {
-        sno |= data[i] << i;
-      }
-      _sequence_num = sno;
-      //const auto running_number = data[4];
-      const auto readings_count = data[5];
-      size_t base_offset = 6;
-      std::vector<sht3xdis_value_t> readings(readings_count);
-      for(size_t i=0; i < readings_count; ++i)
-      {
-        const auto offset = base_offset + i * 6;
-        sht3xdis_value_t reading;
-        reading.busno = data[offset];
-        reading.address = data[offset + 1];
-        reading.raw_humidity = data[offset + 2] | (data[offset + 3] << 8);
-        reading.raw_temperature = data[offset + 4] | (data[offset + 5] << 8);
-        reading.humidity = SHT3XDIS::raw2humidity(reading.raw_humidity);
-        reading.temperature = SHT3XDIS::raw2humidity(reading.raw_temperature);
-        readings[i] = reading;
-      }
-      ESP_LOGI(TAG, "Received sensor readings, s-no: %d, readings: %d", _sequence_num, readings_count);
       if(!_mqtt)
       {
         _mqtt = std::unique_ptr<beehive::mqtt::MQTTClient>(new beehive::mqtt::MQTTClient(_sequence_num));
+        _mqtt->connect();
       }
-      beehive::events::sensors::send_readings(readings);
+      for(const auto& sender : relayed)
+      {
+        if(!sender.records.empty())
+        {
+          beehive::events::lora::send_relayed(sender);
+        }
+        const auto device = _devices->find(sender.device_id);
+        if(device)
+        {
+          beehive::events::lora::send_link({
+              device->device_id(),
+              device->tx_power(),
+              device->link().rssi,
+              device->link().snr,
+              device->packets(),
+              device->cycles(),
+              device->duplicates(),
+              device->late()
+            });
+        }
+      }
+    }
+    send_stats();
+  }
+}
+
+bool LoRaLink::decode_frame(const received_frame_t& frame, std::vector<beehive::events::lora::relayed_t>& relayed)
+{
+  using beehive::events::lora::relayed_t;
+  const auto malformed = [&](codec::status_t status) {
+    ++_malformed_package_count;
+    ESP_LOGE(TAG, "Received malformed package no %d, bytes received: %d, %s", int(_malformed_package_count), int(frame.length), codec::describe(status));
+    return false;
+  };
+  codec::header_t header;
+  const uint8_t* body;
+  size_t body_len;
+  auto status = codec::open(frame.data.data(), frame.length, header, body, body_len);
+  if(status != codec::OK)
+  {
+    return malformed(status);
+  }
+  auto sender = std::find_if(
+    relayed.begin(), relayed.end(),
+    [&](const relayed_t& r) { return r.device_id == header.device_id; });
+  if(sender == relayed.end())
+  {
+    sender = relayed.insert(relayed.end(), { header.device_id, frame.received_at, {} });
+  }
+  auto& records = sender->records;
+  const auto first = records.size();
+  size_t readings_count = 0;
+  // Single readings don't tell
+  std::optional<codec::sender_t> cycles_sender;
+  // The time of reception, not of decoding
+  const auto received = std::time(nullptr) - std::time_t((esp_timer_get_time() - frame.received_at) / 1000000);
+  switch(header.type)
+  {
+  case codec::READINGS:
+    {
+      codec::readings_t readings;
+      status = codec::decode_readings(body, body_len, readings);
+      records.push_back({ header.sequence, to_record(received, 0, readings) });
+      readings_count += readings.count;
+    }
+    break;
+  case codec::CYCLES:
+    cycles_sender.emplace();
+    status = codec::decode_cycles(
+      header.sequence, body, body_len, *cycles_sender,
+      [&](uint32_t sequence, uint32_t age, const codec::readings_t& readings) {
+        records.push_back({ sequence, to_record(received, age, readings) });
+        readings_count += readings.count;
+      });
+    break;
+  default:
+    status = codec::BAD_TYPE;
+  }
+  if(status != codec::OK)
+  {
+    records.resize(first);
+    return malformed(status);
+  }
+  count_airtime(frame.length, readings_count);
+  const auto count = records.size() - first;
+  _link = frame.link;
+
+  auto device = _devices->find(header.device_id);
+  if(!device)
+  {
+    // Still forwarded, we just can't tell duplicates
+    ESP_LOGW(TAG, "Serving %i devices already, not tracking %08x", int(_devices->size()), unsigned(header.device_id));
+    return true;
+  }
+  device->received(frame.received_at, frame.link, cycles_sender ? cycles_sender->tx_power : 0);
+  if(cycles_sender && device->restarted(cycles_sender->epoch))
+  {
+    ESP_LOGW(TAG, "%08x restarted, its sequence numbers start over", unsigned(header.device_id));
+  }
+  // Drops the cycles we forwarded already, the field
+  // device sent them again because our ack got lost.
+  auto kept = first;
+  for(auto i = first; i < records.size(); ++i)
+  {
+    if(device->accept(records[i].sequence))
+    {
+      records[kept++] = records[i];
     }
     else
     {
-      ++_malformed_package_count;
-      ESP_LOGE(TAG, "Received malformed package no %d, bytes received: %d", _malformed_package_count, bytes_received);
+      ++_duplicates;
     }
-    beehive::events::lora::send_stats(_package_count, _malformed_package_count);
   }
+  records.resize(kept);
+  ESP_LOGI(TAG, "Received %i cycles from %08x at %idBm, %.2fdB SNR, %i new, s-no: %d, readings: %d, packets: %d, duplicates: %d, late: %d",
+           int(count), unsigned(header.device_id), int(frame.link.rssi), frame.link.snr / 4.0, int(kept - first),
+           int(device->highest()), int(readings_count),
+           int(device->packets()), int(device->duplicates()), int(device->late()));
+  return true;
+}
+
+void LoRaLink::send_ack(uint32_t device_id, const codec::link_t& link, const uint32_t* sequences, size_t count)
+{
+  std::array<codec::ack_range_t, codec::MAX_ACK_RANGES> ranges;
+  size_t range_count = 0;
+  for(size_t i = 0; i < count; ++i)
+  {
+    const auto sequence = sequences[i];
+    auto& range = ranges[range_count ? range_count - 1 : 0];
+    if(range_count && sequence == range.first + range.count && range.count < UINT8_MAX)
+    {
+      ++range.count;
+    }
+    else if(range_count < ranges.size())
+    {
+      ranges[range_count++] = { sequence, 1 };
+    }
+    // Anything beyond gets retransmitted
+  }
+  std::array<uint8_t, codec::MAX_PACKET_SIZE> data;
+  const auto size = codec::encode_ack(device_id, link, ranges.data(), range_count, data.data(), data.size());
+  _lora.send(data.data(), size, 1000);
 }
 
 void LoRaLink::s_config_event_handler(void *handler_args,
@@ -188,17 +800,22 @@ void LoRaLink::s_config_event_handler(void *handler_args,
 
 void LoRaLink::config_event_handler(esp_event_base_t base, beehive::events::config::config_events_t id, void* event_data)
 {
-  switch(id)
+  using namespace beehive::events::config;
+  if(!(updated_settings(id, event_data) & (1u << LORA_DBM)))
   {
-  case beehive::events::config::LORA_DBM:
-    _lora.tx_power((int)*(uint32_t*)event_data);
-    break;
-    // All ignored
-  case beehive::events::config::SLEEPTIME:
-  case beehive::events::config::MQTT_HOST:
-  case beehive::events::config::SYSTEM_NAME:
-    break;
+    // All others ignored
+    return;
+  }
+  if(_arq_task)
+  {
+    // The power control belongs to it
+    _reconfigure = true;
+    xTaskNotifyGive(_arq_task);
+    return;
   }
+  // The policy stays below it
+  _power.set_ceiling(int(beehive::appstate::lora_dbm()));
+  apply_power();
 }
 
 } // namespace beehive::lora
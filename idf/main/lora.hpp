@@ -3,12 +3,25 @@
 #pragma once
 #ifdef USE_LORA
 
-#include "rf95.hpp"
 #include "beehive_events.hpp"
+#include "histogram.hpp"
+#include "lora_codec.hpp"
+#include "lora_devices.hpp"
+#include "lora_power.hpp"
+#include "spsc_ring.hpp"
+#include "sx1276.hpp"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
 
 #include <array>
+#include <atomic>
 #include <cinttypes>
+#include <deque>
 #include <memory>
+#include <optional>
+#include <utility>
+#include <vector>
 
 namespace beehive::mqtt {
 
@@ -16,6 +29,12 @@ class MQTTClient;
 
 };
 
+namespace beehive::sdcard {
+
+class SDCardWriter;
+
+};
+
 namespace beehive::lora {
 
 bool is_field_device();
@@ -26,7 +45,7 @@ public:
   LoRaLink();
   virtual ~LoRaLink();
 
-  void setup_field_work(size_t sequence_num);
+  void setup_field_work(beehive::sdcard::SDCardWriter&);
   void run_base_work();
 
 private:
@@ -34,13 +53,109 @@ private:
   static void s_sensor_event_handler(void* handler_args, esp_event_base_t base, int32_t id, void* event_data);
   void sensor_event_handler(esp_event_base_t base, beehive::events::sensors::sensor_events_t id, void* event_data);
 
+  struct cycle_t
+  {
+    uint32_t sequence;
+    int64_t taken_at;
+    uint8_t sends;
+    codec::readings_t readings;
+  };
+
+  // Field device: waiting for acks takes seconds, so the
+  // event loop hands the cycles to a task of its own. All
+  // of the window below is only touched from there.
+  static void s_arq_task(void*);
+  void arq_task();
+  // Sends once the packet or the batch is full
+  void add_cycle(const cycle_t&);
+  // Sends the unacknowledged cycles in as few packets
+  // as possible, oldest first.
+  void send_window();
+  bool await_ack();
+  void acknowledged(uint32_t first, uint8_t count, int64_t now);
+  // Sets the transmit power the policy picked
+  void apply_power();
+  // Drops the oldest unacknowledged cycle, to be
+  // read back from the card later.
+  void evict();
+  void backfill();
+  // Forgets the evicted sequence numbers up to and
+  // including the given one.
+  void trim_evicted(uint32_t sequence);
+
+  // Base station: the receive loop puts the raw packets
+  // into a ring, the forward task decodes them.
+  struct received_frame_t
+  {
+    int64_t received_at;
+    codec::link_t link;
+    size_t length;
+    SX1276::buffer_t data;
+  };
+  using frame_ring_t = beehive::util::SPSCRing<received_frame_t, 16>;
+
+  void acknowledge_frame(const received_frame_t&);
+  void send_ack(uint32_t device_id, const codec::link_t&, const uint32_t* sequences, size_t count);
+  static void s_forward_task(void*);
+  void forward_task();
+  // Appends the new cycles of the frame to those of its
+  // sender, returns false if it's malformed.
+  bool decode_frame(const received_frame_t&, std::vector<beehive::events::lora::relayed_t>&);
+  // Accounts for a packet sent or received
+  void count_airtime(size_t packet_size, size_t readings);
+  void send_stats();
+
   static void s_config_event_handler(void* handler_args, esp_event_base_t base, int32_t id, void* event_data);
   void config_event_handler(esp_event_base_t base, beehive::events::config::config_events_t id, void* event_data);
 
-  RF95 _lora;
+  SX1276 _lora;
   size_t _sequence_num = 0;
-  size_t _package_count = 0;
-  size_t _malformed_package_count = 0;
+  uint32_t _device_id = 0;
+  // Tells the base station when we restarted
+  uint16_t _epoch = 0;
+  // Counted from the receive loop and the forward task
+  std::atomic<size_t> _package_count = 0;
+  std::atomic<size_t> _malformed_package_count = 0;
+  uint64_t _airtime = 0;
+  size_t _airtime_readings = 0;
+
+  // Field device: the cycles the base station hasn't
+  // acknowledged yet, ordered by sequence number. Of
+  // these, _fresh haven't been sent at all.
+  std::deque<cycle_t> _unacked;
+  size_t _fresh = 0;
+  size_t _fresh_size = 0;
+  // Evicted sequence numbers as [first, last], oldest first,
+  // still to be read back from the card. Only the evicted
+  // ones: those the deadband suppressed weren't sent in the
+  // first place, and acked ones don't need to be sent again.
+  std::vector<std::pair<uint32_t, uint32_t>> _evicted;
+  beehive::sdcard::SDCardWriter* _sdcard = nullptr;
+  // From the event loop to the ARQ task
+  using cycle_ring_t = beehive::util::SPSCRing<cycle_t, 16>;
+  std::unique_ptr<cycle_ring_t> _cycles;
+  TaskHandle_t _arq_task = nullptr;
+  std::atomic<bool> _reconfigure = false;
+  bool _link_up = false;
+  uint32_t _retries = 0;
+  uint32_t _acked_packets = 0;
+  // From taking the readings to their ack, in ms
+  beehive::util::LatencyHistogram _delivery_latency;
+  // The configured power is the ceiling
+  PowerControl _power;
+  // How the base station received our last packet, on
+  // the base station how we received the last one.
+  codec::link_t _link = {};
+
+  std::unique_ptr<frame_ring_t> _frames;
+  TaskHandle_t _forward_task = nullptr;
+  // Packets, on a field device cycles, dropped
+  // because the ring was full
+  std::atomic<uint32_t> _overruns = 0;
+  // The field devices we serve, only touched
+  // from the forward task
+  std::unique_ptr<DeviceTable<64>> _devices;
+  uint32_t _duplicates = 0;
 
   std::unique_ptr<beehive::mqtt::MQTTClient> _mqtt;
 };
@@ -0,0 +1,555 @@
+// Copyright: 2022, Diez B. Roggisch, Berlin, all rights reserved
+
+#pragma once
+
+#include "records.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+
+// The packets between field devices and the base station.
+// Every packet starts with the same header and ends with a
+// CRC over everything before it:
+//
+//   version type device_id:u32 sequence:u32 body crc:u16
+//
+// All multi byte values are little endian, independent of
+// the CPU. The body depends on the type, for READINGS it is
+//
+//   count (busno address raw_humidity:u16 raw_temperature:u16){count}
+//
+// CYCLES aggregates the readings of several sensor cycles.
+// The header carries the sequence number of the first one,
+// each cycle the difference to the previous one, as cycles
+// get retransmitted selectively:
+//
+//   tx_power epoch:u16 cycles (dsequence:var age:var count reading{count}){cycles}
+//
+// tx_power is the transmit power in dBm the packet was sent
+// with. epoch is picked at random on every boot of the
+// sender: one without a card starts its sequence numbers
+// over, and the receiver must not take them for ones it
+// has seen already. age is the number of seconds the cycle was taken
+// before the packet was sent, so the receiver can timestamp
+// it without the sender having a clock. Packets are split at
+// cycle boundaries, and with at most MAX_SENSORS readings a
+// cycle always fits, so every packet decodes on its own.
+//
+// ACK is the base station's answer to CYCLES, addressed
+// by the device id of the field device. It tells how the
+// packet was received, the negated RSSI in dBm and the SNR
+// in quarter dB, and lists the sequence numbers received:
+//
+//   -rssi snr:i8 ranges (first:u32 count:u8){ranges}
+//
+// var are LEB128 varints.
+//
+// Used on the device and on the host, so it must not
+// depend on anything ESP specific.
+namespace beehive::lora::codec {
+
+const uint8_t VERSION = 4;
+
+enum packet_type_t : uint8_t
+{
+  READINGS = 1,
+  CYCLES = 2,
+  ACK = 3,
+};
+
+const size_t HEADER_SIZE = 10;
+const size_t CRC_SIZE = 2;
+// tx_power, epoch and the cycle count
+const size_t CYCLES_PREFIX_SIZE = 4;
+// The SX1276 FIFO
+const size_t MAX_PACKET_SIZE = 255;
+const size_t READING_SIZE = 6;
+const size_t MAX_CYCLES = 255;
+const size_t MAX_ACK_RANGES = 16;
+
+enum status_t
+{
+  OK,
+  TRUNCATED,
+  BAD_CRC,
+  BAD_VERSION,
+  BAD_TYPE,
+  TOO_MANY_READINGS,
+  TRAILING_DATA,
+};
+
+inline const char* describe(status_t status)
+{
+  switch(status)
+  {
+  case OK: return "ok";
+  case TRUNCATED: return "truncated";
+  case BAD_CRC: return "bad crc";
+  case BAD_VERSION: return "bad version";
+  case BAD_TYPE: return "bad type";
+  case TOO_MANY_READINGS: return "too many readings";
+  case TRAILING_DATA: return "trailing data";
+  }
+  return "unknown";
+}
+
+struct header_t
+{
+  packet_type_t type;
+  uint32_t device_id;
+  uint32_t sequence;
+};
+
+struct ack_range_t
+{
+  uint32_t first;
+  uint8_t count;
+};
+
+// Who sent a CYCLES packet, besides the device id
+struct sender_t
+{
+  // dBm
+  uint8_t tx_power;
+  uint16_t epoch;
+};
+
+// How a packet was received
+struct link_t
+{
+  // dBm
+  int16_t rssi;
+  // quarter dB, as the SX1276 reports it
+  int8_t snr;
+};
+
+struct readings_t
+{
+  uint8_t count;
+  beehive::records::compact_reading_t readings[beehive::records::MAX_SENSORS];
+};
+
+inline size_t varint_size(uint32_t value)
+{
+  size_t size = 1;
+  for(; value >= 0x80; value >>= 7)
+  {
+    ++size;
+  }
+  return size;
+}
+
+// The bytes a cycle takes in a CYCLES body
+inline size_t cycle_size(uint32_t dsequence, uint32_t age, const readings_t& readings)
+{
+  return varint_size(dsequence) + varint_size(age) + 1 + READING_SIZE * readings.count;
+}
+
+// The most a cycle can take
+inline size_t max_cycle_size(const readings_t& readings)
+{
+  return cycle_size(UINT32_MAX, UINT32_MAX, readings);
+}
+
+// CRC-16/CCITT-FALSE. Nibble wise, so the table stays
+// small enough to not matter on the device.
+inline uint16_t crc16(const uint8_t* data, size_t len, uint16_t crc=0xffff)
+{
+  static const uint16_t TABLE[16] = {
+    0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50a5, 0x60c6, 0x70e7,
+    0x8108, 0x9129, 0xa14a, 0xb16b, 0xc18c, 0xd1ad, 0xe1ce, 0xf1ef,
+  };
+  for(size_t i = 0; i < len; ++i)
+  {
+    crc = uint16_t((crc << 4) ^ TABLE[(crc >> 12) ^ (data[i] >> 4)]);
+    crc = uint16_t((crc << 4) ^ TABLE[(crc >> 12) ^ (data[i] & 0x0f)]);
+  }
+  return crc;
+}
+
+// Appends little endian values to a buffer. Writes that
+// don't fit are dropped and mark the writer as overflowed.
+class Writer
+{
+public:
+  Writer(uint8_t* out, size_t capacity)
+    : _begin(out)
+    , _end(out + capacity)
+    , _p(out)
+  {
+  }
+
+  Writer& u8(uint8_t value)
+  {
+    if(reserve(1))
+    {
+      *_p++ = value;
+    }
+    return *this;
+  }
+
+  Writer& u16(uint16_t value)
+  {
+    return u8(uint8_t(value)).u8(uint8_t(value >> 8));
+  }
+
+  Writer& u32(uint32_t value)
+  {
+    return u16(uint16_t(value)).u16(uint16_t(value >> 16));
+  }
+
+  Writer& varint(uint32_t value)
+  {
+    for(; value >= 0x80; value >>= 7)
+    {
+      u8(uint8_t(value) | 0x80);
+    }
+    return u8(uint8_t(value));
+  }
+
+  const uint8_t* begin() const { return _begin; }
+  size_t size() const { return size_t(_p - _begin); }
+  bool overflowed() const { return _overflowed; }
+
+private:
+  bool reserve(size_t len)
+  {
+    if(_overflowed || size_t(_end - _p) < len)
+    {
+      _overflowed = true;
+      return false;
+    }
+    return true;
+  }
+
+  uint8_t* _begin;
+  uint8_t* _end;
+  uint8_t* _p;
+  bool _overflowed = false;
+};
+
+// Reads little endian values, every read checks the
+// bounds. Once one fails, all following ones do.
+class Reader
+{
+public:
+  Reader(const uint8_t* in, size_t len)
+    : _p(in)
+    , _end(in + len)
+  {
+  }
+
+  bool u8(uint8_t& value)
+  {
+    if(!_ok || _p == _end)
+    {
+      return _ok = false;
+    }
+    value = *_p++;
+    return true;
+  }
+
+  bool u16(uint16_t& value)
+  {
+    uint8_t lo, hi;
+    if(!u8(lo) || !u8(hi))
+    {
+      return false;
+    }
+    value = uint16_t(lo | (hi << 8));
+    return true;
+  }
+
+  bool u32(uint32_t& value)
+  {
+    uint16_t lo, hi;
+    if(!u16(lo) || !u16(hi))
+    {
+      return false;
+    }
+    value = uint32_t(lo) | (uint32_t(hi) << 16);
+    return true;
+  }
+
+  bool varint(uint32_t& value)
+  {
+    value = 0;
+    for(int shift = 0; shift < 35; shift += 7)
+    {
+      uint8_t byte;
+      if(!u8(byte))
+      {
+        return false;
+      }
+      value |= uint32_t(byte & 0x7f) << shift;
+      if(!(byte & 0x80))
+      {
+        return true;
+      }
+    }
+    return _ok = false;
+  }
+
+  size_t remaining() const { return size_t(_end - _p); }
+  bool ok() const { return _ok; }
+
+private:
+  const uint8_t* _p;
+  const uint8_t* _end;
+  bool _ok = true;
+};
+
+inline void write_header(Writer& writer, const header_t& header)
+{
+  writer.u8(VERSION).u8(header.type).u32(header.device_id).u32(header.sequence);
+}
+
+// Appends the CRC over everything written so far. Returns
+// the size of the packet, or 0 if it didn't fit.
+inline size_t finish(Writer& writer)
+{
+  writer.u16(crc16(writer.begin(), writer.size()));
+  return writer.overflowed() ? 0 : writer.size();
+}
+
+inline void write_readings(Writer& writer, const readings_t& readings)
+{
+  writer.u8(readings.count);
+  for(size_t i = 0; i < readings.count; ++i)
+  {
+    const auto& reading = readings.readings[i];
+    writer.u8(reading.busno).u8(reading.address).u16(reading.raw_humidity).u16(reading.raw_temperature);
+  }
+}
+
+inline size_t encode_readings(const header_t& header, const readings_t& readings, uint8_t* out, size_t capacity)
+{
+  if(readings.count > beehive::records::MAX_SENSORS)
+  {
+    return 0;
+  }
+  Writer writer(out, capacity);
+  write_header(writer, header);
+  write_readings(writer, readings);
+  return finish(writer);
+}
+
+// Packs cycles into a CYCLES packet until it's full
+class CyclesEncoder
+{
+public:
+  // The sequence in the header is the one of the first cycle
+  CyclesEncoder(uint32_t device_id, const sender_t& sender, uint8_t* out, size_t capacity)
+    : _out(out)
+    , _writer(out, capacity)
+    , _capacity(capacity)
+  {
+    write_header(_writer, { CYCLES, device_id, 0 });
+    // the count is patched by finish()
+    _writer.u8(sender.tx_power).u16(sender.epoch).u8(0);
+  }
+
+  // Returns false if the cycle doesn't fit anymore.
+  // Sequence numbers must be increasing.
+  bool add(uint32_t sequence, uint32_t age, const readings_t& readings)
+  {
+    if(_count == 0)
+    {
+      _first_sequence = _previous_sequence = sequence;
+    }
+    const auto dsequence = sequence - _previous_sequence;
+    if(_count == MAX_CYCLES
+       || readings.count > beehive::records::MAX_SENSORS
+       || _writer.size() + cycle_size(dsequence, age, readings) + CRC_SIZE > _capacity)
+    {
+      return false;
+    }
+    _writer.varint(dsequence).varint(age);
+    write_readings(_writer, readings);
+    _previous_sequence = sequence;
+    ++_count;
+    return true;
+  }
+
+  size_t count() const { return _count; }
+
+  // Returns the size of the packet
+  size_t finish()
+  {
+    Writer sequence(_out + 6, 4);
+    sequence.u32(_first_sequence);
+    _out[HEADER_SIZE + CYCLES_PREFIX_SIZE - 1] = uint8_t(_count);
+    return codec::finish(_writer);
+  }
+
+private:
+  uint8_t* _out;
+  Writer _writer;
+  size_t _capacity;
+  size_t _count = 0;
+  uint32_t _first_sequence = 0;
+  uint32_t _previous_sequence = 0;
+};
+
+inline size_t encode_ack(uint32_t device_id, const link_t& link, const ack_range_t* ranges, size_t count, uint8_t* out, size_t capacity)
+{
+  if(count > MAX_ACK_RANGES)
+  {
+    return 0;
+  }
+  Writer writer(out, capacity);
+  write_header(writer, { ACK, device_id, 0 });
+  // Weaker than -255dBm doesn't get decoded anyway
+  const auto rssi = link.rssi > 0 ? 0 : link.rssi < -255 ? 255 : -link.rssi;
+  writer.u8(uint8_t(rssi)).u8(uint8_t(link.snr));
+  writer.u8(uint8_t(count));
+  for(size_t i = 0; i < count; ++i)
+  {
+    writer.u32(ranges[i].first).u8(ranges[i].count);
+  }
+  return finish(writer);
+}
+
+// Checks the size, CRC and version of a packet and reads
+// its header. body and body_len are what's between header
+// and CRC.
+inline status_t open(const uint8_t* in, size_t len, header_t& header, const uint8_t*& body, size_t& body_len)
+{
+  if(len < HEADER_SIZE + CRC_SIZE)
+  {
+    return TRUNCATED;
+  }
+  const auto crc = uint16_t(in[len - 2] | (in[len - 1] << 8));
+  if(crc16(in, len - CRC_SIZE) != crc)
+  {
+    return BAD_CRC;
+  }
+  Reader reader(in, HEADER_SIZE);
+  uint8_t version, type;
+  reader.u8(version);
+  reader.u8(type);
+  reader.u32(header.device_id);
+  reader.u32(header.sequence);
+  if(version != VERSION)
+  {
+    return BAD_VERSION;
+  }
+  header.type = packet_type_t(type);
+  body = in + HEADER_SIZE;
+  body_len = len - HEADER_SIZE - CRC_SIZE;
+  return OK;
+}
+
+inline status_t read_readings(Reader& reader, readings_t& readings)
+{
+  if(!reader.u8(readings.count))
+  {
+    return TRUNCATED;
+  }
+  if(readings.count > beehive::records::MAX_SENSORS)
+  {
+    return TOO_MANY_READINGS;
+  }
+  for(size_t i = 0; i < readings.count; ++i)
+  {
+    auto& reading = readings.readings[i];
+    uint16_t raw_humidity = 0, raw_temperature = 0;
+    reader.u8(reading.busno);
+    reader.u8(reading.address);
+    reader.u16(raw_humidity);
+    reader.u16(raw_temperature);
+    // The reading is packed, so no references into it
+    reading.raw_humidity = raw_humidity;
+    reading.raw_temperature = raw_temperature;
+  }
+  return reader.ok() ? OK : TRUNCATED;
+}
+
+inline status_t decode_readings(const uint8_t* body, size_t body_len, readings_t& readings)
+{
+  Reader reader(body, body_len);
+  const auto status = read_readings(reader, readings);
+  if(status != OK)
+  {
+    return status;
+  }
+  return reader.remaining() ? TRAILING_DATA : OK;
+}
+
+// Calls callback(sequence, age, readings) for every cycle.
+// The body is validated completely before the first
+// call, so a corrupt packet delivers nothing.
+template<typename Callback>
+status_t decode_cycles(uint32_t first_sequence, const uint8_t* body, size_t body_len, sender_t& sender, Callback callback)
+{
+  for(auto deliver : { false, true })
+  {
+    Reader reader(body, body_len);
+    uint8_t cycles;
+    if(!reader.u8(sender.tx_power) || !reader.u16(sender.epoch) || !reader.u8(cycles))
+    {
+      return TRUNCATED;
+    }
+    auto sequence = first_sequence;
+    for(size_t i = 0; i < cycles; ++i)
+    {
+      uint32_t dsequence, age;
+      readings_t readings;
+      if(!reader.varint(dsequence) || !reader.varint(age))
+      {
+        return TRUNCATED;
+      }
+      const auto status = read_readings(reader, readings);
+      if(status != OK)
+      {
+        return status;
+      }
+      sequence += dsequence;
+      if(deliver)
+      {
+        callback(sequence, age, readings);
+      }
+    }
+    if(reader.remaining())
+    {
+      return TRAILING_DATA;
+    }
+  }
+  return OK;
+}
+
+// Calls callback(first, count) for every acknowledged range
+template<typename Callback>
+status_t decode_ack(const uint8_t* body, size_t body_len, link_t& link, Callback callback)
+{
+  for(auto deliver : { false, true })
+  {
+    Reader reader(body, body_len);
+    uint8_t rssi, snr, ranges;
+    if(!reader.u8(rssi) || !reader.u8(snr) || !reader.u8(ranges))
+    {
+      return TRUNCATED;
+    }
+    link = { int16_t(-rssi), int8_t(snr) };
+    for(size_t i = 0; i < ranges; ++i)
+    {
+      ack_range_t range;
+      if(!reader.u32(range.first) || !reader.u8(range.count))
+      {
+        return TRUNCATED;
+      }
+      if(deliver)
+      {
+        callback(range.first, range.count);
+      }
+    }
+    if(reader.remaining())
+    {
+      return TRAILING_DATA;
+    }
+  }
+  return OK;
+}
+
+} // namespace beehive::lora::codec
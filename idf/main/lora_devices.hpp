@@ -0,0 +1,205 @@
+// Copyright: 2022, Diez B. Roggisch, Berlin, all rights reserved
+
+#pragma once
+
+#include "lora_codec.hpp"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+namespace beehive::lora {
+
+// What the base station knows about a field device.
+class Device
+{
+public:
+  // Sequence numbers closer than this to the highest
+  // one are remembered, so their retransmissions can
+  // be recognised.
+  static const uint32_t WINDOW = 128;
+
+  Device() = default;
+  explicit Device(uint32_t device_id)
+    : _device_id(device_id)
+  {
+  }
+
+  // Returns false if the cycle was forwarded already, a
+  // retransmission because our ack got lost. Cycles older
+  // than the window are forwarded: they come back from
+  // the card of the field device, so they are most likely
+  // new to us.
+  bool accept(uint32_t sequence)
+  {
+    ++_cycles;
+    if(!_cycles_seen || int32_t(sequence - _highest) > 0)
+    {
+      const auto advance = _cycles_seen ? sequence - _highest : WINDOW;
+      for(uint32_t i = 1; i <= advance && i <= WINDOW; ++i)
+      {
+        clear(_highest + i);
+      }
+      _highest = sequence;
+      _cycles_seen = true;
+      mark(sequence);
+      return true;
+    }
+    ++_late;
+    if(_highest - sequence < WINDOW)
+    {
+      if(seen(sequence))
+      {
+        --_late;
+        ++_duplicates;
+        return false;
+      }
+      mark(sequence);
+    }
+    return true;
+  }
+
+  void received(int64_t now, const codec::link_t& link, uint8_t tx_power)
+  {
+    ++_packets;
+    _last_heard = now;
+    _link = link;
+    _tx_power = tx_power;
+  }
+
+  // Returns true if the device restarted since its last
+  // packet. Its sequence numbers start over then, so
+  // what we remember of the old ones is forgotten.
+  bool restarted(uint16_t epoch)
+  {
+    const auto restarted = _epoch_seen && epoch != _epoch;
+    _epoch = epoch;
+    _epoch_seen = true;
+    if(restarted)
+    {
+      ++_restarts;
+      _cycles_seen = false;
+      _seen = {};
+    }
+    return restarted;
+  }
+
+  uint32_t device_id() const { return _device_id; }
+  uint32_t highest() const { return _highest; }
+  uint32_t packets() const { return _packets; }
+  uint32_t cycles() const { return _cycles; }
+  // Cycles we had already, their ack got lost
+  uint32_t duplicates() const { return _duplicates; }
+  // Cycles that came in behind a later one, so their
+  // first transmission didn't reach us
+  uint32_t late() const { return _late; }
+  uint32_t restarts() const { return _restarts; }
+  int64_t last_heard() const { return _last_heard; }
+  // How we received its last packet, and the
+  // power it was sent with
+  const codec::link_t& link() const { return _link; }
+  uint8_t tx_power() const { return _tx_power; }
+
+private:
+  bool seen(uint32_t sequence) const
+  {
+    return _seen[(sequence % WINDOW) / 64] & (uint64_t(1) << (sequence % 64));
+  }
+
+  void mark(uint32_t sequence)
+  {
+    _seen[(sequence % WINDOW) / 64] |= uint64_t(1) << (sequence % 64);
+  }
+
+  void clear(uint32_t sequence)
+  {
+    _seen[(sequence % WINDOW) / 64] &= ~(uint64_t(1) << (sequence % 64));
+  }
+
+  uint32_t _device_id = 0;
+  uint32_t _highest = 0;
+  bool _cycles_seen = false;
+  // One bit per sequence number, modulo the window
+  std::array<uint64_t, WINDOW / 64> _seen = {};
+  uint32_t _packets = 0;
+  uint32_t _cycles = 0;
+  uint32_t _duplicates = 0;
+  uint32_t _late = 0;
+  uint16_t _epoch = 0;
+  bool _epoch_seen = false;
+  uint32_t _restarts = 0;
+  int64_t _last_heard = 0;
+  codec::link_t _link = {};
+  uint8_t _tx_power = 0;
+};
+
+// The field devices a base station serves, keyed by the
+// device id in the packet header. An open-addressed table
+// with linear probing, so looking up the sender of every
+// packet neither allocates nor walks a list. Devices are
+// never removed, and it's kept at most half full.
+template<size_t N>
+class DeviceTable
+{
+  static_assert(N && (N & (N - 1)) == 0, "N must be a power of two");
+public:
+  static const size_t CAPACITY = N / 2;
+
+  // The device, added on first contact. nullptr if we
+  // serve CAPACITY devices already.
+  Device* find(uint32_t device_id)
+  {
+    for(size_t probe = 0; probe < N; ++probe)
+    {
+      auto& slot = _slots[(hash(device_id) + probe) % N];
+      if(slot.used && slot.device.device_id() == device_id)
+      {
+        return &slot.device;
+      }
+      if(!slot.used)
+      {
+        if(_size == CAPACITY)
+        {
+          return nullptr;
+        }
+        slot = { true, Device(device_id) };
+        ++_size;
+        return &slot.device;
+      }
+    }
+    return nullptr;
+  }
+
+  template<typename Callback>
+  void for_each(Callback callback) const
+  {
+    for(const auto& slot : _slots)
+    {
+      if(slot.used)
+      {
+        callback(slot.device);
+      }
+    }
+  }
+
+  size_t size() const { return _size; }
+
+private:
+  struct slot_t
+  {
+    bool used;
+    Device device;
+  };
+
+  static size_t hash(uint32_t device_id)
+  {
+    // The ids are MAC bytes, devices of one batch
+    // only differ in a few bits.
+    return size_t((device_id * 2654435769u) >> 16);
+  }
+
+  std::array<slot_t, N> _slots = {};
+  size_t _size = 0;
+};
+
+} // namespace beehive::lora
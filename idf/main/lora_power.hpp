@@ -0,0 +1,101 @@
+// Copyright: 2022, Diez B. Roggisch, Berlin, all rights reserved
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+namespace beehive::lora {
+
+// Picks the lowest transmit power that keeps the link to
+// the base station reliable, from the SNR the base reports
+// for our packets. Like LoRaWAN's ADR: the best SNR of the
+// last HISTORY packets has to stay MARGIN above what SF7
+// still demodulates, every STEP dB beyond that we turn the
+// power down, every STEP dB below it up. Missing acks turn
+// it up right away.
+//
+// The spreading factor stays at SF7: it's the fastest
+// already, and the base station listens on one spreading
+// factor only.
+class PowerControl
+{
+public:
+  // The SX1276 PA_BOOST range
+  static const int MIN_DBM = 2;
+  static const int MAX_DBM = 20;
+  static const size_t HISTORY = 8;
+  // What SF7 still demodulates, and the margin for
+  // fading, both in quarter dB like the SNR
+  static const int REQUIRED_SNR = -30;
+  static const int MARGIN = 40;
+  static const int STEP = 3;
+  // Consecutive missing acks before we turn it up
+  static const size_t MISSES = 2;
+
+  // Starts at the ceiling, the configured power
+  explicit PowerControl(int ceiling)
+  {
+    set_ceiling(ceiling);
+  }
+
+  void set_ceiling(int ceiling)
+  {
+    _ceiling = std::clamp(ceiling, int(MIN_DBM), int(MAX_DBM));
+    change(std::min(_dbm, _ceiling) - _dbm);
+  }
+
+  // Returns true if the power changed
+  bool acknowledged(int8_t snr)
+  {
+    _misses = 0;
+    _snr[_samples++ % HISTORY] = snr;
+    if(_samples < HISTORY)
+    {
+      return false;
+    }
+    const auto best = *std::max_element(_snr.begin(), _snr.end());
+    const auto margin = (best - REQUIRED_SNR - MARGIN) / 4;
+    // Rounded towards zero, so we don't oscillate
+    // around the margin.
+    return change(-(margin / STEP) * STEP);
+  }
+
+  // Returns true if the power changed
+  bool missed()
+  {
+    if(++_misses < MISSES)
+    {
+      return false;
+    }
+    _misses = 0;
+    return change(STEP);
+  }
+
+  int dbm() const { return _dbm; }
+  int ceiling() const { return _ceiling; }
+
+private:
+  bool change(int delta)
+  {
+    const auto dbm = std::clamp(_dbm + delta, int(MIN_DBM), _ceiling);
+    if(dbm == _dbm)
+    {
+      return false;
+    }
+    _dbm = dbm;
+    // The SNR we have is the one of the old power
+    _samples = 0;
+    return true;
+  }
+
+  int _ceiling = MAX_DBM;
+  int _dbm = MAX_DBM;
+  std::array<int8_t, HISTORY> _snr = {};
+  size_t _samples = 0;
+  size_t _misses = 0;
+};
+
+} // namespace beehive::lora
@@ -7,12 +7,15 @@
 #include "mqtt.hpp"
 #include "sensors.hpp"
 #include "sdcard.hpp"
+#include "flashlog.hpp"
 #include "beehive_events.hpp"
 #include "beehive_http.hpp"
 #include "ota.hpp"
 #include "wifi-provisioning.hpp"
 #include "smartconfig.hpp"
 #include "appstate.hpp"
+#include "batch.hpp"
+#include "boot.hpp"
 #ifdef USE_LORA
 #include "lora.hpp"
 #endif
@@ -43,7 +46,13 @@ namespace {
 const int SDCARD_BIT = BIT0;
 const int MQTT_PUBLISHED_BIT = BIT1;
 const auto SLEEP_CONDITION_TIMEOUT = 30s;
-const auto NTP_TIMEOUT = 15;
+// With QoS 0 we are done once the TCP stack has the
+// messages, this gives WIFI the time to send them.
+const auto QOS0_SEND_GRACE = 20ms;
+const auto NTP_TIMEOUT = 15s;
+// Anything before is the RTC counting from 0
+// after a power loss.
+const time_t VALID_TIME = 1640995200; // 2022-01-01
 
 bool s_caffeine = false;
 
@@ -110,21 +119,26 @@ bool stay_awake()
 }
 
 
+void time_synced(struct timeval*)
+{
+  beehive::boot::mark(beehive::boot::TIME_VALID);
+}
+
+// Doesn't block, whoever needs the time waits
+// for boot::TIME_VALID.
 void start_ntp_service()
 {
   ESP_LOGI(TAG, "Acquire time using NTP");
+  // After deep sleep the RTC still has the time,
+  // NTP then only corrects the drift.
+  if(time(nullptr) >= VALID_TIME)
+  {
+    beehive::boot::mark(beehive::boot::TIME_VALID);
+  }
   sntp_setoperatingmode(SNTP_OPMODE_POLL);
   sntp_setservername(0, beehive::appstate::ntp_server());
+  sntp_set_time_sync_notification_cb(time_synced);
   sntp_init();
-  for(int i=0; i < NTP_TIMEOUT; ++i)
-  {
-    if(sntp_get_sync_status() == SNTP_SYNC_STATUS_COMPLETED)
-    {
-      return;
-    }
-    vTaskDelay(1000 / portTICK_PERIOD_MS);
-  }
-  ESP_LOGE(TAG, "Couldn't obtain NTP date!");
 }
 
 void start_mdns_service()
@@ -156,7 +170,31 @@ void start_mdns_service()
 }
 
 #ifndef USE_LORA
-void wait_or_sleep()
+// Must be set up before the sensors start, so
+// we don't miss their events.
+EventGroupHandle_t watch_sleep_conditions()
+{
+  auto event_group = xEventGroupCreate();
+  // The writer posts these once its queue is empty, after
+  // writing everything or failing to. Mounting or recovering
+  // says nothing about the readings still to come.
+  ESP_ERROR_CHECK(esp_event_handler_instance_register(
+                    SDCARD_EVENTS,
+                    beehive::events::sdcard::DATASET_WRITTEN,
+                    sdcard_event_handler, event_group, nullptr));
+  ESP_ERROR_CHECK(esp_event_handler_instance_register(
+                    SDCARD_EVENTS,
+                    beehive::events::sdcard::NO_FILE,
+                    sdcard_event_handler, event_group, nullptr));
+
+  ESP_ERROR_CHECK(esp_event_handler_instance_register(
+                    BEEHIVE_MQTT_EVENTS,
+                    beehive::events::mqtt::PUBLISHED,
+                    mqtt_event_handler, event_group, nullptr));
+  return event_group;
+}
+
+void wait_or_sleep(EventGroupHandle_t event_group)
 {
   beehive::appstate::promote_configuration();
 
@@ -166,21 +204,6 @@ void wait_or_sleep()
     {
       vTaskDelay(20000 / portTICK_PERIOD_MS);
     }
-    auto event_group = xEventGroupCreate();
-    // Any SDCard event means either we could successfully
-    // write *or* there was an unrecoverable error - so we
-    // don't discriminate and just set the bit always
-    ESP_ERROR_CHECK(esp_event_handler_instance_register(
-		      SDCARD_EVENTS,
-		      ESP_EVENT_ANY_ID,
-		      sdcard_event_handler, event_group, nullptr));
-
-    ESP_ERROR_CHECK(esp_event_handler_instance_register(
-		      BEEHIVE_MQTT_EVENTS,
-		      beehive::events::mqtt::PUBLISHED,
-		      mqtt_event_handler, event_group, nullptr));
-
-
     const auto bits = xEventGroupWaitBits(event_group, SDCARD_BIT | MQTT_PUBLISHED_BIT, pdTRUE, pdTRUE, (SLEEP_CONDITION_TIMEOUT / 1ms) / portTICK_PERIOD_MS);
     // the bits that arrived are still set! So even if we timeout,
     // some bits are set.
@@ -195,6 +218,12 @@ void wait_or_sleep()
     if(!stay_awake())
     {
       ESP_LOGI(TAG, "Sleeping for %i seconds", beehive::appstate::sleeptime());
+      if(beehive::appstate::mqtt_qos() == 0)
+      {
+        vTaskDelay((QOS0_SEND_GRACE / 1ms) / portTICK_PERIOD_MS);
+      }
+      beehive::boot::mark(beehive::boot::SLEEP);
+      beehive::boot::log_trace();
       esp_sleep_enable_timer_wakeup(std::chrono::seconds(beehive::appstate::sleeptime()) / 1us);
       esp_deep_sleep_start();
     }
@@ -243,8 +272,11 @@ void run_over_lora(deets::i2c::I2CHost &i2c_bus)
   if(beehive::lora::is_field_device())
   {
     sdcard::SDCardWriter sdcard_writer;
+    flashlog::FlashLog flash_log([&sdcard_writer]() { return sdcard_writer.available(); });
     beehive::http::HTTPServer http_server([&sdcard_writer]() { return sdcard_writer.file_count();});
-    lora.setup_field_work(sdcard_writer.total_datasets_written());
+    http_server.serve_flashlog(flash_log);
+    http_server.serve_sdcard(sdcard_writer);
+    lora.setup_field_work(sdcard_writer);
 
     beehive::sensors::Sensors sensors(i2c_bus);
 
@@ -272,17 +304,65 @@ void run_over_lora(deets::i2c::I2CHost &i2c_bus)
 
 #else // USE_LORA
 
+// When batching, most wakes only take a reading, put it
+// into RTC memory and go right back to sleep without ever
+// touching WIFI, MQTT or the SD card.
+void collect_into_batch(deets::i2c::I2CHost& i2c_bus)
+{
+  if(esp_sleep_get_wakeup_cause() != ESP_SLEEP_WAKEUP_TIMER || beehive::batch::flush_due())
+  {
+    return;
+  }
+  {
+    beehive::sensors::Sensors sensors(i2c_bus);
+    beehive::batch::push(time(nullptr), sensors.read());
+  }
+  ESP_LOGI(TAG, "Batched %i of %i, sleeping for %i seconds",
+           int(beehive::batch::size()), beehive::appstate::batch_size(), beehive::appstate::sleeptime());
+  esp_sleep_enable_timer_wakeup(std::chrono::seconds(beehive::appstate::sleeptime()) / 1us);
+  esp_deep_sleep_start();
+}
+
+// The sensors take several seconds, and so does getting
+// onto the network. So the acquisition starts first, and
+// runs while we connect. The MQTT client holds back the
+// readings until it is connected.
 void run_over_wifi(deets::i2c::I2CHost& i2c_bus)
 {
+  const auto sleep_conditions = watch_sleep_conditions();
   sdcard::SDCardWriter sdcard_writer;
+  // Without a card there is nothing to wait for
+  if(!sdcard_writer.available())
+  {
+    xEventGroupSetBits(sleep_conditions, SDCARD_BIT);
+  }
+  // Registered after the SD card, so it knows if the
+  // card could take the readings.
+  flashlog::FlashLog flash_log([&sdcard_writer]() { return sdcard_writer.available(); });
   // We pass the total_datasets_written as sequence number to start
   // from
   mqtt::MQTTClient mqtt_client(sdcard_writer.total_datasets_written());
+  if(sdcard_writer.available())
+  {
+    mqtt_client.enable_outbox(sdcard_writer);
+  }
+
+  beehive::sensors::setup_sensor_task(i2c_bus);
+
+  // we first need to setup wifi, because otherwise
+  // MQTT fails due to missing network stack initialisation!
+  deets::wifi::setup();
+  beehive::boot::mark(beehive::boot::WIFI_UP);
+  mqtt_client.connect();
+  start_mdns_service();
+  start_ntp_service();
 
   beehive::http::HTTPServer http_server([&sdcard_writer]() { return sdcard_writer.file_count();});
+  http_server.serve_flashlog(flash_log);
+  http_server.serve_sdcard(sdcard_writer);
+  http_server.report_mqtt(mqtt_client);
 
-  beehive::sensors::setup_sensor_task(i2c_bus);
-  wait_or_sleep();
+  wait_or_sleep(sleep_conditions);
 }
 
 #endif // USE_LORA
@@ -295,12 +375,13 @@ void app_main()
   esp_log_level_set("lora", ESP_LOG_DEBUG);
   esp_log_level_set("sensors", ESP_LOG_DEBUG);
   // esp_log_level_set("buttons", ESP_LOG_DEBUG);
-  //esp_log_level_set("rf95", ESP_LOG_DEBUG);
+  //esp_log_level_set("sx1276", ESP_LOG_DEBUG);
 //  esp_log_level_set("i2c", ESP_LOG_DEBUG);
 
   // Must be the first, because we heavily rely
   // on the event system!
   deets::eventloop::init();
+  beehive::boot::init();
 
   deets::i2c::I2CHost i2c_bus{0, SDA, SCL};
 
@@ -311,15 +392,20 @@ void app_main()
 
   // must be early because it initialises NVS
   beehive::appstate::init();
+  #ifndef USE_LORA
+  collect_into_batch(i2c_bus);
+  #endif
   setup_buttons();
 
-  // we first need to setup wifi, because otherwise
-  // MQTT fails due to missing network stack initialisation!
+  #ifdef USE_LORA
   deets::wifi::setup();
+  beehive::boot::mark(beehive::boot::WIFI_UP);
   start_mdns_service();
   start_ntp_service();
-
-  #ifdef USE_LORA
+  if(!beehive::boot::wait_for(beehive::boot::TIME_VALID, NTP_TIMEOUT))
+  {
+    ESP_LOGE(TAG, "Couldn't obtain NTP date!");
+  }
   run_over_lora(i2c_bus);
   #else
   run_over_wifi(i2c_bus);
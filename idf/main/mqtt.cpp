@@ -3,14 +3,22 @@
 #include "mqtt.hpp"
 #include "appstate.hpp"
 #include "beehive_events.hpp"
+#include "boot.hpp"
+#include "configuration.hpp"
 #include "roland.hpp"
 #include "mqtt_client.h"
-#include "util.hpp"
+#include "record_codec.hpp"
+#include "reporting.hpp"
 
+#include "sdkconfig.h"
+#include <esp_attr.h>
 #include <esp_log.h>
+#include <esp_rom_crc.h>
+#include <esp_timer.h>
+
+#include <algorithm>
+#include <array>
 #include <cstring>
-#include <sstream>
-#include <iomanip>
 
 #define TAG "mqtt"
 
@@ -18,43 +26,133 @@ namespace beehive::mqtt {
 
 namespace {
 
-const auto QOS = 1;
 const auto RETAIN = 0;
 const auto SEPARATOR = ";";
+// "beehive/" and the system name, which is as
+// long as the client id at most
+const size_t TOPIC_SIZE = 256;
+
+// The outbox is replayed in batches, waiting for all
+// PUBACKs of a batch before sending the next one, so a
+// multi-day backlog doesn't flood the broker.
+const size_t REPLAY_BATCH = 16;
+// Records per batch message we publish, everything
+// a batching wake brings fits into one.
+const size_t PUBLISH_BATCH = 24;
+static_assert(REPLAY_BATCH <= PUBLISH_BATCH, "A replay batch must fit into one message");
+const auto REPLAY_INTERVAL_MS = 100;
+const auto REPLAY_ACK_TIMEOUT_MS = 10000;
+const auto REPLAY_TASK_STACK = 6144;
+
+// Encoded batches, one for the event loop and one for
+// the replay task. Too large for either stack, and
+// we don't want to allocate them for every publish.
+std::array<uint8_t, beehive::records::codec::max_batch_size(PUBLISH_BATCH)> s_batch_payload;
+std::array<uint8_t, beehive::records::codec::max_batch_size(REPLAY_BATCH)> s_replay_payload;
+
+// Larger configuration messages are ignored
+const size_t MAX_CONFIG_SIZE = 1024;
+
+#define OUTBOX_MAGIC 0xbee0a5ed
+
+// Everything up to acked has been acknowledged by the
+// broker. Kept in RTC memory across deep sleep, and in
+// NVS whenever the backlog is empty.
+struct outbox_state_t
+{
+  uint32_t magic;
+  uint32_t acked;
+  uint32_t crc;
+};
+
+RTC_DATA_ATTR outbox_state_t s_outbox;
+
+// Connect times in ms over all wakes
+RTC_DATA_ATTR beehive::util::LatencyHistogram s_connect_time;
+
+// The configuration version whose ack the broker
+// got, so a lost ack is repeated on the next wake.
+RTC_DATA_ATTR uint32_t s_config_acked;
+
+#ifdef CONFIG_BEEHIVE_MQTT_TLS
+extern const uint8_t ca_cert_pem_start[] asm("_binary_ca_cert_pem_start");
+#endif
+
+uint32_t outbox_crc(const outbox_state_t& state)
+{
+  return esp_rom_crc32_le(0, reinterpret_cast<const uint8_t*>(&state), offsetof(outbox_state_t, crc));
+}
+
+bool outbox_valid()
+{
+  return s_outbox.magic == OUTBOX_MAGIC && s_outbox.crc == outbox_crc(s_outbox);
+}
+
+void store_acked(size_t acked)
+{
+  s_outbox = { OUTBOX_MAGIC, uint32_t(acked), 0 };
+  s_outbox.crc = outbox_crc(s_outbox);
+}
+
+// Only with the card at hand: its counter is what
+// tells us if the card was swapped.
+size_t restore_acked(size_t counter)
+{
+  const auto acked = outbox_valid() ? std::optional<uint32_t>(s_outbox.acked) : beehive::appstate::mqtt_acked_sequence();
+  // Without any acks on record we'd replay the whole
+  // card, and a larger value means the card was swapped.
+  if(!acked || *acked > counter)
+  {
+    store_acked(counter);
+    return counter;
+  }
+  store_acked(*acked);
+  return *acked;
+}
 
 void native_publish(
+  beehive::util::Formatter& payload,
   const size_t counter,
+  const std::time_t timestamp,
   const std::vector<events::sensors::sht3xdis_value_t> &readings,
-  std::function < void(const char *topic, const char *data, int len, int qos, int retain)> publish
+  std::function < void(const char *topic, const char *data, int len, int qos, int retain)> publish,
+  int qos
   )
 {
-  std::stringstream topic;
+  beehive::util::FormatBuffer<TOPIC_SIZE> topic;
   size_t readings_count = 0;
 
-  topic << "beehive/" << beehive::appstate::system_name();
+  topic.append("beehive/").append(beehive::appstate::system_name());
 
-  std::stringstream ss;
-  ss << counter << "," << beehive::util::isoformat() << SEPARATOR;
+  payload.clear();
+  payload.decimal(counter).append(',').isoformat(timestamp).append(SEPARATOR);
 
   for(const auto& entry : readings)
   {
-    ss << std::hex << std::setw(2) << std::setfill('0') << int(entry.busno);
-    ss << std::hex << std::setw(2) << std::setfill('0') << int(entry.address) << ",";
-    ss << "T" << std::hex << std::setw(4) << std::setfill('0') << entry.raw_temperature << ",";
-    ss << "H" << std::hex << std::setw(4) << std::setfill('0') << entry.raw_humidity;
+    payload.hex(entry.busno, 2).hex(entry.address, 2).append(',');
+    payload.append('T').hex(entry.raw_temperature, 4).append(',');
+    payload.append('H').hex(entry.raw_humidity, 4);
     if(++readings_count < readings.size())
     {
-      ss << SEPARATOR;
+      payload.append(SEPARATOR);
     }
   }
-  const auto payload = ss.str();
-  const auto topic_ = topic.str();
-  publish(topic_.c_str(), payload.c_str(), payload.size(), QOS, RETAIN);
+  if(payload.overflowed())
+  {
+    ESP_LOGE(TAG, "Payload for %i readings too long", int(readings.size()));
+    return;
+  }
+  publish(topic.c_str(), payload.c_str(), payload.size(), qos, RETAIN);
 }
 
 }
 MQTTClient::MQTTClient(size_t counter)
-  : _counter(counter)
+  : _qos(int(beehive::appstate::mqtt_qos()))
+  , _counter(counter)
+  , _connected(false)
+  , _boot_counter(counter)
+  , _replay_next(counter + 1)
+  , _highest_published(counter)
 {
   std::memset(&_config, 0, sizeof(esp_mqtt_client_config_t));
   _config.user_context = this;
@@ -65,22 +163,360 @@ MQTTClient::MQTTClient(size_t counter)
   ESP_LOGD(TAG, "MQTT client-id %s, connecting to host %s", _client_id, _hostname);
   _config.client_id = _client_id;
   _config.host = _hostname;
+
+  ESP_ERROR_CHECK(esp_event_handler_instance_register(CONFIG_EVENTS, esp_mqtt_event_id_t(ESP_EVENT_ANY_ID), MQTTClient::s_config_event_handler, this, NULL));
+  ESP_ERROR_CHECK(esp_event_handler_instance_register(SENSOR_EVENTS, beehive::events::sensors::SHT3XDIS_READINGS, MQTTClient::s_sensor_event_handler, this, NULL));
+  ESP_ERROR_CHECK(esp_event_handler_instance_register(SENSOR_EVENTS, beehive::events::sensors::SHT3XDIS_BATCH, MQTTClient::s_sensor_event_handler, this, NULL));
+  ESP_ERROR_CHECK(esp_event_handler_instance_register(BEEHIVE_MQTT_EVENTS, beehive::events::mqtt::CONNECTED, MQTTClient::s_connected_event_handler, this, NULL));
+  ESP_ERROR_CHECK(esp_event_handler_instance_register(LORA_EVENTS, beehive::events::lora::RELAYED, MQTTClient::s_lora_event_handler, this, NULL));
+  ESP_ERROR_CHECK(esp_event_handler_instance_register(LORA_EVENTS, beehive::events::lora::LINK, MQTTClient::s_lora_event_handler, this, NULL));
+}
+
+void MQTTClient::connect()
+{
+#ifdef CONFIG_BEEHIVE_MQTT_TLS
+  // The host must match the broker's certificate, so
+  // it has to be a name rather than an IP address.
+  // Each connect is a full handshake, esp-mqtt doesn't
+  // let us resume the session, see README.org.
+  _config.transport = MQTT_TRANSPORT_OVER_SSL;
+  _config.port = CONFIG_BEEHIVE_MQTT_TLS_PORT;
+  _config.cert_pem = reinterpret_cast<const char*>(ca_cert_pem_start);
+#endif
   _client = esp_mqtt_client_init(&_config);
   esp_mqtt_client_register_event(
     _client,
     esp_mqtt_event_id_t(ESP_EVENT_ANY_ID),
     MQTTClient::s_handle_mqtt_event, this);
   esp_mqtt_client_start(_client);
-
-  ESP_ERROR_CHECK(esp_event_handler_instance_register(CONFIG_EVENTS, esp_mqtt_event_id_t(ESP_EVENT_ANY_ID), MQTTClient::s_config_event_handler, this, NULL));
-  ESP_ERROR_CHECK(esp_event_handler_instance_register(SENSOR_EVENTS, beehive::events::sensors::SHT3XDIS_READINGS, MQTTClient::s_sensor_event_handler, this, NULL));
 }
 
 int MQTTClient::publish(const char *topic, const char *data, int len, int qos,
                         int retain) {
+  // Without a connection esp-mqtt drops QoS 0 messages, and
+  // still returns 0. Report them as failed, so track keeps
+  // their records for the next wake.
+  if(qos == 0 && !_connected)
+  {
+    ESP_LOGD(TAG, "Not connected, not publishing to %s", topic);
+    return -1;
+  }
   return esp_mqtt_client_publish(_client, topic, data, len, qos, retain);
 }
 
+void MQTTClient::publish_batch(const beehive::records::codec::BatchEncoder& encoder, size_t sequence, size_t last_sequence)
+{
+  beehive::util::FormatBuffer<TOPIC_SIZE> topic;
+  topic.append("beehive/").append(beehive::appstate::system_name()).append("/batch");
+  const auto message_id = publish(topic.c_str(), reinterpret_cast<const char*>(encoder.data()), encoder.size(), _qos, RETAIN);
+  ESP_LOGD(TAG, "batch of %i records published as message %i", int(encoder.count()), message_id);
+  track(message_id, sequence, last_sequence);
+}
+
+void MQTTClient::track(int message_id, size_t sequence, size_t last_sequence)
+{
+  size_t backlog;
+  {
+    std::lock_guard<std::mutex> lock(_in_flight_mutex);
+    // QoS 0 publishes return 0 once the message is handed to
+    // the TCP stack, publish only makes them while connected.
+    // There won't be a PUBACK, so that's as delivered as they get.
+    const auto sent = message_id == 0;
+    // Failed publishes (-1) never get a PUBACK
+    if(message_id < 0 || (!sent && !_in_flight.insert(message_id, esp_timer_get_time(), sequence)))
+    {
+      if(message_id > 0)
+      {
+        ESP_LOGE(TAG, "Can't track message %i", message_id);
+        ++_untracked;
+      }
+      // The record stays in the outbox for the next wake
+      if(sequence && (!_first_failed || sequence < *_first_failed))
+      {
+        _first_failed = sequence;
+      }
+      if(message_id < 0 && sequence)
+      {
+        beehive::reporting::forget(beehive::reporting::MQTT);
+      }
+    }
+    _highest_published = std::max({ _highest_published, sequence, last_sequence });
+    backlog = this->backlog();
+  }
+  beehive::events::mqtt::published(backlog);
+}
+
+void MQTTClient::suppressed(size_t sequence)
+{
+  size_t backlog;
+  {
+    std::lock_guard<std::mutex> lock(_in_flight_mutex);
+    _highest_published = std::max(_highest_published, sequence);
+    advance_acked();
+    backlog = this->backlog();
+  }
+  ESP_LOGD(TAG, "Nothing to report for record %i", int(sequence));
+  beehive::events::mqtt::published(backlog);
+}
+
+void MQTTClient::report_backlog()
+{
+  size_t backlog;
+  {
+    std::lock_guard<std::mutex> lock(_in_flight_mutex);
+    backlog = this->backlog();
+  }
+  beehive::events::mqtt::published(backlog);
+}
+
+void MQTTClient::acknowledged(int message_id)
+{
+  size_t backlog, acked;
+  auto replayed = false;
+  {
+    std::lock_guard<std::mutex> lock(_in_flight_mutex);
+    const auto entry = _in_flight.erase(message_id);
+    if(entry && message_id == _config_ack_id)
+    {
+      s_config_acked = _config_ack_version;
+    }
+    if(entry)
+    {
+      beehive::boot::mark(beehive::boot::FIRST_PUBACK);
+      _ack_latency.record(uint32_t((esp_timer_get_time() - entry->sent_at) / 1000));
+      replayed = entry->sequence && entry->sequence <= _boot_counter;
+    }
+    advance_acked();
+    backlog = this->backlog();
+    acked = s_outbox.acked;
+  }
+  if(_outbox && backlog == 0 && acked != _persisted_acked)
+  {
+    beehive::appstate::set_mqtt_acked_sequence(acked);
+    _persisted_acked = acked;
+  }
+  // The MQTT_EVENTS are scoped to the client, so
+  // I create this forwarding.
+  beehive::events::mqtt::published(backlog);
+  if(replayed && _replay_task)
+  {
+    xTaskNotifyGive(_replay_task);
+  }
+}
+
+void MQTTClient::failed(int message_id)
+{
+  size_t backlog;
+  auto replayed = false;
+  {
+    std::lock_guard<std::mutex> lock(_in_flight_mutex);
+    const auto entry = _in_flight.erase(message_id);
+    // The record stays in the outbox for the next wake
+    if(entry && entry->sequence && (!_first_failed || entry->sequence < *_first_failed))
+    {
+      _first_failed = entry->sequence;
+    }
+    if(entry && entry->sequence)
+    {
+      beehive::reporting::forget(beehive::reporting::MQTT);
+    }
+    if(entry)
+    {
+      replayed = entry->sequence && entry->sequence <= _boot_counter;
+    }
+    advance_acked();
+    backlog = this->backlog();
+  }
+  ESP_LOGE(TAG, "Message %i expired without an ack", message_id);
+  beehive::events::mqtt::published(backlog);
+  if(replayed && _replay_task)
+  {
+    xTaskNotifyGive(_replay_task);
+  }
+}
+
+void MQTTClient::advance_acked()
+{
+  // Without the card our sequence numbers don't continue
+  // the ones on it, so the watermark stays as it is.
+  if(!_outbox)
+  {
+    return;
+  }
+  auto acked = _highest_published;
+  if(_outbox && _replay_next <= _boot_counter)
+  {
+    acked = std::min(acked, _replay_next - 1);
+  }
+  const auto lowest = _in_flight.lowest_sequence();
+  if(lowest)
+  {
+    acked = std::min(acked, *lowest - 1);
+  }
+  if(_first_failed)
+  {
+    acked = std::min(acked, *_first_failed - 1);
+  }
+  if(acked > s_outbox.acked)
+  {
+    store_acked(acked);
+  }
+}
+
+size_t MQTTClient::backlog() const
+{
+  // Until the readings of this wake came in, an empty
+  // outbox doesn't mean we are done.
+  auto backlog = _in_flight.size() + _pending_records + (_awaiting_readings ? 1 : 0);
+  if(_outbox && _replay_next <= _boot_counter)
+  {
+    backlog += _boot_counter + 1 - _replay_next;
+  }
+  return backlog;
+}
+
+void MQTTClient::enable_outbox(beehive::sdcard::SDCardWriter& sdcard)
+{
+  {
+    std::lock_guard<std::mutex> lock(_in_flight_mutex);
+    _outbox = &sdcard;
+    _replay_next = restore_acked(_boot_counter) + 1;
+    _persisted_acked = s_outbox.acked;
+  }
+  _replay_records.reserve(REPLAY_BATCH);
+  ESP_LOGI(TAG, "Outbox: acked up to %i, replaying up to %i", int(_replay_next - 1), int(_boot_counter));
+  xTaskCreate(MQTTClient::s_replay_task, "outbox", REPLAY_TASK_STACK, this, uxTaskPriorityGet(NULL), &_replay_task);
+  if(_connected)
+  {
+    xTaskNotifyGive(_replay_task);
+  }
+}
+
+void MQTTClient::s_replay_task(void* user_data)
+{
+  static_cast<MQTTClient*>(user_data)->replay_task();
+}
+
+void MQTTClient::replay_task()
+{
+  while(true)
+  {
+    // Woken up by every connect
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    while(_connected && replay_batch())
+    {
+      vTaskDelay(REPLAY_INTERVAL_MS / portTICK_PERIOD_MS);
+    }
+  }
+}
+
+bool MQTTClient::replay_batch()
+{
+  size_t next;
+  {
+    std::lock_guard<std::mutex> lock(_in_flight_mutex);
+    next = _replay_next;
+  }
+  if(next > _boot_counter)
+  {
+    return false;
+  }
+  const auto start = esp_timer_get_time();
+  _replay_records.clear();
+  _outbox->read_since(
+    next - 1,
+    [this](const char* line, size_t len) {
+      const auto stored = beehive::sdcard::SDCardWriter::parse_record(line, len);
+      if(!stored)
+      {
+        return true;
+      }
+      if(stored->sequence > _boot_counter)
+      {
+        return false;
+      }
+      _replay_records.push_back(*stored);
+      return _replay_records.size() < REPLAY_BATCH;
+    });
+
+  if(_replay_records.empty())
+  {
+    size_t backlog;
+    {
+      std::lock_guard<std::mutex> lock(_in_flight_mutex);
+      // Whatever isn't on the card can't be replayed
+      _replay_next = _boot_counter + 1;
+      advance_acked();
+      backlog = this->backlog();
+    }
+    beehive::events::mqtt::published(backlog);
+    return false;
+  }
+  // Tracking the batch holds back the acked sequence
+  // before we move past it.
+  beehive::records::codec::BatchEncoder encoder(s_replay_payload.data());
+  for(const auto& stored : _replay_records)
+  {
+    encoder.add(uint32_t(stored.sequence), stored.record);
+  }
+  publish_batch(encoder, _replay_records.front().sequence, _replay_records.back().sequence);
+  {
+    std::lock_guard<std::mutex> lock(_in_flight_mutex);
+    _replay_next = _replay_records.back().sequence + 1;
+  }
+  // Wait for the whole batch to be acknowledged
+  const auto last = _replay_records.back().sequence;
+  while(true)
+  {
+    std::optional<size_t> lowest;
+    {
+      std::lock_guard<std::mutex> lock(_in_flight_mutex);
+      lowest = _in_flight.lowest_sequence();
+    }
+    if(!lowest || *lowest > last)
+    {
+      break;
+    }
+    if(!ulTaskNotifyTake(pdTRUE, REPLAY_ACK_TIMEOUT_MS / portTICK_PERIOD_MS))
+    {
+      ESP_LOGE(TAG, "Outbox replay timed out at sequence %i", int(*lowest));
+      return false;
+    }
+  }
+  _replayed += _replay_records.size();
+  _replay_time += esp_timer_get_time() - start;
+  return true;
+}
+
+publish_stats_t MQTTClient::stats() const
+{
+  std::lock_guard<std::mutex> lock(_in_flight_mutex);
+  const auto oldest = _in_flight.oldest();
+  return {
+    _in_flight.size(),
+    oldest ? uint32_t((esp_timer_get_time() - *oldest) / 1000) : 0,
+    _untracked,
+    _ack_latency.count(),
+    _ack_latency.percentile(50),
+    _ack_latency.percentile(90),
+    _ack_latency.percentile(99),
+    _ack_latency.max(),
+    _highest_published - s_outbox.acked,
+    _replayed,
+    _replay_time ? _replayed / (_replay_time / 1e6f) : 0.0f,
+#ifdef CONFIG_BEEHIVE_MQTT_TLS
+    true,
+#else
+    false,
+#endif
+    _connect_time,
+    s_connect_time.count(),
+    s_connect_time.percentile(50),
+    s_connect_time.percentile(90),
+    s_connect_time.max()
+  };
+}
+
 void MQTTClient::s_handle_mqtt_event(void *event_handler_arg, esp_event_base_t event_base, int32_t event_id, void *event_data)
 {
   static_cast<MQTTClient*>(event_handler_arg)->handle_mqtt_event(event_base, event_id, event_data);
@@ -94,9 +530,25 @@ void MQTTClient::handle_mqtt_event(esp_event_base_t event_base, int32_t event_id
   switch (event_id) {
   case MQTT_EVENT_CONNECTED:
     ESP_LOGD(TAG, "MQTT_EVENT_CONNECTED");
+    _connected = true;
+    if(_connect_started)
+    {
+      _connect_time = uint32_t((esp_timer_get_time() - _connect_started) / 1000);
+      s_connect_time.record(_connect_time);
+      ESP_LOGI(TAG, "Connected after %ims", int(_connect_time));
+    }
+    beehive::boot::mark(beehive::boot::MQTT_CONNECTED);
+    subscribe_configuration();
+    // Publishes what came in before the connection
+    beehive::events::mqtt::connected();
+    if(_replay_task)
+    {
+      xTaskNotifyGive(_replay_task);
+    }
     break;
   case MQTT_EVENT_DISCONNECTED:
     ESP_LOGD(TAG, "MQTT_EVENT_DISCONNECTED");
+    _connected = false;
     break;
   case MQTT_EVENT_SUBSCRIBED:
     ESP_LOGD(TAG, "MQTT_EVENT_SUBSCRIBED");
@@ -106,15 +558,11 @@ void MQTTClient::handle_mqtt_event(esp_event_base_t event_base, int32_t event_id
     break;
   case MQTT_EVENT_PUBLISHED:
     ESP_LOGD(TAG, "MQTT_EVENT_PUBLISHED, msg_id=%d", event->msg_id);
-    // The MQTT_EVENTS are scoped to the client, so
-    // I create this forwarding.
-    _published_messages.erase(event->msg_id);
-    beehive::events::mqtt::published(_published_messages.size());
+    acknowledged(event->msg_id);
     break;
   case MQTT_EVENT_DATA:
     ESP_LOGD(TAG, "MQTT_EVENT_DATA");
-    printf("TOPIC=%.*s\r\n", event->topic_len, event->topic);
-    printf("DATA=%.*s\r\n", event->data_len, event->data);
+    configuration_data(event);
     break;
   case MQTT_EVENT_ERROR:
     ESP_LOGD(TAG, "MQTT_EVENT_ERROR");
@@ -122,12 +570,14 @@ void MQTTClient::handle_mqtt_event(esp_event_base_t event_base, int32_t event_id
 #if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(4, 4, 0)
   case MQTT_EVENT_DELETED:
     ESP_LOGD(TAG, "MQTT_EVENT_DELETED, msg_id=%d", event->msg_id);
-    _published_messages.erase(event->msg_id);
-    beehive::events::mqtt::published(_published_messages.size());
+    failed(event->msg_id);
     break;
 #endif
   case MQTT_EVENT_BEFORE_CONNECT:
     ESP_LOGD(TAG, "MQTT_EVENT_BEFORE_CONNECT");
+    // Also before every reconnect, so we time the
+    // attempt that succeeded.
+    _connect_started = esp_timer_get_time();
     break;
   default:
     ESP_LOGD(TAG, "Other event id:%d", event_id);
@@ -136,6 +586,102 @@ void MQTTClient::handle_mqtt_event(esp_event_base_t event_base, int32_t event_id
 }
 
 
+void MQTTClient::subscribe_configuration()
+{
+  // The broker sends the retained configuration right
+  // after the SUBACK, so it usually arrives while we are
+  // still waiting for the PUBACKs of the readings. We
+  // don't wait for it: one that misses the window is
+  // still retained, and gets applied on the next wake.
+  beehive::util::FormatBuffer<TOPIC_SIZE> topic;
+  topic.append("beehive/").append(beehive::appstate::system_name()).append("/config");
+  if(esp_mqtt_client_subscribe(_client, topic.c_str(), 1) < 0)
+  {
+    ESP_LOGE(TAG, "Can't subscribe to %s", topic.c_str());
+  }
+}
+
+void MQTTClient::configuration_data(esp_mqtt_event_handle_t event)
+{
+  // Only the first chunk of a message carries the topic
+  if(event->current_data_offset == 0)
+  {
+    beehive::util::FormatBuffer<TOPIC_SIZE> topic;
+    topic.append("beehive/").append(beehive::appstate::system_name()).append("/config");
+    _receiving_config = std::string_view(event->topic, size_t(event->topic_len)) == topic.c_str()
+      && event->total_data_len > 0
+      && size_t(event->total_data_len) <= MAX_CONFIG_SIZE;
+    _remote_config.clear();
+  }
+  if(!_receiving_config)
+  {
+    return;
+  }
+  _remote_config.append(event->data, size_t(event->data_len));
+  if(_remote_config.size() == size_t(event->total_data_len))
+  {
+    _receiving_config = false;
+    apply_configuration();
+  }
+}
+
+void MQTTClient::apply_configuration()
+{
+  using json = nlohmann::json;
+  // No exceptions, so invalid JSON comes back discarded
+  const auto body = json::parse(_remote_config, nullptr, false);
+  if(body.is_discarded() || !body.is_object() || !body.contains("version") || !body["version"].is_number_unsigned())
+  {
+    ESP_LOGE(TAG, "Ignoring configuration without version: %s", _remote_config.c_str());
+    return;
+  }
+  const auto version = body["version"].get<uint32_t>();
+  // The message is retained, so we get it on every wake
+  const auto applied = beehive::appstate::config_version();
+  if(applied && version <= *applied)
+  {
+    ESP_LOGD(TAG, "Configuration version %u already applied", unsigned(version));
+    if(version == *applied && s_config_acked != version)
+    {
+      acknowledge_configuration(beehive::appstate::system_name(), version);
+    }
+    return;
+  }
+  // The ack goes next to the configuration, even if
+  // that renames us.
+  const auto system_name = beehive::appstate::system_name();
+  {
+    // The settings and the version go into NVS together
+    beehive::appstate::Update update;
+    beehive::configuration::apply(body);
+    beehive::appstate::set_config_version(version);
+  }
+  ESP_LOGI(TAG, "Applied configuration version %u", unsigned(version));
+  acknowledge_configuration(system_name, version);
+}
+
+void MQTTClient::acknowledge_configuration(const std::string& system_name, uint32_t version)
+{
+  beehive::util::FormatBuffer<TOPIC_SIZE> topic;
+  topic.append("beehive/").append(system_name).append("/config/ack");
+  beehive::util::FormatBuffer<32> ack;
+  ack.append("{\"version\": ").decimal(version).append('}');
+  // Retained, so the current version can be looked up
+  // at any time. Tracked like a reading, so we don't go
+  // to sleep before it's out.
+  const auto message_id = publish(topic.c_str(), ack.c_str(), int(ack.size()), _qos, 1);
+  if(message_id == 0)
+  {
+    s_config_acked = version;
+  }
+  {
+    std::lock_guard<std::mutex> lock(_in_flight_mutex);
+    _config_ack_id = message_id;
+    _config_ack_version = version;
+  }
+  track(message_id);
+}
+
 void MQTTClient::s_config_event_handler(void *handler_args,
                                         esp_event_base_t event_base, int32_t event_id,
                                         void *event_data)
@@ -146,32 +692,33 @@ void MQTTClient::s_config_event_handler(void *handler_args,
 
 void MQTTClient::config_event_handler(esp_event_base_t base, beehive::events::config::config_events_t id, void* event_data)
 {
-  switch(id)
+  using namespace beehive::events::config;
+  // Single settings and batched UPDATEs alike, the
+  // new values are in appstate.
+  const auto settings = updated_settings(id, event_data);
+  if(settings & (1u << MQTT_HOST))
+  {
+    std::strncpy(_hostname, beehive::appstate::mqtt_host().c_str(), sizeof(_hostname));
+    ESP_LOGD(TAG, "Configuration changed - MQTT_HOST: %s", _hostname);
+  }
+  if(settings & (1u << SYSTEM_NAME))
   {
-  case beehive::events::config::MQTT_HOST:
-    {
-      const auto hostname = beehive::events::config::mqtt::hostname(id, event_data);
-      if(hostname)
-      {
-	std::strncpy(_hostname, hostname->c_str(), sizeof(_hostname));
-	ESP_LOGD(TAG, "Configuration changed - MQTT_HOST: %s", _hostname);
-	esp_mqtt_set_config(_client, &_config);
-      }
-    }
-    break;
-  case beehive::events::config::SYSTEM_NAME:
     std::strncpy(_client_id, beehive::appstate::system_name().c_str(), sizeof(_client_id));
     ESP_LOGD(TAG, "Configuration changed - MQTT_CLIENT_ID: %s", _client_id);
-    // It appears as if this re-setting of the client id does only take effect
-    // after a reboot. I'm ok with this as in normal operation, we'd do that through
-    // deep sleep anyway.
+  }
+  // It appears as if this re-setting of the client id does only take effect
+  // after a reboot. I'm ok with this as in normal operation, we'd do that through
+  // deep sleep anyway. Before connect() the config is only used later.
+  if(settings & ((1u << MQTT_HOST) | (1u << SYSTEM_NAME)) && _client)
+  {
     esp_mqtt_set_config(_client, &_config);
-    break;
-    // All ignored
-  case beehive::events::config::SLEEPTIME:
-  case beehive::events::config::LORA_DBM:
-    break;
   }
+  if(settings & (1u << MQTT_QOS))
+  {
+    _qos = int(beehive::appstate::mqtt_qos());
+    ESP_LOGD(TAG, "Configuration changed - MQTT_QOS: %i", int(_qos));
+  }
+  // All others ignored
 }
 
 void MQTTClient::s_sensor_event_handler(void *handler_args,
@@ -183,30 +730,199 @@ void MQTTClient::s_sensor_event_handler(void *handler_args,
 
 void MQTTClient::sensor_event_handler(esp_event_base_t base, beehive::events::sensors::sensor_events_t id, void* event_data)
 {
-  const auto readings = beehive::events::sensors::receive_readings(id, event_data);
-  if(readings)
+  auto records = beehive::events::sensors::receive_records(id, event_data);
+  if(!records)
   {
-    native_publish(++_counter, *readings,
-		    [this]
+    return;
+  }
+  // The sequence numbers follow the card, whenever
+  // we get to publish them.
+  const auto first_sequence = _counter + 1;
+  _counter += records->size();
+  if(!_connected)
+  {
+    ESP_LOGD(TAG, "Not connected yet, holding back %i records", int(records->size()));
+    _pending_records += records->size();
+    _pending.push_back({ first_sequence, std::move(*records) });
+    _awaiting_readings = false;
+    report_backlog();
+    return;
+  }
+  publish_records(first_sequence, *records);
+  _awaiting_readings = false;
+  report_backlog();
+}
+
+void MQTTClient::s_connected_event_handler(void *handler_args,
+                                           esp_event_base_t base, int32_t id,
+                                           void *event_data) {
+  static_cast<MQTTClient*>(handler_args)->connected_event_handler();
+}
+
+void MQTTClient::connected_event_handler()
+{
+  // Runs on the event loop like the sensor handler,
+  // so the pending records are ours alone.
+  for(auto& pending : _pending)
+  {
+    publish_records(pending.first_sequence, pending.records);
+    _pending_records -= pending.records.size();
+  }
+  _pending.clear();
+  for(const auto& relayed : _pending_relayed)
+  {
+    publish_relayed(relayed);
+    _pending_records -= relayed.records.size();
+  }
+  _pending_relayed.clear();
+  report_backlog();
+}
+
+void MQTTClient::s_lora_event_handler(void *handler_args,
+                                         esp_event_base_t base, int32_t id,
+                                         void *event_data) {
+  static_cast<MQTTClient*>(handler_args)->lora_event_handler(beehive::events::lora::lora_events_t(id), event_data);
+}
+
+void MQTTClient::lora_event_handler(beehive::events::lora::lora_events_t id, void* event_data)
+{
+  const auto link = beehive::events::lora::receive_link(id, event_data);
+  if(link)
+  {
+    // The next one replaces it anyway
+    if(_connected)
+    {
+      publish_link(*link);
+    }
+    return;
+  }
+  auto relayed = beehive::events::lora::receive_relayed(id, event_data);
+  if(!relayed)
+  {
+    return;
+  }
+  _awaiting_readings = false;
+  if(!_connected)
+  {
+    ESP_LOGD(TAG, "Not connected yet, holding back %i records of %08x", int(relayed->records.size()), unsigned(relayed->device_id));
+    _pending_records += relayed->records.size();
+    _pending_relayed.push_back(std::move(*relayed));
+    report_backlog();
+    return;
+  }
+  publish_relayed(*relayed);
+  report_backlog();
+}
+
+void MQTTClient::publish_link(const beehive::events::lora::device_link_t& link)
+{
+  beehive::util::FormatBuffer<TOPIC_SIZE> topic;
+  topic.append("beehive/").append(beehive::appstate::system_name()).append('/');
+  topic.hex(link.device_id, 8).append("/link");
+  _payload.clear();
+  _payload.append("{\"rssi\": ").decimal(link.rssi);
+  _payload.append(", \"snr\": ").fixed(link.snr / 4.0f);
+  _payload.append(", \"tx_power\": ").decimal(link.tx_power);
+  _payload.append(", \"packets\": ").decimal(link.packets);
+  _payload.append(", \"cycles\": ").decimal(link.cycles);
+  _payload.append(", \"duplicates\": ").decimal(link.duplicates);
+  _payload.append(", \"late\": ").decimal(link.late).append('}');
+  publish(topic.c_str(), _payload.c_str(), int(_payload.size()), 0, 1);
+}
+
+void MQTTClient::publish_relayed(const beehive::events::lora::relayed_t& relayed)
+{
+  using namespace beehive::records::codec;
+  beehive::util::FormatBuffer<TOPIC_SIZE> topic;
+  topic.append("beehive/").append(beehive::appstate::system_name()).append('/');
+  topic.hex(relayed.device_id, 8).append("/batch");
+  // The sequence numbers are the field device's, so
+  // duplicates and gaps can be told downstream. The
+  // records are on its card, there's nothing for us
+  // to replay.
+  for(size_t first = 0; first < relayed.records.size(); first += PUBLISH_BATCH)
+  {
+    BatchEncoder encoder(s_batch_payload.data());
+    const auto last = std::min(relayed.records.size(), first + PUBLISH_BATCH);
+    for(auto i = first; i < last; ++i)
+    {
+      encoder.add(relayed.records[i].sequence, relayed.records[i].record);
+    }
+    const auto message_id = publish(topic.c_str(), reinterpret_cast<const char*>(encoder.data()), encoder.size(), _qos, RETAIN);
+    ESP_LOGD(TAG, "batch of %i records from %08x published as message %i", int(encoder.count()), unsigned(relayed.device_id), message_id);
+    track(message_id);
+  }
+  // Including the wait for the connection
+  _relay_latency.record(uint32_t(esp_timer_get_time() - relayed.received_at));
+}
+
+void MQTTClient::publish_records(size_t first_sequence, std::vector<beehive::events::sensors::sht3xdis_record_t>& records)
+{
+  // Only now they count as reported. Records held back
+  // until a connection that never comes aren't.
+  for(auto& record : records)
+  {
+    beehive::reporting::filter(beehive::reporting::MQTT, record.timestamp, record.readings);
+  }
+  // Several cycles at once go out as one binary message
+  if(records.size() > 1)
+  {
+    beehive::records::codec::BatchEncoder encoder(s_batch_payload.data());
+    size_t batch_first = 0;
+    size_t batch_last = 0;
+    auto sequence = first_sequence;
+    for(const auto& record : records)
+    {
+      if(!record.readings.empty())
+      {
+        if(encoder.count() == PUBLISH_BATCH)
+        {
+          publish_batch(encoder, batch_first, batch_last);
+          encoder = beehive::records::codec::BatchEncoder(s_batch_payload.data());
+        }
+        if(encoder.count() == 0)
+        {
+          batch_first = sequence;
+        }
+        encoder.add(uint32_t(sequence), beehive::events::sensors::compact(record.timestamp, record.readings));
+        batch_last = sequence;
+      }
+      ++sequence;
+    }
+    if(encoder.count() == 0)
+    {
+      suppressed(sequence - 1);
+    }
+    else
+    {
+      publish_batch(encoder, batch_first, batch_last);
+    }
+    return;
+  }
+  auto sequence = first_sequence;
+  for(const auto& record : records)
+  {
+    if(record.readings.empty())
+    {
+      suppressed(sequence++);
+      continue;
+    }
+    native_publish(_payload, sequence, record.timestamp, record.readings,
+		    [this, sequence]
 		    (const char *topic, const char *data, int len, int qos, int retain) {
 		      const auto message_id = publish(topic, data, len, qos, retain);
 		      ESP_LOGD(TAG, "beehive published message %i", message_id);
-		      _published_messages.insert(message_id);
-                      beehive::events::mqtt::published(_published_messages.size());
-		    });
+		      track(message_id, sequence);
+		    }, _qos);
 
-    roland::publish(_counter, *readings,
+    roland::publish(_payload, sequence, record.timestamp, record.readings,
 		    [this]
 		    (const char *topic, const char *data, int len, int qos, int retain) {
 		      const auto message_id = publish(topic, data, len, qos, retain);
 		      ESP_LOGD(TAG, "roland published message %i", message_id);
-		      _published_messages.insert(message_id);
-                      beehive::events::mqtt::published(_published_messages.size());
-		    });
-    for(const auto message_id : _published_messages)
-    {
-      ESP_LOGD(TAG, "id %i", message_id);
-    }
+		      track(message_id);
+		    }, _qos);
+    ++sequence;
   }
 }
 } // namespace beehive::mqtt
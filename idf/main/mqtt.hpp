@@ -3,22 +3,93 @@
 #pragma once
 
 #include "beehive_events.hpp"
+#include "format.hpp"
+#include "histogram.hpp"
+#include "inflight.hpp"
+#include "record_codec.hpp"
+#include "sdcard.hpp"
 
 #include <mqtt_client.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
 
-#include <set>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
 
 namespace beehive::mqtt {
 
+struct publish_stats_t
+{
+  size_t in_flight;
+  // age of the oldest message without PUBACK, in ms
+  uint32_t oldest_unacked_age;
+  // publishes we couldn't track
+  uint32_t untracked;
+  uint32_t acked;
+  // publish to PUBACK latencies in ms
+  uint32_t p50;
+  uint32_t p90;
+  uint32_t p99;
+  uint32_t max;
+  // records the broker hasn't acknowledged yet,
+  // including the ones still on the card
+  size_t outbox_depth;
+  uint32_t replayed;
+  // replayed records per second
+  float replay_rate;
+  bool tls;
+  // From starting the connect to the CONNACK, which
+  // includes the TLS handshake. Kept across deep sleep,
+  // so it covers many wakes.
+  uint32_t connect_time;
+  uint32_t connects;
+  uint32_t connect_p50;
+  uint32_t connect_p90;
+  uint32_t connect_max;
+};
+
 class MQTTClient
 {
 public:
+  // Takes the readings from now on, but only publishes
+  // them after connect() got us a connection.
   MQTTClient(size_t counter);
 
+  // Needs the network stack to be set up
+  void connect();
+
   int publish(const char *topic, const char *data, int len=0, int qos=0, int retain=0);
+  publish_stats_t stats() const;
+  // LoRa base station: from the first packet of relayed
+  // records leaving the radio to their publish, in us
+  const beehive::util::LatencyHistogram& relay_latency() const { return _relay_latency; }
+  // Replays the records from the card that the broker
+  // hasn't acknowledged yet, once we are connected.
+  void enable_outbox(beehive::sdcard::SDCardWriter&);
 private:
 
-  void publish_message_backlog_count();
+  // A message covers the records from sequence
+  // to last_sequence, 0 if it doesn't need replay.
+  void track(int message_id, size_t sequence=0, size_t last_sequence=0);
+  // The records of the batch run from sequence to last_sequence
+  void publish_batch(const beehive::records::codec::BatchEncoder&, size_t sequence, size_t last_sequence);
+  // A record the deadband held back counts as delivered,
+  // it stays on the card.
+  void suppressed(size_t sequence);
+  void report_backlog();
+  void acknowledged(int message_id);
+  // The client gave up on the message, its
+  // records count as not delivered.
+  void failed(int message_id);
+  // Must be called with the in-flight mutex held
+  void advance_acked();
+  size_t backlog() const;
+
+  static void s_replay_task(void*);
+  void replay_task();
+  bool replay_batch();
 
   static void s_handle_mqtt_event(void *event_handler_arg, esp_event_base_t event_base, int32_t event_id, void *event_data);
   void handle_mqtt_event(esp_event_base_t event_base, int32_t event_id, void *event_data);
@@ -29,15 +100,83 @@ private:
   static void s_sensor_event_handler(void* handler_args, esp_event_base_t base, int32_t id, void* event_data);
   void sensor_event_handler(esp_event_base_t base, beehive::events::sensors::sensor_events_t id, void* event_data);
 
+  static void s_connected_event_handler(void* handler_args, esp_event_base_t base, int32_t id, void* event_data);
+  void connected_event_handler();
+
+  // The cycles a LoRa base station received from its
+  // field devices and the state of their links, each
+  // under the device's topic.
+  static void s_lora_event_handler(void* handler_args, esp_event_base_t base, int32_t id, void* event_data);
+  void lora_event_handler(beehive::events::lora::lora_events_t id, void* event_data);
+  void publish_relayed(const beehive::events::lora::relayed_t&);
+  // Retained, so the state of each link can be looked up
+  void publish_link(const beehive::events::lora::device_link_t&);
+
+  // Filters the records for publish-on-change first
+  void publish_records(size_t first_sequence, std::vector<beehive::events::sensors::sht3xdis_record_t>&);
+
+  // The remote configuration, from the MQTT task
+  void subscribe_configuration();
+  void configuration_data(esp_mqtt_event_handle_t);
+  void apply_configuration();
+  void acknowledge_configuration(const std::string& system_name, uint32_t version);
+
   esp_mqtt_client_config_t _config;
-  esp_mqtt_client_handle_t _client;
+  esp_mqtt_client_handle_t _client = nullptr;
 
   char _client_id[200];
   char _hostname[200];
+  // The delivery policy, from the configuration
+  std::atomic<int> _qos;
 
   size_t _counter;
 
-  std::set<int> _published_messages;
+  // Records that came in before we were connected,
+  // only touched from the event loop.
+  struct pending_t
+  {
+    size_t first_sequence;
+    std::vector<beehive::events::sensors::sht3xdis_record_t> records;
+  };
+  std::vector<pending_t> _pending;
+  std::vector<beehive::events::lora::relayed_t> _pending_relayed;
+  std::atomic<size_t> _pending_records = 0;
+  std::atomic<bool> _awaiting_readings = true;
+  // Scratch space for the payloads, only
+  // used from the event loop.
+  beehive::util::FormatBuffer<512> _payload;
+
+  // Published from the event loop, acknowledged
+  // from the MQTT task.
+  mutable std::mutex _in_flight_mutex;
+  InFlightTable<64> _in_flight;
+  uint32_t _untracked = 0;
+  beehive::util::LatencyHistogram _ack_latency;
+  beehive::util::LatencyHistogram _relay_latency;
+
+  // The outbox: records up to _boot_counter are on the
+  // card, and get replayed from _replay_next on.
+  std::atomic<bool> _connected;
+  beehive::sdcard::SDCardWriter* _outbox = nullptr;
+  TaskHandle_t _replay_task = nullptr;
+  const size_t _boot_counter;
+  size_t _replay_next;
+  size_t _highest_published;
+  std::optional<size_t> _first_failed;
+  std::vector<beehive::sdcard::stored_record_t> _replay_records;
+  size_t _persisted_acked = 0;
+  uint32_t _replayed = 0;
+  int64_t _replay_time = 0;
+
+  int64_t _connect_started = 0;
+  uint32_t _connect_time = 0;
+
+  // A configuration message can arrive in chunks
+  std::string _remote_config;
+  bool _receiving_config = false;
+  // Guarded by the in-flight mutex
+  int _config_ack_id = -1;
+  uint32_t _config_ack_version = 0;
 };
 
 } // namespace beehive::mqtt
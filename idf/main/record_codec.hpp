@@ -0,0 +1,313 @@
+// Copyright: 2022, Diez B. Roggisch, Berlin, all rights reserved
+
+#pragma once
+
+#include "records.hpp"
+
+#include <cstddef>
+#include <cstdint>
+
+// A compressed stream of compact records. Consecutive
+// readings of a sensor only differ by a few counts, so
+// instead of the full values we store zig-zag encoded
+// varint deltas against the previous record.
+//
+// A key frame carries the sensor layout (bus and address
+// of each sensor) and absolute values, delta frames only
+// the differences. Key frames are written every
+// KEY_INTERVAL records and whenever the layout changes, so
+// a decoder can pick up at any of them.
+//
+//   key:   'K' count (busno address){count} timestamp (humidity temperature){count}
+//   delta: 'D' dtimestamp (dhumidity dtemperature){count}
+//
+// All numbers are LEB128 varints, deltas are zig-zag encoded.
+// Used on the device and in the host decoder library, so
+// it must not depend on anything ESP specific.
+namespace beehive::records::codec {
+
+const uint8_t KEY_FRAME = 'K';
+const uint8_t DELTA_FRAME = 'D';
+const size_t KEY_INTERVAL = 32;
+// tag, count, layout, timestamp and two values per sensor
+const size_t MAX_FRAME_SIZE = 1 + 1 + 2 * MAX_SENSORS + 5 + 2 * 3 * MAX_SENSORS;
+
+inline uint32_t zigzag(int32_t value)
+{
+  return (uint32_t(value) << 1) ^ uint32_t(value >> 31);
+}
+
+inline int32_t unzigzag(uint32_t value)
+{
+  return int32_t(value >> 1) ^ -int32_t(value & 1);
+}
+
+inline uint8_t* put_varint(uint8_t* out, uint32_t value)
+{
+  while(value >= 0x80)
+  {
+    *out++ = uint8_t(value) | 0x80;
+    value >>= 7;
+  }
+  *out++ = uint8_t(value);
+  return out;
+}
+
+// Returns nullptr if the data ends prematurely
+// or the value doesn't fit.
+inline const uint8_t* get_varint(const uint8_t* in, const uint8_t* end, uint32_t& value)
+{
+  value = 0;
+  for(int shift = 0; shift < 35 && in < end; shift += 7)
+  {
+    const auto byte = *in++;
+    value |= uint32_t(byte & 0x7f) << shift;
+    if(!(byte & 0x80))
+    {
+      return in;
+    }
+  }
+  return nullptr;
+}
+
+class Encoder
+{
+public:
+  // Writes one frame, out must have room for MAX_FRAME_SIZE
+  // bytes. Returns the number of bytes written.
+  size_t encode(const compact_record_t& record, uint8_t* out)
+  {
+    auto p = out;
+    if(_since_key >= KEY_INTERVAL || !same_layout(record))
+    {
+      *p++ = KEY_FRAME;
+      *p++ = record.count;
+      for(size_t i = 0; i < record.count; ++i)
+      {
+        *p++ = record.readings[i].busno;
+        *p++ = record.readings[i].address;
+      }
+      p = put_varint(p, record.timestamp);
+      for(size_t i = 0; i < record.count; ++i)
+      {
+        p = put_varint(p, record.readings[i].raw_humidity);
+        p = put_varint(p, record.readings[i].raw_temperature);
+      }
+      _since_key = 0;
+    }
+    else
+    {
+      *p++ = DELTA_FRAME;
+      p = put_varint(p, zigzag(int32_t(record.timestamp - _previous.timestamp)));
+      for(size_t i = 0; i < record.count; ++i)
+      {
+        const auto& reading = record.readings[i];
+        const auto& previous = _previous.readings[i];
+        p = put_varint(p, zigzag(int32_t(reading.raw_humidity) - int32_t(previous.raw_humidity)));
+        p = put_varint(p, zigzag(int32_t(reading.raw_temperature) - int32_t(previous.raw_temperature)));
+      }
+    }
+    ++_since_key;
+    _previous = record;
+    return size_t(p - out);
+  }
+
+  // The next frame will be a key frame, to be
+  // called at the start of every file or payload.
+  void reset()
+  {
+    _since_key = KEY_INTERVAL;
+  }
+
+private:
+  bool same_layout(const compact_record_t& record) const
+  {
+    if(record.count != _previous.count)
+    {
+      return false;
+    }
+    for(size_t i = 0; i < record.count; ++i)
+    {
+      if(record.readings[i].busno != _previous.readings[i].busno
+         || record.readings[i].address != _previous.readings[i].address)
+      {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  compact_record_t _previous = {};
+  size_t _since_key = KEY_INTERVAL;
+};
+
+class Decoder
+{
+public:
+  // Decodes the frame at in. Returns the position behind
+  // it, or nullptr if the data is truncated, corrupt or
+  // a delta frame comes before any key frame.
+  const uint8_t* decode(const uint8_t* in, const uint8_t* end, compact_record_t& record)
+  {
+    if(in >= end)
+    {
+      return nullptr;
+    }
+    uint32_t value;
+    const auto tag = *in++;
+    if(tag == KEY_FRAME)
+    {
+      if(in >= end || *in > MAX_SENSORS || end - in < 1 + 2 * *in)
+      {
+        return nullptr;
+      }
+      record.count = *in++;
+      for(size_t i = 0; i < record.count; ++i)
+      {
+        record.readings[i].busno = *in++;
+        record.readings[i].address = *in++;
+      }
+      if(!(in = get_varint(in, end, value)))
+      {
+        return nullptr;
+      }
+      record.timestamp = value;
+      for(size_t i = 0; i < record.count; ++i)
+      {
+        if(!(in = get_varint(in, end, value)))
+        {
+          return nullptr;
+        }
+        record.readings[i].raw_humidity = uint16_t(value);
+        if(!(in = get_varint(in, end, value)))
+        {
+          return nullptr;
+        }
+        record.readings[i].raw_temperature = uint16_t(value);
+      }
+    }
+    else if(tag == DELTA_FRAME && _have_key)
+    {
+      record = _previous;
+      if(!(in = get_varint(in, end, value)))
+      {
+        return nullptr;
+      }
+      record.timestamp += unzigzag(value);
+      for(size_t i = 0; i < record.count; ++i)
+      {
+        if(!(in = get_varint(in, end, value)))
+        {
+          return nullptr;
+        }
+        record.readings[i].raw_humidity += unzigzag(value);
+        if(!(in = get_varint(in, end, value)))
+        {
+          return nullptr;
+        }
+        record.readings[i].raw_temperature += unzigzag(value);
+      }
+    }
+    else
+    {
+      return nullptr;
+    }
+    _have_key = true;
+    _previous = record;
+    return in;
+  }
+
+  void reset()
+  {
+    _have_key = false;
+  }
+
+private:
+  compact_record_t _previous = {};
+  bool _have_key = false;
+};
+
+// The payload of batched uploads, several records with
+// their sequence numbers in one message:
+//
+//   'B' version count (dsequence frame){count}
+//
+// The first dsequence is absolute, the following ones are
+// relative to the previous record. count is a single byte.
+const uint8_t BATCH_MAGIC = 'B';
+const uint8_t BATCH_VERSION = 1;
+const size_t MAX_BATCH_RECORDS = 255;
+
+constexpr size_t max_batch_size(size_t count)
+{
+  return 3 + count * (5 + MAX_FRAME_SIZE);
+}
+
+class BatchEncoder
+{
+public:
+  // out must have room for max_batch_size() bytes
+  explicit BatchEncoder(uint8_t* out)
+    : _out(out)
+    , _p(out + 3)
+  {
+    _out[0] = BATCH_MAGIC;
+    _out[1] = BATCH_VERSION;
+    _out[2] = 0;
+  }
+
+  // Returns false if the batch is full
+  bool add(uint32_t sequence, const compact_record_t& record)
+  {
+    if(_out[2] == MAX_BATCH_RECORDS)
+    {
+      return false;
+    }
+    _p = put_varint(_p, sequence - _previous_sequence);
+    _p += _encoder.encode(record, _p);
+    _previous_sequence = sequence;
+    ++_out[2];
+    return true;
+  }
+
+  size_t count() const { return _out[2]; }
+  const uint8_t* data() const { return _out; }
+  size_t size() const { return size_t(_p - _out); }
+
+private:
+  uint8_t* _out;
+  uint8_t* _p;
+  Encoder _encoder;
+  uint32_t _previous_sequence = 0;
+};
+
+// Calls callback(sequence, record) for every record in
+// the batch. Returns false if the payload is corrupt or of
+// an unknown version.
+template<typename Callback>
+bool decode_batch(const uint8_t* in, size_t len, Callback callback)
+{
+  const auto end = in + len;
+  if(len < 3 || in[0] != BATCH_MAGIC || in[1] != BATCH_VERSION)
+  {
+    return false;
+  }
+  const size_t count = in[2];
+  in += 3;
+  Decoder decoder;
+  uint32_t sequence = 0;
+  for(size_t i = 0; i < count; ++i)
+  {
+    uint32_t delta;
+    compact_record_t record;
+    if(!(in = get_varint(in, end, delta)) || !(in = decoder.decode(in, end, record)))
+    {
+      return false;
+    }
+    sequence += delta;
+    callback(sequence, record);
+  }
+  return in == end;
+}
+
+} // namespace beehive::records::codec
@@ -0,0 +1,40 @@
+// Copyright: 2022, Diez B. Roggisch, Berlin, all rights reserved
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// The compact binary representation of one sensor cycle. This
+// is shared between everything that needs to keep readings
+// around without going through the text formats, so it must
+// not depend on anything ESP specific.
+namespace beehive::records {
+
+// TCA9548A has 8 busses, each can carry two SHT3XDIS
+const size_t MAX_SENSORS = 16;
+
+struct compact_reading_t
+{
+  uint8_t busno;
+  uint8_t address;
+  uint16_t raw_humidity;
+  uint16_t raw_temperature;
+} __attribute__((packed));
+
+struct compact_record_t
+{
+  // seconds since epoch
+  uint32_t timestamp;
+  uint8_t count;
+  compact_reading_t readings[MAX_SENSORS];
+} __attribute__((packed));
+
+// Number of bytes actually used by a record, the
+// unused readings slots can be omitted when storing.
+inline size_t used_size(const compact_record_t& record)
+{
+  return offsetof(compact_record_t, readings) + record.count * sizeof(compact_reading_t);
+}
+
+} // namespace beehive::records
@@ -0,0 +1,116 @@
+// Copyright: 2022, Diez B. Roggisch, Berlin, all rights reserved
+
+#include "reporting.hpp"
+#include "appstate.hpp"
+#include "records.hpp"
+
+#include <esp_attr.h>
+#include <esp_log.h>
+
+#include <algorithm>
+#include <cstdlib>
+
+#define TAG "reporting"
+
+namespace beehive::reporting {
+
+namespace {
+
+using namespace beehive::events::sensors;
+
+struct reported_t
+{
+  uint8_t busno;
+  uint8_t address;
+  uint16_t raw_humidity;
+  uint16_t raw_temperature;
+  int64_t timestamp;
+};
+
+struct rtc_state_t
+{
+  size_t count;
+  reported_t sensors[beehive::records::MAX_SENSORS];
+};
+
+RTC_DATA_ATTR rtc_state_t s_state[SINK_COUNT];
+
+reported_t* find(rtc_state_t& state, const sht3xdis_value_t& reading)
+{
+  for(size_t i=0; i < state.count; ++i)
+  {
+    auto& sensor = state.sensors[i];
+    if(sensor.busno == reading.busno && sensor.address == reading.address)
+    {
+      return &sensor;
+    }
+  }
+  return nullptr;
+}
+
+bool moved(uint16_t value, uint16_t reported, uint32_t deadband)
+{
+  return uint32_t(std::abs(int(value) - int(reported))) > deadband;
+}
+
+} // namespace
+
+bool enabled()
+{
+  return beehive::appstate::deadband() > 0;
+}
+
+void filter(sink_t sink, std::time_t timestamp, std::vector<sht3xdis_value_t>& readings)
+{
+  if(!enabled())
+  {
+    return;
+  }
+  const auto deadband = beehive::appstate::deadband();
+  const auto heartbeat = int64_t(beehive::appstate::heartbeat());
+  auto& state = s_state[sink];
+  const auto count = readings.size();
+  readings.erase(
+    std::remove_if(
+      readings.begin(), readings.end(),
+      [&](const sht3xdis_value_t& reading) {
+        auto sensor = find(state, reading);
+        if(sensor
+           && !moved(reading.raw_humidity, sensor->raw_humidity, deadband)
+           && !moved(reading.raw_temperature, sensor->raw_temperature, deadband)
+           // A clock that went backwards makes the heartbeat due
+           && timestamp >= sensor->timestamp
+           && timestamp - sensor->timestamp < heartbeat)
+        {
+          return true;
+        }
+        if(!sensor)
+        {
+          if(state.count == beehive::records::MAX_SENSORS)
+          {
+            // Can't remember it, so always report it
+            return false;
+          }
+          sensor = &state.sensors[state.count++];
+          sensor->busno = reading.busno;
+          sensor->address = reading.address;
+        }
+        sensor->raw_humidity = reading.raw_humidity;
+        sensor->raw_temperature = reading.raw_temperature;
+        sensor->timestamp = timestamp;
+        return false;
+      }),
+    readings.end());
+  ESP_LOGD(TAG, "Reporting %i of %i readings", int(readings.size()), int(count));
+}
+
+void forget(sink_t sink)
+{
+  if(s_state[sink].count)
+  {
+    ESP_LOGW(TAG, "Readings weren't delivered, reporting all next time");
+  }
+  s_state[sink].count = 0;
+}
+
+} // namespace beehive::reporting
@@ -0,0 +1,38 @@
+// Copyright: 2022, Diez B. Roggisch, Berlin, all rights reserved
+
+#pragma once
+
+#include "beehive_events.hpp"
+
+#include <ctime>
+#include <vector>
+
+// Publish-on-change: a sink only reports the sensors whose
+// raw values moved beyond the configured deadband since they
+// were last reported, or whose heartbeat is due. The last
+// reported values live in RTC slow memory, so they survive
+// deep sleep. The SD card is not a sink in this sense, it
+// stores every reading.
+namespace beehive::reporting {
+
+// Every sink keeps its own state, so reporting
+// to one doesn't hold back the other.
+enum sink_t
+{
+  MQTT,
+  LORA,
+  SINK_COUNT
+};
+
+bool enabled();
+
+// Removes the readings that don't need to be reported from
+// readings, and remembers the remaining ones as reported.
+void filter(sink_t, std::time_t timestamp, std::vector<events::sensors::sht3xdis_value_t>& readings);
+
+// The sink couldn't deliver readings filter() let through.
+// What they were compared against is forgotten, so the
+// next readings are all reported.
+void forget(sink_t);
+
+} // namespace beehive::reporting
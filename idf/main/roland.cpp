@@ -1,57 +1,66 @@
 #include "roland.hpp"
 #include "appstate.hpp"
 
+#include <esp_log.h>
+
 #include <iterator>
-#include <sstream>
-#include <iomanip>
 #include <type_traits>
 #include <algorithm>
 
+#define TAG "roland"
+
 namespace beehive::mqtt::roland {
 
 namespace {
 
-const auto QOS = 1;
 const auto RETAIN = 0;
 const auto TOPIC = "B-value";
+// The SHT3x resolves 0.01 degrees and percent
+const auto DECIMALS = 2;
 
 void publish_one_message(
+    beehive::util::Formatter& payload,
     const size_t counter,
+    const std::time_t timestamp,
     const std::vector<events::sensors::sht3xdis_value_t> &readings,
     std::function<void(const char *topic, const char *data, int len, int qos,
                        int retain)>
     publish,
-    const std::string& column_suffix
+    int qos,
+    std::string_view column_suffix
   ) {
-  std::stringstream ss;
   size_t readings_count = 0;
 
-  time_t now;
-  time(&now);
-
-  ss << beehive::appstate::system_name() << column_suffix << "," << counter << "," << now << ":";
+  payload.clear();
+  payload.append(beehive::appstate::system_name()).append(column_suffix);
+  payload.append(',').decimal(counter).append(',').decimal(int64_t(timestamp)).append(':');
 
   for(const auto& entry : readings)
   {
-    ss << std::hex << std::setw(2) << std::setfill('0') << int(entry.busno);
-    ss << std::hex << std::setw(2) << std::setfill('0') << int(entry.address) << ",";
-    ss << entry.temperature << "," << entry.humidity;
+    payload.hex(entry.busno, 2).hex(entry.address, 2).append(',');
+    payload.fixed(entry.temperature, DECIMALS).append(',').fixed(entry.humidity, DECIMALS);
     if(++readings_count < readings.size())
     {
-      ss << ":";
+      payload.append(':');
     }
   }
-  const auto payload = ss.str();
-  publish(TOPIC, payload.c_str(), payload.size(), QOS, RETAIN);
+  if(payload.overflowed())
+  {
+    ESP_LOGE(TAG, "Payload for %i readings too long", int(readings.size()));
+    return;
+  }
+  publish(TOPIC, payload.c_str(), payload.size(), qos, RETAIN);
 }
 
 } // namespace
 
-void publish(const size_t counter, const std::vector<events::sensors::sht3xdis_value_t> &readings,
+void publish(beehive::util::Formatter& payload,
+             const size_t counter, const std::time_t timestamp, const std::vector<events::sensors::sht3xdis_value_t> &readings,
              std::function < void(const char *topic, const char *data, int len,
-                                  int qos, int retain)> publish)
+                                  int qos, int retain)> publish,
+             int qos)
 {
-  publish_one_message(counter, readings, publish, "");
+  publish_one_message(payload, counter, timestamp, readings, publish, qos, "");
 }
 
 } // namespace beehive::mqtt::roland
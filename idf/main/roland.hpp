@@ -3,14 +3,20 @@
 #pragma once
 #include "sensors.hpp"
 #include "beehive_events.hpp"
+#include "format.hpp"
 
+#include <ctime>
 #include <functional>
 
 namespace beehive::mqtt::roland {
 
+// payload is the scratch space the message is formatted in
 void publish(
+  beehive::util::Formatter& payload,
   const size_t counter,
+  const std::time_t timestamp,
   const std::vector<events::sensors::sht3xdis_value_t> &readings,
-  std::function < void(const char *topic, const char *data, int len, int qos, int retain)> publish
+  std::function < void(const char *topic, const char *data, int len, int qos, int retain)> publish,
+  int qos
   );
 }
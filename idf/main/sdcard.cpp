@@ -2,16 +2,24 @@
 #include "sdcard.hpp"
 #include "beehive_events.hpp"
 #include "pins.hpp"
-#include "util.hpp"
+#include "format.hpp"
 
+#include <algorithm>
+#include <array>
+#include <cstddef>
 #include <dirent.h>
 #include <fcntl.h>
 #include <fstream>
+#include <memory>
+#include <new>
 #include <stdio.h>
 #include <string.h>
 #include <sys/unistd.h>
 #include <sys/stat.h>
 #include "esp_err.h"
+#include "esp_attr.h"
+#include "esp_rom_crc.h"
+#include "esp_timer.h"
 #include "esp_vfs_fat.h"
 #include "driver/sdspi_host.h"
 #include "driver/spi_common.h"
@@ -19,8 +27,6 @@
 #include "hal/spi_types.h"
 #include "sdkconfig.h"
 #include <iostream>
-#include <sstream>
-#include <iomanip>
 #include <chrono>
 
 //#define LOG_LOCAL_LEVEL ESP_LOG_DEBUG
@@ -35,49 +41,275 @@ static const char *TAG = "sdcard";
 #define MOUNT_POINT "/sdcard"
 static const char *s_mount_point = "/sdcard";
 // must have the form "V<number>," - the comma is important!
-static const char *FILE_FORMAT_VERSION = "V2,";
+static const char *FILE_FORMAT_VERSION = "V3,";
+// "*" + CRC32 in hex + "\r\n"
+#define CRC_SUFFIX_LEN 11
+// A torn write is at most one staging buffer long
+#define MAX_TORN_SIZE 4096
+// Data files are preallocated in whole clusters at creation
+// and filled with zeros, the first NUL byte at the start of
+// a line marks the logical end of the data. Together with
+// the write cursor this keeps appends from touching the FAT.
+// A day of records with two sensors fits into two clusters.
+#define ALLOCATION_UNIT_SIZE (16 * 1024)
+
+struct line_scan_t
+{
+  // offset behind the last valid line
+  size_t end;
+  size_t lines;
+  size_t last_sequence;
+};
 
 #define FILE_PREFIX "BEE" // must be upper-case
 #define DATASETS_PER_FILE (12 * 24) // Just assume every 5 minutes, 24h a day
+// Must *not* start with FILE_PREFIX, otherwise we
+// try to parse it as data file index.
+#define CURSOR_FILENAME MOUNT_POINT "/CURSOR.BIN"
+#define CURSOR_MAGIC 0xbee0c0e0
+// Every INDEX_STRIDE'th record gets an entry in the
+// sparse index, so we can seek to sequence numbers or
+// points in time without reading everything.
+#define INDEX_FILENAME MOUNT_POINT "/INDEX.BIN"
+#define INDEX_STRIDE 32
+// Timestamps before this were taken without NTP time
+#define VALID_TIMESTAMP 1577836800 // 2020-01-01
+// Long enough for a full record of MAX_SENSORS
+#define MAX_LINE_LENGTH 512
+#define WRITER_TASK_STACK 4096
+
+// The writer state we need to continue appending without
+// scanning the card. It is kept in RTC memory so it survives
+// deep sleep, and mirrored onto the card for cold boots.
+struct writer_cursor_t
+{
+  uint32_t magic;
+  uint32_t filename_index;
+  uint32_t datasets_written;
+  uint32_t total_datasets_written;
+  // the logical end of the current file after the last write
+  uint32_t file_end;
+  // the size including the preallocated padding, used to
+  // validate the cursor against the card contents.
+  uint32_t file_size;
+  // where the records in time order begin, see
+  // SDCardWriter::_ordered_since
+  uint32_t ordered_since;
+  uint32_t latest_timestamp;
+  uint32_t crc;
+};
+
+RTC_DATA_ATTR writer_cursor_t s_rtc_cursor;
+
+// The last sequence number handed out. The records of a
+// failed write never make it to the card, but MQTT has
+// published them under their numbers, so those must not
+// be handed out again after deep sleep.
+RTC_DATA_ATTR uint32_t s_reserved_sequence;
+
+uint32_t cursor_crc(const writer_cursor_t& cursor)
+{
+  return esp_rom_crc32_le(0, reinterpret_cast<const uint8_t*>(&cursor), offsetof(writer_cursor_t, crc));
+}
+
+bool cursor_valid(const writer_cursor_t& cursor)
+{
+  return cursor.magic == CURSOR_MAGIC && cursor.crc == cursor_crc(cursor);
+}
 
 // DMA channel to be used by the SPI peripheral
 #ifndef SPI_DMA_CHAN
 #define SPI_DMA_CHAN    1
 #endif //SPI_DMA_CHAN
 
-size_t parse_line(size_t current_total_datasets_written,
-                  const std::vector<char> &line)
+std::optional<size_t> line_sequence(const char* line, size_t len)
 {
-  ESP_LOGD(TAG, "look at line %s", line.data());
-  const auto prefixlen = 1 + strlen(FILE_FORMAT_VERSION);
-  if(line.size() >= 11 && line[0] == '#') // #{FILE_FORMAT_VERSION}01234567,\r\n
+  // #V<number>,01234567,
+  if(len < 3 || line[0] != '#')
+  {
+    return std::nullopt;
+  }
+  const auto comma = static_cast<const char*>(memchr(line, ',', len));
+  if(!comma)
+  {
+    return std::nullopt;
+  }
+  char* end;
+  const auto sequence = strtoul(comma + 1, &end, 16);
+  if(end == comma + 1 || *end != ',')
   {
-    const auto total_datasets_written = size_t(std::stoul(&line[prefixlen], nullptr, 16));
-    if(total_datasets_written > current_total_datasets_written)
+    return std::nullopt;
+  }
+  return size_t(sequence);
+}
+
+int64_t days_from_civil(int64_t y, unsigned m, unsigned d)
+{
+  y -= m <= 2;
+  const auto era = (y >= 0 ? y : y - 399) / 400;
+  const auto yoe = unsigned(y - era * 400);
+  const auto doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+  const auto doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  return era * 146097 + int64_t(doe) - 719468;
+}
+
+// Parses the UTC timestamp in the third column
+std::optional<std::time_t> line_timestamp(const char* line, size_t len)
+{
+  const auto first = static_cast<const char*>(memchr(line, ',', len));
+  const auto second = first ? static_cast<const char*>(memchr(first + 1, ',', len - (first + 1 - line))) : nullptr;
+  if(!second || line + len - second < 20)
+  {
+    return std::nullopt;
+  }
+  int year, month, day, hour, minute, second_;
+  if(sscanf(second + 1, "%4d-%2d-%2dT%2d:%2d:%2d", &year, &month, &day, &hour, &minute, &second_) != 6)
+  {
+    return std::nullopt;
+  }
+  return std::time_t(days_from_civil(year, month, day) * 86400 + hour * 3600 + minute * 60 + second_);
+}
+
+// A record line is only valid if it is complete, and for
+// V3 onwards if its CRC matches.
+bool valid_line(const char* line, size_t len)
+{
+  if(len < 2 || line[0] != '#' || line[len - 1] != '\n')
+  {
+    return false;
+  }
+  if(strncmp(line, "#V2,", 4) == 0)
+  {
+    return true;
+  }
+  // ...,*01234567\r\n
+  const auto crc_pos = len - CRC_SUFFIX_LEN;
+  if(len < CRC_SUFFIX_LEN || line[crc_pos] != '*')
+  {
+    return false;
+  }
+  char* end;
+  const auto crc = strtoul(line + crc_pos + 1, &end, 16);
+  return end == line + len - 2 && crc == esp_rom_crc32_le(0, reinterpret_cast<const uint8_t*>(line), crc_pos);
+}
+
+bool is_data_file(const char* name)
+{
+  const auto prefix_len = strlen(FILE_PREFIX);
+  return strncmp(FILE_PREFIX, name, prefix_len) == 0;
+}
+
+// Reads valid lines from offset on and stops at the
+// first torn or otherwise broken one.
+line_scan_t scan_lines(FILE* f, size_t offset)
+{
+  line_scan_t result = { offset, 0, 0 };
+  fseek(f, offset, SEEK_SET);
+  std::array<char, 512> buffer;
+  std::array<char, 512> line;
+  size_t line_len = 0;
+  size_t read_bytes;
+  while((read_bytes = fread(buffer.data(), 1, buffer.size(), f)) > 0)
+  {
+    for(size_t i=0; i < read_bytes; ++i)
+    {
+      // Either padding or garbage
+      if(line_len == line.size() || (line_len == 0 && buffer[i] != '#'))
+      {
+        return result;
+      }
+      line[line_len++] = buffer[i];
+      if(buffer[i] == '\n')
+      {
+        if(!valid_line(line.data(), line_len))
+        {
+          return result;
+        }
+        const auto sequence = line_sequence(line.data(), line_len);
+        if(sequence)
+        {
+          result.last_sequence = std::max(result.last_sequence, *sequence);
+        }
+        result.end += line_len;
+        ++result.lines;
+        line_len = 0;
+      }
+    }
+  }
+  return result;
+}
+
+// Creates the file with room for a whole rotation
+// of lines this long.
+FILE* create_preallocated(const std::string& fname, size_t line_length)
+{
+  auto f = fopen(fname.c_str(), "w+");
+  if(!f)
+  {
+    return f;
+  }
+  const auto expected_size = (DATASETS_PER_FILE + 1) * line_length;
+  const auto size = (expected_size + ALLOCATION_UNIT_SIZE - 1) / ALLOCATION_UNIT_SIZE * ALLOCATION_UNIT_SIZE;
+  // Whole allocation units go to the card as multi sector
+  // writes. Seeking past the end instead would leave stale
+  // sectors as padding, maybe old valid lines.
+  static const std::array<char, 512> small_zeros = {};
+  std::unique_ptr<char[]> zeros(new(std::nothrow) char[ALLOCATION_UNIT_SIZE]());
+  const auto chunk = zeros ? zeros.get() : small_zeros.data();
+  const auto chunk_size = zeros ? size_t(ALLOCATION_UNIT_SIZE) : small_zeros.size();
+  for(size_t written = 0; written < size; written += chunk_size)
+  {
+    if(fwrite(chunk, 1, chunk_size, f) != chunk_size)
     {
-      ESP_LOGD(TAG, "computed total_datasets_written: %i", int(total_datasets_written));
-      return total_datasets_written;
+      ESP_LOGE(TAG, "Couldn't preallocate %s: %i, %s", fname.c_str(), errno, strerror(errno));
+      break;
     }
   }
-  return current_total_datasets_written;
+  fseek(f, 0, SEEK_SET);
+  return f;
 }
 
 std::string generate_filename(size_t filename_index)
 {
-  std::stringstream ss;
+  beehive::util::FormatBuffer<32> name;
   const auto digits = 8 - strlen(FILE_PREFIX);
   const auto mask = (1 << (4 * digits)) - 1;
-  ss << MOUNT_POINT << "/" << std::string(FILE_PREFIX) << std::hex << std::setw(digits) << std::setfill('0') << (filename_index & mask)  << ".txt";
-  return ss.str();
+  name.append(MOUNT_POINT "/" FILE_PREFIX).hex(filename_index & mask, int(digits)).append(".txt");
+  return name.c_str();
+}
+
+// Including the padding, 0 if there is no such file
+size_t physical_size(const std::string& fname)
+{
+  struct stat statbuf;
+  return stat(fname.c_str(), &statbuf) == 0 ? size_t(statbuf.st_size) : 0;
 }
 
 } // namespace
 
 SDCardWriter::SDCardWriter()
-  : _file(nullptr)
+  : _mounted(false)
+  , _write_failed(false)
+  , _current_staging(nullptr)
+  , _staging_events(0)
+  , _unreported(false)
+  , _unreported_failure(false)
+  , _writer_task(nullptr)
+  , _next_sequence(0)
+  , _max_queue_depth(0)
+  , _dropped(0)
+  , _records_written(0)
+  , _bytes_written(0)
+  , _write_path_time(0)
+  , _preallocation_time(0)
+  , _boot_recovery_time(0)
+  , _file(nullptr)
+  , _file_end(0)
   , _filename_index(0)
   , _datasets_written(0)
   , _total_datasets_written(0)
+  , _ordered_since(1)
+  , _latest_timestamp(0)
 {
     esp_err_t ret;
     // Options for mounting the filesystem.
@@ -85,8 +317,14 @@ SDCardWriter::SDCardWriter()
     // formatted in case when mounting fails.
     esp_vfs_fat_sdmmc_mount_config_t mount_config = {
         .format_if_mount_failed = true,
-        .max_files = 5,
-        .allocation_unit_size = 16 * 1024
+        // Open at the same time at most: one file for the
+        // writer task, which writes cursor and index only
+        // after closing the data file, and one each for the
+        // outbox replay and the HTTP server, which serves one
+        // request at a time. Directories don't count. Each
+        // slot costs a sector buffer, 8 leaves room to spare.
+        .max_files = 8,
+        .allocation_unit_size = ALLOCATION_UNIT_SIZE
     };
 
     ESP_LOGI(TAG, "Initializing SD card");
@@ -132,15 +370,34 @@ SDCardWriter::SDCardWriter()
     }
     // Card has been initialized, print its properties
     sdmmc_card_print_info(stdout, _card);
+    _mounted = true;
     esp_event_post(
       SDCARD_EVENTS, beehive::events::sdcard::MOUNTED, nullptr, 0, 0);
 
-    ESP_ERROR_CHECK(esp_event_handler_instance_register(SENSOR_EVENTS, beehive::events::sensors::SHT3XDIS_READINGS, SDCardWriter::s_sensor_event_handler, this, NULL));
+    diskstats::install(_card, s_mount_point);
+
+    const auto recovery_start = esp_timer_get_time();
     setup_file_info();
+    _boot_recovery_time = uint32_t(esp_timer_get_time() - recovery_start);
+    ESP_LOGI(TAG, "Boot recovery took %ius", int(_boot_recovery_time));
+    _total_datasets_written = std::max<size_t>(_total_datasets_written, s_reserved_sequence);
+    _next_sequence = _total_datasets_written;
+
+    // A slow card must not stall the event loop, so the
+    // actual writing happens in a task of its own.
+    _staging = std::make_unique<staging_queue_t>();
+    xTaskCreate(SDCardWriter::s_writer_task, "sdcard", WRITER_TASK_STACK, this, tskIDLE_PRIORITY + 1, &_writer_task);
+
+    ESP_ERROR_CHECK(esp_event_handler_instance_register(SENSOR_EVENTS, beehive::events::sensors::SHT3XDIS_READINGS, SDCardWriter::s_sensor_event_handler, this, NULL));
+    ESP_ERROR_CHECK(esp_event_handler_instance_register(SENSOR_EVENTS, beehive::events::sensors::SHT3XDIS_BATCH, SDCardWriter::s_sensor_event_handler, this, NULL));
 }
 
 SDCardWriter::~SDCardWriter()
 {
+    if(_writer_task)
+    {
+      vTaskDelete(_writer_task);
+    }
     // All done, unmount partition and disable SDMMC or SPI peripheral
     esp_vfs_fat_sdcard_unmount(s_mount_point, _card);
     ESP_LOGI(TAG, "Card unmounted");
@@ -153,52 +410,194 @@ void SDCardWriter::count_datasets_written()
   auto f = fopen(fname.c_str(), "r");
   if(f)
   {
-    ESP_LOGD(TAG, "Counting newlines in %s", fname.c_str());
+    ESP_LOGD(TAG, "Counting lines in %s", fname.c_str());
+    const auto tail = scan_lines(f, 0);
+    fseek(f, 0, SEEK_END);
+    const auto file_size = size_t(ftell(f));
+    fclose(f);
+    ESP_LOGD(TAG, "Counted %zu lines", tail.lines);
+    _datasets_written = tail.lines;
+    _total_datasets_written = std::max<size_t>(_total_datasets_written, tail.last_sequence);
+    _file_end = tail.end;
+    repair_tail(fname, tail.end, file_size, 0, false);
+  }
+  else
+  {
+    ESP_LOGE(TAG, "Couldn't count open file '%s' to count", fname.c_str());
+  }
+}
 
-    size_t newlines_counted = 0;
-    auto use_count = false;
-    std::array<char, 256> buffer;
-    std::vector<char> line_buffer;
-    while(true)
+void SDCardWriter::repair_tail(const std::string& fname, size_t valid_size, size_t file_size, size_t records_recovered, bool used_cursor)
+{
+  beehive::events::sdcard::recovery_report_t report = {
+    _filename_index,
+    0,
+    records_recovered,
+    used_cursor
+  };
+  if(valid_size < file_size)
+  {
+    auto f = fopen(fname.c_str(), "r+");
+    if(!f)
     {
-      clearerr(f);
-      const auto read_bytes = fread(buffer.data(), 1, buffer.size(), f);
-      if(read_bytes == 0)
+      ESP_LOGE(TAG, "Can't open %s for repair: %i, %s", fname.c_str(), errno, strerror(errno));
+      return;
+    }
+    // Inside the preallocated space the torn record is
+    // followed by padding, and we just blank it out.
+    // Otherwise it's at the end of the file.
+    std::array<char, 512> buffer;
+    fseek(f, valid_size, SEEK_SET);
+    auto padded = false;
+    size_t read_bytes;
+    while(!padded && report.bytes_discarded < MAX_TORN_SIZE && (read_bytes = fread(buffer.data(), 1, buffer.size(), f)) > 0)
+    {
+      const auto nul = std::find(buffer.begin(), buffer.begin() + read_bytes, '\0');
+      padded = nul != buffer.begin() + read_bytes;
+      report.bytes_discarded += nul - buffer.begin();
+    }
+    if(padded)
+    {
+      if(report.bytes_discarded)
       {
-	if(feof(f))
-	{
-	  use_count = true;
-	}
-	break;
+        ESP_LOGE(TAG, "Blanking torn record in %s: %i bytes at %i", fname.c_str(), int(report.bytes_discarded), int(valid_size));
+        buffer.fill(0);
+        fseek(f, valid_size, SEEK_SET);
+        for(size_t blanked = 0; blanked < report.bytes_discarded; blanked += buffer.size())
+        {
+          fwrite(buffer.data(), 1, std::min(buffer.size(), report.bytes_discarded - blanked), f);
+        }
       }
-      for(size_t i=0; i < read_bytes; ++i)
+      fclose(f);
+    }
+    else
+    {
+      fclose(f);
+      report.bytes_discarded = file_size - valid_size;
+      ESP_LOGE(TAG, "Truncating torn record in %s: %i -> %i", fname.c_str(), int(file_size), int(valid_size));
+      if(truncate(fname.c_str(), valid_size) != 0)
       {
-	const auto c = buffer[i];
-	line_buffer.push_back(c);
-	if(c == '\n')
-	{
-	  line_buffer.push_back(0);
-	  ++newlines_counted;
-	  _total_datasets_written = parse_line(_total_datasets_written, line_buffer);
-	  line_buffer.clear();
-	}
+        ESP_LOGE(TAG, "Truncating %s failed: %i, %s", fname.c_str(), errno, strerror(errno));
       }
+    }
+  }
+  if(report.bytes_discarded || report.records_recovered || !used_cursor)
+  {
+    beehive::events::sdcard::recovered(report);
+  }
+}
 
+bool SDCardWriter::restore_cursor()
+{
+  writer_cursor_t cursor = s_rtc_cursor;
+  if(!cursor_valid(cursor))
+  {
+    ESP_LOGD(TAG, "No RTC cursor, trying %s", CURSOR_FILENAME);
+    auto f = fopen(CURSOR_FILENAME, "rb");
+    if(!f)
+    {
+      return false;
+    }
+    const auto read = fread(&cursor, sizeof(cursor), 1, f);
+    fclose(f);
+    if(read != 1 || !cursor_valid(cursor))
+    {
+      ESP_LOGE(TAG, "Corrupt cursor file %s", CURSOR_FILENAME);
+      return false;
+    }
+  }
+  // The cursor must match the card, otherwise the card
+  // has been swapped or written to externally.
+  // Data behind the cursor means we lost power after writing
+  // but before updating the cursor, so we only need to look
+  // at the tail. The preallocated padding behind it is zero,
+  // so a single byte tells us whether there is any.
+  const auto fname = generate_filename(cursor.filename_index);
+  const auto file_size = physical_size(fname);
+  if(file_size < cursor.file_end)
+  {
+    ESP_LOGE(TAG, "Cursor mismatch for %s: %i < %i", fname.c_str(), int(file_size), int(cursor.file_end));
+    return false;
+  }
+  _filename_index = cursor.filename_index;
+  _datasets_written = cursor.datasets_written;
+  _total_datasets_written = cursor.total_datasets_written;
+  _ordered_since = cursor.ordered_since;
+  _latest_timestamp = cursor.latest_timestamp;
+  _file_end = cursor.file_end;
+  if(file_size > cursor.file_end)
+  {
+    auto f = fopen(fname.c_str(), "r");
+    if(!f)
+    {
+      return false;
     }
-    if(use_count)
+    char next = 0;
+    fseek(f, cursor.file_end, SEEK_SET);
+    if(file_size == cursor.file_size && fread(&next, 1, 1, f) == 1 && next == '\0')
+    {
+      fclose(f);
+    }
+    else
     {
-      ESP_LOGD(TAG, "Counted %i newlines", newlines_counted);
-      _datasets_written = newlines_counted;
+      const auto tail = scan_lines(f, cursor.file_end);
+      fclose(f);
+      _datasets_written += tail.lines;
+      _total_datasets_written = std::max<size_t>(_total_datasets_written, tail.last_sequence);
+      _file_end = tail.end;
+      if(tail.lines)
+      {
+        // We don't know the times of these
+        _ordered_since = _total_datasets_written + 1;
+        _latest_timestamp = 0;
+      }
+      repair_tail(fname, tail.end, file_size, tail.lines, true);
+      if(tail.lines || file_size != cursor.file_size)
+      {
+        store_cursor(tail.end, physical_size(fname));
+      }
     }
   }
+  ESP_LOGI(TAG, "Restored cursor: file %i, datasets %i, total %i", int(_filename_index), int(_datasets_written), int(_total_datasets_written));
+  return true;
+}
+
+void SDCardWriter::store_cursor(size_t file_end, size_t file_size)
+{
+  writer_cursor_t cursor = {
+    CURSOR_MAGIC,
+    uint32_t(_filename_index),
+    uint32_t(_datasets_written),
+    uint32_t(_total_datasets_written),
+    uint32_t(file_end),
+    uint32_t(file_size),
+    uint32_t(_ordered_since),
+    _latest_timestamp,
+    0
+  };
+  cursor.crc = cursor_crc(cursor);
+  s_rtc_cursor = cursor;
+
+  auto f = fopen(CURSOR_FILENAME, "wb");
+  if(f)
+  {
+    fwrite(&cursor, sizeof(cursor), 1, f);
+    fclose(f);
+  }
   else
   {
-    ESP_LOGE(TAG, "Couldn't count open file '%s' to count", fname.c_str());
+    ESP_LOGE(TAG, "error opening cursor file %s: %i, %s", CURSOR_FILENAME, errno, strerror(errno));
   }
 }
 
 void SDCardWriter::setup_file_info()
 {
+  if(restore_cursor())
+  {
+    return;
+  }
+  ESP_LOGI(TAG, "No valid cursor, scanning %s", s_mount_point);
+
   const auto prefix_len = strlen(FILE_PREFIX);
 
   struct dirent *ep;
@@ -210,14 +609,14 @@ void SDCardWriter::setup_file_info()
     {
       const auto entry_len = strnlen(ep->d_name, 256);
       const auto compare_len = std::min(entry_len, prefix_len);
-      ESP_LOGD(TAG, "Found file: '%s', compare length: %i, entry_len: %i", ep->d_name, compare_len, entry_len);
+      ESP_LOGD(TAG, "Found file: '%s', compare length: %zu, entry_len: %zu", ep->d_name, compare_len, entry_len);
       if(strncmp(FILE_PREFIX, ep->d_name, compare_len) == 0)
       {
 	const auto file_index_of_found_file = std::stoul(std::string(&ep->d_name[prefix_len]), nullptr, 16);
 	ESP_LOGD(TAG, "Found beehive file %s, %i", ep->d_name, int(file_index_of_found_file));
-	_filename_index = std::max(
+	_filename_index = std::max<size_t>(
 	  _filename_index,
-	  size_t(file_index_of_found_file)
+	  file_index_of_found_file
 	);
 	// In a first approximation, we derive the datapoint index from the
 	// number of entries per day
@@ -226,6 +625,11 @@ void SDCardWriter::setup_file_info()
     }
     closedir(dp);
     count_datasets_written();
+    // The times on the card are unknown, so the
+    // records in order start with the next one.
+    _ordered_since = _total_datasets_written + 1;
+    _latest_timestamp = 0;
+    store_cursor(_file_end, physical_size(generate_filename(_filename_index)));
   }
   else
   {
@@ -240,7 +644,7 @@ void SDCardWriter::report_file_size()
   ESP_LOGD(TAG, "File %s size %li", _filename.c_str(), statbuf.st_size);
 }
 
-void SDCardWriter::file_rotation() {
+void SDCardWriter::file_rotation(size_t line_length) {
   if(_datasets_written > DATASETS_PER_FILE)
   {
     _datasets_written = 0;
@@ -253,14 +657,23 @@ void SDCardWriter::file_rotation() {
     }
     _filename = generate_filename(_filename_index);
 
-    const auto mode = _datasets_written == 0 ? "w" : "a";
     if(_datasets_written == 0)
     {
       ESP_LOGI(TAG, "Creating SD card log file '%s'", _filename.c_str());
+      const auto preallocation_start = esp_timer_get_time();
+      _file = create_preallocated(_filename, line_length);
+      _preallocation_time += uint32_t(esp_timer_get_time() - preallocation_start);
+      _file_end = 0;
+    }
+    else
+    {
+      // Appending means writing over the padding
+      _file = fopen(_filename.c_str(), "r+");
+      if(_file)
+      {
+        fseek(_file, _file_end, SEEK_SET);
+      }
     }
-    ESP_LOGD(TAG, "log file mode: '%s'", mode);
-
-    _file = fopen(_filename.c_str(), mode);
 
     if(!_file)
     {
@@ -272,54 +685,573 @@ void SDCardWriter::file_rotation() {
 
 
 void SDCardWriter::s_sensor_event_handler(void *handler_args,
-                                        esp_event_base_t base, int32_t id,
+                                        esp_event_base_t, int32_t id,
                                         void *event_data) {
-  static_cast<SDCardWriter*>(handler_args)->sensor_event_handler(base, beehive::events::sensors::sensor_events_t(id), event_data);
+  static_cast<SDCardWriter*>(handler_args)->sensor_event_handler(beehive::events::sensors::sensor_events_t(id), event_data);
+}
+
+void SDCardWriter::sensor_event_handler(beehive::events::sensors::sensor_events_t id, void* event_data)
+{
+  const auto records = beehive::events::sensors::receive_records(id, event_data);
+  if(records)
+  {
+    ++_staging_events;
+    for(const auto& record : *records)
+    {
+      // Even if the record gets dropped, MQTT counts it too
+      const auto sequence = ++_next_sequence;
+      s_reserved_sequence = uint32_t(sequence);
+      auto* buffer = staging_buffer();
+      if(buffer && (buffer->line_count == buffer->lines.size() || buffer->text.size() - buffer->fill < MAX_LINE_LENGTH))
+      {
+        publish_staged();
+        buffer = staging_buffer();
+      }
+      // Waiting would stall the event loop
+      if(!buffer)
+      {
+        ++_dropped;
+        ESP_LOGE(TAG, "Staging buffers full, dropping record %i, %i dropped", int(sequence), int(_dropped));
+        continue;
+      }
+      beehive::util::Formatter line(buffer->text.data() + buffer->fill, MAX_LINE_LENGTH);
+      line.append('#').append(FILE_FORMAT_VERSION).hex(uint32_t(sequence), 8).append(',').isoformat(record.timestamp).append(',');
+      for(const auto& reading : record.readings)
+      {
+        line.hex(reading.busno, 2).append(',').hex(reading.address, 2).append(',');
+        line.append('H').hex(reading.raw_humidity, 4).append(",T").hex(reading.raw_temperature, 4).append(',');
+      }
+      const auto crc = esp_rom_crc32_le(0, reinterpret_cast<const uint8_t*>(line.c_str()), line.size());
+      line.append('*').hex(crc, 8).append("\r\n");
+      if(line.overflowed())
+      {
+        ESP_LOGE(TAG, "Line for %i readings too long, dropping record %i", int(record.readings.size()), int(sequence));
+        continue;
+      }
+      const auto len = line.size();
+      buffer->lines[buffer->line_count++] = {
+        uint32_t(sequence),
+        uint32_t(record.timestamp),
+        uint16_t(buffer->fill),
+        uint16_t(len)
+      };
+      buffer->fill += len;
+    }
+    publish_staged();
+    // A drain that ran meanwhile left the report to us
+    --_staging_events;
+    xTaskNotifyGive(_writer_task);
+  }
 }
 
-void SDCardWriter::sensor_event_handler(esp_event_base_t base, beehive::events::sensors::sensor_events_t id, void* event_data)
+staging_buffer_t* SDCardWriter::staging_buffer()
 {
-  const auto readings = beehive::events::sensors::receive_readings(id, event_data);
-  file_rotation();
-  if(readings)
+  if(!_current_staging)
   {
-    if(_file)
+    _current_staging = _staging->producer_slot();
+    if(_current_staging)
     {
-      ESP_LOGD(TAG, "Writing data to the sdcard");
-      std::stringstream ss;
+      _current_staging->line_count = 0;
+      _current_staging->fill = 0;
+    }
+  }
+  return _current_staging;
+}
+
+void SDCardWriter::publish_staged()
+{
+  if(_current_staging && _current_staging->line_count)
+  {
+    _current_staging = nullptr;
+    _staging->publish();
+    _max_queue_depth = std::max(_max_queue_depth, _staging->size());
+    xTaskNotifyGive(_writer_task);
+  }
+}
+
+void SDCardWriter::s_writer_task(void* user_data)
+{
+  static_cast<SDCardWriter*>(user_data)->writer_task();
+}
 
-      ss << "#" << FILE_FORMAT_VERSION << std::hex << std::setw(8) << std::setfill('0') << ++_total_datasets_written << "," << beehive::util::isoformat() << ",";
+void SDCardWriter::writer_task()
+{
+  while(true)
+  {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    drain();
+  }
+}
 
-      for(const auto& reading : *readings)
+void SDCardWriter::drain()
+{
+  auto buffer = _staging->consumer_slot();
+  if(buffer)
+  {
+    write_buffers(buffer);
+  }
+  // Events still staging or buffers still queued get their
+  // own notification, the drain after them reports.
+  if(!_unreported || _staging_events != 0 || _staging->size() != 0)
+  {
+    return;
+  }
+  _unreported = false;
+  if(!_unreported_failure)
+  {
+    const size_t total_datasets_written = _total_datasets_written;
+    const size_t filename_index = _filename_index;
+    esp_event_post(
+      SDCARD_EVENTS, beehive::events::sdcard::DATASET_WRITTEN, &total_datasets_written, sizeof(total_datasets_written), 0);
+    esp_event_post(
+      SDCARD_EVENTS, beehive::events::sdcard::FILE_COUNT, &filename_index, sizeof(filename_index), 0);
+  }
+  else
+  {
+    esp_event_post(
+      SDCARD_EVENTS, beehive::events::sdcard::NO_FILE, nullptr, 0, 0);
+  }
+  _unreported_failure = false;
+}
+
+void SDCardWriter::write_buffers(staging_buffer_t* buffer)
+{
+  auto written = false;
+  auto failed = false;
+  const auto drain_start = esp_timer_get_time();
+  _index_entries.clear();
+  for(; buffer; buffer = _staging->consumer_slot())
+  {
+    if(!failed && write_staged(*buffer))
+    {
+      written = true;
+    }
+    else
+    {
+      failed = true;
+    }
+    _staging->release();
+  }
+  if(_file)
+  {
+    // We close the file here because
+    // the event will trigger the deep sleep of the
+    // system. And we want to be sure we have written all
+    // data.
+    close_file();
+  }
+  if(!_index_entries.empty())
+  {
+    auto f = fopen(INDEX_FILENAME, "ab");
+    if(f)
+    {
+      fwrite(_index_entries.data(), sizeof(index_entry_t), _index_entries.size(), f);
+      fclose(f);
+    }
+  }
+
+  _write_path_time += uint32_t(esp_timer_get_time() - drain_start);
+
+  _write_failed = failed || !written;
+  _unreported = true;
+  _unreported_failure = _unreported_failure || _write_failed;
+}
+
+bool SDCardWriter::write_staged(const staging_buffer_t& buffer)
+{
+  size_t line = 0;
+  while(line < buffer.line_count)
+  {
+    file_rotation(buffer.lines[line].length);
+    if(!_file)
+    {
+      return false;
+    }
+    // All lines that still fit into this file
+    // go out with one fwrite.
+    const auto count = std::min(buffer.line_count - line, size_t(DATASETS_PER_FILE + 1 - _datasets_written));
+    const auto start = buffer.lines[line].offset;
+    const auto& last = buffer.lines[line + count - 1];
+    const auto len = size_t(last.offset + last.length - start);
+    const auto file_offset = size_t(ftell(_file));
+    for(auto i = line; i < line + count; ++i)
+    {
+      const auto& staged = buffer.lines[i];
+      if(staged.timestamp >= VALID_TIMESTAMP)
+      {
+        if(staged.timestamp < _latest_timestamp)
+        {
+          ESP_LOGW(TAG, "Clock went back at sequence %u", unsigned(staged.sequence));
+          _ordered_since = staged.sequence;
+        }
+        _latest_timestamp = staged.timestamp;
+      }
+      if(staged.sequence % INDEX_STRIDE == 0)
+      {
+        // Records without proper time get the latest one,
+        // so the entries stay in order.
+        _index_entries.push_back({
+            staged.sequence,
+            _latest_timestamp,
+            uint32_t(_filename_index),
+            uint32_t(file_offset + staged.offset - start)
+          });
+      }
+    }
+    ESP_LOGD(TAG, "Writing %i lines to the sdcard", int(count));
+    const auto write_start = esp_timer_get_time();
+    const auto ok = fwrite(buffer.text.data() + start, 1, len, _file) == len;
+    _write_latency.record(uint32_t(esp_timer_get_time() - write_start));
+    if(!ok)
+    {
+      ESP_LOGE(TAG, "error writing to %s: %i, %s", _filename.c_str(), errno, strerror(errno));
+      close_file();
+      return false;
+    }
+    _datasets_written += count;
+    _records_written += count;
+    _bytes_written += len;
+    _total_datasets_written = last.sequence;
+    _file_end = file_offset + len;
+    line += count;
+    // A batch might span a file rotation. The full
+    // file gives back the padding it didn't need.
+    if(_datasets_written > DATASETS_PER_FILE)
+    {
+      close_file();
+      if(truncate(_filename.c_str(), _file_end) != 0)
+      {
+        ESP_LOGE(TAG, "Truncating %s failed: %i, %s", _filename.c_str(), errno, strerror(errno));
+      }
+    }
+  }
+  return true;
+}
+
+writer_stats_t SDCardWriter::stats() const
+{
+  return {
+    _staging ? _staging->size() : 0,
+    _max_queue_depth,
+    _dropped,
+    _write_latency.count(),
+    _write_latency.percentile(50),
+    _write_latency.percentile(90),
+    _write_latency.percentile(99),
+    _write_latency.max(),
+    _records_written,
+    _bytes_written,
+    _write_path_time,
+    _preallocation_time,
+    _boot_recovery_time,
+    diskstats::counters()
+  };
+}
+
+void SDCardWriter::close_file()
+{
+  fseek(_file, 0, SEEK_END);
+  const auto file_size = size_t(ftell(_file));
+  fclose(_file);
+  _file = nullptr;
+  report_file_size();
+  store_cursor(_file_end, file_size);
+}
+
+std::vector<file_info_t> SDCardWriter::list_files() const
+{
+  std::vector<file_info_t> result;
+  if(!_mounted)
+  {
+    return result;
+  }
+  auto dp = opendir(s_mount_point);
+  if(!dp)
+  {
+    return result;
+  }
+  struct dirent *ep;
+  while((ep = readdir(dp)))
+  {
+    if(is_data_file(ep->d_name))
+    {
+      const auto size = data_file_size(std::string(MOUNT_POINT "/") + ep->d_name);
+      if(size)
       {
-	ss << std::hex << std::setw(2) << std::setfill('0') << int(reading.busno) << ",";
-	ss << std::hex << std::setw(2) << std::setfill('0') << int(reading.address) << ",";
-	ss << "H" << std::hex << std::setw(4) << std::setfill('0') << int(reading.raw_humidity) << ",";
-	ss << "T" << std::hex << std::setw(4) << std::setfill('0') << int(reading.raw_temperature) << ",";
+        result.push_back({ ep->d_name, *size });
       }
-      ss << "\r\n";
-      fprintf(_file, ss.str().c_str());
-      ++_datasets_written;
-
-      // We close the file here because
-      // the event will trigger the deep sleep of the
-      // system. And we want to be sure we have written all
-      // data.
-      fclose(_file);
-      _file = nullptr;
-      report_file_size();
-
-      esp_event_post(
-	SDCARD_EVENTS, beehive::events::sdcard::DATASET_WRITTEN, &_total_datasets_written, sizeof(_total_datasets_written), 0);
-      esp_event_post(
-	SDCARD_EVENTS, beehive::events::sdcard::FILE_COUNT, &_filename_index, sizeof(_filename_index), 0);
+    }
+  }
+  closedir(dp);
+  std::sort(result.begin(), result.end(), [](const auto& a, const auto& b) { return a.name < b.name; });
+  return result;
+}
+
+std::optional<size_t> SDCardWriter::data_file_size(const std::string& path) const
+{
+  struct stat statbuf;
+  if(stat(path.c_str(), &statbuf) != 0)
+  {
+    return std::nullopt;
+  }
+  // Only the file we write to has padding
+  if(path == generate_filename(_filename_index))
+  {
+    return std::min(size_t(statbuf.st_size), size_t(_file_end));
+  }
+  return size_t(statbuf.st_size);
+}
+
+std::optional<std::string> SDCardWriter::data_file_path(const char* name) const
+{
+  // Only plain data file names, so nobody can
+  // escape the mount point.
+  if(!_mounted || !is_data_file(name) || strlen(name) > 12 || strpbrk(name, "/\\"))
+  {
+    return std::nullopt;
+  }
+  return std::string(MOUNT_POINT "/") + name;
+}
+
+std::optional<size_t> SDCardWriter::first_sequence(size_t filename_index) const
+{
+  const auto fname = generate_filename(filename_index);
+  auto f = fopen(fname.c_str(), "r");
+  if(!f)
+  {
+    return std::nullopt;
+  }
+  std::array<char, 32> head;
+  const auto read_bytes = fread(head.data(), 1, head.size(), f);
+  fclose(f);
+  return line_sequence(head.data(), read_bytes);
+}
+
+std::optional<position_t> SDCardWriter::index_lookup(std::function<bool(uint32_t sequence, uint32_t timestamp)> before) const
+{
+  auto f = fopen(INDEX_FILENAME, "rb");
+  if(!f)
+  {
+    return std::nullopt;
+  }
+  fseek(f, 0, SEEK_END);
+  const auto count = size_t(ftell(f)) / sizeof(index_entry_t);
+
+  // Find the last entry for which before is true
+  std::optional<position_t> result;
+  size_t lo = 0;
+  size_t hi = count;
+  while(lo < hi)
+  {
+    const auto mid = lo + (hi - lo) / 2;
+    index_entry_t entry;
+    fseek(f, mid * sizeof(index_entry_t), SEEK_SET);
+    if(fread(&entry, sizeof(entry), 1, f) != 1)
+    {
+      break;
+    }
+    if(before(entry.sequence, entry.timestamp))
+    {
+      result = position_t{ entry.filename_index, entry.offset };
+      lo = mid + 1;
+    }
+    else
+    {
+      hi = mid;
+    }
+  }
+  fclose(f);
+  return result;
+}
+
+std::optional<position_t> SDCardWriter::time_lookup(std::time_t from, size_t ordered_since) const
+{
+  // The entries before the ordered records count as
+  // before everything, so the predicate stays sorted.
+  return index_lookup(
+    [from, ordered_since](uint32_t entry_sequence, uint32_t entry_timestamp) {
+      return entry_sequence < ordered_since || entry_timestamp <= from;
+    });
+}
+
+position_t SDCardWriter::file_lookup(size_t sequence) const
+{
+  // Binary search for the last file starting at or before the
+  // sequence. Files we can't read count as "before", which
+  // just means we read a bit more than necessary.
+  size_t lo = 1;
+  size_t hi = _filename_index;
+  while(lo < hi)
+  {
+    const auto mid = lo + (hi - lo + 1) / 2;
+    const auto first = first_sequence(mid);
+    if(!first || *first <= sequence)
+    {
+      lo = mid;
     }
     else
     {
-      esp_event_post(
-	SDCARD_EVENTS, beehive::events::sdcard::NO_FILE, nullptr, 0, 0);
+      hi = mid - 1;
+    }
+  }
+  return { lo, 0 };
+}
+
+void SDCardWriter::read_from(position_t position, line_callback_t callback) const
+{
+  std::array<char, 512> buffer;
+  std::array<char, 512> line;
+  for(auto index = position.filename_index; index <= _filename_index; ++index)
+  {
+    const auto fname = generate_filename(index);
+    auto f = fopen(fname.c_str(), "r");
+    if(!f)
+    {
+      continue;
+    }
+    if(index == position.filename_index)
+    {
+      fseek(f, position.offset, SEEK_SET);
+    }
+    size_t line_len = 0;
+    size_t read_bytes;
+    auto padding = false;
+    while(!padding && (read_bytes = fread(buffer.data(), 1, buffer.size(), f)) > 0)
+    {
+      for(size_t i=0; i < read_bytes; ++i)
+      {
+        if(line_len == 0 && buffer[i] == '\0')
+        {
+          padding = true;
+          break;
+        }
+        // Overlong lines are garbage, we just cut them
+        if(line_len < line.size())
+        {
+          line[line_len++] = buffer[i];
+        }
+        if(buffer[i] == '\n')
+        {
+          if(!callback(line.data(), line_len))
+          {
+            fclose(f);
+            return;
+          }
+          line_len = 0;
+        }
+      }
+    }
+    fclose(f);
+  }
+}
+
+std::optional<stored_record_t> SDCardWriter::parse_record(const char* line, size_t len)
+{
+  if(!valid_line(line, len))
+  {
+    return std::nullopt;
+  }
+  const auto sequence = line_sequence(line, len);
+  const auto timestamp = line_timestamp(line, len);
+  if(!sequence || !timestamp)
+  {
+    return std::nullopt;
+  }
+  stored_record_t result = { *sequence, {} };
+  result.record.timestamp = uint32_t(*timestamp);
+  // The readings start behind the third comma, and end
+  // with the line or the CRC.
+  auto p = line;
+  const auto end = line + len;
+  for(int commas = 0; commas < 3 && p; ++commas)
+  {
+    p = static_cast<const char*>(memchr(p, ',', end - p));
+    p = p ? p + 1 : nullptr;
+  }
+  while(p && p < end && *p != '*' && *p != '\r' && result.record.count < beehive::records::MAX_SENSORS)
+  {
+    unsigned busno, address, humidity, temperature;
+    int consumed = 0;
+    if(sscanf(p, "%2x,%2x,H%4x,T%4x,%n", &busno, &address, &humidity, &temperature, &consumed) != 4 || consumed == 0)
+    {
+      return std::nullopt;
+    }
+    result.record.readings[result.record.count++] = {
+      uint8_t(busno), uint8_t(address), uint16_t(humidity), uint16_t(temperature)
+    };
+    p += consumed;
+  }
+  return result;
+}
+
+void SDCardWriter::read_since(size_t sequence, line_callback_t callback) const
+{
+  if(!_mounted)
+  {
+    return;
+  }
+  const auto position = index_lookup(
+    [sequence](uint32_t entry_sequence, uint32_t) { return entry_sequence <= sequence; }
+    );
+  read_from(
+    position ? *position : file_lookup(sequence),
+    [sequence, &callback](const char* line, size_t len) {
+      const auto line_seq = line_sequence(line, len);
+      return !(line_seq && *line_seq > sequence) || callback(line, len);
+    });
+}
+
+void SDCardWriter::read_time_range(std::time_t from, std::time_t to, line_callback_t callback) const
+{
+  if(!_mounted)
+  {
+    return;
+  }
+  // The writer checks the time of every record, and from
+  // ordered_since on they are in order. Records written
+  // while we read haven't been checked yet.
+  const size_t ordered_until = _total_datasets_written;
+  const size_t ordered_since = _ordered_since;
+  auto stopped = false;
+  const auto in_range = [from, to, &callback, &stopped](const char* line, size_t len, std::optional<std::time_t> timestamp) {
+    if(!timestamp || *timestamp < VALID_TIMESTAMP || *timestamp < from || *timestamp > to)
+    {
+      return true;
     }
+    stopped = !callback(line, len);
+    return !stopped;
+  };
+  // Before that the clock went back at some point,
+  // and we have to read everything.
+  if(ordered_since > 1)
+  {
+    read_from(
+      position_t{ 1, 0 },
+      [ordered_since, &in_range](const char* line, size_t len) {
+        const auto sequence = line_sequence(line, len);
+        return (sequence && *sequence >= ordered_since) ? false : in_range(line, len, line_timestamp(line, len));
+      });
+  }
+  if(stopped)
+  {
+    return;
   }
+  const auto position = time_lookup(from, ordered_since);
+  read_from(
+    position ? *position : file_lookup(ordered_since),
+    [to, ordered_since, ordered_until, &in_range](const char* line, size_t len) {
+      const auto sequence = line_sequence(line, len);
+      if(!sequence || *sequence < ordered_since)
+      {
+        return true;
+      }
+      const auto timestamp = line_timestamp(line, len);
+      if(timestamp && *timestamp > to && *timestamp >= VALID_TIMESTAMP && *sequence <= ordered_until)
+      {
+        return false;
+      }
+      return in_range(line, len, timestamp);
+    });
 }
 
 } // namespace beehive::sdcard
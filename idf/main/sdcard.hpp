@@ -3,40 +3,205 @@
 #pragma once
 
 #include "beehive_events.hpp"
+#include "diskstats.hpp"
+#include "histogram.hpp"
+#include "spsc_ring.hpp"
 
-#include "sdcard.hpp"
 #include "sdmmc_cmd.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include <array>
+#include <atomic>
+#include <ctime>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
 
 namespace beehive::sdcard {
 
+struct file_info_t
+{
+  std::string name;
+  size_t size;
+};
+
+struct position_t
+{
+  size_t filename_index;
+  size_t offset;
+};
+
+// One entry of the sparse index on the card
+struct index_entry_t
+{
+  uint32_t sequence;
+  uint32_t timestamp;
+  uint32_t filename_index;
+  uint32_t offset;
+};
+
+struct writer_stats_t
+{
+  size_t queue_depth;
+  size_t max_queue_depth;
+  // records dropped because the writer fell behind
+  uint32_t dropped;
+  uint32_t writes;
+  // latencies of the fwrite calls in us
+  uint32_t p50;
+  uint32_t p90;
+  uint32_t p99;
+  uint32_t max;
+  // the whole write path, from the staging buffer
+  // to the closed file
+  uint32_t records_written;
+  uint32_t bytes_written;
+  uint32_t write_path_time;
+  // creating and zero filling new files, part of the
+  // write path
+  uint32_t preallocation_time;
+  // restoring the cursor or scanning the card at boot
+  uint32_t boot_recovery_time;
+  diskstats::disk_counters_t disk;
+};
+
+// Formatted lines on their way to the writer task.
+struct staged_line_t
+{
+  uint32_t sequence;
+  uint32_t timestamp;
+  uint16_t offset;
+  uint16_t length;
+};
+
+struct staging_buffer_t
+{
+  size_t line_count;
+  size_t fill;
+  std::array<staged_line_t, 32> lines;
+  std::array<char, 4096> text;
+};
+
+struct stored_record_t
+{
+  size_t sequence;
+  beehive::records::compact_record_t record;
+};
+
 class SDCardWriter
 {
 public:
+  // Gets a complete line including the line ending, returns
+  // false to stop reading.
+  using line_callback_t = std::function<bool(const char* line, size_t len)>;
+
   SDCardWriter();
   ~SDCardWriter();
 
   size_t total_datasets_written() const { return _total_datasets_written; }
   size_t file_count() const { return _filename_index; }
+  // True if readings actually end up on the card
+  bool available() const { return _mounted && !_write_failed; }
+  writer_stats_t stats() const;
+
+  // The data files on the card, sorted by name
+  std::vector<file_info_t> list_files() const;
+  // Maps the name of a data file to its full path, if
+  // it is a valid name.
+  std::optional<std::string> data_file_path(const char* name) const;
+  // The size of the data in the file, without padding
+  std::optional<size_t> data_file_size(const std::string& path) const;
+  // Turns a line from read_since or read_time_range
+  // back into a record.
+  static std::optional<stored_record_t> parse_record(const char* line, size_t len);
+  // Passes all lines with a sequence number larger than the given one
+  void read_since(size_t sequence, line_callback_t callback) const;
+  // Passes all lines with a timestamp within [from, to]
+  void read_time_range(std::time_t from, std::time_t to, line_callback_t callback) const;
+
 private:
+  std::optional<size_t> first_sequence(size_t filename_index) const;
+  // Binary search, only for what the index is sorted by
+  std::optional<position_t> index_lookup(std::function<bool(uint32_t sequence, uint32_t timestamp)> before) const;
+  // Where to start reading for records from the given time
+  // among those from ordered_since on, nullopt without index.
+  std::optional<position_t> time_lookup(std::time_t from, size_t ordered_since) const;
+  position_t file_lookup(size_t sequence) const;
+  void read_from(position_t, line_callback_t callback) const;
+
 
   static void s_sensor_event_handler(void *handler_args, esp_event_base_t base, int32_t id, void *event_data);
-  void sensor_event_handler(esp_event_base_t base, beehive::events::sensors::sensor_events_t id, void* event_data);
+  void sensor_event_handler(beehive::events::sensors::sensor_events_t id, void* event_data);
+  // nullptr while the writer task has no free buffer
+  staging_buffer_t* staging_buffer();
+  void publish_staged();
+
+  static void s_writer_task(void*);
+  void writer_task();
+  void drain();
+  // From buffer on, all queued ones
+  void write_buffers(staging_buffer_t* buffer);
+  bool write_staged(const staging_buffer_t&);
   void setup_file_info();
-  void file_rotation();
+  void file_rotation(size_t line_length);
+  void close_file();
   void report_file_size();
   void count_datasets_written();
+  void repair_tail(const std::string& fname, size_t valid_size, size_t file_size, size_t records_recovered, bool used_cursor);
+  bool restore_cursor();
+  // The logical end and the size including padding
+  void store_cursor(size_t file_end, size_t file_size);
 
   sdmmc_card_t* _card;
   sdmmc_host_t _host;
 
+  std::atomic<bool> _mounted;
+  std::atomic<bool> _write_failed;
+
+  // The event loop formats lines into the staging
+  // buffers, the writer task puts them on the card.
+  using staging_queue_t = beehive::util::SPSCRing<staging_buffer_t, 4>;
+  std::unique_ptr<staging_queue_t> _staging;
+  staging_buffer_t* _current_staging;
+  // Sensor events still being staged. The writer reports
+  // only when there are none and the queue is empty, or
+  // the system could sleep on a half written batch.
+  std::atomic<uint32_t> _staging_events;
+  // Drains since the last report, writer task only
+  bool _unreported;
+  bool _unreported_failure;
+  TaskHandle_t _writer_task;
+  size_t _next_sequence;
+  size_t _max_queue_depth;
+  std::atomic<uint32_t> _dropped;
+  beehive::util::LatencyHistogram _write_latency;
+  std::atomic<uint32_t> _records_written;
+  std::atomic<uint32_t> _bytes_written;
+  std::atomic<uint32_t> _write_path_time;
+  std::atomic<uint32_t> _preallocation_time;
+  uint32_t _boot_recovery_time;
+  std::vector<index_entry_t> _index_entries;
+
   FILE* _file;
   std::string _filename;
-  // number of the filename to write to
-  size_t _filename_index;
+  // logical end of the current file
+  std::atomic<size_t> _file_end;
+  // number of the filename to write to, read
+  // from other tasks like the counter
+  std::atomic<size_t> _filename_index;
   // number of datasets written in one file.
   size_t _datasets_written;
   // a globally running number for all datasets
-  size_t _total_datasets_written;
+  std::atomic<size_t> _total_datasets_written;
+  // The records from this sequence number on are in time
+  // order, unless the clock goes back again. Queries by
+  // time can stop early among them.
+  std::atomic<size_t> _ordered_since;
+  // of the records in order, writer task only
+  uint32_t _latest_timestamp;
 };
 
 } // namespace beehive::sdcard
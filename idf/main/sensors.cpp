@@ -6,6 +6,8 @@
 #include "pins.hpp"
 #include "appstate.hpp"
 #include "util.hpp"
+#include "batch.hpp"
+#include "boot.hpp"
 
 #include "deets/i2c/tca9548a.hpp"
 #include "deets/i2c/sht3xdis.hpp"
@@ -36,6 +38,8 @@ using namespace beehive::events::sensors;
 
 const auto SENSOR_READING_COUNT = 16;
 const auto SENSOR_READING_TIMEOUT = 200ms;
+// How long NTP may take on a cold boot
+const auto TIME_TIMEOUT = 15s;
 
 #ifdef CONFIG_BEEHIVE_FAKE_SENSOR_DATA
 const double HZ = 0.1;
@@ -82,7 +86,15 @@ void sensor_task(void* user_pointer)
   while(true)
   {
     ESP_LOGD(TAG, "Doing sensor work, then sleep for %dms", int(millis));
-    sensors.work();
+    const auto readings = sensors.read();
+    beehive::boot::mark(beehive::boot::READINGS_TAKEN);
+    // NTP runs concurrently, and on a cold boot the
+    // readings must not be stamped before it's done.
+    if(!beehive::boot::wait_for(beehive::boot::TIME_VALID, TIME_TIMEOUT))
+    {
+      ESP_LOGE(TAG, "No valid time, the readings carry the wrong timestamp");
+    }
+    beehive::batch::submit(readings);
     vTaskDelay(millis / portTICK_PERIOD_MS);
   }
 }
@@ -118,6 +130,11 @@ Sensors::Sensors(deets::i2c::I2CHost& bus)
 Sensors::~Sensors() {}
 
 void Sensors::work()
+{
+  send_readings(read());
+}
+
+std::vector<sht3xdis_value_t> Sensors::read()
 {
   using namespace beehive::events::sensors;
   using namespace std::chrono_literals;
@@ -176,7 +193,7 @@ void Sensors::work()
   #ifdef CONFIG_BEEHIVE_FAKE_SENSOR_DATA
   fake_sensor_data(readings, sensors_seen);
   #endif
-  send_readings(readings);
+  return readings;
 }
 
 void setup_sensor_task(deets::i2c::I2CHost& i2c_bus)
@@ -3,6 +3,7 @@
 #pragma once
 
 #include "deets/i2c.hpp"
+#include "beehive_events.hpp"
 
 #include <memory>
 #include <vector>
@@ -34,7 +35,9 @@ public:
   Sensors(deets::i2c::I2CHost& bus);
   ~Sensors();
 
+  // Reads and posts the sensor values
   void work();
+  std::vector<beehive::events::sensors::sht3xdis_value_t> read();
 
 private:
 
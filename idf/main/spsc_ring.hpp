@@ -0,0 +1,66 @@
+// Copyright: 2022, Diez B. Roggisch, Berlin, all rights reserved
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+
+namespace beehive::util {
+
+// A lock-free ring for exactly one producer and one consumer
+// task. Slots are filled and drained in place, so big
+// elements don't get copied around.
+template<typename T, size_t N>
+class SPSCRing
+{
+  static_assert(N && (N & (N - 1)) == 0, "N must be a power of two");
+public:
+  // The slot to fill next, or nullptr if the ring is full.
+  T* producer_slot()
+  {
+    const auto head = _head.load(std::memory_order_relaxed);
+    if(head - _tail.load(std::memory_order_acquire) == N)
+    {
+      return nullptr;
+    }
+    return &_slots[head % N];
+  }
+
+  // Hands the slot from producer_slot() over to the consumer.
+  void publish()
+  {
+    _head.store(_head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+  }
+
+  // The oldest published slot, or nullptr if the ring is empty.
+  T* consumer_slot()
+  {
+    const auto tail = _tail.load(std::memory_order_relaxed);
+    if(tail == _head.load(std::memory_order_acquire))
+    {
+      return nullptr;
+    }
+    return &_slots[tail % N];
+  }
+
+  // Gives the slot from consumer_slot() back to the producer.
+  void release()
+  {
+    _tail.store(_tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+  }
+
+  size_t size() const
+  {
+    return _head.load(std::memory_order_acquire) - _tail.load(std::memory_order_acquire);
+  }
+
+  static constexpr size_t capacity() { return N; }
+
+private:
+  std::array<T, N> _slots;
+  std::atomic<size_t> _head = 0;
+  std::atomic<size_t> _tail = 0;
+};
+
+} // namespace beehive::util
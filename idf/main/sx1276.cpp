@@ -0,0 +1,319 @@
+// Copyright: 2022, Diez B. Roggisch, Berlin, all rights reserved
+#ifdef USE_LORA
+#include "sx1276.hpp"
+
+#include "sdkconfig.h"
+#include "freertos/task.h"
+
+#include <algorithm>
+
+#define LOG_LOCAL_LEVEL ESP_LOG_DEBUG
+#include "esp_log.h"
+
+#define TAG "sx1276"
+
+namespace beehive::lora {
+
+namespace {
+
+// See the SX1276 datasheet, 6.4
+const uint8_t REG_FIFO = 0x00;
+const uint8_t REG_OP_MODE = 0x01;
+const uint8_t REG_FRF_MSB = 0x06;
+const uint8_t REG_FRF_MID = 0x07;
+const uint8_t REG_FRF_LSB = 0x08;
+const uint8_t REG_PA_CONFIG = 0x09;
+const uint8_t REG_OCP = 0x0b;
+const uint8_t REG_LNA = 0x0c;
+const uint8_t REG_FIFO_ADDR_PTR = 0x0d;
+const uint8_t REG_FIFO_TX_BASE_ADDR = 0x0e;
+const uint8_t REG_FIFO_RX_BASE_ADDR = 0x0f;
+const uint8_t REG_FIFO_RX_CURRENT_ADDR = 0x10;
+const uint8_t REG_IRQ_FLAGS = 0x12;
+const uint8_t REG_RX_NB_BYTES = 0x13;
+const uint8_t REG_PKT_SNR_VALUE = 0x19;
+const uint8_t REG_PKT_RSSI_VALUE = 0x1a;
+const uint8_t REG_MODEM_CONFIG_1 = 0x1d;
+const uint8_t REG_MODEM_CONFIG_2 = 0x1e;
+const uint8_t REG_PREAMBLE_MSB = 0x20;
+const uint8_t REG_PREAMBLE_LSB = 0x21;
+const uint8_t REG_PAYLOAD_LENGTH = 0x22;
+const uint8_t REG_MODEM_CONFIG_3 = 0x26;
+const uint8_t REG_SYNC_WORD = 0x39;
+const uint8_t REG_DIO_MAPPING_1 = 0x40;
+const uint8_t REG_VERSION = 0x42;
+const uint8_t REG_PA_DAC = 0x4d;
+
+const uint8_t MODE_LONG_RANGE = 0x80;
+const uint8_t MODE_SLEEP = 0x00;
+const uint8_t MODE_STDBY = 0x01;
+const uint8_t MODE_TX = 0x03;
+const uint8_t MODE_RX_CONTINUOUS = 0x05;
+
+const uint8_t IRQ_RX_DONE = 0x40;
+const uint8_t IRQ_PAYLOAD_CRC_ERROR = 0x20;
+const uint8_t IRQ_TX_DONE = 0x08;
+
+const uint8_t DIO0_RX_DONE = 0x00;
+const uint8_t DIO0_TX_DONE = 0x40;
+
+const uint8_t PA_BOOST = 0x80;
+const uint8_t PA_DAC_DEFAULT = 0x84;
+// +20dBm on PA_BOOST
+const uint8_t PA_DAC_BOOST = 0x87;
+
+const uint8_t VERSION = 0x12;
+const uint32_t OSCILLATOR_HZ = 32000000;
+
+TickType_t ticks(int timeout_ms)
+{
+  if(timeout_ms < 0)
+  {
+    return portMAX_DELAY;
+  }
+  // At least one tick, or we wouldn't wait at all
+  return std::max<TickType_t>(timeout_ms / portTICK_PERIOD_MS, 1);
+}
+
+} // namespace
+
+SX1276::SX1276(spi_host_device_t host, gpio_num_t cs, gpio_num_t sclk, gpio_num_t mosi, gpio_num_t miso, int speed, gpio_num_t di0, gpio_num_t rst, int dbm)
+  : _host(host)
+  , _di0(di0)
+{
+  spi_bus_config_t bus_cfg = {};
+  bus_cfg.mosi_io_num = mosi;
+  bus_cfg.miso_io_num = miso;
+  bus_cfg.sclk_io_num = sclk;
+  bus_cfg.quadwp_io_num = -1;
+  bus_cfg.quadhd_io_num = -1;
+  ESP_ERROR_CHECK(spi_bus_initialize(host, &bus_cfg, SPI_DMA_CH_AUTO));
+
+  spi_device_interface_config_t device_cfg = {};
+  device_cfg.address_bits = 8;
+  device_cfg.mode = 0;
+  device_cfg.clock_speed_hz = speed;
+  device_cfg.spics_io_num = cs;
+  device_cfg.queue_size = 1;
+  ESP_ERROR_CHECK(spi_bus_add_device(host, &device_cfg, &_spi));
+
+  gpio_set_direction(rst, GPIO_MODE_OUTPUT);
+  gpio_set_level(rst, 0);
+  vTaskDelay(1);
+  gpio_set_level(rst, 1);
+  vTaskDelay(10 / portTICK_PERIOD_MS + 1);
+
+  const auto version = read(REG_VERSION);
+  if(version != VERSION)
+  {
+    ESP_LOGE(TAG, "Unexpected version 0x%02x, is the modem connected?", version);
+  }
+
+  // LoRa mode can only be entered from sleep, the
+  // first write gets us there.
+  mode(MODE_SLEEP);
+  vTaskDelay(10 / portTICK_PERIOD_MS + 1);
+  mode(MODE_SLEEP);
+  mode(MODE_STDBY);
+  const auto frf = (uint64_t(CONFIG_BEEHIVE_LORA_FREQUENCY) << 19) / OSCILLATOR_HZ;
+  write(REG_FRF_MSB, uint8_t(frf >> 16));
+  write(REG_FRF_MID, uint8_t(frf >> 8));
+  write(REG_FRF_LSB, uint8_t(frf));
+  // The whole FIFO for either direction, we
+  // never send and receive at the same time.
+  write(REG_FIFO_TX_BASE_ADDR, 0);
+  write(REG_FIFO_RX_BASE_ADDR, 0);
+  // Maximum gain, boosted LNA
+  write(REG_LNA, 0x23);
+  // 125kHz, 4/5, explicit header
+  write(REG_MODEM_CONFIG_1, 0x72);
+  // SF7, payload CRC
+  write(REG_MODEM_CONFIG_2, 0x74);
+  // AGC
+  write(REG_MODEM_CONFIG_3, 0x04);
+  write(REG_PREAMBLE_MSB, 0);
+  write(REG_PREAMBLE_LSB, 8);
+
+  _dio0 = xSemaphoreCreateBinary();
+  gpio_set_direction(di0, GPIO_MODE_INPUT);
+  gpio_set_intr_type(di0, GPIO_INTR_POSEDGE);
+  // Others might have installed it already
+  const auto err = gpio_install_isr_service(0);
+  if(err != ESP_OK && err != ESP_ERR_INVALID_STATE)
+  {
+    ESP_ERROR_CHECK(err);
+  }
+  ESP_ERROR_CHECK(gpio_isr_handler_add(di0, SX1276::s_dio0_isr, this));
+
+  tx_power(dbm);
+}
+
+SX1276::~SX1276()
+{
+  gpio_isr_handler_remove(_di0);
+  mode(MODE_SLEEP);
+  spi_bus_remove_device(_spi);
+  spi_bus_free(_host);
+  vSemaphoreDelete(_dio0);
+}
+
+void IRAM_ATTR SX1276::s_dio0_isr(void* arg)
+{
+  auto self = static_cast<SX1276*>(arg);
+  BaseType_t woken = pdFALSE;
+  xSemaphoreGiveFromISR(self->_dio0, &woken);
+  if(woken)
+  {
+    portYIELD_FROM_ISR();
+  }
+}
+
+void SX1276::sync_word(uint8_t sync_word)
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+  write(REG_SYNC_WORD, sync_word);
+}
+
+void SX1276::tx_power(int dbm)
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+  dbm = std::clamp(dbm, 2, 20);
+  // Above 17dBm only with the PA DAC, which adds
+  // 3dB, and more current than the default limit.
+  if(dbm > 17)
+  {
+    write(REG_PA_DAC, PA_DAC_BOOST);
+    // 140mA
+    write(REG_OCP, 0x20 | 0x11);
+    dbm -= 3;
+  }
+  else
+  {
+    write(REG_PA_DAC, PA_DAC_DEFAULT);
+    // 100mA
+    write(REG_OCP, 0x20 | 0x0b);
+  }
+  write(REG_PA_CONFIG, uint8_t(PA_BOOST | (dbm - 2)));
+}
+
+bool SX1276::send(const uint8_t* data, size_t len, int timeout_ms)
+{
+  if(len == 0 || len > FIFO_SIZE)
+  {
+    return false;
+  }
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    mode(MODE_STDBY);
+    _receiving = false;
+    write(REG_DIO_MAPPING_1, DIO0_TX_DONE);
+    write(REG_FIFO_ADDR_PTR, 0);
+    write_fifo(data, len);
+    write(REG_PAYLOAD_LENGTH, uint8_t(len));
+    write(REG_IRQ_FLAGS, 0xff);
+    xSemaphoreTake(_dio0, 0);
+    mode(MODE_TX);
+  }
+  const auto done = xSemaphoreTake(_dio0, ticks(timeout_ms)) == pdTRUE;
+  std::lock_guard<std::mutex> lock(_mutex);
+  const auto flags = read(REG_IRQ_FLAGS);
+  write(REG_IRQ_FLAGS, flags);
+  if(!done || !(flags & IRQ_TX_DONE))
+  {
+    ESP_LOGE(TAG, "Sending %i bytes timed out", int(len));
+    mode(MODE_STDBY);
+    return false;
+  }
+  // The modem is back in standby
+  return true;
+}
+
+size_t SX1276::recv(buffer_t& buffer, int timeout_ms)
+{
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if(!_receiving)
+    {
+      mode(MODE_STDBY);
+      write(REG_DIO_MAPPING_1, DIO0_RX_DONE);
+      write(REG_IRQ_FLAGS, 0xff);
+      xSemaphoreTake(_dio0, 0);
+      mode(MODE_RX_CONTINUOUS);
+      _receiving = true;
+    }
+  }
+  if(xSemaphoreTake(_dio0, ticks(timeout_ms)) != pdTRUE)
+  {
+    return 0;
+  }
+  std::lock_guard<std::mutex> lock(_mutex);
+  const auto flags = read(REG_IRQ_FLAGS);
+  write(REG_IRQ_FLAGS, flags);
+  if(!(flags & IRQ_RX_DONE) || (flags & IRQ_PAYLOAD_CRC_ERROR))
+  {
+    return 0;
+  }
+  const auto len = read(REG_RX_NB_BYTES);
+  write(REG_FIFO_ADDR_PTR, read(REG_FIFO_RX_CURRENT_ADDR));
+  read_fifo(buffer.data(), len);
+  // See the datasheet, 5.5.5. We are on the HF port. Below
+  // the noise floor the RSSI register only has the noise,
+  // the SNR tells how far below it the packet was.
+  const auto snr = int8_t(read(REG_PKT_SNR_VALUE));
+  const auto rssi = read(REG_PKT_RSSI_VALUE);
+  _packet_snr = snr / 4.0f;
+  _packet_rssi = snr < 0 ? -157 + rssi + snr / 4 : -157 + rssi * 16 / 15;
+  return len;
+}
+
+uint8_t SX1276::read(uint8_t reg)
+{
+  spi_transaction_t t = {};
+  t.flags = SPI_TRANS_USE_RXDATA;
+  t.addr = reg & 0x7f;
+  t.length = 8;
+  ESP_ERROR_CHECK(spi_device_polling_transmit(_spi, &t));
+  return t.rx_data[0];
+}
+
+void SX1276::write(uint8_t reg, uint8_t value)
+{
+  spi_transaction_t t = {};
+  t.flags = SPI_TRANS_USE_TXDATA;
+  t.addr = reg | 0x80;
+  t.length = 8;
+  t.tx_data[0] = value;
+  ESP_ERROR_CHECK(spi_device_polling_transmit(_spi, &t));
+}
+
+void SX1276::read_fifo(uint8_t* data, size_t len)
+{
+  if(!len)
+  {
+    return;
+  }
+  spi_transaction_t t = {};
+  t.addr = REG_FIFO;
+  t.length = 8 * len;
+  t.rxlength = 8 * len;
+  t.rx_buffer = data;
+  ESP_ERROR_CHECK(spi_device_polling_transmit(_spi, &t));
+}
+
+void SX1276::write_fifo(const uint8_t* data, size_t len)
+{
+  spi_transaction_t t = {};
+  t.addr = REG_FIFO | 0x80;
+  t.length = 8 * len;
+  t.tx_buffer = data;
+  ESP_ERROR_CHECK(spi_device_polling_transmit(_spi, &t));
+}
+
+void SX1276::mode(uint8_t mode)
+{
+  write(REG_OP_MODE, MODE_LONG_RANGE | mode);
+}
+
+} // namespace beehive::lora
+
+#endif // USE_LORA
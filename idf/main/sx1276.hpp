@@ -0,0 +1,73 @@
+// Copyright: 2022, Diez B. Roggisch, Berlin, all rights reserved
+
+#pragma once
+#ifdef USE_LORA
+
+#include "driver/gpio.h"
+#include "driver/spi_master.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+namespace beehive::lora {
+
+// The SX1276 LoRa modem of the TTGO boards, with the
+// settings of the RF95 driver from esp32deets: SF7, 125kHz
+// bandwidth, 4/5 coding rate, 8 symbols preamble, explicit
+// header and payload CRC. Unlike that one it can give up
+// waiting for a packet, which the acks need.
+//
+// DIO0 signals the end of a transmission or reception. The
+// register accesses are serialised, so the transmit power
+// can be changed while another task waits for a packet.
+class SX1276
+{
+public:
+  static const size_t FIFO_SIZE = 255;
+  using buffer_t = std::array<uint8_t, FIFO_SIZE>;
+
+  SX1276(spi_host_device_t host, gpio_num_t cs, gpio_num_t sclk, gpio_num_t mosi, gpio_num_t miso, int speed, gpio_num_t di0, gpio_num_t rst, int dbm);
+  ~SX1276();
+  SX1276(const SX1276&) = delete;
+  SX1276& operator=(const SX1276&) = delete;
+
+  void sync_word(uint8_t);
+  // dBm, on PA_BOOST
+  void tx_power(int);
+  // Returns false if the packet wasn't sent within timeout_ms
+  bool send(const uint8_t* data, size_t len, int timeout_ms);
+  // Returns the size of the packet, 0 if none with a valid
+  // CRC came in within timeout_ms. A negative timeout
+  // waits forever. Keeps receiving afterwards, so a
+  // packet arriving until the next call isn't lost.
+  size_t recv(buffer_t& buffer, int timeout_ms=-1);
+  // Of the last packet received, dBm and dB. Read together
+  // with the packet, so the next one can't mix in.
+  int packet_rssi() const { return _packet_rssi; }
+  float packet_snr() const { return _packet_snr; }
+
+private:
+  static void IRAM_ATTR s_dio0_isr(void*);
+
+  uint8_t read(uint8_t reg);
+  void write(uint8_t reg, uint8_t value);
+  void read_fifo(uint8_t* data, size_t len);
+  void write_fifo(const uint8_t* data, size_t len);
+  void mode(uint8_t);
+
+  spi_host_device_t _host;
+  spi_device_handle_t _spi = nullptr;
+  gpio_num_t _di0;
+  SemaphoreHandle_t _dio0 = nullptr;
+  std::mutex _mutex;
+  bool _receiving = false;
+  int _packet_rssi = 0;
+  float _packet_snr = 0;
+};
+
+} // namespace beehive::lora
+#endif // USE_LORA
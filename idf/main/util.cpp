@@ -1,18 +1,22 @@
 // Copyright: 2021, Diez B. Roggisch, Berlin, all rights reserved
 
 #include "util.hpp"
+#include "format.hpp"
 
-#include <iomanip>
 #include <chrono>
 
 namespace beehive::util {
 
 std::string isoformat()
 {
-  std::time_t t = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
-  std::stringstream ss;
-  ss << std::put_time( std::localtime( &t ), "%FT%T%z" );
-  return ss.str();
+  return isoformat(std::chrono::system_clock::to_time_t(std::chrono::system_clock::now()));
+}
+
+std::string isoformat(std::time_t t)
+{
+  beehive::util::FormatBuffer<32> result;
+  result.isoformat(t);
+  return result.c_str();
 }
 
 }
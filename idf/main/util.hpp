@@ -2,10 +2,12 @@
 
 #pragma once
 
+#include <ctime>
 #include <string>
 
 namespace beehive::util {
 
 std::string isoformat();
+std::string isoformat(std::time_t);
 
 }
@@ -2,6 +2,7 @@
 
 import paho.mqtt.client as mqtt
 
+import sys
 import threading
 import queue
 import argparse
@@ -13,6 +14,9 @@ from bokeh.models import ColumnDataSource
 from bokeh.plotting import curdoc, figure
 from bokeh.layouts import column
 
+sys.path.append(str(pathlib.Path(__file__).parent.parent / "scripts"))
+import beehive_codec  # noqa: E402
+
 
 def regroup_line(sdcard_data):
     # the V2 format contains a trailing , because it's easier to write that.
@@ -169,11 +173,19 @@ class Visualisation:
         # Subscribing in on_connect() means that if we lose the connection and
         # reconnect then subscriptions will be renewed.
         client.subscribe(self._topic)
+        client.subscribe(f"{self._topic}/batch")
 
     def _on_message(self, client, userdata, msg):
         #print(msg.topic, str(msg.payload))
-        self._data_q.put(msg.payload)
-        self._writer(msg.payload)
+        payloads = [msg.payload]
+        if msg.topic.endswith("/batch"):
+            payloads = [
+                beehive_codec.native_payload(*record)
+                for record in beehive_codec.decode_batch(msg.payload)
+            ]
+        for payload in payloads:
+            self._data_q.put(payload)
+            self._writer(payload)
         self._doc.add_next_tick_callback(self._process_data)
 
     def _add_graph(self, id_, temperature, humidity, data):
@@ -0,0 +1,251 @@
+# Copyright: 2022, Diez B. Roggisch, Berlin . All rights reserved.
+"""
+ctypes wrapper around the record codec library from host/codec.
+
+Build it with
+
+  cmake -S host/codec -B host/codec/build && cmake --build host/codec/build
+
+or point BEEHIVE_CODEC_LIB at the library.
+"""
+import os
+import ctypes
+import pathlib
+import datetime as dt
+
+MAX_SENSORS = 16
+
+LIBRARY = pathlib.Path(__file__).parent.parent / "host" / "codec" / "build" / "libbeehive_codec.so"
+
+
+class Reading(ctypes.Structure):
+    _pack_ = 1
+    _fields_ = [
+        ("busno", ctypes.c_uint8),
+        ("address", ctypes.c_uint8),
+        ("raw_humidity", ctypes.c_uint16),
+        ("raw_temperature", ctypes.c_uint16),
+    ]
+
+
+class Record(ctypes.Structure):
+    _pack_ = 1
+    _fields_ = [
+        ("timestamp", ctypes.c_uint32),
+        ("count", ctypes.c_uint8),
+        ("readings", Reading * MAX_SENSORS),
+    ]
+
+
+def _load():
+    lib = ctypes.CDLL(os.environ.get("BEEHIVE_CODEC_LIB", str(LIBRARY)))
+    lib.beehive_codec_max_frame_size.restype = ctypes.c_size_t
+    lib.beehive_codec_encode.restype = ctypes.c_size_t
+    lib.beehive_codec_encode.argtypes = [
+        ctypes.POINTER(Record), ctypes.c_size_t, ctypes.c_char_p, ctypes.c_size_t
+    ]
+    lib.beehive_codec_decode.restype = ctypes.c_int
+    lib.beehive_codec_decode.argtypes = [
+        ctypes.c_char_p, ctypes.c_size_t, ctypes.POINTER(Record), ctypes.c_size_t
+    ]
+    lib.beehive_codec_decode_batch.restype = ctypes.c_int
+    lib.beehive_codec_decode_batch.argtypes = [
+        ctypes.c_char_p, ctypes.c_size_t,
+        ctypes.POINTER(ctypes.c_uint32), ctypes.POINTER(Record), ctypes.c_size_t
+    ]
+    lib.beehive_codec_encode_batch.restype = ctypes.c_size_t
+    lib.beehive_codec_encode_batch.argtypes = [
+        ctypes.POINTER(ctypes.c_uint32), ctypes.POINTER(Record), ctypes.c_size_t,
+        ctypes.c_char_p, ctypes.c_size_t
+    ]
+    lib.beehive_lora_encode_readings.restype = ctypes.c_size_t
+    lib.beehive_lora_encode_readings.argtypes = [
+        ctypes.c_uint32, ctypes.c_uint32, ctypes.POINTER(Reading), ctypes.c_size_t,
+        ctypes.c_char_p, ctypes.c_size_t
+    ]
+    lib.beehive_lora_decode_readings.restype = ctypes.c_int
+    lib.beehive_lora_decode_readings.argtypes = [
+        ctypes.c_char_p, ctypes.c_size_t,
+        ctypes.POINTER(ctypes.c_uint32), ctypes.POINTER(ctypes.c_uint32), ctypes.POINTER(Reading)
+    ]
+    lib.beehive_lora_decode_cycles.restype = ctypes.c_int
+    lib.beehive_lora_decode_cycles.argtypes = [
+        ctypes.c_char_p, ctypes.c_size_t,
+        ctypes.POINTER(ctypes.c_uint32), ctypes.POINTER(ctypes.c_uint32),
+        ctypes.POINTER(Record), ctypes.c_size_t
+    ]
+    lib.beehive_lora_encode_ack.restype = ctypes.c_size_t
+    lib.beehive_lora_encode_ack.argtypes = [
+        ctypes.c_uint32, ctypes.c_int16, ctypes.c_int8,
+        ctypes.POINTER(ctypes.c_uint32), ctypes.POINTER(ctypes.c_uint8),
+        ctypes.c_size_t, ctypes.c_char_p, ctypes.c_size_t
+    ]
+    return lib
+
+
+_lib = _load()
+
+
+# One byte for the record count
+MAX_BATCH_RECORDS = 255
+
+
+def _to_array(records):
+    array = (Record * len(records))()
+    for record, (timestamp, readings) in zip(array, records):
+        assert len(readings) <= MAX_SENSORS
+        record.timestamp = timestamp
+        record.count = len(readings)
+        for reading, values in zip(record.readings, readings):
+            (reading.busno, reading.address,
+             reading.raw_humidity, reading.raw_temperature) = values
+    return array
+
+
+def _from_record(record):
+    return (
+        record.timestamp,
+        [
+            (reading.busno, reading.address, reading.raw_humidity, reading.raw_temperature)
+            for reading in record.readings[:record.count]
+        ]
+    )
+
+
+def encode(records):
+    """
+    records is a list of (timestamp, [(busno, address, raw_humidity, raw_temperature), ...])
+    """
+    array = _to_array(records)
+    capacity = len(records) * _lib.beehive_codec_max_frame_size()
+    out = ctypes.create_string_buffer(capacity)
+    written = _lib.beehive_codec_encode(array, len(records), out, capacity)
+    return out.raw[:written]
+
+
+def decode(data, max_records=4096):
+    array = (Record * max_records)()
+    count = _lib.beehive_codec_decode(data, len(data), array, max_records)
+    if count < 0:
+        raise ValueError("Corrupt record data")
+    return [_from_record(record) for record in array[:count]]
+
+
+def encode_batch(records):
+    """
+    records is a list of (sequence, timestamp, readings), as
+    published on beehive/<name>/batch
+    """
+    sequences = (ctypes.c_uint32 * len(records))(*(sequence for sequence, _, _ in records))
+    array = _to_array([(timestamp, readings) for _, timestamp, readings in records])
+    capacity = 3 + len(records) * (5 + _lib.beehive_codec_max_frame_size())
+    out = ctypes.create_string_buffer(capacity)
+    written = _lib.beehive_codec_encode_batch(sequences, array, len(records), out, capacity)
+    if not written:
+        raise ValueError("Too many records for one batch")
+    return out.raw[:written]
+
+
+def decode_batch(payload):
+    """
+    Decodes a beehive/<name>/batch payload into a list
+    of (sequence, timestamp, readings)
+    """
+    sequences = (ctypes.c_uint32 * MAX_BATCH_RECORDS)()
+    array = (Record * MAX_BATCH_RECORDS)()
+    count = _lib.beehive_codec_decode_batch(payload, len(payload), sequences, array, MAX_BATCH_RECORDS)
+    if count < 0:
+        raise ValueError("Corrupt batch payload")
+    return [
+        (sequence, *_from_record(record))
+        for sequence, record in zip(sequences[:count], array[:count])
+    ]
+
+
+# The RF95 FIFO
+MAX_LORA_PACKET = 255
+
+
+def encode_lora_readings(device_id, sequence, readings):
+    """
+    A LoRa READINGS packet as sent by field devices
+    """
+    array = (Reading * MAX_SENSORS)()
+    for reading, values in zip(array, readings):
+        (reading.busno, reading.address,
+         reading.raw_humidity, reading.raw_temperature) = values
+    out = ctypes.create_string_buffer(MAX_LORA_PACKET)
+    written = _lib.beehive_lora_encode_readings(device_id, sequence, array, len(readings), out, MAX_LORA_PACKET)
+    if not written:
+        raise ValueError("Too many readings for one packet")
+    return out.raw[:written]
+
+
+def decode_lora_readings(packet):
+    """
+    Decodes a LoRa READINGS packet into (device_id, sequence, readings)
+    """
+    device_id = ctypes.c_uint32()
+    sequence = ctypes.c_uint32()
+    array = (Reading * MAX_SENSORS)()
+    count = _lib.beehive_lora_decode_readings(packet, len(packet), ctypes.byref(device_id), ctypes.byref(sequence), array)
+    if count < 0:
+        raise ValueError(f"Invalid LoRa packet ({-count})")
+    return (
+        device_id.value,
+        sequence.value,
+        [
+            (reading.busno, reading.address, reading.raw_humidity, reading.raw_temperature)
+            for reading in array[:count]
+        ]
+    )
+
+
+def decode_lora_cycles(packet):
+    """
+    Decodes a LoRa CYCLES packet into (device_id, [(sequence, age, readings), ...]),
+    age being the seconds the cycle was taken before the packet was sent.
+    """
+    device_id = ctypes.c_uint32()
+    sequences = (ctypes.c_uint32 * 255)()
+    array = (Record * 255)()
+    count = _lib.beehive_lora_decode_cycles(packet, len(packet), ctypes.byref(device_id), sequences, array, len(array))
+    if count < 0:
+        raise ValueError(f"Invalid LoRa packet ({-count})")
+    return (
+        device_id.value,
+        [
+            (sequence, *_from_record(record))
+            for sequence, record in zip(sequences[:count], array[:count])
+        ]
+    )
+
+
+def encode_lora_ack(device_id, ranges, rssi=0, snr=0.0):
+    """
+    The base station's ACK for [(first_sequence, count), ...],
+    reporting the RSSI (dBm) and SNR (dB) it received the
+    packet with.
+    """
+    firsts = (ctypes.c_uint32 * len(ranges))(*(first for first, _ in ranges))
+    counts = (ctypes.c_uint8 * len(ranges))(*(count for _, count in ranges))
+    out = ctypes.create_string_buffer(MAX_LORA_PACKET)
+    written = _lib.beehive_lora_encode_ack(
+        device_id, rssi, round(snr * 4), firsts, counts, len(ranges), out, MAX_LORA_PACKET
+    )
+    if not written:
+        raise ValueError("Too many ranges for one ACK")
+    return out.raw[:written]
+
+
+def native_payload(sequence, timestamp, readings):
+    """
+    Formats a decoded record like the single messages on
+    beehive/<name>, so consumers only need to parse one format.
+    """
+    iso = dt.datetime.fromtimestamp(timestamp, dt.timezone.utc).strftime("%Y-%m-%dT%H:%M:%S+0000")
+    sensors = [
+        f"{busno:02x}{address:02x},T{temperature:04x},H{humidity:04x}"
+        for busno, address, humidity, temperature in readings
+    ]
+    return ";".join([f"{sequence},{iso}"] + sensors).encode("ascii")
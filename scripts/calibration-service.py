@@ -6,6 +6,8 @@ from functools import partial
 
 import paho.mqtt.client as mqtt
 
+import beehive_codec
+
 from dataclasses import dataclass
 
 PREFIX = "beehive"
@@ -169,11 +171,20 @@ def main():
 
     def on_message(client, userdata, msg):
         name = msg.topic[len(f"{PREFIX}/"):]
-        for topic, payload in generate_calibrated_messages(
-                name, msg.payload, calibrations
-            ):
-            print(topic, payload)
-            client.publish(topic, payload)
+        payloads = [msg.payload]
+        # Batches carry several cycles in binary form
+        if name.endswith("/batch"):
+            name = name[:-len("/batch")]
+            payloads = [
+                beehive_codec.native_payload(*record)
+                for record in beehive_codec.decode_batch(msg.payload)
+            ]
+        for payload in payloads:
+            for topic, payload in generate_calibrated_messages(
+                    name, payload, calibrations
+                ):
+                print(topic, payload)
+                client.publish(topic, payload)
 
     client = mqtt.Client()
     client.on_connect = on_connect
@@ -0,0 +1,61 @@
+# Copyright: 2022, Diez B. Roggisch, Berlin . All rights reserved.
+"""
+Compares the size of the readings in a message dump as
+MQTT payloads, SD card lines and compressed records.
+"""
+import json
+import argparse
+import datetime as dt
+
+import beehive_codec
+
+
+def parse_payload(payload):
+    # 6238,2021-10-13T13:21:11+0000;0444,T6491,H8523;...
+    header, *sensors = payload.split(";")
+    _, timestamp = header.split(",")
+    timestamp = dt.datetime.strptime(timestamp, "%Y-%m-%dT%H:%M:%S%z")
+    readings = []
+    for sensor in sensors:
+        id_, temperature, humidity = sensor.split(",")
+        readings.append((
+            int(id_[:2], 16),
+            int(id_[2:], 16),
+            int(humidity[1:], 16),
+            int(temperature[1:], 16),
+        ))
+    return int(timestamp.timestamp()), readings
+
+
+def sd_line_size(sequence, timestamp, readings):
+    # #V3,%08x,<isoformat>,(bb,aa,Hxxxx,Txxxx,)*,*%08x\r\n
+    iso = dt.datetime.fromtimestamp(timestamp, dt.timezone.utc).strftime("%Y-%m-%dT%H:%M:%S+0000")
+    return len(f"#V3,{sequence:08x},{iso},") + len(readings) * len("bb,aa,Hxxxx,Txxxx,") + len("*01234567\r\n")
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("--topic", default="beehive/beehive")
+    parser.add_argument("dump")
+    opts = parser.parse_args()
+
+    payload_size = 0
+    records = []
+    with open(opts.dump) as inf:
+        for line in inf:
+            message = json.loads(line)
+            if message["topic"] == opts.topic:
+                payload_size += len(message["payload"])
+                records.append(parse_payload(message["payload"]))
+
+    encoded = beehive_codec.encode(records)
+    assert beehive_codec.decode(encoded) == records
+    sd_size = sum(sd_line_size(i, *record) for i, record in enumerate(records))
+    print(f"{len(records)} records")
+    print(f"MQTT payloads: {payload_size:6} bytes, {payload_size / len(encoded):.1f}x")
+    print(f"SD card lines: {sd_size:6} bytes, {sd_size / len(encoded):.1f}x")
+    print(f"Compressed:    {len(encoded):6} bytes")
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,48 @@
+# Copyright: 2022, Diez B. Roggisch, Berlin . All rights reserved.
+import json
+import pathlib
+import argparse
+import urllib.request
+
+# The JSON API and the data server run on different ports
+API_PORT = 80
+DATA_PORT = 8080
+
+
+def list_files(host):
+    with urllib.request.urlopen(f"http://{host}:{API_PORT}/files") as inf:
+        return json.load(inf)
+
+
+def download(host, name, size, destination):
+    """
+    Downloads a file, resuming a partial download
+    """
+    target = destination / name
+    have = target.stat().st_size if target.exists() else 0
+    if have >= size:
+        return
+    request = urllib.request.Request(
+        f"http://{host}:{DATA_PORT}/files/{name}",
+        headers={"Range": f"bytes={have}-"},
+    )
+    with urllib.request.urlopen(request) as inf, target.open("ab") as outf:
+        while chunk := inf.read(4096):
+            outf.write(chunk)
+    print(f"{name}: {have} -> {target.stat().st_size} bytes")
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("host", help="Beehive hostname or IP")
+    parser.add_argument("directory")
+
+    opts = parser.parse_args()
+    destination = pathlib.Path(opts.directory)
+    destination.mkdir(parents=True, exist_ok=True)
+    for entry in list_files(opts.host):
+        download(opts.host, entry["name"], entry["size"], destination)
+
+
+if __name__ == '__main__':
+    main()
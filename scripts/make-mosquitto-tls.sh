@@ -0,0 +1,39 @@
+#!/bin/bash
+# Creates a throwaway CA and broker certificate, and a
+# mosquitto configuration with a TLS listener on 8883, to
+# test MQTT over TLS against a local broker:
+#
+#   scripts/make-mosquitto-tls.sh beehive-broker.local
+#   ./start-mosquitto.sh mosquitto-tls/mosquitto.conf
+#
+# The firmware only trusts idf/server_certs/ca_cert.pem, so
+# append mosquitto-tls/ca.crt to it for the test build (but
+# don't commit that), enable BEEHIVE_MQTT_TLS and set the
+# mqtt_hostname to the name given here.
+set -e
+HOST=${1:?usage: $0 <broker hostname>}
+DIR=mosquitto-tls
+mkdir -p $DIR
+
+openssl req -x509 -newkey rsa:2048 -nodes -days 365 \
+        -subj "/CN=beehive test CA" \
+        -keyout $DIR/ca.key -out $DIR/ca.crt
+openssl req -newkey rsa:2048 -nodes \
+        -subj "/CN=$HOST" \
+        -keyout $DIR/server.key -out $DIR/server.csr
+openssl x509 -req -days 365 -in $DIR/server.csr \
+        -CA $DIR/ca.crt -CAkey $DIR/ca.key -CAcreateserial \
+        -extfile <(printf "subjectAltName=DNS:%s" "$HOST") \
+        -out $DIR/server.crt
+
+cat > $DIR/mosquitto.conf <<CONF
+allow_anonymous true
+
+listener 1883
+
+listener 8883
+cafile $PWD/$DIR/ca.crt
+certfile $PWD/$DIR/server.crt
+keyfile $PWD/$DIR/server.key
+CONF
+echo "Wrote $DIR/mosquitto.conf"
@@ -0,0 +1,38 @@
+# Copyright: 2022, Diez B. Roggisch, Berlin . All rights reserved.
+"""
+Derives the cost of the SD card write path from the
+counters a node reports in /status.
+"""
+import json
+import argparse
+import urllib.request
+
+
+def sdcard_stats(host):
+    with urllib.request.urlopen(f"http://{host}/status") as inf:
+        return json.load(inf)["sdcard"]
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("host", help="Beehive hostname or IP")
+    opts = parser.parse_args()
+
+    stats = sdcard_stats(opts.host)
+    records = stats["records-written"]
+    print(f"boot recovery:      {stats['boot-recovery-us'] / 1000:.1f}ms")
+    print(f"records written:    {records}")
+    if not records:
+        return
+    print(f"records/s:          {records / (stats['write-path-us'] / 1e6):.1f}")
+    print(f"preallocation:      {stats['preallocation-us'] / 1000:.1f}ms of {stats['write-path-us'] / 1000:.1f}ms")
+    print(f"payload/record:     {stats['bytes-written'] / records:.1f} bytes")
+    print(f"written/record:     {stats['sectors-written'] * 512 / records:.1f} bytes")
+    print(f"FAT sectors/record: {stats['fat-sectors-written'] / records:.2f}")
+    print(f"dir sectors/record: {stats['directory-sectors-written'] / records:.2f}")
+    latency = stats["write-latency-us"]
+    print(f"fwrite latency:     p50 {latency['p50']}us p90 {latency['p90']}us p99 {latency['p99']}us max {latency['max']}us")
+
+
+if __name__ == '__main__':
+    main()
@@ -1,6 +1,7 @@
 # Copyright: 2021, Diez B. Roggisch, Berlin . All rights reserved.
 import pathlib
 import argparse
+import binascii
 import datetime as dt
 from collections import defaultdict
 
@@ -40,13 +41,29 @@ def process_sensors(sensor_parts):
         return res
 
 
+def valid_line(line):
+    """
+    V3 lines carry a trailing *<crc32> over everything
+    before the asterisk, torn lines fail the check.
+    """
+    if line.startswith("#V2"):
+        return line
+    if line.startswith("#V3"):
+        payload, _, crc = line.rpartition("*")
+        try:
+            if payload and binascii.crc32(payload.encode("ascii")) == int(crc, 16):
+                return payload
+        except ValueError:
+            pass
+    return None
+
+
 def load_data_file(logfile):
     res = []
     with logfile.open("r") as inf:
         for line in inf:
-            line = line.strip()
+            line = valid_line(line.strip())
             if line:
-                assert line.startswith("#V2")
                 # strip off the trailing comma, as it othewise confguses
                 # the rest of the process
                 _, _, timestamp, *sensors = line.rstrip(",").split(",")